@@ -104,6 +104,228 @@ static int get_bl_marker(unsigned int *marker)
 	(context_put_int( \
 		CONTEXT_GLOBAL, current_processing_ctx, bl_ctx_idx, value))
 
+
+/*
+ * Rules index: each list keeps its rules in a path compressed binary trie
+ * per address family, keyed by the rule's IP/mask prefix, so a lookup only
+ * checks the port, proto and text of the rules whose net holds the IP.
+ * The index is guarded by the same count_read/count_write as the list.
+ */
+struct bl_node {
+	struct bl_node *kids[2];
+	unsigned int bitlen;
+	unsigned char addr[16];
+	struct bl_rule *rules; /* rules with exactly this prefix */
+};
+
+#define bl_addr_bit(_a, _i) (((_a)[(_i) >> 3] >> (7 - ((_i) & 7))) & 1)
+#define bl_idx_root(_head, _af) \
+	(&(_head)->idx[(_af) == AF_INET6 ? 1 : 0])
+
+static inline unsigned int bl_common_bits(unsigned char *a, unsigned char *b,
+		unsigned int max)
+{
+	unsigned int i = 0;
+
+	while (i + 8 <= max && a[i >> 3] == b[i >> 3])
+		i += 8;
+	while (i < max && bl_addr_bit(a, i) == bl_addr_bit(b, i))
+		i++;
+
+	return i;
+}
+
+/* length of the prefix described by the rule, -1 if it is not indexable */
+static int bl_rule_prefix(struct bl_rule *r)
+{
+	unsigned int i, len = 0;
+	unsigned char b;
+
+	if (r->flags & BLR_APPLY_CONTRARY ||
+	(r->ip_net.ip.af != AF_INET && r->ip_net.ip.af != AF_INET6))
+		return -1;
+
+	for (i = 0; i < r->ip_net.mask.len; i++) {
+		for (b = r->ip_net.mask.u.addr[i]; b & 0x80; b <<= 1)
+			len++;
+		if (b)
+			return -1; /* not a contiguous mask */
+		if (r->ip_net.mask.u.addr[i] != 0xff) {
+			for (i++; i < r->ip_net.mask.len; i++)
+				if (r->ip_net.mask.u.addr[i])
+					return -1;
+			break;
+		}
+	}
+
+	return len;
+}
+
+static struct bl_node *bl_new_node(unsigned char *addr, unsigned int bitlen)
+{
+	struct bl_node *n;
+
+	n = shm_malloc(sizeof *n);
+	if (!n) {
+		LM_ERR("no more shm memory!\n");
+		return NULL;
+	}
+
+	memset(n, 0, sizeof *n);
+	memcpy(n->addr, addr, sizeof n->addr);
+	n->bitlen = bitlen;
+
+	return n;
+}
+
+/* looks up the node of the given prefix, creating it if missing */
+static struct bl_node *bl_get_node(struct bl_node **link,
+		unsigned char *addr, unsigned int bitlen)
+{
+	struct bl_node *cur, *n, *b;
+	unsigned int c;
+
+	while ((cur = *link)) {
+		c = bl_common_bits(cur->addr, addr,
+			cur->bitlen < bitlen ? cur->bitlen : bitlen);
+
+		if (c == cur->bitlen) {
+			if (c == bitlen)
+				return cur;
+			link = &cur->kids[bl_addr_bit(addr, c)];
+			continue;
+		}
+
+		/* the prefix diverges inside this node - split it */
+		if (!(n = bl_new_node(addr, bitlen)))
+			return NULL;
+
+		if (c == bitlen) {
+			n->kids[bl_addr_bit(cur->addr, c)] = cur;
+			*link = n;
+		} else {
+			if (!(b = bl_new_node(addr, c))) {
+				shm_free(n);
+				return NULL;
+			}
+			b->kids[bl_addr_bit(addr, c)] = n;
+			b->kids[bl_addr_bit(cur->addr, c)] = cur;
+			*link = b;
+		}
+
+		return n;
+	}
+
+	return (*link = bl_new_node(addr, bitlen));
+}
+
+/* unlinks the rule from the trie, dropping the nodes left useless */
+static void bl_del_node(struct bl_node **link, struct bl_rule *r,
+		unsigned int bitlen)
+{
+	struct bl_node *cur = *link;
+	struct bl_rule **rp;
+
+	if (!cur || cur->bitlen > bitlen ||
+	bl_common_bits(cur->addr, r->ip_net.ip.u.addr, cur->bitlen) < cur->bitlen)
+		return;
+
+	if (cur->bitlen == bitlen) {
+		for (rp = &cur->rules; *rp; rp = &(*rp)->idx_next)
+			if (*rp == r) {
+				*rp = r->idx_next;
+				break;
+			}
+	} else {
+		bl_del_node(&cur->kids[bl_addr_bit(r->ip_net.ip.u.addr, cur->bitlen)],
+			r, bitlen);
+	}
+
+	if (!cur->rules && (!cur->kids[0] || !cur->kids[1])) {
+		*link = cur->kids[0] ? cur->kids[0] : cur->kids[1];
+		shm_free(cur);
+	}
+}
+
+static void bl_free_nodes(struct bl_node *n)
+{
+	if (!n)
+		return;
+
+	bl_free_nodes(n->kids[0]);
+	bl_free_nodes(n->kids[1]);
+	shm_free(n);
+}
+
+static void bl_idx_free(struct bl_head *head)
+{
+	bl_free_nodes(head->idx[0]);
+	bl_free_nodes(head->idx[1]);
+	head->idx[0] = head->idx[1] = NULL;
+	head->unindexed = NULL;
+}
+
+static int bl_idx_add(struct bl_head *head, struct bl_rule *r)
+{
+	struct bl_node *n;
+	int len;
+
+	if (head->no_idx)
+		return 0;
+
+	if ((len = bl_rule_prefix(r)) < 0) {
+		r->idx_next = head->unindexed;
+		head->unindexed = r;
+		return 0;
+	}
+
+	n = bl_get_node(bl_idx_root(head, r->ip_net.ip.af),
+		r->ip_net.ip.u.addr, len);
+	if (!n) {
+		LM_ERR("failed to index list %.*s, falling back to a full scan\n",
+			head->name.len, head->name.s);
+		bl_idx_free(head);
+		head->no_idx = 1;
+		return -1;
+	}
+
+	r->idx_next = n->rules;
+	n->rules = r;
+	return 0;
+}
+
+static void bl_idx_del(struct bl_head *head, struct bl_rule *r)
+{
+	struct bl_rule **rp;
+	int len;
+
+	if (head->no_idx)
+		return;
+
+	if ((len = bl_rule_prefix(r)) < 0) {
+		for (rp = &head->unindexed; *rp; rp = &(*rp)->idx_next)
+			if (*rp == r) {
+				*rp = r->idx_next;
+				break;
+			}
+		return;
+	}
+
+	bl_del_node(bl_idx_root(head, r->ip_net.ip.af), r, len);
+}
+
+static void bl_idx_build(struct bl_head *head)
+{
+	struct bl_rule *p;
+
+	bl_idx_free(head);
+	head->no_idx = 0;
+
+	for (p = head->first; p; p = p->next)
+		if (bl_idx_add(head, p) < 0)
+			return;
+}
+
 struct bl_head *create_bl_head(int owner, int flags, struct bl_rule *head,
 											struct bl_rule *tail, str *name)
 {
@@ -164,6 +386,7 @@ struct bl_head *create_bl_head(int owner, int flags, struct bl_rule *head,
 	blst_heads[i].flags = flags;
 	blst_heads[i].first = head;
 	blst_heads[i].last = tail;
+	bl_idx_build(blst_heads + i);
 
 	if (flags & BL_BY_DEFAULT)
 		bl_default_marker |= (1 << i);
@@ -184,6 +407,7 @@ void destroy_black_lists(void)
 			lock_dealloc(blst_heads[i].lock);
 		}
 
+		bl_idx_free(blst_heads + i);
 		for (p = blst_heads[i].first; p; ) {
 			q = p;
 			p = p->next;
@@ -245,6 +469,9 @@ static inline void delete_expired(struct bl_head *elem, unsigned int ticks)
 		elem->first = p;
 	}
 
+	for (p = q; p; p = p->next)
+		bl_idx_del(elem, p);
+
 done:
 	elem->count_write = 0;
 
@@ -419,6 +646,7 @@ static inline int reload_permanent_list(struct bl_rule *first,
 
 	head->first = first;
 	head->last = last;
+	bl_idx_build(head);
 
 	head->count_write = 0;
 
@@ -483,6 +711,10 @@ int add_list_to_head(struct bl_head *head,
 	if (!first)
 		goto done;
 
+	for (p = first; p; p = p->next)
+		if (bl_idx_add(head, p) < 0)
+			break;
+
 	if (!head->first) {
 		head->last  = last;
 		head->first = first;
@@ -564,13 +796,53 @@ void reset_bl_markers(void)
 
 
 
+static inline int bl_rule_matches(struct bl_rule *p, struct ip_addr *ip,
+		str *text, unsigned short port, unsigned short proto)
+{
+	int t_val;
+
+	t_val = (p->port==0 || p->port==port) &&
+		(p->proto==PROTO_NONE || p->proto==proto) &&
+		(matchnet(ip, &(p->ip_net)) == 1) &&
+		(p->body.s==NULL || !fnmatch(p->body.s, text->s, 0));
+
+	return !!(p->flags & BLR_APPLY_CONTRARY) ^ !!(t_val);
+}
+
+static inline int check_against_rule_index(struct bl_head *head,
+		struct ip_addr *ip, str *text, unsigned short port,
+		unsigned short proto)
+{
+	struct bl_node *n;
+	struct bl_rule *p;
+
+	for (p = head->unindexed; p; p = p->idx_next)
+		if (bl_rule_matches(p, ip, text, port, proto))
+			return 1;
+
+	if (ip->af != AF_INET && ip->af != AF_INET6)
+		return 0;
+
+	for (n = *bl_idx_root(head, ip->af); n &&
+	bl_common_bits(n->addr, ip->u.addr, n->bitlen) == n->bitlen;
+	n = n->kids[bl_addr_bit(ip->u.addr, n->bitlen)]) {
+		for (p = n->rules; p; p = p->idx_next)
+			if (bl_rule_matches(p, ip, text, port, proto))
+				return 1;
+
+		if (n->bitlen >= ip->len * 8)
+			break;
+	}
+
+	return 0;
+}
+
 static inline int check_against_rule_list(struct ip_addr *ip, str *text,
 					  unsigned short port,
 					  unsigned short proto,
 					  int i)
 {
 	struct bl_rule *p;
-	int t_val;
 	int ret = 0;
 
 	LM_DBG("using list %.*s \n",
@@ -588,19 +860,20 @@ static inline int check_against_rule_list(struct ip_addr *ip, str *text,
 		lock_release(blst_heads[i].lock);
 	}
 
-	for(p = blst_heads[i].first ; p ; p = p->next) {
-		t_val = (p->port==0 || p->port==port) &&
-			(p->proto==PROTO_NONE || p->proto==proto) &&
-			(matchnet(ip, &(p->ip_net)) == 1) &&
-			(p->body.s==NULL || !fnmatch(p->body.s, text->s, 0));
-		if(!!(p->flags & BLR_APPLY_CONTRARY) ^ !!(t_val)){
-			ret = 1;
-			LM_DBG("matched list %.*s \n",
-				blst_heads[i].name.len,blst_heads[i].name.s);
-			break;
-		}
+	if (!blst_heads[i].no_idx) {
+		ret = check_against_rule_index(blst_heads + i, ip, text, port, proto);
+	} else {
+		for(p = blst_heads[i].first ; p ; p = p->next)
+			if (bl_rule_matches(p, ip, text, port, proto)) {
+				ret = 1;
+				break;
+			}
 	}
 
+	if (ret)
+		LM_DBG("matched list %.*s \n",
+			blst_heads[i].name.len,blst_heads[i].name.s);
+
 	if( !(blst_heads[i].flags&BL_READONLY_LIST) ) {
 		lock_get( blst_heads[i].lock );
 		blst_heads[i].count_read--;
@@ -45,8 +45,11 @@ struct bl_rule{
 	str body;
 	struct bl_rule *next;
 	unsigned int expire_end;
+	struct bl_rule *idx_next; /*!< next rule in the same index slot */
 };
 
+struct bl_node;
+
 struct bl_head{
 	str name;
 	int owner; 	/*!< the id of the module that owns the set of rules */
@@ -57,6 +60,11 @@ struct bl_head{
 	/* ... more fields, maybe ... */
 	struct bl_rule *first;
 	struct bl_rule *last;
+	/* index of the rules, rebuilt on reload and kept in sync on
+	 * add/expire; if it could not be built, the rules are walked */
+	int no_idx;
+	struct bl_node *idx[2];     /*!< IPv4 and IPv6 prefix tries */
+	struct bl_rule *unindexed;  /*!< contrary or non-prefix mask rules */
 };
 
 
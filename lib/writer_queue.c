@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include "../dprint.h"
+#include "../mem/shm_mem.h"
+#include "writer_queue.h"
+
+
+struct writer_queue *wq_create(unsigned int max, unsigned int wake_at)
+{
+	struct writer_queue *q;
+
+	q = shm_malloc(sizeof *q);
+	if (!q) {
+		LM_ERR("no more shm memory\n");
+		return NULL;
+	}
+	memset(q, 0, sizeof *q);
+	q->max = max;
+	q->wake_at = wake_at;
+
+	if (pipe(q->wake_pipe) < 0) {
+		LM_ERR("failed to create the writer pipe: %s\n", strerror(errno));
+		goto error;
+	}
+	if (fcntl(q->wake_pipe[0], F_SETFL, O_NONBLOCK) < 0 ||
+	fcntl(q->wake_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+		LM_ERR("failed to set the writer pipe non-blocking: %s\n",
+			strerror(errno));
+		close(q->wake_pipe[0]);
+		close(q->wake_pipe[1]);
+		goto error;
+	}
+
+	lock_init(&q->lock);
+	return q;
+
+error:
+	shm_free(q);
+	return NULL;
+}
+
+
+void wq_destroy(struct writer_queue *q)
+{
+	lock_destroy(&q->lock);
+	close(q->wake_pipe[0]);
+	close(q->wake_pipe[1]);
+	shm_free(q);
+}
+
+
+int wq_push(struct writer_queue *q, struct wq_item *it)
+{
+	int wake;
+
+	it->next = NULL;
+
+	lock_get(&q->lock);
+	if (q->depth >= q->max) {
+		lock_release(&q->lock);
+		return -1;
+	}
+	if (q->last)
+		q->last->next = it;
+	else
+		q->first = it;
+	q->last = it;
+	q->depth++;
+	wake = (++q->queued == q->wake_at);
+	lock_release(&q->lock);
+
+	/* a full batch is waiting - do not let it sit until the timeout */
+	if (wake && write(q->wake_pipe[1], "", 1) < 0 && errno != EAGAIN)
+		LM_DBG("failed to wake up the writer: %s\n", strerror(errno));
+
+	return 0;
+}
+
+
+void wq_append(struct writer_queue *q, struct wq_item *first,
+		struct wq_item *last, unsigned int n)
+{
+	last->next = NULL;
+
+	lock_get(&q->lock);
+	if (q->last)
+		q->last->next = first;
+	else
+		q->first = first;
+	q->last = last;
+	q->queued += n;
+	q->depth += n;
+	lock_release(&q->lock);
+}
+
+
+struct wq_item *wq_take(struct writer_queue *q, unsigned int max,
+		struct wq_item **last, unsigned int *n)
+{
+	struct wq_item *first, *it;
+	unsigned int no;
+
+	lock_get(&q->lock);
+	first = q->first;
+	if (!first) {
+		lock_release(&q->lock);
+		*last = NULL;
+		*n = 0;
+		return NULL;
+	}
+
+	if (!max || max >= q->queued) {
+		it = q->last;
+		no = q->queued;
+		q->first = q->last = NULL;
+	} else {
+		for (it = first, no = 1; no < max; it = it->next, no++);
+		q->first = it->next;
+	}
+	it->next = NULL;
+	q->queued -= no;
+	lock_release(&q->lock);
+
+	*last = it;
+	*n = no;
+	return first;
+}
+
+
+void wq_put_back(struct writer_queue *q, struct wq_item *first,
+		struct wq_item *last, unsigned int n)
+{
+	lock_get(&q->lock);
+	last->next = q->first;
+	q->first = first;
+	if (!q->last)
+		q->last = last;
+	q->queued += n;
+	lock_release(&q->lock);
+}
+
+
+void wq_done(struct writer_queue *q, unsigned int n)
+{
+	lock_get(&q->lock);
+	q->depth -= n;
+	lock_release(&q->lock);
+}
+
+
+void wq_wait(struct writer_queue *q, int timeout)
+{
+	struct pollfd pfd;
+	char buf[64];
+
+	pfd.fd = q->wake_pipe[0];
+	pfd.events = POLLIN;
+
+	if (poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+		LM_ERR("poll failed: %s\n", strerror(errno));
+	while (read(q->wake_pipe[0], buf, sizeof buf) > 0);
+}
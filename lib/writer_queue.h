@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+
+#ifndef __LIB_WRITER_QUEUE__
+#define __LIB_WRITER_QUEUE__
+
+#include "../locking.h"
+#include "container.h"
+
+/*
+ * A bounded shm FIFO filled by any process and drained by a single writer
+ * process, which sleeps until enough items are queued or a timeout hits.
+ *
+ * The items embed a struct wq_item and are allocated by the caller:
+ *
+ *	struct my_rec {
+ *		...
+ *		struct wq_item link;
+ *	};
+ *
+ *	rec = container_of(it, struct my_rec, link);
+ *
+ * The items taken by the writer still count against the queue limit until
+ * the writer reports them done, so a stuck writer does not let the memory
+ * grow without bounds.
+ */
+
+struct wq_item {
+	struct wq_item *next;
+};
+
+struct writer_queue {
+	gen_lock_t lock;
+	struct wq_item *first;
+	struct wq_item *last;
+	unsigned int queued;   /* items waiting in the queue */
+	unsigned int depth;    /* queued + taken by the writer, not done yet */
+	unsigned int max;      /* depth limit of wq_push() */
+	unsigned int wake_at;  /* queued items that wake up the writer */
+	unsigned int flush_ms; /* last flush duration, kept by the writer */
+	int wake_pipe[2];
+};
+
+/* must be called before forking, the wake up pipe is shared */
+struct writer_queue *wq_create(unsigned int max, unsigned int wake_at);
+void wq_destroy(struct writer_queue *q);
+
+/* returns 0 on success or -1 if the queue is full */
+int wq_push(struct writer_queue *q, struct wq_item *it);
+
+/* appends a list of 'n' items, regardless of the limit */
+void wq_append(struct writer_queue *q, struct wq_item *first,
+		struct wq_item *last, unsigned int n);
+
+/* detaches up to 'max' items (all of them, if 0) from the head; the
+ * number of items and the last one are returned through 'n' and 'last' */
+struct wq_item *wq_take(struct writer_queue *q, unsigned int max,
+		struct wq_item **last, unsigned int *n);
+
+/* returns taken items to the head of the queue, in the same order */
+void wq_put_back(struct writer_queue *q, struct wq_item *first,
+		struct wq_item *last, unsigned int n);
+
+/* releases 'n' taken items from the queue limit */
+void wq_done(struct writer_queue *q, unsigned int n);
+
+/* sleeps until the writer is woken up or 'timeout' ms passed */
+void wq_wait(struct writer_queue *q, int timeout);
+
+/* cheap, lockless check before building an item */
+static inline int wq_full(struct writer_queue *q)
+{
+	return q->depth >= q->max;
+}
+
+#endif /* __LIB_WRITER_QUEUE__ */
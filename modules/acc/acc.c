@@ -55,6 +55,8 @@
 #include "acc_extra.h"
 #include "acc_logic.h"
 #include "acc_vars.h"
+#include "acc_db_queue.h"
+#include "acc_cdr_file.h"
 
 #define TABLE_VERSION 7
 
@@ -75,6 +77,7 @@ extern struct acc_extra *log_extra_tags;
 extern struct acc_extra *db_extra_tags;
 extern struct acc_extra *aaa_extra_tags;
 extern struct acc_extra *evi_extra_tags;
+extern struct acc_extra *file_extra_tags;
 
 extern tag_t* extra_tags;
 extern int extra_tgs_len;
@@ -83,6 +86,7 @@ extern struct acc_extra *log_leg_tags;
 extern struct acc_extra *db_leg_tags;
 extern struct acc_extra *aaa_leg_tags;
 extern struct acc_extra *evi_leg_tags;
+extern struct acc_extra *file_leg_tags;
 
 extern tag_t* leg_tags;
 extern int leg_tgs_len;
@@ -508,6 +512,29 @@ void acc_db_close(void)
 }
 
 
+/* writes a row built from the first n keys - used by the DB writer */
+int acc_db_insert_row(db_ps_t *ps, const str *table, db_val_t *vals, int n)
+{
+	acc_dbf.use_table(db_handle, table);
+	CON_PS_REFERENCE(db_handle) = ps;
+	CON_RESET_INSLIST(db_handle);
+
+	return acc_dbf.insert(db_handle, db_keys, vals, n);
+}
+
+
+/* inserts the first n values, or only queues them for the DB writer */
+static inline int acc_db_insert(str *table, query_list_t **ins_list, int n)
+{
+	if (acc_db_batch_size)
+		return acc_db_queue_row(table, db_vals, n);
+
+	if (con_set_inslist(&acc_dbf,db_handle,ins_list,db_keys,n) < 0 )
+		CON_RESET_INSLIST(db_handle);
+	return acc_dbf.insert(db_handle, db_keys, db_vals, n);
+}
+
+
 int acc_db_request( struct sip_msg *rq, struct sip_msg *rpl,
 		query_list_t **ins_list, int cdr_flag, int missed)
 {
@@ -571,6 +598,9 @@ int acc_db_request( struct sip_msg *rq, struct sip_msg *rpl,
 		}
 	}
 
+	if (acc_db_batch_size)
+		goto values;
+
 	acc_dbf.use_table(db_handle, &acc_env.text/*table*/);
 	if (ctx && cdr_flag) {
 		if (ins_list)
@@ -592,7 +622,7 @@ int acc_db_request( struct sip_msg *rq, struct sip_msg *rpl,
 
 	CON_PS_REFERENCE(db_handle) = ps;
 
-
+values:
 	/* multi-leg columns */
 	if (ctx) {
 		/* prevent acces for setting variable */
@@ -607,9 +637,7 @@ int acc_db_request( struct sip_msg *rq, struct sip_msg *rpl,
 
 		if ( !ctx->leg_values ) {
 			accX_unlock(&ctx->lock);
-			if (con_set_inslist(&acc_dbf,db_handle,ins_list,db_keys,n) < 0 )
-				CON_RESET_INSLIST(db_handle);
-			if (acc_dbf.insert(db_handle, db_keys, db_vals, n) < 0) {
+			if (acc_db_insert(&acc_env.text, ins_list, n) < 0) {
 				LM_ERR("failed to insert into %.*s table\n", acc_env.text.len, acc_env.text.s);
 				return -1;
 			}
@@ -618,9 +646,7 @@ int acc_db_request( struct sip_msg *rq, struct sip_msg *rpl,
 				for (extra=db_leg_tags, i=m; extra; extra=extra->next, i++) {
 					VAL_STR(db_vals+i)=LEG_VALUE( j, extra, ctx);
 				}
-				if (con_set_inslist(&acc_dbf,db_handle,ins_list,db_keys,n) < 0 )
-					CON_RESET_INSLIST(db_handle);
-				if (acc_dbf.insert(db_handle, db_keys, db_vals, n) < 0) {
+				if (acc_db_insert(&acc_env.text, ins_list, n) < 0) {
 					LM_ERR("failed to insert into %.*s table\n", acc_env.text.len, acc_env.text.s);
 					accX_unlock(&ctx->lock);
 					return -1;
@@ -629,9 +655,7 @@ int acc_db_request( struct sip_msg *rq, struct sip_msg *rpl,
 			accX_unlock(&ctx->lock);
 		}
 	} else {
-		if (con_set_inslist(&acc_dbf,db_handle,ins_list,db_keys,m) < 0 )
-				CON_RESET_INSLIST(db_handle);
-		if (acc_dbf.insert(db_handle, db_keys, db_vals, m) < 0) {
+		if (acc_db_insert(&acc_env.text, ins_list, m) < 0) {
 			LM_ERR("failed to insert into %.*s table\n", acc_env.text.len, acc_env.text.s);
 			return -1;
 		}
@@ -685,8 +709,10 @@ int acc_db_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx)
 		TIMEVAL_MS_DIFF(start_time, ctx->bye_time);
 
 	total = ret + 5;
-	acc_dbf.use_table(db_handle, &table);
-	CON_PS_REFERENCE(db_handle) = &my_ps;
+	if (!acc_db_batch_size) {
+		acc_dbf.use_table(db_handle, &table);
+		CON_PS_REFERENCE(db_handle) = &my_ps;
+	}
 
 
 	/* prevent acces for setting variable */
@@ -696,9 +722,7 @@ int acc_db_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx)
 		VAL_STR(db_vals+i) = ctx->extra_values[extra->tag_idx].value;
 
 	if (!ctx->leg_values) {
-		if (con_set_inslist(&acc_dbf,db_handle,&ins_list,db_keys,total) < 0 )
-			CON_RESET_INSLIST(db_handle);
-		if (acc_dbf.insert(db_handle, db_keys, db_vals, total) < 0) {
+		if (acc_db_insert(&table, &ins_list, total) < 0) {
 			LM_ERR("failed to insert into database\n");
 			accX_unlock(&ctx->lock);
 			goto end;
@@ -712,9 +736,7 @@ int acc_db_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx)
 				VAL_STR(db_vals+ret+j+1) = LEG_VALUE( i, extra, ctx);
 			}
 
-			if (con_set_inslist(&acc_dbf,db_handle,&ins_list,db_keys,total) < 0 )
-				CON_RESET_INSLIST(db_handle);
-			if (acc_dbf.insert(db_handle,db_keys,db_vals,total) < 0) {
+			if (acc_db_insert(&table, &ins_list, total) < 0) {
 				LM_ERR("failed inserting into database\n");
 				accX_unlock(&ctx->lock);
 				goto end;
@@ -1407,6 +1429,80 @@ end:
 	return res;
 }
 
+
+/********************************************
+ *        CDR FILES
+ ********************************************/
+
+int acc_file_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx)
+{
+	static str vals[ACC_CORE_LEN+MAX_ACC_EXTRA+MAX_ACC_LEG];
+	long long ints[CDR_FILE_INT_COLS];
+	struct timeval start_time;
+	struct acc_extra* extra;
+	str core_s;
+	int i, j, nr_extra, nr_leg_vals, res = -1;
+
+	if (!acc_cdr_file_dir) {
+		LM_ERR("CDR files not enabled - cdr_file_dir not set!\n");
+		return -1;
+	}
+
+	core_s.s = 0;
+
+	if (prebuild_core_arr(dlg, &core_s, &start_time) < 0) {
+		LM_ERR("cannot copy core arguments\n");
+		goto end;
+	}
+
+	nr_extra = acc_cdr_file_extras();
+	nr_leg_vals = acc_cdr_file_legs();
+
+	for (i=0;i<ACC_CORE_LEN;i++)
+		vals[i] = val_arr[i];
+
+	ints[CDR_FILE_TIME] = start_time.tv_sec;
+	ints[CDR_FILE_SETUPTIME] = start_time.tv_sec - ctx->created;
+	ints[CDR_FILE_CREATED] = ctx->created;
+	ints[CDR_FILE_DURATION] = ctx->bye_time.tv_sec - start_time.tv_sec;
+	ints[CDR_FILE_MS_DURATION] = TIMEVAL_MS_DIFF(start_time, ctx->bye_time);
+
+	/* prevent acces for setting variable */
+	accX_lock(&ctx->lock);
+
+	for (extra=file_extra_tags, i=ACC_CORE_LEN; extra; extra=extra->next, i++)
+		vals[i] = ctx->extra_values[extra->tag_idx].value;
+
+	if (!ctx->leg_values) {
+		for (j=0; j < nr_leg_vals; j++) {
+			vals[ACC_CORE_LEN+nr_extra+j].s = 0;
+			vals[ACC_CORE_LEN+nr_extra+j].len = 0;
+		}
+		if (acc_cdr_file_push(vals, ints) < 0) {
+			accX_unlock(&ctx->lock);
+			goto end;
+		}
+	} else {
+		for (i=0; i < ctx->legs_no; i++) {
+			for (extra=file_leg_tags, j=ACC_CORE_LEN+nr_extra; extra;
+					extra=extra->next, j++)
+				vals[j] = LEG_VALUE(i, extra, ctx);
+
+			if (acc_cdr_file_push(vals, ints) < 0) {
+				accX_unlock(&ctx->lock);
+				goto end;
+			}
+		}
+	}
+	accX_unlock(&ctx->lock);
+
+	res = 1;
+end:
+	if (core_s.s)
+		pkg_free(core_s.s);
+	return res;
+}
+
 /* Functions used to store values into dlg */
 
 static str cdr_buf;
@@ -90,6 +90,7 @@ void acc_db_close();
 int  acc_db_request( struct sip_msg *req, struct sip_msg *rpl,
 		query_list_t **ins_list, int cdr_flag, int missed);
 int acc_db_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx);
+int acc_db_insert_row(db_ps_t *ps, const str *table, db_val_t *vals, int n);
 
 
 int  init_acc_aaa(char* aaa_proto_url, int srv_type);
@@ -117,6 +118,7 @@ extern evi_params_p acc_missed_event_params;
 extern evi_param_p evi_missed_params[ACC_CORE_LEN+1+ACC_DLG_LEN+
 	MAX_ACC_EXTRA+MAX_ACC_LEG];
 
+int  acc_file_cdrs(struct dlg_cell *dlg, struct sip_msg *msg, acc_ctx_t* ctx);
 
 int restore_dlg_extra(struct dlg_cell* dlg, acc_ctx_t** ctx);
 int restore_dlg_extra_ctx(struct dlg_cell* dlg, acc_ctx_t *ctx);
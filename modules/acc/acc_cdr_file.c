@@ -0,0 +1,1176 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *
+ * Columnar CDR files: the CDRs are queued in shm by the SIP workers and
+ * appended by a dedicated process to segment files, in blocks. Inside a
+ * block every column is stored separately - the string columns dictionary
+ * encoded, the integer ones as zig-zag varint deltas - so a reader only
+ * decodes the columns it needs, and skips the blocks outside the queried
+ * time range by looking at the block header only.
+ *
+ * Segment layout:
+ *   segment header, then for each column: type (1 byte), name length
+ *   (1 byte), name; then any number of blocks:
+ *   block header, column lengths (ncols x 4 bytes), column data.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "../../dprint.h"
+#include "../../ut.h"
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../lib/writer_queue.h"
+
+#include "acc_extra.h"
+#include "acc_mod.h"
+#include "acc.h"
+#include "acc_cdr_file.h"
+
+#define CDR_SEG_MAGIC     "OSCDRSEG"
+#define CDR_SEG_VERSION   1
+#define CDR_BLOCK_MAGIC   0x43445242 /* "CDRB" */
+#define CDR_SEG_PREFIX    "cdr_"
+#define CDR_SEG_SUFFIX    ".seg"
+
+#define CDR_COL_STR 's'
+#define CDR_COL_INT 'i'
+
+#define CDR_MAX_COLS 255
+#define CDR_LIST_LIMIT 100
+
+struct cdr_seg_hdr {
+	char magic[8];
+	unsigned int version;
+	unsigned int ncols;
+	unsigned int nstr;      /* string columns, stored first */
+};
+
+struct cdr_block_hdr {
+	unsigned int magic;
+	unsigned int rows;
+	unsigned int size;      /* bytes after the header */
+	unsigned int ncols;
+	long long min_time;
+	long long max_time;
+};
+
+struct cdr_file_rec {
+	struct wq_item link;    /* first, so the end of a list maps to NULL */
+	long long ints[CDR_FILE_INT_COLS];
+	str *vals;
+	/* str[nstr] and the string values follow */
+};
+
+#define cdr_rec_of(_it) container_of(_it, struct cdr_file_rec, link)
+#define cdr_rec_next(_rec) cdr_rec_of((_rec)->link.next)
+
+struct cdr_buf {
+	unsigned char *s;
+	unsigned int len;
+	unsigned int size;
+};
+
+stat_var *cdr_file_written_stat;
+stat_var *cdr_file_dropped_stat;
+
+extern struct acc_extra *file_extra_tags;
+extern struct acc_extra *file_leg_tags;
+
+static struct writer_queue *cdr_queue;
+
+/* column layout of the running configuration */
+static int cdr_nextra, cdr_nleg, cdr_nstr, cdr_ncols;
+static str *cdr_col_names;
+
+/* writer state */
+static int seg_fd = -1;
+static unsigned long seg_size;
+static time_t seg_start;
+static unsigned int seg_no;
+static struct cdr_buf *col_bufs;
+static struct cdr_buf out_buf;
+static int *dict_slots;
+static unsigned int dict_cap;
+static str *dict_vals;
+
+
+int acc_cdr_file_extras(void)
+{
+	return cdr_nextra;
+}
+
+
+int acc_cdr_file_legs(void)
+{
+	return cdr_nleg;
+}
+
+
+unsigned long acc_cdr_file_queue_depth(void)
+{
+	return cdr_queue ? cdr_queue->depth : 0;
+}
+
+
+int acc_cdr_file_init(void)
+{
+	struct acc_extra *extra;
+	int n;
+
+	if (acc_cdr_file_block_rows <= 0)
+		acc_cdr_file_block_rows = 4096;
+	if (acc_cdr_file_queue_size < acc_cdr_file_block_rows) {
+		LM_WARN("cdr_file_queue_size too small, raising it to %d\n",
+			acc_cdr_file_block_rows);
+		acc_cdr_file_queue_size = acc_cdr_file_block_rows;
+	}
+	if (acc_cdr_file_flush_interval <= 0)
+		acc_cdr_file_flush_interval = 1000;
+
+	if (access(acc_cdr_file_dir, W_OK) < 0) {
+		LM_ERR("CDR file dir %s is not writable: %s\n", acc_cdr_file_dir,
+			strerror(errno));
+		return -1;
+	}
+
+	for (extra = file_extra_tags; extra; extra = extra->next)
+		cdr_nextra++;
+	for (extra = file_leg_tags; extra; extra = extra->next)
+		cdr_nleg++;
+	cdr_nstr = ACC_CORE_LEN + cdr_nextra + cdr_nleg;
+	cdr_ncols = cdr_nstr + CDR_FILE_INT_COLS;
+	if (cdr_ncols > CDR_MAX_COLS) {
+		LM_ERR("too many CDR file columns (%d)\n", cdr_ncols);
+		return -1;
+	}
+
+	cdr_col_names = pkg_malloc(cdr_ncols * sizeof *cdr_col_names);
+	if (!cdr_col_names) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+
+	n = 0;
+	cdr_col_names[n++] = acc_method_col;
+	cdr_col_names[n++] = acc_fromtag_col;
+	cdr_col_names[n++] = acc_totag_col;
+	cdr_col_names[n++] = acc_callid_col;
+	cdr_col_names[n++] = acc_sipcode_col;
+	cdr_col_names[n++] = acc_sipreason_col;
+	for (extra = file_extra_tags; extra; extra = extra->next)
+		cdr_col_names[n++] = extra->name;
+	for (extra = file_leg_tags; extra; extra = extra->next)
+		cdr_col_names[n++] = extra->name;
+	cdr_col_names[n + CDR_FILE_TIME] = acc_time_col;
+	cdr_col_names[n + CDR_FILE_SETUPTIME] = acc_setuptime_col;
+	cdr_col_names[n + CDR_FILE_CREATED] = acc_created_col;
+	cdr_col_names[n + CDR_FILE_DURATION] = acc_duration_col;
+	cdr_col_names[n + CDR_FILE_MS_DURATION] = acc_ms_duration_col;
+
+	for (n = 0; n < cdr_ncols; n++)
+		if (cdr_col_names[n].len > 255) {
+			LM_ERR("column name too long: %.*s\n", cdr_col_names[n].len,
+				cdr_col_names[n].s);
+			return -1;
+		}
+
+	cdr_queue = wq_create(acc_cdr_file_queue_size, acc_cdr_file_block_rows);
+	if (!cdr_queue)
+		return -1;
+
+	return 0;
+}
+
+
+int acc_cdr_file_push(const str *vals, const long long *ints)
+{
+	struct cdr_file_rec *rec;
+	unsigned int size;
+	char *p;
+	int i;
+
+	if (wq_full(cdr_queue))
+		goto full;
+
+	size = sizeof *rec + cdr_nstr * sizeof(str);
+	for (i = 0; i < cdr_nstr; i++)
+		size += vals[i].len;
+
+	rec = shm_malloc(size);
+	if (!rec) {
+		LM_ERR("no more shm memory\n");
+		update_stat(cdr_file_dropped_stat, 1);
+		return -1;
+	}
+
+	memcpy(rec->ints, ints, sizeof rec->ints);
+	rec->vals = (str *)(rec + 1);
+	p = (char *)(rec->vals + cdr_nstr);
+	for (i = 0; i < cdr_nstr; i++) {
+		rec->vals[i].s = p;
+		rec->vals[i].len = vals[i].len;
+		if (vals[i].len) {
+			memcpy(p, vals[i].s, vals[i].len);
+			p += vals[i].len;
+		}
+	}
+
+	if (wq_push(cdr_queue, &rec->link) < 0) {
+		shm_free(rec);
+		goto full;
+	}
+
+	return 1;
+full:
+	LM_DBG("CDR file queue is full (%d CDRs), dropping CDR\n",
+		acc_cdr_file_queue_size);
+	update_stat(cdr_file_dropped_stat, 1);
+	return -1;
+}
+
+
+/*************************** encoding ***************************/
+
+static int cdr_buf_reserve(struct cdr_buf *b, unsigned int len)
+{
+	unsigned char *s;
+	unsigned int size;
+
+	if (b->len + len <= b->size)
+		return 0;
+
+	for (size = b->size ? b->size : 4096; size < b->len + len; size *= 2);
+	s = pkg_realloc(b->s, size);
+	if (!s) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	b->s = s;
+	b->size = size;
+	return 0;
+}
+
+
+/* the caller must have reserved 10 bytes */
+static inline void cdr_put_varint(struct cdr_buf *b, unsigned long long v)
+{
+	while (v >= 0x80) {
+		b->s[b->len++] = (unsigned char)(v | 0x80);
+		v >>= 7;
+	}
+	b->s[b->len++] = (unsigned char)v;
+}
+
+
+static inline int cdr_get_varint(const unsigned char **p,
+		const unsigned char *end, unsigned long long *v)
+{
+	unsigned long long r = 0;
+	int shift;
+
+	for (shift = 0; *p < end && shift < 64; shift += 7) {
+		r |= (unsigned long long)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) {
+			*v = r;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+
+#define zigzag(_v)   (((unsigned long long)(_v) << 1) ^ (unsigned long long)((_v) >> 63))
+#define unzigzag(_v) ((long long)((_v) >> 1) ^ -(long long)((_v) & 1))
+
+
+static inline unsigned int cdr_str_hash(const str *s)
+{
+	unsigned int h = 2166136261u;
+	int i;
+
+	for (i = 0; i < s->len; i++)
+		h = (h ^ (unsigned char)s->s[i]) * 16777619u;
+	return h;
+}
+
+
+/* dictionary of the distinct values, then the value index of every row */
+static int cdr_encode_str(struct cdr_buf *b, struct cdr_file_rec *rec,
+		int rows, int col)
+{
+	struct cdr_file_rec *it;
+	unsigned int h, ndict = 0;
+	int i, *idx;
+
+	memset(dict_slots, 0, dict_cap * sizeof *dict_slots);
+	idx = (int *)out_buf.s;
+
+	/* first pass: build the dictionary, keep the indexes in out_buf */
+	for (it = rec, i = 0; i < rows; it = cdr_rec_next(it), i++) {
+		for (h = cdr_str_hash(&it->vals[col]) & (dict_cap - 1);
+		dict_slots[h]; h = (h + 1) & (dict_cap - 1))
+			if (str_strcmp(&dict_vals[dict_slots[h] - 1], &it->vals[col]) == 0)
+				break;
+		if (!dict_slots[h]) {
+			dict_vals[ndict] = it->vals[col];
+			dict_slots[h] = ++ndict;
+		}
+		idx[i] = dict_slots[h] - 1;
+	}
+
+	if (cdr_buf_reserve(b, 10) < 0)
+		return -1;
+	cdr_put_varint(b, ndict);
+	for (h = 0; h < ndict; h++) {
+		if (cdr_buf_reserve(b, 10 + dict_vals[h].len) < 0)
+			return -1;
+		cdr_put_varint(b, dict_vals[h].len);
+		memcpy(b->s + b->len, dict_vals[h].s, dict_vals[h].len);
+		b->len += dict_vals[h].len;
+	}
+
+	if (cdr_buf_reserve(b, 10 * rows) < 0)
+		return -1;
+	for (i = 0; i < rows; i++)
+		cdr_put_varint(b, idx[i]);
+
+	return 0;
+}
+
+
+static int cdr_encode_int(struct cdr_buf *b, struct cdr_file_rec *rec,
+		int rows, int col)
+{
+	long long prev = 0;
+	int i;
+
+	if (cdr_buf_reserve(b, 10 * rows) < 0)
+		return -1;
+
+	for (i = 0; i < rows; rec = cdr_rec_next(rec), i++) {
+		cdr_put_varint(b, zigzag(rec->ints[col] - prev));
+		prev = rec->ints[col];
+	}
+
+	return 0;
+}
+
+
+static int cdr_write_all(int fd, const void *buf, size_t len)
+{
+	ssize_t n;
+
+	while (len) {
+		n = write(fd, buf, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+	return 0;
+}
+
+
+static void cdr_close_segment(void)
+{
+	if (seg_fd < 0)
+		return;
+	close(seg_fd);
+	seg_fd = -1;
+}
+
+
+static int cdr_open_segment(time_t now)
+{
+	struct cdr_seg_hdr hdr;
+	char path[PATH_MAX];
+	unsigned char len;
+	int i;
+
+	for (;;) {
+		snprintf(path, sizeof path, "%s/" CDR_SEG_PREFIX "%lu_%u"
+			CDR_SEG_SUFFIX, acc_cdr_file_dir, (unsigned long)now, seg_no++);
+		seg_fd = open(path, O_WRONLY|O_CREAT|O_EXCL|O_APPEND, 0644);
+		if (seg_fd >= 0)
+			break;
+		if (errno != EEXIST) {
+			LM_ERR("failed to create CDR segment %s: %s\n", path,
+				strerror(errno));
+			return -1;
+		}
+	}
+
+	memcpy(hdr.magic, CDR_SEG_MAGIC, sizeof hdr.magic);
+	hdr.version = CDR_SEG_VERSION;
+	hdr.ncols = cdr_ncols;
+	hdr.nstr = cdr_nstr;
+
+	out_buf.len = 0;
+	if (cdr_buf_reserve(&out_buf, sizeof hdr) < 0)
+		goto error;
+	memcpy(out_buf.s, &hdr, sizeof hdr);
+	out_buf.len = sizeof hdr;
+
+	for (i = 0; i < cdr_ncols; i++) {
+		if (cdr_buf_reserve(&out_buf, 2 + cdr_col_names[i].len) < 0)
+			goto error;
+		out_buf.s[out_buf.len++] = i < cdr_nstr ? CDR_COL_STR : CDR_COL_INT;
+		len = cdr_col_names[i].len;
+		out_buf.s[out_buf.len++] = len;
+		memcpy(out_buf.s + out_buf.len, cdr_col_names[i].s, len);
+		out_buf.len += len;
+	}
+
+	if (cdr_write_all(seg_fd, out_buf.s, out_buf.len) < 0) {
+		LM_ERR("failed to write CDR segment %s: %s\n", path, strerror(errno));
+		goto error;
+	}
+
+	seg_size = out_buf.len;
+	seg_start = now;
+	LM_DBG("started CDR segment %s\n", path);
+	return 0;
+error:
+	close(seg_fd);
+	seg_fd = -1;
+	unlink(path);
+	return -1;
+}
+
+
+/* encodes the first 'rows' CDRs of the given list as one block and appends
+ * it to the current segment, rotating it if needed */
+static int cdr_write_block(struct cdr_file_rec *rec, int rows)
+{
+	struct cdr_block_hdr *hdr;
+	struct cdr_file_rec *it;
+	unsigned int *col_len;
+	unsigned int cap, size;
+	time_t now;
+	int i;
+
+	/* the dictionary needs a free slot for every row */
+	for (cap = 16; cap < 2 * rows; cap <<= 1);
+	if (cap > dict_cap) {
+		if (dict_slots)
+			pkg_free(dict_slots);
+		if (dict_vals)
+			pkg_free(dict_vals);
+		dict_slots = pkg_malloc(cap * sizeof *dict_slots);
+		dict_vals = pkg_malloc(cap / 2 * sizeof *dict_vals);
+		if (!dict_slots || !dict_vals) {
+			LM_ERR("no more pkg memory\n");
+			if (dict_slots)
+				pkg_free(dict_slots);
+			if (dict_vals)
+				pkg_free(dict_vals);
+			dict_slots = NULL;
+			dict_vals = NULL;
+			dict_cap = 0;
+			return -1;
+		}
+		dict_cap = cap;
+	}
+
+	/* out_buf holds the row indexes while encoding the string columns */
+	out_buf.len = 0;
+	if (cdr_buf_reserve(&out_buf, rows * sizeof(int)) < 0)
+		return -1;
+
+	for (i = 0; i < cdr_ncols; i++) {
+		col_bufs[i].len = 0;
+		if ((i < cdr_nstr ? cdr_encode_str(&col_bufs[i], rec, rows, i) :
+		cdr_encode_int(&col_bufs[i], rec, rows, i - cdr_nstr)) < 0)
+			return -1;
+	}
+
+	size = cdr_ncols * sizeof *col_len;
+	for (i = 0; i < cdr_ncols; i++)
+		size += col_bufs[i].len;
+
+	out_buf.len = 0;
+	if (cdr_buf_reserve(&out_buf, sizeof *hdr + size) < 0)
+		return -1;
+
+	hdr = (struct cdr_block_hdr *)out_buf.s;
+	hdr->magic = CDR_BLOCK_MAGIC;
+	hdr->rows = rows;
+	hdr->size = size;
+	hdr->ncols = cdr_ncols;
+	hdr->min_time = hdr->max_time = rec->ints[CDR_FILE_TIME];
+	for (it = cdr_rec_next(rec), i = 1; i < rows;
+	it = cdr_rec_next(it), i++) {
+		if (it->ints[CDR_FILE_TIME] < hdr->min_time)
+			hdr->min_time = it->ints[CDR_FILE_TIME];
+		if (it->ints[CDR_FILE_TIME] > hdr->max_time)
+			hdr->max_time = it->ints[CDR_FILE_TIME];
+	}
+
+	col_len = (unsigned int *)(hdr + 1);
+	out_buf.len = sizeof *hdr + cdr_ncols * sizeof *col_len;
+	for (i = 0; i < cdr_ncols; i++) {
+		col_len[i] = col_bufs[i].len;
+		memcpy(out_buf.s + out_buf.len, col_bufs[i].s, col_bufs[i].len);
+		out_buf.len += col_bufs[i].len;
+	}
+
+	now = time(NULL);
+	if (seg_fd >= 0 && (seg_size + out_buf.len >
+	(unsigned long)acc_cdr_file_max_size * 1024 * 1024 ||
+	(acc_cdr_file_rotate_interval > 0 &&
+	now >= seg_start + acc_cdr_file_rotate_interval)))
+		cdr_close_segment();
+
+	if (seg_fd < 0) {
+		/* the header was overwritten by the block - keep it aside */
+		struct cdr_buf block = out_buf;
+
+		memset(&out_buf, 0, sizeof out_buf);
+		i = cdr_open_segment(now);
+		if (out_buf.s)
+			pkg_free(out_buf.s);
+		out_buf = block;
+		if (i < 0)
+			return -1;
+	}
+
+	if (cdr_write_all(seg_fd, out_buf.s, out_buf.len) < 0) {
+		LM_ERR("failed to write CDR block: %s\n", strerror(errno));
+		/* do not leave a partial block behind */
+		if (ftruncate(seg_fd, seg_size) < 0)
+			cdr_close_segment();
+		return -1;
+	}
+	seg_size += out_buf.len;
+
+	return 0;
+}
+
+
+/* writes up to 'max' CDRs from the head of the queue; the CDRs go back
+ * to the queue if the block could not be written */
+static int cdr_flush_queue(int max)
+{
+	struct wq_item *first, *last, *it, *next;
+	unsigned int rows;
+
+	first = wq_take(cdr_queue, max, &last, &rows);
+	if (!first)
+		return 0;
+
+	if (cdr_write_block(cdr_rec_of(first), rows) < 0) {
+		wq_put_back(cdr_queue, first, last, rows);
+		return -1;
+	}
+
+	for (it = first; it; it = next) {
+		next = it->next;
+		shm_free(cdr_rec_of(it));
+	}
+	wq_done(cdr_queue, rows);
+
+	update_stat(cdr_file_written_stat, rows);
+	return rows;
+}
+
+
+static int cdr_writer_init(void)
+{
+	col_bufs = pkg_malloc(cdr_ncols * sizeof *col_bufs);
+	if (!col_bufs) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	memset(col_bufs, 0, cdr_ncols * sizeof *col_bufs);
+	return 0;
+}
+
+
+static inline unsigned long cdr_ms_since(struct timeval *tv)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - tv->tv_sec) * 1000 +
+		(now.tv_usec - tv->tv_usec) / 1000;
+}
+
+
+void acc_cdr_file_proc(int rank)
+{
+	struct timeval last_flush;
+
+	if (cdr_writer_init() < 0)
+		return;
+
+	gettimeofday(&last_flush, NULL);
+
+	for (;;) {
+		wq_wait(cdr_queue, acc_cdr_file_flush_interval);
+
+		/* full blocks first */
+		while (cdr_queue->queued >= acc_cdr_file_block_rows &&
+		cdr_flush_queue(acc_cdr_file_block_rows) > 0)
+			gettimeofday(&last_flush, NULL);
+
+		/* then whatever waited long enough */
+		if (cdr_ms_since(&last_flush) >= acc_cdr_file_flush_interval) {
+			if (cdr_queue->queued)
+				cdr_flush_queue(acc_cdr_file_block_rows);
+			gettimeofday(&last_flush, NULL);
+		}
+
+		/* do not keep an idle segment open past its lifetime */
+		if (seg_fd >= 0 && acc_cdr_file_rotate_interval > 0 &&
+		time(NULL) >= seg_start + acc_cdr_file_rotate_interval)
+			cdr_close_segment();
+	}
+}
+
+
+void acc_cdr_file_destroy(void)
+{
+	if (!cdr_queue)
+		return;
+
+	if (cdr_queue->queued && (col_bufs || cdr_writer_init() == 0))
+		while (cdr_queue->queued &&
+		cdr_flush_queue(acc_cdr_file_block_rows) > 0);
+
+	if (cdr_queue->queued)
+		LM_WARN("%u CDRs were not written to file\n", cdr_queue->queued);
+
+	cdr_close_segment();
+	wq_destroy(cdr_queue);
+	cdr_queue = NULL;
+}
+
+
+/*************************** reading ***************************/
+
+struct cdr_seg {
+	unsigned char *map;
+	size_t size;
+	const unsigned char *blocks;  /* first block */
+	unsigned int ncols;
+	unsigned int nstr;
+	str names[CDR_MAX_COLS];
+};
+
+/* a decoded column of a block */
+struct cdr_col {
+	str *dict;                 /* string columns */
+	unsigned long long *vals;  /* dictionary index or integer value */
+};
+
+struct cdr_group {
+	str value;
+	unsigned long cdrs;
+	unsigned long long duration;
+	struct cdr_group *next;
+};
+
+#define CDR_GROUP_BUCKETS 256
+
+struct cdr_query {
+	long long from;
+	long long to;
+	/* listing */
+	int limit;
+	unsigned long listed;
+	mi_item_t *list;
+	/* aggregation */
+	str group_by;
+	unsigned long cdrs;
+	unsigned long long duration;
+	struct cdr_group *groups[CDR_GROUP_BUCKETS];
+	int error;
+};
+
+
+static int cdr_seg_open(const char *path, struct cdr_seg *seg)
+{
+	const struct cdr_seg_hdr *hdr;
+	const unsigned char *p, *end;
+	struct stat st;
+	unsigned int i;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		LM_ERR("failed to open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof *hdr) {
+		close(fd);
+		return -1;
+	}
+
+	seg->size = st.st_size;
+	seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg->map == MAP_FAILED) {
+		LM_ERR("failed to map %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	hdr = (const struct cdr_seg_hdr *)seg->map;
+	if (memcmp(hdr->magic, CDR_SEG_MAGIC, sizeof hdr->magic) ||
+	hdr->version != CDR_SEG_VERSION || hdr->ncols > CDR_MAX_COLS ||
+	hdr->nstr + CDR_FILE_INT_COLS != hdr->ncols) {
+		LM_ERR("%s is not a valid CDR segment\n", path);
+		goto error;
+	}
+	seg->ncols = hdr->ncols;
+	seg->nstr = hdr->nstr;
+
+	p = (const unsigned char *)(hdr + 1);
+	end = seg->map + seg->size;
+	for (i = 0; i < seg->ncols; i++) {
+		if (p + 2 > end || p + 2 + p[1] > end)
+			goto error;
+		seg->names[i].len = p[1];
+		seg->names[i].s = (char *)p + 2;
+		p += 2 + p[1];
+	}
+	seg->blocks = p;
+
+	return 0;
+error:
+	munmap(seg->map, seg->size);
+	return -1;
+}
+
+
+static int cdr_decode_col(const struct cdr_seg *seg, const unsigned char *p,
+		unsigned int len, unsigned int rows, unsigned int col,
+		struct cdr_col *c)
+{
+	const unsigned char *end = p + len;
+	unsigned long long v, ndict = 0, prev = 0;
+	unsigned int i;
+
+	if (col < seg->nstr) {
+		if (cdr_get_varint(&p, end, &ndict) < 0 || ndict > rows)
+			return -1;
+		for (i = 0; i < ndict; i++) {
+			if (cdr_get_varint(&p, end, &v) < 0 || p + v > end)
+				return -1;
+			c->dict[i].s = (char *)p;
+			c->dict[i].len = v;
+			p += v;
+		}
+	}
+
+	for (i = 0; i < rows; i++) {
+		if (cdr_get_varint(&p, end, &v) < 0)
+			return -1;
+		if (col < seg->nstr) {
+			if (v >= ndict)
+				return -1;
+			c->vals[i] = v;
+		} else {
+			prev += unzigzag(v);
+			c->vals[i] = prev;
+		}
+	}
+
+	return 0;
+}
+
+
+static inline str *cdr_col_str(struct cdr_col *c, unsigned int row)
+{
+	return &c->dict[c->vals[row]];
+}
+
+
+static int cdr_add_group(struct cdr_query *q, str *value,
+		unsigned long long duration)
+{
+	struct cdr_group *g;
+	unsigned int h = cdr_str_hash(value) & (CDR_GROUP_BUCKETS - 1);
+
+	for (g = q->groups[h]; g; g = g->next)
+		if (str_strcmp(&g->value, value) == 0)
+			break;
+
+	if (!g) {
+		g = pkg_malloc(sizeof *g + value->len);
+		if (!g) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		g->value.s = (char *)(g + 1);
+		g->value.len = value->len;
+		memcpy(g->value.s, value->s, value->len);
+		g->cdrs = 0;
+		g->duration = 0;
+		g->next = q->groups[h];
+		q->groups[h] = g;
+	}
+
+	g->cdrs++;
+	g->duration += duration;
+	return 0;
+}
+
+
+static int cdr_list_row(struct cdr_query *q, const struct cdr_seg *seg,
+		struct cdr_col *cols, unsigned int row)
+{
+	mi_item_t *obj;
+	unsigned int i;
+	str *s;
+
+	obj = add_mi_object(q->list, NULL, 0);
+	if (!obj)
+		return -1;
+
+	for (i = 0; i < seg->ncols; i++) {
+		if (i < seg->nstr) {
+			s = cdr_col_str(&cols[i], row);
+			if (add_mi_string(obj, seg->names[i].s, seg->names[i].len,
+			s->s, s->len) < 0)
+				return -1;
+		} else if (add_mi_number(obj, seg->names[i].s, seg->names[i].len,
+		(long long)cols[i].vals[row]) < 0) {
+			return -1;
+		}
+	}
+
+	q->listed++;
+	return 0;
+}
+
+
+/* runs the query over a block; all the columns are decoded for listing,
+ * otherwise only the time, duration and group-by ones. The blocks are not
+ * aligned in the segment, so the column lengths are copied out of 'body' */
+static int cdr_query_block(struct cdr_query *q, const struct cdr_seg *seg,
+		const struct cdr_block_hdr *hdr, const unsigned char *body)
+{
+	unsigned int col_len[CDR_MAX_COLS];
+	const unsigned char *p;
+	struct cdr_col *cols;
+	unsigned int i, row, time_col, dur_col, group_col = 0;
+	unsigned long long *vals;
+	unsigned long len;
+	str *dict;
+	int ret = -1;
+
+	memcpy(col_len, body, seg->ncols * sizeof *col_len);
+	for (i = 0, len = seg->ncols * sizeof *col_len; i < seg->ncols; i++)
+		len += col_len[i];
+	if (len != hdr->size) {
+		LM_ERR("corrupted CDR block\n");
+		return -1;
+	}
+	if (!hdr->rows)
+		return 0;
+
+	time_col = seg->nstr + CDR_FILE_TIME;
+	dur_col = seg->nstr + CDR_FILE_DURATION;
+	if (q->group_by.s) {
+		for (group_col = 0; group_col < seg->nstr; group_col++)
+			if (str_strcmp(&seg->names[group_col], &q->group_by) == 0)
+				break;
+		/* column not present in this segment */
+		if (group_col == seg->nstr)
+			return 0;
+	}
+
+	cols = pkg_malloc(seg->ncols * sizeof *cols);
+	vals = pkg_malloc(seg->ncols * hdr->rows * sizeof *vals);
+	dict = pkg_malloc(seg->nstr * hdr->rows * sizeof *dict);
+	if (!cols || !vals || !dict) {
+		LM_ERR("no more pkg memory\n");
+		goto end;
+	}
+
+	p = body + seg->ncols * sizeof *col_len;
+	for (i = 0; i < seg->ncols; i++) {
+		cols[i].vals = vals + i * hdr->rows;
+		cols[i].dict = i < seg->nstr ? dict + i * hdr->rows : NULL;
+		if ((q->list || i == time_col || i == dur_col ||
+		(q->group_by.s && i == group_col)) &&
+		cdr_decode_col(seg, p, col_len[i], hdr->rows, i, &cols[i]) < 0) {
+			LM_ERR("corrupted CDR block\n");
+			goto end;
+		}
+		p += col_len[i];
+	}
+
+	for (row = 0; row < hdr->rows; row++) {
+		if ((long long)cols[time_col].vals[row] < q->from ||
+		(long long)cols[time_col].vals[row] > q->to)
+			continue;
+
+		if (q->list) {
+			if (q->listed >= q->limit)
+				break;
+			if (cdr_list_row(q, seg, cols, row) < 0)
+				goto end;
+			continue;
+		}
+
+		q->cdrs++;
+		q->duration += cols[dur_col].vals[row];
+		if (q->group_by.s && cdr_add_group(q,
+		cdr_col_str(&cols[group_col], row), cols[dur_col].vals[row]) < 0)
+			goto end;
+	}
+
+	ret = 0;
+end:
+	if (cols)
+		pkg_free(cols);
+	if (vals)
+		pkg_free(vals);
+	if (dict)
+		pkg_free(dict);
+	return ret;
+}
+
+
+static int cdr_query_segment(struct cdr_query *q, const char *path)
+{
+	struct cdr_block_hdr hdr;
+	const unsigned char *p, *end;
+	struct cdr_seg seg;
+	int ret = 0;
+
+	if (cdr_seg_open(path, &seg) < 0)
+		return 0;
+
+	end = seg.map + seg.size;
+	for (p = seg.blocks; p + sizeof hdr <= end; p += sizeof hdr + hdr.size) {
+		/* the blocks follow the variable length column names */
+		memcpy(&hdr, p, sizeof hdr);
+		if (hdr.magic != CDR_BLOCK_MAGIC || hdr.ncols != seg.ncols ||
+		hdr.size < hdr.ncols * sizeof(unsigned int)) {
+			LM_ERR("corrupted CDR segment %s\n", path);
+			break;
+		}
+		/* the writer may still be appending this one */
+		if (p + sizeof hdr + hdr.size > end)
+			break;
+
+		if (hdr.max_time < q->from || hdr.min_time > q->to)
+			continue;
+
+		if (cdr_query_block(q, &seg, &hdr, p + sizeof hdr) < 0) {
+			ret = -1;
+			break;
+		}
+		if (q->list && q->listed >= q->limit)
+			break;
+	}
+
+	munmap(seg.map, seg.size);
+	return ret;
+}
+
+
+static int cdr_seg_filter(const struct dirent *d)
+{
+	int len = strlen(d->d_name);
+
+	return len > sizeof(CDR_SEG_PREFIX CDR_SEG_SUFFIX) - 1 &&
+		!strncmp(d->d_name, CDR_SEG_PREFIX, sizeof(CDR_SEG_PREFIX) - 1) &&
+		!strcmp(d->d_name + len - (sizeof(CDR_SEG_SUFFIX) - 1),
+			CDR_SEG_SUFFIX);
+}
+
+
+/* segments are named after their start time, older ones first */
+static int cdr_seg_cmp(const struct dirent **a, const struct dirent **b)
+{
+	unsigned long ta, tb;
+	unsigned int sa, sb;
+
+	if (sscanf((*a)->d_name, CDR_SEG_PREFIX "%lu_%u", &ta, &sa) != 2 ||
+	sscanf((*b)->d_name, CDR_SEG_PREFIX "%lu_%u", &tb, &sb) != 2)
+		return strcmp((*a)->d_name, (*b)->d_name);
+
+	if (ta != tb)
+		return ta < tb ? -1 : 1;
+	return sa < sb ? -1 : (sa > sb);
+}
+
+
+static int cdr_run_query(struct cdr_query *q)
+{
+	struct dirent **names;
+	char path[PATH_MAX];
+	int n, i, ret = 0;
+
+	n = scandir(acc_cdr_file_dir, &names, cdr_seg_filter, cdr_seg_cmp);
+	if (n < 0) {
+		LM_ERR("failed to scan %s: %s\n", acc_cdr_file_dir, strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		/* a segment may hold CDRs of calls started long before it was
+		 * opened, so only the block headers tell what it covers */
+		if (ret == 0 && (!q->list || q->listed < q->limit)) {
+			snprintf(path, sizeof path, "%s/%s", acc_cdr_file_dir,
+				names[i]->d_name);
+			ret = cdr_query_segment(q, path);
+		}
+		free(names[i]);
+	}
+	free(names);
+
+	return ret;
+}
+
+
+static mi_response_t *cdr_mi_query(const mi_params_t *params, int limit,
+		str *group_by)
+{
+	mi_response_t *resp;
+	mi_item_t *resp_obj, *groups_arr, *group_obj;
+	struct cdr_query q;
+	struct cdr_group *g, *next;
+	int from, to, i;
+
+	if (!acc_cdr_file_dir)
+		return init_mi_error(400, MI_SSTR("CDR files not enabled"));
+
+	if (get_mi_int_param(params, "from", &from) < 0 ||
+	get_mi_int_param(params, "to", &to) < 0)
+		return init_mi_param_error();
+
+	memset(&q, 0, sizeof q);
+	q.from = from;
+	q.to = to;
+	q.limit = limit;
+	if (group_by)
+		q.group_by = *group_by;
+
+	resp = init_mi_result_object(&resp_obj);
+	if (!resp)
+		return NULL;
+
+	if (limit) {
+		q.list = add_mi_array(resp_obj, MI_SSTR("CDRs"));
+		if (!q.list)
+			goto error;
+	}
+
+	if (cdr_run_query(&q) < 0)
+		goto error;
+
+	if (!limit) {
+		if (add_mi_number(resp_obj, MI_SSTR("cdrs"), q.cdrs) < 0 ||
+		add_mi_number(resp_obj, MI_SSTR("duration"), q.duration) < 0)
+			goto error;
+
+		if (group_by) {
+			groups_arr = add_mi_array(resp_obj, MI_SSTR("groups"));
+			if (!groups_arr)
+				goto error;
+			for (i = 0; i < CDR_GROUP_BUCKETS; i++)
+				for (g = q.groups[i]; g; g = g->next) {
+					group_obj = add_mi_object(groups_arr, NULL, 0);
+					if (!group_obj ||
+					add_mi_string(group_obj, group_by->s, group_by->len,
+						g->value.s, g->value.len) < 0 ||
+					add_mi_number(group_obj, MI_SSTR("cdrs"), g->cdrs) < 0 ||
+					add_mi_number(group_obj, MI_SSTR("duration"),
+						g->duration) < 0)
+						goto error;
+				}
+		}
+	}
+
+	for (i = 0; i < CDR_GROUP_BUCKETS; i++)
+		for (g = q.groups[i]; g; g = next) {
+			next = g->next;
+			pkg_free(g);
+		}
+
+	return resp;
+error:
+	for (i = 0; i < CDR_GROUP_BUCKETS; i++)
+		for (g = q.groups[i]; g; g = next) {
+			next = g->next;
+			pkg_free(g);
+		}
+	free_mi_response(resp);
+	return init_mi_error(500, MI_SSTR("Failed to query the CDR files"));
+}
+
+
+mi_response_t *mi_cdr_file_list(const mi_params_t *params,
+		struct mi_handler *async_hdl)
+{
+	return cdr_mi_query(params, CDR_LIST_LIMIT, NULL);
+}
+
+
+mi_response_t *mi_cdr_file_list_limit(const mi_params_t *params,
+		struct mi_handler *async_hdl)
+{
+	int limit;
+
+	if (get_mi_int_param(params, "limit", &limit) < 0)
+		return init_mi_param_error();
+	if (limit <= 0)
+		return init_mi_error(400, MI_SSTR("Bad limit"));
+
+	return cdr_mi_query(params, limit, NULL);
+}
+
+
+mi_response_t *mi_cdr_file_aggregate(const mi_params_t *params,
+		struct mi_handler *async_hdl)
+{
+	return cdr_mi_query(params, 0, NULL);
+}
+
+
+mi_response_t *mi_cdr_file_aggregate_group(const mi_params_t *params,
+		struct mi_handler *async_hdl)
+{
+	str group_by;
+
+	if (get_mi_string_param(params, "group_by", &group_by.s,
+	&group_by.len) < 0)
+		return init_mi_param_error();
+
+	return cdr_mi_query(params, 0, &group_by);
+}
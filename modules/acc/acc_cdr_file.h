@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+
+#ifndef _ACC_CDR_FILE_H_
+#define _ACC_CDR_FILE_H_
+
+#include "../../str.h"
+#include "../../statistics.h"
+#include "../../mi/mi.h"
+
+/* integer columns of a CDR, stored after the string ones */
+#define CDR_FILE_TIME       0
+#define CDR_FILE_SETUPTIME  1
+#define CDR_FILE_CREATED    2
+#define CDR_FILE_DURATION   3
+#define CDR_FILE_MS_DURATION 4
+#define CDR_FILE_INT_COLS   5
+
+extern stat_var *cdr_file_written_stat;
+extern stat_var *cdr_file_dropped_stat;
+
+/* builds the column layout and the shm queue (called in mod_init) */
+int acc_cdr_file_init(void);
+
+/* writes the still queued CDRs at shutdown */
+void acc_cdr_file_destroy(void);
+
+/* queues one CDR: the core, extra and leg values, in this order,
+ * and the integer columns; returns 1 on success, -1 on error */
+int acc_cdr_file_push(const str *vals, const long long *ints);
+
+/* number of extra / leg values expected by acc_cdr_file_push() */
+int acc_cdr_file_extras(void);
+int acc_cdr_file_legs(void);
+
+/* main loop of the "ACC CDR file writer" process */
+void acc_cdr_file_proc(int rank);
+
+unsigned long acc_cdr_file_queue_depth(void);
+
+mi_response_t *mi_cdr_file_list(const mi_params_t *params,
+		struct mi_handler *async_hdl);
+mi_response_t *mi_cdr_file_list_limit(const mi_params_t *params,
+		struct mi_handler *async_hdl);
+mi_response_t *mi_cdr_file_aggregate(const mi_params_t *params,
+		struct mi_handler *async_hdl);
+mi_response_t *mi_cdr_file_aggregate_group(const mi_params_t *params,
+		struct mi_handler *async_hdl);
+
+#endif
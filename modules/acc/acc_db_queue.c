@@ -0,0 +1,647 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *
+ * Queued DB accounting: the SIP workers only copy the rows into a bounded
+ * shm queue, while a dedicated process writes them to the database in
+ * batches. If the database is unreachable, the queued rows are spilled to
+ * a file and replayed once the database is back.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+
+#include "../../dprint.h"
+#include "../../ut.h"
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../timer.h"
+#include "../../lib/writer_queue.h"
+
+#include "acc.h"
+#include "acc_mod.h"
+#include "acc_db_queue.h"
+
+#define ACC_SPILL_FILE    "acc_cdr.spill"
+#define ACC_REPLAY_SUFFIX ".replay"
+#define ACC_SPILL_MAGIC   0x41434332 /* "ACC2" */
+
+struct acc_db_row {
+	str table;
+	int n;
+	int attempts;          /* failed inserts so far */
+	unsigned int size;     /* bytes following the header */
+	db_val_t *vals;
+	struct wq_item link;
+	/* db_val_t[n], table name and string values follow */
+};
+
+#define acc_db_row_of(_it) container_of(_it, struct acc_db_row, link)
+
+/* on-disk record header; the values are stored with the string pointers
+ * replaced by offsets from the start of the payload */
+struct acc_spill_hdr {
+	unsigned int magic;
+	unsigned int size;
+	int n;
+	int table_len;
+	int attempts;
+};
+
+/* prepared statements of the writer, one per table and column count */
+struct acc_db_ps {
+	str table;
+	int n;
+	db_ps_t ps;
+	struct acc_db_ps *next;
+};
+
+stat_var *acc_db_flushed_stat;
+stat_var *acc_db_spilled_stat;
+stat_var *acc_db_dropped_stat;
+
+static struct writer_queue *acc_queue;
+static const str *acc_queue_db_url;
+
+static char *spill_file;
+static char *replay_file;
+static FILE *replay_f;
+
+static struct acc_db_ps *acc_db_ps_list;
+
+
+int acc_db_queue_init(const str *db_url)
+{
+	int len;
+
+	if (acc_db_queue_size <= 0) {
+		LM_ERR("invalid db_queue_size %d\n", acc_db_queue_size);
+		return -1;
+	}
+	if (acc_db_flush_interval <= 0)
+		acc_db_flush_interval = 1000;
+	if (acc_db_retry_interval <= 0)
+		acc_db_retry_interval = 1;
+	if (acc_db_max_attempts <= 0)
+		acc_db_max_attempts = 1;
+
+	acc_queue = wq_create(acc_db_queue_size, acc_db_batch_size);
+	if (!acc_queue)
+		return -1;
+
+	if (acc_db_spill_dir && acc_db_spill_dir[0]) {
+		if (access(acc_db_spill_dir, W_OK) < 0) {
+			LM_ERR("spill dir %s is not writable: %s\n", acc_db_spill_dir,
+				strerror(errno));
+			return -1;
+		}
+
+		len = strlen(acc_db_spill_dir);
+		spill_file = pkg_malloc(2 * (len + 1 + sizeof(ACC_SPILL_FILE)) +
+			sizeof(ACC_REPLAY_SUFFIX));
+		if (!spill_file) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		sprintf(spill_file, "%s/" ACC_SPILL_FILE, acc_db_spill_dir);
+		replay_file = spill_file + strlen(spill_file) + 1;
+		sprintf(replay_file, "%s/" ACC_SPILL_FILE ACC_REPLAY_SUFFIX,
+			acc_db_spill_dir);
+	}
+
+	acc_queue_db_url = db_url;
+	return 0;
+}
+
+
+unsigned long acc_db_queue_depth(void)
+{
+	return acc_queue ? acc_queue->depth : 0;
+}
+
+
+unsigned long acc_db_flush_latency(void)
+{
+	return acc_queue ? acc_queue->flush_ms : 0;
+}
+
+
+static inline unsigned int acc_db_val_len(const db_val_t *v)
+{
+	if (VAL_NULL(v))
+		return 0;
+
+	switch (VAL_TYPE(v)) {
+		case DB_STR:
+			return VAL_STR(v).len;
+		case DB_STRING:
+			return strlen(VAL_STRING(v)) + 1;
+		case DB_BLOB:
+			return VAL_BLOB(v).len;
+		default:
+			return 0;
+	}
+}
+
+
+/* turns the offsets of a spilled row back into pointers inside 'base' */
+static void acc_db_row_relocate(db_val_t *vals, int n, char *base)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (VAL_NULL(vals + i))
+			continue;
+		switch (VAL_TYPE(vals + i)) {
+			case DB_STR:
+			case DB_BLOB:
+				/* empty strings were not converted when spilled */
+				VAL_STR(vals + i).s = VAL_STR(vals + i).len ?
+					base + (unsigned long)VAL_STR(vals + i).s : base;
+				break;
+			case DB_STRING:
+				VAL_STRING(vals + i) = base +
+					(unsigned long)VAL_STRING(vals + i);
+				break;
+			default:
+				break;
+		}
+	}
+}
+
+
+int acc_db_queue_row(const str *table, const db_val_t *vals, int n)
+{
+	struct acc_db_row *row;
+	unsigned int size, len;
+	char *p;
+	int i;
+
+	/* cheap check before paying for the copy */
+	if (wq_full(acc_queue))
+		goto full;
+
+	size = n * sizeof(db_val_t) + table->len;
+	for (i = 0; i < n; i++)
+		size += acc_db_val_len(vals + i);
+
+	row = shm_malloc(sizeof *row + size);
+	if (!row) {
+		LM_ERR("no more shm memory\n");
+		update_stat(acc_db_dropped_stat, 1);
+		return -1;
+	}
+
+	row->n = n;
+	row->attempts = 0;
+	row->size = size;
+	row->vals = (db_val_t *)(row + 1);
+	memcpy(row->vals, vals, n * sizeof(db_val_t));
+
+	p = (char *)(row->vals + n);
+	row->table.s = p;
+	row->table.len = table->len;
+	memcpy(p, table->s, table->len);
+	p += table->len;
+
+	for (i = 0; i < n; i++) {
+		VAL_FREE(row->vals + i) = 0;
+		if ((len = acc_db_val_len(vals + i)) == 0)
+			continue;
+		switch (VAL_TYPE(vals + i)) {
+			case DB_STR:
+			case DB_BLOB:
+				memcpy(p, VAL_STR(vals + i).s, len);
+				VAL_STR(row->vals + i).s = p;
+				break;
+			case DB_STRING:
+				memcpy(p, VAL_STRING(vals + i), len);
+				VAL_STRING(row->vals + i) = p;
+				break;
+			default:
+				break;
+		}
+		p += len;
+	}
+
+	if (wq_push(acc_queue, &row->link) < 0) {
+		shm_free(row);
+		goto full;
+	}
+
+	return 1;
+full:
+	LM_DBG("CDR queue is full (%d rows), dropping row\n", acc_db_queue_size);
+	update_stat(acc_db_dropped_stat, 1);
+	return -1;
+}
+
+
+/* appends the given rows to the spill file and frees them;
+ * returns the number of rows written */
+static int acc_db_spill(struct wq_item *it)
+{
+	struct acc_spill_hdr hdr;
+	struct acc_db_row *row;
+	struct wq_item *next;
+	db_val_t val;
+	FILE *f;
+	char *base;
+	unsigned int len;
+	int i, no = 0;
+
+	f = fopen(spill_file, "ab");
+	if (!f) {
+		LM_ERR("failed to open spill file %s: %s\n", spill_file,
+			strerror(errno));
+		return -1;
+	}
+
+	for (; it; it = next) {
+		next = it->next;
+		row = acc_db_row_of(it);
+
+		hdr.magic = ACC_SPILL_MAGIC;
+		hdr.size = row->size;
+		hdr.n = row->n;
+		hdr.table_len = row->table.len;
+		hdr.attempts = row->attempts;
+		if (fwrite(&hdr, sizeof hdr, 1, f) != 1)
+			goto error;
+
+		base = (char *)row->vals;
+		for (i = 0; i < row->n; i++) {
+			val = row->vals[i];
+			if (acc_db_val_len(&val)) {
+				if (VAL_TYPE(&val) == DB_STRING)
+					VAL_STRING(&val) = (char *)(VAL_STRING(&val) - base);
+				else
+					VAL_STR(&val).s = (char *)(VAL_STR(&val).s - base);
+			}
+			if (fwrite(&val, sizeof val, 1, f) != 1)
+				goto error;
+		}
+
+		len = row->size - row->n * sizeof(db_val_t);
+		if (fwrite(row->vals + row->n, 1, len, f) != len)
+			goto error;
+
+		shm_free(row);
+		no++;
+	}
+
+	if (fclose(f) != 0)
+		LM_ERR("failed to write spill file %s: %s\n", spill_file,
+			strerror(errno));
+	return no;
+
+error:
+	LM_ERR("failed to write spill file %s: %s\n", spill_file,
+		strerror(errno));
+	fclose(f);
+	/* whatever could not be written is lost */
+	for (; it; it = next) {
+		next = it->next;
+		shm_free(acc_db_row_of(it));
+		update_stat(acc_db_dropped_stat, 1);
+	}
+	return no;
+}
+
+
+/* moves everything from the queue to the spill file */
+static void acc_db_spill_queue(void)
+{
+	struct wq_item *rows, *last;
+	unsigned int queued;
+	int no;
+
+	rows = wq_take(acc_queue, 0, &last, &queued);
+	if (!rows)
+		return;
+
+	no = acc_db_spill(rows);
+	if (no < 0) {
+		/* keep them in memory and try again later */
+		wq_put_back(acc_queue, rows, last, queued);
+		return;
+	}
+
+	update_stat(acc_db_spilled_stat, no);
+	wq_done(acc_queue, queued);
+
+	LM_INFO("spilled %d accounting rows to %s\n", no, spill_file);
+}
+
+
+/* loads up to 'max' rows from the replay file back into the queue;
+ * returns the number of loaded rows */
+static int acc_db_replay(int max)
+{
+	struct acc_spill_hdr hdr;
+	struct acc_db_row *row;
+	struct wq_item *first = NULL, *last = NULL;
+	struct stat st;
+	int no = 0;
+
+	if (!replay_f) {
+		if (stat(replay_file, &st) < 0) {
+			if (stat(spill_file, &st) < 0)
+				return 0;
+			if (rename(spill_file, replay_file) < 0) {
+				LM_ERR("failed to rename %s: %s\n", spill_file,
+					strerror(errno));
+				return 0;
+			}
+		}
+
+		replay_f = fopen(replay_file, "rb");
+		if (!replay_f) {
+			LM_ERR("failed to open %s: %s\n", replay_file, strerror(errno));
+			return 0;
+		}
+		LM_INFO("replaying spilled accounting rows from %s\n", replay_file);
+	}
+
+	while (no < max) {
+		if (fread(&hdr, sizeof hdr, 1, replay_f) != 1) {
+			if (ferror(replay_f))
+				goto corrupted;
+			/* all done */
+			fclose(replay_f);
+			replay_f = NULL;
+			unlink(replay_file);
+			break;
+		}
+
+		if (hdr.magic != ACC_SPILL_MAGIC || hdr.n <= 0 ||
+		hdr.table_len <= 0 || hdr.size < hdr.n * sizeof(db_val_t) +
+		hdr.table_len)
+			goto corrupted;
+
+		row = shm_malloc(sizeof *row + hdr.size);
+		if (!row) {
+			LM_ERR("no more shm memory\n");
+			/* retry from the same record next time */
+			fseek(replay_f, -(long)sizeof hdr, SEEK_CUR);
+			break;
+		}
+		row->vals = (db_val_t *)(row + 1);
+		if (fread(row->vals, 1, hdr.size, replay_f) != hdr.size) {
+			shm_free(row);
+			goto corrupted;
+		}
+
+		row->n = hdr.n;
+		row->attempts = hdr.attempts;
+		row->size = hdr.size;
+		row->table.s = (char *)(row->vals + hdr.n);
+		row->table.len = hdr.table_len;
+		acc_db_row_relocate(row->vals, row->n, (char *)row->vals);
+
+		if (last)
+			last->next = &row->link;
+		else
+			first = &row->link;
+		last = &row->link;
+		no++;
+	}
+
+	goto out;
+
+corrupted:
+	LM_ERR("corrupted spill file %s, skipping the rest of it\n",
+		replay_file);
+	fclose(replay_f);
+	replay_f = NULL;
+	unlink(replay_file);
+out:
+	if (first)
+		wq_append(acc_queue, first, last, no);
+	return no;
+}
+
+
+static db_ps_t *acc_db_get_ps(const str *table, int n)
+{
+	struct acc_db_ps *it;
+
+	for (it = acc_db_ps_list; it; it = it->next)
+		if (it->n == n && str_strcmp(&it->table, table) == 0)
+			return &it->ps;
+
+	it = pkg_malloc(sizeof *it + table->len);
+	if (!it) {
+		LM_ERR("no more pkg memory\n");
+		return NULL;
+	}
+	it->table.s = (char *)(it + 1);
+	it->table.len = table->len;
+	memcpy(it->table.s, table->s, table->len);
+	it->n = n;
+	it->ps = NULL;
+	it->next = acc_db_ps_list;
+	acc_db_ps_list = it;
+
+	return &it->ps;
+}
+
+
+static inline int acc_db_write_row(struct acc_db_row *row)
+{
+	return acc_db_insert_row(acc_db_get_ps(&row->table, row->n),
+		&row->table, row->vals, row->n);
+}
+
+
+/* writes one batch of rows to the database; a row the database rejects
+ * while it accepts the rows after it is retried with the next batches and
+ * dropped after db_max_attempts tries, while a run of failures with no
+ * success after it is taken as an outage. Returns 0 if the queue was
+ * drained, 1 if there are rows left and -1 if the database failed */
+static int acc_db_flush_batch(void)
+{
+	struct wq_item *rows, *it, *last, *next, *probe;
+	struct wq_item *failed = NULL, *failed_last = NULL, **prev;
+	struct wq_item *trail = NULL;  /* first of the current run of failures */
+	struct acc_db_row *row;
+	struct timeval start, end;
+	unsigned int no;
+	int done = 0, dropped = 0, fails = 0, down = 0;
+
+	rows = wq_take(acc_queue, acc_db_batch_size, &last, &no);
+	if (!rows)
+		return 0;
+
+	gettimeofday(&start, NULL);
+
+	for (it = rows; it; it = next) {
+		next = it->next;
+		row = acc_db_row_of(it);
+
+		if (acc_db_write_row(row) == 0) {
+			shm_free(row);
+			done++;
+			fails = 0;
+			trail = NULL;
+			continue;
+		}
+
+		it->next = NULL;
+		if (failed_last)
+			failed_last->next = it;
+		else
+			failed = it;
+		failed_last = it;
+
+		if (!fails)
+			trail = it;
+		if (++fails < 2)
+			continue;
+
+		/* two rows in a row failed - before taking the database as down,
+		 * try it with a row from the other end of the batch */
+		if (!next || acc_db_write_row(acc_db_row_of(last)) < 0) {
+			down = 1;
+			break;
+		}
+
+		probe = last;
+		if (next == last) {
+			next = NULL;
+		} else {
+			for (last = next; last->next != probe; last = last->next);
+			last->next = NULL;
+		}
+		shm_free(acc_db_row_of(probe));
+		done++;
+		fails = 0;
+		trail = NULL;
+	}
+	/* the database may have gone away after the last success */
+	if (fails)
+		down = 1;
+
+	/* the database accepted rows after these ones, so they are to blame;
+	 * the trailing run of failures is not charged */
+	for (prev = &failed, failed_last = NULL; (it = *prev) && it != trail; ) {
+		row = acc_db_row_of(it);
+		if (++row->attempts < acc_db_max_attempts) {
+			failed_last = it;
+			prev = &it->next;
+			continue;
+		}
+		LM_ERR("dropping row for %.*s table, rejected %d times\n",
+			row->table.len, row->table.s, row->attempts);
+		*prev = it->next;
+		shm_free(row);
+		dropped++;
+	}
+	for (; it; it = it->next)
+		failed_last = it;
+
+	/* put back what was not written, keeping the order */
+	if (failed) {
+		failed_last->next = next;
+		if (next)
+			failed_last = last;
+	} else if (next) {
+		failed = next;
+		failed_last = last;
+	}
+
+	gettimeofday(&end, NULL);
+	acc_queue->flush_ms = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_usec - start.tv_usec) / 1000;
+
+	if (failed)
+		wq_put_back(acc_queue, failed, failed_last, no - done - dropped);
+	wq_done(acc_queue, done + dropped);
+
+	if (done)
+		update_stat(acc_db_flushed_stat, done);
+	if (dropped)
+		update_stat(acc_db_dropped_stat, dropped);
+
+	if (down) {
+		LM_ERR("failed to insert into the database, %d rows written out "
+			"of the batch\n", done);
+		return -1;
+	}
+
+	return acc_queue->queued != 0;
+}
+
+
+void acc_db_writer_proc(int rank)
+{
+	unsigned int retry = 0;
+	int ret;
+
+	if (acc_db_init_child(acc_queue_db_url) < 0) {
+		LM_ERR("could not open database connection\n");
+		return;
+	}
+
+	for (;;) {
+		wq_wait(acc_queue, acc_db_flush_interval);
+
+		if (retry) {
+			/* database is down - keep the memory free for new rows */
+			if (spill_file)
+				acc_db_spill_queue();
+			if (get_ticks() < retry)
+				continue;
+			retry = 0;
+		}
+
+		if (spill_file && acc_queue->queued < acc_db_batch_size)
+			acc_db_replay(acc_db_batch_size);
+
+		while ((ret = acc_db_flush_batch()) > 0);
+
+		if (ret < 0) {
+			retry = get_ticks() + acc_db_retry_interval;
+			if (spill_file)
+				acc_db_spill_queue();
+		}
+	}
+}
+
+
+void acc_db_queue_destroy(void)
+{
+	if (!acc_queue)
+		return;
+
+	if (acc_queue->queued) {
+		if (spill_file)
+			acc_db_spill_queue();
+		else
+			LM_WARN("%u accounting rows were not written to the database\n",
+				acc_queue->depth);
+	}
+
+	wq_destroy(acc_queue);
+	acc_queue = NULL;
+}
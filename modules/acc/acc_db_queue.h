@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ */
+
+
+#ifndef _ACC_DB_QUEUE_H_
+#define _ACC_DB_QUEUE_H_
+
+#include "../../str.h"
+#include "../../statistics.h"
+#include "../../db/db.h"
+
+extern stat_var *acc_db_flushed_stat;
+extern stat_var *acc_db_spilled_stat;
+extern stat_var *acc_db_dropped_stat;
+
+/* sets up the shm queue and the writer wake-up pipe (called in mod_init) */
+int acc_db_queue_init(const str *db_url);
+
+/* spills whatever is still queued at shutdown */
+void acc_db_queue_destroy(void);
+
+/* copies a row (the first n columns of the acc keys) into the queue;
+ * returns 1 on success, -1 if the row could not be queued */
+int acc_db_queue_row(const str *table, const db_val_t *vals, int n);
+
+/* main loop of the "ACC DB writer" process */
+void acc_db_writer_proc(int rank);
+
+unsigned long acc_db_queue_depth(void);
+unsigned long acc_db_flush_latency(void);
+
+#endif
@@ -59,6 +59,7 @@ extern struct acc_extra *log_extra_tags;
 extern struct acc_extra *db_extra_tags;
 extern struct acc_extra *aaa_extra_tags;
 extern struct acc_extra *evi_extra_tags;
+extern struct acc_extra *file_extra_tags;
 
 extern int    extra_tgs_len;
 extern tag_t* extra_tags;
@@ -67,6 +68,7 @@ extern struct acc_extra *log_leg_tags;
 extern struct acc_extra *db_leg_tags;
 extern struct acc_extra *aaa_leg_tags;
 extern struct acc_extra *evi_leg_tags;
+extern struct acc_extra *file_leg_tags;
 
 extern int    leg_tgs_len;
 extern tag_t* leg_tags;
@@ -196,6 +198,7 @@ static struct acc_extra** extra_str2bkend(str* bkend)
 	str db_bkend_s = str_init("db");
 	str aaa_bkend_s = str_init("aaa");
 	str evi_bkend_s = str_init("evi");
+	str file_bkend_s = str_init("file");
 
 	if (!str_strcmp(bkend, &log_bkend_s))
 		return &log_extra_tags;
@@ -209,6 +212,9 @@ static struct acc_extra** extra_str2bkend(str* bkend)
 	if (!str_strcmp(bkend, &evi_bkend_s))
 		return &evi_extra_tags;
 
+	if (!str_strcmp(bkend, &file_bkend_s))
+		return &file_extra_tags;
+
 	return NULL;
 }
 
@@ -218,6 +224,7 @@ static struct acc_extra** leg_str2bkend(str* bkend)
 	str db_bkend_s = str_init("db");
 	str aaa_bkend_s = str_init("aaa");
 	str evi_bkend_s = str_init("evi");
+	str file_bkend_s = str_init("file");
 
 	if (!str_strcmp(bkend, &log_bkend_s))
 		return &log_leg_tags;
@@ -231,6 +238,9 @@ static struct acc_extra** leg_str2bkend(str* bkend)
 	if (!str_strcmp(bkend, &evi_bkend_s))
 		return &evi_leg_tags;
 
+	if (!str_strcmp(bkend, &file_bkend_s))
+		return &file_leg_tags;
+
 	return NULL;
 }
 
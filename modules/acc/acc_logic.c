@@ -101,14 +101,19 @@ int is_cdr_enabled=0;
 #define is_evi_mc_on(_mask)          is_evi_flag_on(_mask, DO_ACC_MISSED)
 #define is_evi_failed_on(_mask)      is_evi_flag_on(_mask, DO_ACC_FAILED)
 
+#define is_file_flag_on(_mask, _flag) is_acc_flag_set(_mask, DO_ACC_FILE, _flag)
+#define is_file_acc_on(_mask)        is_file_flag_on(_mask, DO_ACC)
+#define is_file_cdr_on(_mask)        is_file_flag_on(_mask, DO_ACC_CDR)
+
 
 #define is_acc_on(_mask) \
 	( (is_log_acc_on(_mask)) || (is_db_acc_on(_mask)) \
-	|| (is_aaa_acc_on(_mask)) || (is_evi_acc_on(_mask)) )
+	|| (is_aaa_acc_on(_mask)) || (is_evi_acc_on(_mask)) \
+	|| (is_file_acc_on(_mask)) )
 
 #define is_cdr_acc_on(_mask) (is_log_cdr_on(_mask)  ||              \
 		is_aaa_cdr_on(_mask) || is_db_cdr_on(_mask) ||              \
-		is_evi_cdr_on(_mask))
+		is_evi_cdr_on(_mask) || is_file_cdr_on(_mask))
 
 #define is_mc_acc_on(_mask) (is_log_mc_on(_mask)    ||              \
 		is_aaa_mc_on(_mask) || is_db_mc_on(_mask)  ||              \
@@ -903,6 +908,11 @@ static void acc_dlg_ended(struct dlg_cell *dlg, int type,
 				return;
 			}
 		}
+
+		if (is_file_acc_on(ctx->flags) && acc_file_cdrs(dlg, _params->msg, ctx) < 0) {
+			LM_ERR("cannot write CDR to file\n");
+			return;
+		}
 	}
 
 }
@@ -1000,6 +1010,11 @@ static void acc_cdr_cb( struct cell* t, int type, struct tmcb_params *ps )
 			return;
 		}
 	}
+
+	if (is_file_acc_on(ctx->flags) && acc_file_cdrs(dlg, ps->req, ctx) < 0) {
+		LM_ERR("cannot write CDR to file\n");
+		return;
+	}
 }
 
 
@@ -1047,6 +1062,7 @@ static str do_acc_log_s=str_init(DO_ACC_LOG_STR);
 static str do_acc_aaa_s=str_init(DO_ACC_AAA_STR);
 static str do_acc_db_s=str_init(DO_ACC_DB_STR);
 static str do_acc_evi_s=str_init(DO_ACC_EVI_STR);
+static str do_acc_file_s=str_init(DO_ACC_FILE_STR);
 
 /* accounting flags strings */
 static str do_acc_cdr_s=str_init(DO_ACC_CDR_STR);
@@ -1055,7 +1071,7 @@ static str do_acc_failed_s=str_init(DO_ACC_FAILED_STR);
 
 
 /**
- * types: log, aaa, db, evi
+ * types: log, aaa, db, evi, file
  * case insesitive
  *
  */
@@ -1076,6 +1092,9 @@ unsigned long long do_acc_type_parser(str* token)
 	}  else if (token->len == do_acc_evi_s.len &&
 			!strncasecmp(token->s, do_acc_evi_s.s, token->len)) {
 		return DO_ACC_EVI;
+	} else if (token->len == do_acc_file_s.len &&
+			!strncasecmp(token->s, do_acc_file_s.s, token->len)) {
+		return DO_ACC_FILE;
 	} else {
 		LM_ERR("invalid accounting backend: <%.*s>!\n", token->len, token->s);
 		return DO_ACC_ERR;
@@ -1399,7 +1418,8 @@ int w_drop_acc(struct sip_msg* msg, unsigned long long *type,
 		return -1;
 	}
 
-	flag_mask = (type ? *type : DO_ACC_LOG | DO_ACC_AAA | DO_ACC_DB | DO_ACC_EVI) *
+	flag_mask = (type ? *type :
+			DO_ACC_LOG | DO_ACC_AAA | DO_ACC_DB | DO_ACC_EVI | DO_ACC_FILE) *
 		(flags ? *flags : ALL_ACC_FLAGS);
 
 	reset_flags(acc_ctx->flags, flag_mask);
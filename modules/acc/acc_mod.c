@@ -59,6 +59,8 @@
 #include "acc_extra.h"
 #include "acc_logic.h"
 #include "acc_vars.h"
+#include "acc_db_queue.h"
+#include "acc_cdr_file.h"
 
 struct dlg_binds dlg_api;
 struct tm_binds tmb;
@@ -66,6 +68,7 @@ struct rr_binds rrb;
 
 static int mod_init(void);
 static int child_init(int rank);
+static void mod_destroy(void);
 
 
 /* ----- General purpose variables ----------- */
@@ -120,6 +123,13 @@ static str db_table_avp = {0,0};
 int db_table_name = -1;
 unsigned short db_table_name_type = -1;
 str db_table_mc = str_init("missed_calls");
+/* queued DB accounting - rows per batch, 0 means direct inserts */
+int acc_db_batch_size = 0;
+int acc_db_queue_size = 10000;
+int acc_db_flush_interval = 1000; /* ms */
+int acc_db_retry_interval = 5; /* s */
+int acc_db_max_attempts = 3;
+char *acc_db_spill_dir = NULL;
 /* names of columns in tables acc/missed calls*/
 str acc_method_col     = str_init("method");
 str acc_fromtag_col    = str_init("from_tag");
@@ -138,6 +148,17 @@ str acc_created_col    = str_init("created");
 struct acc_extra *evi_extra_tags = 0;
 struct acc_extra *evi_leg_tags = 0;
 
+/* ----- CDR file acc variables ----------- */
+char *acc_cdr_file_dir = NULL;
+int acc_cdr_file_queue_size = 10000;
+int acc_cdr_file_block_rows = 4096;
+int acc_cdr_file_flush_interval = 1000; /* ms */
+int acc_cdr_file_max_size = 64; /* MB */
+int acc_cdr_file_rotate_interval = 3600; /* s */
+/* CDR file extra variables */
+struct acc_extra *file_extra_tags = 0;
+struct acc_extra *file_leg_tags = 0;
+
 /* db avp variables */
 str acc_created_avp_name = str_init("accX_created");
 int acc_created_avp_id = -1;
@@ -221,9 +242,55 @@ static param_export_t params[] = {
 	{"acc_sip_reason_column",STR_PARAM, &acc_sipreason_col.s  },
 	{"acc_time_column",      STR_PARAM, &acc_time_col.s       },
 	{"acc_created_avp_name", STR_PARAM, &acc_created_avp_name.s},
+	{"db_batch_size",        INT_PARAM, &acc_db_batch_size    },
+	{"db_queue_size",        INT_PARAM, &acc_db_queue_size    },
+	{"db_flush_interval",    INT_PARAM, &acc_db_flush_interval},
+	{"db_retry_interval",    INT_PARAM, &acc_db_retry_interval},
+	{"db_max_attempts",      INT_PARAM, &acc_db_max_attempts  },
+	{"db_spill_dir",         STR_PARAM, &acc_db_spill_dir     },
+	/* CDR file specific */
+	{"cdr_file_dir",             STR_PARAM, &acc_cdr_file_dir           },
+	{"cdr_file_queue_size",      INT_PARAM, &acc_cdr_file_queue_size    },
+	{"cdr_file_block_rows",      INT_PARAM, &acc_cdr_file_block_rows    },
+	{"cdr_file_flush_interval",  INT_PARAM, &acc_cdr_file_flush_interval},
+	{"cdr_file_max_size",        INT_PARAM, &acc_cdr_file_max_size      },
+	{"cdr_file_rotate_interval", INT_PARAM, &acc_cdr_file_rotate_interval},
+	{0,0,0}
+};
+
+static stat_export_t mod_stats[] = {
+	{"cdr_queue_depth",   STAT_IS_FUNC, (stat_var**)acc_db_queue_depth   },
+	{"cdr_flush_latency", STAT_IS_FUNC, (stat_var**)acc_db_flush_latency },
+	{"cdr_flushed",       0,            &acc_db_flushed_stat             },
+	{"cdr_spilled",       0,            &acc_db_spilled_stat             },
+	{"cdr_dropped",       0,            &acc_db_dropped_stat             },
+	{"cdr_file_queue_depth", STAT_IS_FUNC,
+		(stat_var**)acc_cdr_file_queue_depth                             },
+	{"cdr_file_written",  0,            &cdr_file_written_stat           },
+	{"cdr_file_dropped",  0,            &cdr_file_dropped_stat           },
 	{0,0,0}
 };
 
+static proc_export_t procs[] = {
+	{"ACC DB writer", 0, 0, acc_db_writer_proc, 1, 0},
+	{"ACC CDR file writer", 0, 0, acc_cdr_file_proc, 1, 0},
+	{0,0,0,0,0,0}
+};
+
+static mi_export_t mi_cmds[] = {
+	{ "acc_cdr_list", 0, MI_NAMED_PARAMS_ONLY, 0, {
+		{mi_cdr_file_list, {"from", "to", 0}},
+		{mi_cdr_file_list_limit, {"from", "to", "limit", 0}},
+		{EMPTY_MI_RECIPE}}
+	},
+	{ "acc_cdr_aggregate", 0, MI_NAMED_PARAMS_ONLY, 0, {
+		{mi_cdr_file_aggregate, {"from", "to", 0}},
+		{mi_cdr_file_aggregate_group, {"from", "to", "group_by", 0}},
+		{EMPTY_MI_RECIPE}}
+	},
+	{EMPTY_MI_EXPORT}
+};
+
 static module_dependency_t *get_deps_aaa_url(param_export_t *param)
 {
 	char *aaa_url = *(char **)param->param_pointer;
@@ -284,15 +351,15 @@ struct module_exports exports= {
 	cmds,       /* exported functions */
 	0,          /* exported async functions */
 	params,     /* exported params */
-	0,          /* exported statistics */
-	0,          /* exported MI functions */
+	mod_stats,  /* exported statistics */
+	mi_cmds,    /* exported MI functions */
 	mod_items,  /* exported pseudo-variables */
 	0,			/* exported transformations */
-	0,          /* extra processes */
+	procs,      /* extra processes */
 	mod_preinit,/* pre-initialization module */
 	mod_init,   /* initialization module */
 	0,          /* response function */
-	0,          /* destroy function */
+	mod_destroy,/* destroy function */
 	child_init, /* per-child init function */
 	0           /* reload confirm function */
 };
@@ -369,13 +436,39 @@ static int mod_init( void )
 			LM_ERR("failed! bad db url / missing db module ?\n");
 			return -1;
 		}
+		if (acc_db_batch_size < 0)
+			acc_db_batch_size = 0;
+		if (acc_db_batch_size && acc_db_queue_init(&db_url) < 0) {
+			LM_ERR("failed to init the DB accounting queue\n");
+			return -1;
+		}
 	} else {
 		if (db_extra_tags || db_leg_tags) {
 			LM_ERR("DB leg and/or extra fields defined but no DB url!\n");
 			return -1;
 		}
+		acc_db_batch_size = 0;
 	}
 
+	/* the DB writer is only needed for queued accounting */
+	procs[0].no = acc_db_batch_size ? 1 : 0;
+
+	/* ----------- CDR FILE INIT SECTION ----------- */
+	if (acc_cdr_file_dir && acc_cdr_file_dir[0]) {
+		if (acc_cdr_file_init() < 0) {
+			LM_ERR("failed to init the CDR files\n");
+			return -1;
+		}
+	} else {
+		if (file_extra_tags || file_leg_tags) {
+			LM_ERR("file leg and/or extra fields defined but no "
+				"cdr_file_dir!\n");
+			return -1;
+		}
+		acc_cdr_file_dir = NULL;
+	}
+	procs[1].no = acc_cdr_file_dir ? 1 : 0;
+
 
 	/* ------------ AAA PROTOCOL INIT SECTION ----------- */
 	if (aaa_proto_url && aaa_proto_url[0]) {
@@ -412,7 +505,8 @@ static int mod_init( void )
 
 static int child_init(int rank)
 {
-	if(db_url.s && acc_db_init_child(&db_url)<0) {
+	/* with queued accounting only the DB writer talks to the database */
+	if(db_url.s && !acc_db_batch_size && acc_db_init_child(&db_url)<0) {
 		LM_ERR("could not open database connection");
 		return -1;
 	}
@@ -421,3 +515,10 @@ static int child_init(int rank)
 }
 
 
+static void mod_destroy(void)
+{
+	if (acc_db_batch_size)
+		acc_db_queue_destroy();
+	if (acc_cdr_file_dir)
+		acc_cdr_file_destroy();
+}
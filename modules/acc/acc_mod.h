@@ -75,6 +75,20 @@ extern str acc_created_col;
 extern int db_table_name;
 extern unsigned short db_table_name_type;
 
+extern int acc_db_batch_size;
+extern int acc_db_queue_size;
+extern int acc_db_flush_interval;
+extern int acc_db_retry_interval;
+extern int acc_db_max_attempts;
+extern char *acc_db_spill_dir;
+
+extern char *acc_cdr_file_dir;
+extern int acc_cdr_file_queue_size;
+extern int acc_cdr_file_block_rows;
+extern int acc_cdr_file_flush_interval;
+extern int acc_cdr_file_max_size;
+extern int acc_cdr_file_rotate_interval;
+
 
 extern int evi_flag;
 extern int evi_missed_flag;
@@ -57,6 +57,7 @@ int local_exec_threshold = 0;
 
 lcache_col_t* lcache_collection = NULL;
 url_lst_t* url_list=NULL;
+static mem_limit_lst_t* mem_limits=NULL;
 
 str cache_repl_cap = str_init("cachedb-local-repl");
 int cluster_id = 0;
@@ -71,12 +72,15 @@ mi_response_t *mi_cache_remove_chunk_2(const mi_params_t *params,
 void localcache_clean(unsigned int ticks,void *param);
 static int parse_collections(unsigned int type, void *val);
 static int store_urls(unsigned int type, void *val);
+static int store_mem_limits(unsigned int type, void *val);
 
 static param_export_t params[]={
 	{ "cache_clean_period", INT_PARAM, &cache_clean_period },
 	{ "exec_threshold",     INT_PARAM, &local_exec_threshold },
 	{ "cache_collections",  STR_PARAM|USE_FUNC_PARAM, (void *)parse_collections },
 	{ "cachedb_url",        STR_PARAM|USE_FUNC_PARAM, (void *)store_urls },
+	{ "collection_memory_limit", STR_PARAM|USE_FUNC_PARAM,
+		(void *)store_mem_limits },
 	{ "cluster_id",INT_PARAM, &cluster_id },
 	{ "cluster_persistency",STR_PARAM, &cluster_persist },
 	{0,0,0}
@@ -146,7 +150,7 @@ static int remove_chunk_f(struct sip_msg* msg, str* col_s, str* pat)
 	struct timeval start;
 
 	lcache_col_t* col;
-	lcache_t* cache_htable;
+	lcache_shard_t* sh;
 
 	if ( !col_s ) {
 		/* use default collection; default collection is always first in list */
@@ -163,8 +167,6 @@ static int remove_chunk_f(struct sip_msg* msg, str* col_s, str* pat)
 		}
 	}
 
-	cache_htable = col->col_htable;
-
 	if (pat->len+1 > pat_buff_size) {
 		pat_buff = pkg_realloc(pat_buff,pat->len+1);
 		if (pat_buff == NULL) {
@@ -183,9 +185,9 @@ static int remove_chunk_f(struct sip_msg* msg, str* col_s, str* pat)
 	start_expire_timer(start,local_exec_threshold);
 
 	for(i = 0; i< col->size; i++) {
-		lock_get(&cache_htable[i].lock);
-		me1 = cache_htable[i].entries;
-		me2 = NULL;
+		sh = lcache_shard(col, i);
+		lock_get(&sh->lock);
+		me1 = col->col_htable[i].entries;
 
 		while(me1) {
 			if (me1->attr.len + 1 > key_buff_size) {
@@ -193,7 +195,7 @@ static int remove_chunk_f(struct sip_msg* msg, str* col_s, str* pat)
 				if (key_buff == NULL) {
 					LM_ERR("No more pkg mem\n");
 					key_buff_size = 0;
-					lock_release(&cache_htable[i].lock);
+					lock_release(&sh->lock);
 					_stop_expire_timer(start,local_exec_threshold,
 						"cachedb_local remove_chunk",pat->s,pat->len,0,
 						cdb_slow_queries, cdb_total_queries);
@@ -206,25 +208,16 @@ static int remove_chunk_f(struct sip_msg* msg, str* col_s, str* pat)
 			memcpy(key_buff,me1->attr.s,me1->attr.len);
 			key_buff[me1->attr.len] = 0;
 
+			me2 = me1;
+			me1 = me1->next;
+
 			if(fnmatch(pat_buff,key_buff,0) == 0) {
 				LM_DBG("[%.*s] matches glob [%.*s] - removing from bucket %d\n",
-						me1->attr.len, me1->attr.s,pat_buff_size,pat_buff,i);
-
-				if(me2) {
-					me2->next = me1->next;
-					shm_free(me1);
-					me1 = me2->next;
-				} else{
-					cache_htable[i].entries = me1->next;
-					shm_free(me1);
-					me1 = cache_htable[i].entries;
-				}
-			} else {
-				me2 = me1;
-				me1 = me1->next;
+						me2->attr.len, me2->attr.s,pat_buff_size,pat_buff,i);
+				lcache_htable_unlink(col, sh, me2);
 			}
 		}
-		lock_release(&cache_htable[i].lock);
+		lock_release(&sh->lock);
 	}
 
 	_stop_expire_timer(start,local_exec_threshold,
@@ -333,6 +326,7 @@ static int mod_init(void)
 	str name=str_init("local");
 
 	url_lst_t *it=url_list, *foo=NULL;
+	mem_limit_lst_t *ml;
 	lcache_col_t *default_col, *col_it;
 
 	memset(&cde, 0, sizeof cde);
@@ -377,11 +371,12 @@ static int mod_init(void)
 			LM_ERR("no more shared memory!\n");
 			return -1;
 		}
+		memset(default_col, 0, sizeof(lcache_col_t));
 
 		default_col->col_name.s = DEFAULT_COLLECTION_NAME;
 		default_col->col_name.len = sizeof(DEFAULT_COLLECTION_NAME) - 1;
 		default_col->size = (1 << HASH_SIZE_DEFAULT);
-		if (lcache_htable_init(&default_col->col_htable, default_col->size) < 0) {
+		if (lcache_htable_init(default_col) < 0) {
 			LM_ERR("failed to initialize for <%s> collection!\n",
 						DEFAULT_COLLECTION_NAME);
 			return -1;
@@ -428,12 +423,37 @@ static int mod_init(void)
 		}
 	}
 
+	/* apply the memory limits of the collections */
+	while (mem_limits) {
+		for ( col_it=lcache_collection; col_it; col_it=col_it->next )
+			if ( !str_strcmp(&col_it->col_name, &mem_limits->col_name) )
+				break;
+
+		if ( !col_it ) {
+			LM_ERR("memory limit set for undefined collection <%.*s>!\n",
+					mem_limits->col_name.len, mem_limits->col_name.s);
+			return -1;
+		}
+
+		lcache_htable_set_limit(col_it, mem_limits->max_mem);
+
+		ml = mem_limits;
+		mem_limits = mem_limits->next;
+		pkg_free(ml);
+	}
+
 	/* check to see if we've got unused collections */
 	for ( col_it=lcache_collection; col_it; col_it=col_it->next ) {
 		if ( !col_it->is_used ) {
 			LM_WARN("collection <%.*s> is not assigned to any url!\n",
 					col_it->col_name.len, col_it->col_name.s);
 		}
+
+		if (lcache_htable_register_stats(col_it) < 0) {
+			LM_ERR("failed to register the statistics of collection "
+				"<%.*s>\n", col_it->col_name.len, col_it->col_name.s);
+			return -1;
+		}
 	}
 
 	/* register timer to delete the expired entries */
@@ -490,57 +510,16 @@ static void destroy(void)
 	lcache_col_t* it;
 
 	for ( it=lcache_collection; it; it=it->next) {
-		lcache_htable_destroy(&it->col_htable, it->size);
+		lcache_htable_destroy(it);
 	}
 }
 
 void localcache_clean(unsigned int ticks,void *param)
 {
-	int i;
-	lcache_entry_t* me1, *me2;
 	lcache_col_t* it;
-	lcache_t* cache_htable;
-
-	for ( it=lcache_collection; it; it=it->next ) {
-		LM_DBG("start\n");
-		cache_htable = it->col_htable;
-
-		for(i = 0; i< it->size; i++)
-		{
-			lock_get(&cache_htable[i].lock);
-			me1 = cache_htable[i].entries;
-			me2 = NULL;
-
-			while(me1)
-			{
-				if((me1->expires > 0) && (me1->expires < get_ticks()))
-				{
-					LM_DBG("deleted entry attr= [%.*s]\n",
-							me1->attr.len, me1->attr.s);
-
-					if(me2)
-					{
-						me2->next = me1->next;
-						shm_free(me1);
-						me1 = me2->next;
-					}
-					else
-					{
-						cache_htable[i].entries = me1->next;
-						shm_free(me1);
-						me1 = cache_htable[i].entries;
-					}
-				}
-				else
-				{
-					me2 = me1;
-					me1 = me1->next;
-				}
-			}
 
-			lock_release(&cache_htable[i].lock);
-		}
-	}
+	for ( it=lcache_collection; it; it=it->next )
+		lcache_htable_expire(it, ticks);
 }
 
 static int parse_collections(unsigned int type, void* val)
@@ -606,7 +585,7 @@ static int parse_collections(unsigned int type, void* val)
 		}
 
 		new_col->size = (1 << coll_size);
-		if (lcache_htable_init(&new_col->col_htable, new_col->size) < 0) {
+		if (lcache_htable_init(new_col) < 0) {
 			LM_ERR("failed to initialize htable for collection <%.*s>!\n",
 					coll.len, coll.s);
 			return -1;
@@ -654,3 +633,75 @@ static int store_urls(unsigned int type, void *val)
 
 	return 0;
 }
+
+
+/**
+ * parse the "collection = bytes[K|M|G]; ..." memory limits and keep them
+ * until mod init, when all the collections are created
+ */
+static int store_mem_limits(unsigned int type, void *val)
+{
+	str list, size;
+	csv_record *limits, *limit, *kv = NULL;
+	mem_limit_lst_t *ml;
+	unsigned long mul;
+	unsigned int n;
+
+	init_str(&list, (char *)val);
+	limits = __parse_csv_record(&list, 0, ';');
+	if (!limits)
+		goto bad_input;
+
+	for (limit = limits; limit; limit = limit->next) {
+		if (ZSTR(limit->s))
+			continue;
+
+		kv = __parse_csv_record(&limit->s, 0, '=');
+		if (!kv || !kv->next || ZSTR(kv->s) || ZSTR(kv->next->s))
+			goto bad_input;
+
+		size = kv->next->s;
+		mul = 1;
+		switch (size.s[size.len - 1]) {
+			case 'k': case 'K': mul = 1024; break;
+			case 'm': case 'M': mul = 1024 * 1024; break;
+			case 'g': case 'G': mul = 1024 * 1024 * 1024; break;
+		}
+		if (mul != 1)
+			size.len--;
+
+		if (str2int(&size, &n) < 0) {
+			LM_ERR("invalid memory limit <%.*s>!\n",
+					kv->next->s.len, kv->next->s.s);
+			goto bad_input;
+		}
+
+		ml = pkg_malloc(sizeof(mem_limit_lst_t) + kv->s.len);
+		if (!ml) {
+			LM_ERR("no more pkg mem!\n");
+			goto error;
+		}
+
+		ml->col_name.s = (char *)(ml + 1);
+		ml->col_name.len = kv->s.len;
+		memcpy(ml->col_name.s, kv->s.s, kv->s.len);
+		ml->max_mem = (unsigned long)n * mul;
+		ml->next = mem_limits;
+		mem_limits = ml;
+
+		free_csv_record(kv);
+		kv = NULL;
+	}
+
+	free_csv_record(limits);
+	return 0;
+
+bad_input:
+	LM_ERR("failed to parse 'collection_memory_limit'!\n");
+error:
+	if (kv)
+		free_csv_record(kv);
+	if (limits)
+		free_csv_record(limits);
+	return -1;
+}
@@ -52,6 +52,14 @@ typedef struct lcache_col {
 	lcache_t* col_htable;
 	int size;
 
+	/* the buckets are grouped in shards, each with its own lock */
+	lcache_shard_t* shards;
+	int shards_no;
+	/* memory of all the entries, updated atomically */
+	volatile unsigned long mem;
+	unsigned long max_mem;		/* 0 means no limit */
+	unsigned int evict_next;	/* next shard to evict from */
+
 	/* we need to know somehow if this collection is used or not;
 	 * if not used we'll need to throw an error */
 	int is_used;
@@ -64,6 +72,12 @@ typedef struct url_lst {
 	struct url_lst* next;
 } url_lst_t;
 
+typedef struct mem_limit_lst {
+	str col_name;
+	unsigned long max_mem;
+	struct mem_limit_lst* next;
+} mem_limit_lst_t;
+
 extern lcache_col_t* lcache_collection;
 extern url_lst_t* url_list;
 
@@ -183,7 +183,9 @@ error:
 int receive_sync_request(int node_id)
 {
         int i;
+        unsigned int now;
         lcache_col_t *col;
+        lcache_shard_t *sh;
         lcache_entry_t *data;
         bin_packet_t *sync_packet;
 
@@ -191,24 +193,29 @@ int receive_sync_request(int node_id)
                 LM_ERR("Found collection %.*s\n", col->col_name.len, col->col_name.s);
 
                 for (i =0; i < col->size; i++) {
-                        lock_get(&col->col_htable[i].lock);
+                        sh = lcache_shard(col, i);
+                        lock_get(&sh->lock);
+                        now = get_ticks();
                         data = col->col_htable[i].entries;
                         while(data) {
-                                if (data->expires == 0 || data->expires > get_ticks()) {
+                                if (data->expires == 0 || data->expires > now) {
                                         sync_packet = clusterer_api.sync_chunk_start(&cache_repl_cap,
                                                                         cluster_id, node_id, BIN_VERSION);
                                         if (!sync_packet) {
                                                 LM_ERR("Can not create sync packet!\n");
+                                                lock_release(&sh->lock);
                                                 return -1;
                                         }
                                         bin_push_str(sync_packet, &col->col_name);
                                         bin_push_str(sync_packet, &data->attr);
                                         bin_push_str(sync_packet, &data->value);
-                                        bin_push_int(sync_packet, data->expires);
+                                        /* the receiver expects the time left to live */
+                                        bin_push_int(sync_packet,
+                                                data->expires ? data->expires - now : 0);
                                 }
                                 data = data->next;
                         }
-                        lock_release(&col->col_htable[i].lock);
+                        lock_release(&sh->lock);
                 }
         }
 
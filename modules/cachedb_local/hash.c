@@ -30,77 +30,339 @@
 #include "../../dprint.h"
 #include "../../ut.h"
 #include "../../timer.h"
+#include "../../statistics.h"
 #include "../../mem/mem.h"
 #include "../../mem/shm_mem.h"
 #include "cachedb_local.h"
 #include "cachedb_local_replication.h"
 #include "hash.h"
 
-void lcache_htable_remove_safe(str attr, lcache_entry_t** it);
+static inline void lcache_lru_unlink(lcache_shard_t *sh, lcache_entry_t *me)
+{
+	if (me->lru_prev)
+		me->lru_prev->lru_next = me->lru_next;
+	else
+		sh->lru_head = me->lru_next;
+
+	if (me->lru_next)
+		me->lru_next->lru_prev = me->lru_prev;
+	else
+		sh->lru_tail = me->lru_prev;
+
+	me->lru_prev = me->lru_next = NULL;
+}
+
+static inline void lcache_lru_push(lcache_shard_t *sh, lcache_entry_t *me)
+{
+	me->lru_prev = NULL;
+	me->lru_next = sh->lru_head;
+	if (sh->lru_head)
+		sh->lru_head->lru_prev = me;
+	else
+		sh->lru_tail = me;
+	sh->lru_head = me;
+}
+
+/* entries with no expiration are not kept on the wheel */
+static inline void lcache_wheel_unlink(lcache_shard_t *sh, lcache_entry_t *me)
+{
+	if (me->expires == 0)
+		return;
+
+	if (me->wheel_prev)
+		me->wheel_prev->wheel_next = me->wheel_next;
+	else
+		sh->wheel[me->expires & (LCACHE_WHEEL_SIZE - 1)] = me->wheel_next;
+
+	if (me->wheel_next)
+		me->wheel_next->wheel_prev = me->wheel_prev;
+}
+
+static inline void lcache_wheel_push(lcache_shard_t *sh, lcache_entry_t *me)
+{
+	lcache_entry_t **slot;
+
+	if (me->expires == 0)
+		return;
+
+	slot = &sh->wheel[me->expires & (LCACHE_WHEEL_SIZE - 1)];
+	me->wheel_prev = NULL;
+	me->wheel_next = *slot;
+	if (*slot)
+		(*slot)->wheel_prev = me;
+	*slot = me;
+}
+
+static inline void lcache_link(lcache_t *bucket, lcache_shard_t *sh,
+		lcache_entry_t *me)
+{
+	me->next = bucket->entries;
+	bucket->entries = me;
+
+	lcache_lru_push(sh, me);
+	lcache_wheel_push(sh, me);
 
-int lcache_htable_init(lcache_t** cache_htable_p, int size)
+	sh->items++;
+}
+
+/* removes the entry from all the lists of its shard and frees it;
+ * the shard lock must be held */
+void lcache_htable_unlink(lcache_col_t *col, lcache_shard_t *sh,
+		lcache_entry_t *me)
+{
+	lcache_t *bucket;
+	lcache_entry_t **it;
+
+	bucket = &col->col_htable[core_hash(&me->attr, 0, col->size)];
+	for (it = &bucket->entries; *it && *it != me; it = &(*it)->next);
+	if (*it)
+		*it = me->next;
+	else
+		LM_BUG("entry [%.*s] not found in its bucket\n",
+				me->attr.len, me->attr.s);
+
+	lcache_lru_unlink(sh, me);
+	lcache_wheel_unlink(sh, me);
+
+	sh->items--;
+
+	__sync_fetch_and_sub(&col->mem, me->size);
+	shm_free(me);
+}
+
+/* evicts the least recently used entry of the next non-empty shard, going
+ * through the shards in a round robin fashion; no shard lock may be held.
+ * Returns 0 if there was nothing left to evict */
+static int lcache_evict_one(lcache_col_t *col)
+{
+	lcache_shard_t *sh;
+	int n;
+
+	for (n = 0; n < col->shards_no; n++) {
+		sh = &col->shards[__sync_fetch_and_add(&col->evict_next, 1) &
+			(col->shards_no - 1)];
+		/* unlocked peek, just to quickly skip the empty shards */
+		if (!sh->lru_tail)
+			continue;
+
+		lock_get(&sh->lock);
+		if (sh->lru_tail) {
+			LM_DBG("evicting [%.*s] from collection <%.*s>\n",
+					sh->lru_tail->attr.len, sh->lru_tail->attr.s,
+					col->col_name.len, col->col_name.s);
+			lcache_htable_unlink(col, sh, sh->lru_tail);
+			sh->evictions++;
+			lock_release(&sh->lock);
+			return 1;
+		}
+		lock_release(&sh->lock);
+	}
+
+	return 0;
+}
+
+/* allocates a zeroed entry of @size bytes, accounted into the memory of
+ * the collection; as long as the collection is over its limit or the shm
+ * allocation fails, the least recently used entries are evicted.
+ * No shard lock may be held */
+static lcache_entry_t *lcache_entry_new(lcache_col_t *col, int size)
+{
+	lcache_entry_t *me;
+
+	/* reserve the memory first, so concurrent inserts cannot overshoot */
+	__sync_fetch_and_add(&col->mem, size);
+	while (col->max_mem && col->mem > col->max_mem)
+		if (!lcache_evict_one(col))
+			break;
+
+	while ((me = shm_malloc(size)) == NULL)
+		if (!lcache_evict_one(col)) {
+			__sync_fetch_and_sub(&col->mem, size);
+			LM_ERR("no more shared memory\n");
+			return NULL;
+		}
+
+	memset(me, 0, size);
+	me->size = size;
+
+	return me;
+}
+
+/* releases an entry which did not make it into the collection */
+static inline void lcache_entry_free(lcache_col_t *col, lcache_entry_t *me)
+{
+	__sync_fetch_and_sub(&col->mem, me->size);
+	shm_free(me);
+}
+
+int lcache_htable_init(lcache_col_t *col)
 {
 	int i = 0, j;
-	lcache_t* cache_htable;
 
-	if (cache_htable_p == NULL) {
-		LM_ERR("<null> htable pointer!\n");
+	col->col_htable = shm_malloc(col->size * sizeof(lcache_t));
+	if (col->col_htable == NULL) {
+		LM_ERR("no more shared memory\n");
 		return -1;
 	}
+	memset(col->col_htable, 0, col->size * sizeof(lcache_t));
 
-	cache_htable = (lcache_t*)shm_malloc(size * sizeof(lcache_t));
-	if(cache_htable == NULL)
-	{
+	col->shards_no = col->size < LCACHE_MAX_SHARDS ?
+		col->size : LCACHE_MAX_SHARDS;
+	col->shards = shm_malloc(col->shards_no * sizeof(lcache_shard_t));
+	if (col->shards == NULL) {
 		LM_ERR("no more shared memory\n");
-		return -1;
+		goto error;
 	}
-	memset(cache_htable, 0, size * sizeof(lcache_t));
+	memset(col->shards, 0, col->shards_no * sizeof(lcache_shard_t));
 
-	for(i= 0; i< size; i++)
-	{
-		if(lock_init(&cache_htable[i].lock)== 0)
-		{
+	for (i = 0; i < col->shards_no; i++) {
+		if (lock_init(&col->shards[i].lock) == 0) {
 			LM_ERR("failed to initialize lock [%d]\n", i);
 			goto error;
 		}
+		col->shards[i].wheel_tick = get_ticks();
 	}
 
-	*cache_htable_p = cache_htable;
-
 	return 0;
 
 error:
-	for(j = 0; j< i; j++)
-	{
-		lock_destroy(&cache_htable[j].lock);
+	if (col->shards) {
+		for (j = 0; j < i; j++)
+			lock_destroy(&col->shards[j].lock);
+		shm_free(col->shards);
+		col->shards = NULL;
 	}
-	shm_free(cache_htable);
-	cache_htable = NULL;
+	shm_free(col->col_htable);
+	col->col_htable = NULL;
 	return -1;
 }
 
-void lcache_htable_destroy(lcache_t** cache_htable_p, int size)
+void lcache_htable_destroy(lcache_col_t *col)
 {
 	int i;
 	lcache_entry_t* me1, *me2;
-	lcache_t* cache_htable = *cache_htable_p;
 
-	if(cache_htable == NULL)
+	if (col->col_htable == NULL)
 		return;
 
-	for(i = 0; i< size; i++)
-	{
-		lock_destroy(&cache_htable[i].lock);
-		me1 = cache_htable[i].entries;
-		while(me1)
-		{
+	for (i = 0; i < col->shards_no; i++)
+		lock_destroy(&col->shards[i].lock);
+
+	for (i = 0; i < col->size; i++) {
+		me1 = col->col_htable[i].entries;
+		while (me1) {
 			me2 = me1->next;
 			shm_free(me1);
 			me1 = me2;
 		}
 	}
-	shm_free(cache_htable);
-	*cache_htable_p = NULL;
+
+	shm_free(col->shards);
+	col->shards = NULL;
+	shm_free(col->col_htable);
+	col->col_htable = NULL;
+}
+
+/* the memory limit is enforced for the collection as a whole */
+void lcache_htable_set_limit(lcache_col_t *col, unsigned long max_mem)
+{
+	col->max_mem = max_mem;
+}
+
+/* advances the timing wheel of each shard up to @ticks, releasing the
+ * entries found expired in the slots passed over */
+void lcache_htable_expire(lcache_col_t *col, unsigned int ticks)
+{
+	int i, n;
+	unsigned int t;
+	lcache_shard_t *sh;
+	lcache_entry_t *me, *next;
+
+	for (i = 0; i < col->shards_no; i++) {
+		sh = &col->shards[i];
+
+		lock_get(&sh->lock);
+
+		/* the slot of the current tick may still hold valid entries */
+		n = (int)(ticks - 1 - sh->wheel_tick);
+		if (n > LCACHE_WHEEL_SIZE)
+			n = LCACHE_WHEEL_SIZE;
+
+		for (t = sh->wheel_tick + 1; n > 0; n--, t++) {
+			for (me = sh->wheel[t & (LCACHE_WHEEL_SIZE - 1)]; me; me = next) {
+				next = me->wheel_next;
+				if (me->expires < ticks) {
+					LM_DBG("deleted entry attr= [%.*s]\n",
+							me->attr.len, me->attr.s);
+					lcache_htable_unlink(col, sh, me);
+					sh->expired++;
+				}
+			}
+		}
+
+		if ((int)(ticks - 1 - sh->wheel_tick) > 0)
+			sh->wheel_tick = ticks - 1;
+
+		lock_release(&sh->lock);
+	}
+}
+
+#define LCACHE_STAT_FUNC(_field) \
+	static unsigned long lcache_stat_##_field(void *param) \
+	{ \
+		lcache_col_t *col = (lcache_col_t *)param; \
+		unsigned long ret = 0; \
+		int i; \
+		for (i = 0; i < col->shards_no; i++) \
+			ret += col->shards[i]._field; \
+		return ret; \
+	}
+
+LCACHE_STAT_FUNC(items)
+LCACHE_STAT_FUNC(hits)
+LCACHE_STAT_FUNC(misses)
+LCACHE_STAT_FUNC(evictions)
+LCACHE_STAT_FUNC(expired)
+
+static unsigned long lcache_stat_mem(void *param)
+{
+	return ((lcache_col_t *)param)->mem;
+}
+
+static struct {
+	char *name;
+	stat_function func;
+} lcache_stats[] = {
+	{ "items",     lcache_stat_items },
+	{ "memory",    lcache_stat_mem },
+	{ "hits",      lcache_stat_hits },
+	{ "misses",    lcache_stat_misses },
+	{ "evictions", lcache_stat_evictions },
+	{ "expired",   lcache_stat_expired },
+};
+
+/* registers the "<collection>-<stat>" statistics of the collection */
+int lcache_htable_register_stats(lcache_col_t *col)
+{
+	unsigned int i;
+	char *name;
+
+	for (i = 0; i < sizeof(lcache_stats) / sizeof(lcache_stats[0]); i++) {
+		name = build_stat_name(&col->col_name, lcache_stats[i].name);
+		if (!name) {
+			LM_ERR("failed to build stat name\n");
+			return -1;
+		}
+
+		if (register_stat2("cachedb_local", name,
+				(stat_var **)lcache_stats[i].func,
+				STAT_SHM_NAME|STAT_IS_FUNC, col, 0) != 0) {
+			LM_ERR("failed to register stat %s\n", name);
+			return -1;
+		}
+	}
+
+	return 0;
 }
 
 int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires)
@@ -108,6 +370,19 @@ int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires)
 	return _lcache_htable_insert(con, attr, value, expires, 0);
 }
 
+/* looks up @attr into its bucket; the shard lock must be held */
+static inline lcache_entry_t *lcache_htable_lookup(lcache_t *bucket, str *attr)
+{
+	lcache_entry_t *it;
+
+	for (it = bucket->entries; it; it = it->next)
+		if (it->attr.len == attr->len &&
+				memcmp(it->attr.s, attr->s, attr->len) == 0)
+			return it;
+
+	return NULL;
+}
+
 int _lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires, int isrepl)
 {
 	lcache_entry_t* me, *it;
@@ -115,7 +390,8 @@ int _lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires, i
 	int size;
 	struct timeval start;
 
-	lcache_t* cache_htable;
+	lcache_t* bucket;
+	lcache_shard_t* sh;
 	lcache_col_t* cache_col;
 
 	cache_col = ((lcache_con*)con->data)->col;
@@ -125,17 +401,21 @@ int _lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires, i
 		return -1;
 	}
 
-	cache_htable = cache_col->col_htable;
+	hash_code= core_hash( attr, 0, cache_col->size);
+	bucket = &cache_col->col_htable[hash_code];
+	sh = lcache_shard(cache_col, hash_code);
 
 	size= sizeof(lcache_entry_t) + attr->len + value->len;
+	if (cache_col->max_mem && size > cache_col->max_mem) {
+		LM_ERR("entry [%.*s] of %d bytes exceeds the memory limit of "
+			"collection <%.*s>\n", attr->len, attr->s, size,
+			cache_col->col_name.len, cache_col->col_name.s);
+		return -1;
+	}
 
-	me = (lcache_entry_t*)shm_malloc(size);
+	me = lcache_entry_new(cache_col, size);
 	if(me == NULL)
-	{
-		LM_ERR("no more shared memory\n");
 		return -1;
-	}
-	memset(me, 0, size);
 
 	start_expire_timer(start,local_exec_threshold);
 
@@ -149,18 +429,16 @@ int _lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires, i
 	if( expires != 0)
 		me->expires = get_ticks() + expires;
 
-	hash_code= core_hash( attr, 0, cache_col->size);
-	lock_get(&cache_htable[hash_code].lock);
-
-	it = cache_htable[hash_code].entries;
+	lock_get(&sh->lock);
 
 	/* if a previous record for the same attr delete it */
-	lcache_htable_remove_safe( *attr, &it);
+	it = lcache_htable_lookup(bucket, attr);
+	if (it)
+		lcache_htable_unlink(cache_col, sh, it);
 
-	me->next = it;
-	cache_htable[hash_code].entries = me;
+	lcache_link(bucket, sh, me);
 
-	lock_release(&cache_htable[hash_code].lock);
+	lock_release(&sh->lock);
 
 	_stop_expire_timer(start,local_exec_threshold,
 		"cachedb_local insert",attr->s,attr->len,0,
@@ -173,31 +451,6 @@ int _lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires, i
 	return 1;
 }
 
-void lcache_htable_remove_safe(str attr, lcache_entry_t** it_p)
-{
-	lcache_entry_t* me = NULL, *it= *it_p;
-
-	while(it)
-	{
-		if(it->attr.len == attr.len &&
-				(strncmp(it->attr.s, attr.s, attr.len) == 0))
-		{
-
-			if(me)
-				me->next = it->next;
-			else
-				*it_p = it->next;
-
-			shm_free(it);
-
-			return;
-		}
-		me = it;
-		it = it->next;
-	}
-	LM_DBG("entry not found\n");
-}
-
 int lcache_htable_remove(cachedb_con *con,str* attr)
 {
 	return _lcache_htable_remove(con, attr, 0);
@@ -208,7 +461,8 @@ int _lcache_htable_remove(cachedb_con *con,str* attr, int isrepl)
 	int hash_code;
 	struct timeval start;
 
-	lcache_t* cache_htable;
+	lcache_entry_t* it;
+	lcache_shard_t* sh;
 	lcache_col_t* cache_col;
 
 	cache_col = ((lcache_con*)con->data)->col;
@@ -218,17 +472,19 @@ int _lcache_htable_remove(cachedb_con *con,str* attr, int isrepl)
 		return -1;
 	}
 
-	cache_htable = cache_col->col_htable;
-
-
 	start_expire_timer(start,local_exec_threshold);
 
 	hash_code= core_hash( attr, 0, cache_col->size);
-	lock_get(&cache_htable[hash_code].lock);
+	sh = lcache_shard(cache_col, hash_code);
+	lock_get(&sh->lock);
 
-	lcache_htable_remove_safe( *attr, &cache_htable[hash_code].entries);
+	it = lcache_htable_lookup(&cache_col->col_htable[hash_code], attr);
+	if (it)
+		lcache_htable_unlink(cache_col, sh, it);
+	else
+		LM_DBG("entry not found\n");
 
-	lock_release(&cache_htable[hash_code].lock);
+	lock_release(&sh->lock);
 
 	_stop_expire_timer(start,local_exec_threshold,
 		"cachedb_local remove",attr->s,attr->len,0,
@@ -240,17 +496,48 @@ int _lcache_htable_remove(cachedb_con *con,str* attr, int isrepl)
 	return 0;
 }
 
+/* looks up a valid entry, accounting the hit or miss; an expired entry
+ * is released on the spot. The shard lock must be held */
+static lcache_entry_t *lcache_htable_get(lcache_col_t *col,
+		lcache_shard_t *sh, lcache_t *bucket, str *attr)
+{
+	lcache_entry_t *it;
+
+	it = lcache_htable_lookup(bucket, attr);
+	if (it && it->expires != 0 && it->expires < get_ticks()) {
+		/* found an expired entry  -> delete it */
+		lcache_htable_unlink(col, sh, it);
+		sh->expired++;
+		it = NULL;
+	}
+
+	if (!it) {
+		sh->misses++;
+		return NULL;
+	}
+
+	sh->hits++;
+	if (sh->lru_head != it) {
+		lcache_lru_unlink(sh, it);
+		lcache_lru_push(sh, it);
+	}
+
+	return it;
+}
+
 int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_val)
 {
 	int hash_code;
-	lcache_entry_t *it=NULL,*it_prev=NULL;
+	lcache_entry_t *it=NULL,*me;
 	int old_value;
 	char *new_value;
 	int new_len;
+	int size;
 	str ins_val;
 	struct timeval start;
 
-	lcache_t* cache_htable;
+	lcache_t* bucket;
+	lcache_shard_t* sh;
 	lcache_col_t* cache_col;
 
 	cache_col = ((lcache_con*)con->data)->col;
@@ -260,93 +547,83 @@ int lcache_htable_add(cachedb_con *con,str *attr,int val,int expires,int *new_va
 		return -1;
 	}
 
-	cache_htable = cache_col->col_htable;
-
 	start_expire_timer(start,local_exec_threshold);
 
+	me = NULL;
 	hash_code = core_hash(attr,0,cache_col->size);
-	lock_get(&cache_htable[hash_code].lock);
+	bucket = &cache_col->col_htable[hash_code];
+	sh = lcache_shard(cache_col, hash_code);
+	lock_get(&sh->lock);
 
-	it = cache_htable[hash_code].entries;
+	it = lcache_htable_get(cache_col, sh, bucket, attr);
 	while (it) {
-		if (it->attr.len == attr->len &&
-				memcmp(it->attr.s,attr->s,attr->len) == 0) {
-			if (it->expires !=0 && it->expires < get_ticks()) {
-				/* found an expired entry  -> delete it */
-				if(it_prev)
-					it_prev->next = it->next;
-				else
-					cache_htable[hash_code].entries = it->next;
-
-				shm_free(it);
-				lock_release(&cache_htable[hash_code].lock);
-
-				ins_val.s = sint2str(val,&ins_val.len);
-				if (lcache_htable_insert(con,attr,&ins_val,expires) < 0) {
-					LM_ERR("failed to insert value\n");
-					_stop_expire_timer(start,local_exec_threshold,
-						"cachedb_local add",attr->s,attr->len,0,
-						cdb_slow_queries, cdb_total_queries);
-					return -1;
-				}
-
-				if (new_val)
-					*new_val = val;
-
-				_stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local add",attr->s,attr->len,0,
-					cdb_slow_queries, cdb_total_queries);
-				return 0;
-			}
-
-			/* found our valid entry */
-			if (str2sint(&it->value,&old_value) < 0) {
-				LM_ERR("not an integer\n");
-				lock_release(&cache_htable[hash_code].lock);
-				_stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local add",attr->s,attr->len,0,
-					cdb_slow_queries, cdb_total_queries);
-				return -1;
-			}
-
-			old_value+=val;
-			expires = it->expires;
-			new_value = sint2str(old_value,&new_len);
-			it = shm_realloc(it,sizeof(lcache_entry_t) + attr->len +new_len);
-			if (it == NULL) {
-				LM_ERR("failed to realloc struct\n");
-				lock_release(&cache_htable[hash_code].lock);
-				_stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local add",attr->s,attr->len,0,
-					cdb_slow_queries, cdb_total_queries);
-				return -1;
-			}
-
-			if (it_prev)
-				it_prev->next = it;
-			else
-				cache_htable[hash_code].entries = it;
+		/* found our valid entry */
+		if (str2sint(&it->value,&old_value) < 0) {
+			LM_ERR("not an integer\n");
+			lock_release(&sh->lock);
+			if (me)
+				lcache_entry_free(cache_col, me);
+			_stop_expire_timer(start,local_exec_threshold,
+				"cachedb_local add",attr->s,attr->len,0,
+				cdb_slow_queries, cdb_total_queries);
+			return -1;
+		}
 
-			it->attr.s = (char*)(it + 1);
-			it->value.s =(char *)(it + 1) + attr->len;
-			it->expires = expires;
+		old_value+=val;
+		new_value = sint2str(old_value,&new_len);
+		if (new_len == it->value.len)
+			break;
+
+		/* the entry is linked in several lists, so replace it with
+		 * a new one rather than reallocating it */
+		size = sizeof(lcache_entry_t) + attr->len + new_len;
+		if (me && me->size == size) {
+			me->attr.s = (char*)(me + 1);
+			me->attr.len = attr->len;
+			memcpy(me->attr.s, attr->s, attr->len);
+			me->value.s = (char *)(me + 1) + attr->len;
+			me->expires = it->expires;
+
+			lcache_htable_unlink(cache_col, sh, it);
+			lcache_link(bucket, sh, me);
+			it = me;
+			me = NULL;
+			break;
+		}
 
-			memcpy(it->value.s,new_value,new_len);
-			it->value.len = new_len;
-			lock_release(&cache_htable[hash_code].lock);
-			if (new_val)
-				*new_val = old_value;
+		/* making room may evict from any shard, so allocate unlocked
+		 * and look our entry up again afterwards */
+		lock_release(&sh->lock);
+		if (me)
+			lcache_entry_free(cache_col, me);
+		me = lcache_entry_new(cache_col, size);
+		if (me == NULL) {
 			_stop_expire_timer(start,local_exec_threshold,
 				"cachedb_local add",attr->s,attr->len,0,
 				cdb_slow_queries, cdb_total_queries);
-			return 0;
+			return -1;
 		}
+		lock_get(&sh->lock);
+		it = lcache_htable_lookup(bucket, attr);
+	}
 
-		it_prev = it;
-		it = it->next;
+	if (it) {
+		memcpy(it->value.s,new_value,new_len);
+		it->value.len = new_len;
+		lock_release(&sh->lock);
+		if (me)
+			lcache_entry_free(cache_col, me);
+		if (new_val)
+			*new_val = old_value;
+		_stop_expire_timer(start,local_exec_threshold,
+			"cachedb_local add",attr->s,attr->len,0,
+			cdb_slow_queries, cdb_total_queries);
+		return 0;
 	}
 
-	lock_release(&cache_htable[hash_code].lock);
+	lock_release(&sh->lock);
+	if (me)
+		lcache_entry_free(cache_col, me);
 
 	/* not found */
 	ins_val.s = sint2str(val,&ins_val.len);
@@ -380,11 +657,11 @@ int lcache_htable_sub(cachedb_con *con,str *attr,int val,int expires,int *new_va
 int lcache_htable_fetch(cachedb_con *con,str* attr, str* res)
 {
 	int hash_code;
-	lcache_entry_t* it = NULL, *it_aux = NULL;
+	lcache_entry_t* it;
 	char* value;
 	struct timeval start;
 
-	lcache_t* cache_htable;
+	lcache_shard_t* sh;
 	lcache_col_t* cache_col;
 
 	cache_col = ((lcache_con*)con->data)->col;
@@ -395,75 +672,50 @@ int lcache_htable_fetch(cachedb_con *con,str* attr, str* res)
 		return -1;
 	}
 
-	cache_htable = cache_col->col_htable;
-
 	start_expire_timer(start,local_exec_threshold);
 
 	hash_code= core_hash( attr, 0, cache_col->size);
-	lock_get(&cache_htable[hash_code].lock);
+	sh = lcache_shard(cache_col, hash_code);
+	lock_get(&sh->lock);
 
-	it = cache_htable[hash_code].entries;
+	it = lcache_htable_get(cache_col, sh,
+			&cache_col->col_htable[hash_code], attr);
+	if (!it) {
+		lock_release(&sh->lock);
+		_stop_expire_timer(start,local_exec_threshold,
+			"cachedb_local fetch",attr->s,attr->len,0,
+			cdb_slow_queries, cdb_total_queries);
+		return -2;
+	}
 
-	while(it)
+	value = (char*)pkg_malloc(it->value.len);
+	if(value == NULL)
 	{
-		if(it->attr.len == attr->len &&
-				(strncmp(it->attr.s, attr->s, attr->len) == 0))
-		{
-			if( it->expires != 0 && it->expires < get_ticks())
-			{
-				/* found an expired entry  -> delete it */
-				if(it_aux)
-					it_aux->next = it->next;
-				else
-					cache_htable[hash_code].entries = it->next;
-
-				shm_free(it);
-
-				lock_release(&cache_htable[hash_code].lock);
-				_stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local fetch",attr->s,attr->len,0,
-					cdb_slow_queries, cdb_total_queries);
-				return -2;
-			}
-			value = (char*)pkg_malloc(it->value.len);
-			if(value == NULL)
-			{
-				LM_ERR("no more memory\n");
-				lock_release(&cache_htable[hash_code].lock);
-				_stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local fetch",attr->s,attr->len,0,
-					cdb_slow_queries, cdb_total_queries);
-				return -1;
-			}
-			memcpy(value, it->value.s, it->value.len);
-			res->len = it->value.len;
-			res->s = value;
-			lock_release(&cache_htable[hash_code].lock);
-			_stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local fetch",attr->s,attr->len,0,
-				cdb_slow_queries, cdb_total_queries);
-			return 1;
-		}
-
-		it_aux = it;
-		it = it->next;
+		LM_ERR("no more memory\n");
+		lock_release(&sh->lock);
+		_stop_expire_timer(start,local_exec_threshold,
+			"cachedb_local fetch",attr->s,attr->len,0,
+			cdb_slow_queries, cdb_total_queries);
+		return -1;
 	}
-
-	lock_release(&cache_htable[hash_code].lock);
+	memcpy(value, it->value.s, it->value.len);
+	res->len = it->value.len;
+	res->s = value;
+	lock_release(&sh->lock);
 	_stop_expire_timer(start,local_exec_threshold,
 		"cachedb_local fetch",attr->s,attr->len,0,
 		cdb_slow_queries, cdb_total_queries);
-	return -2;
+	return 1;
 }
 
 int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val)
 {
 	int hash_code;
-	lcache_entry_t* it = NULL, *it_aux = NULL;
+	lcache_entry_t* it;
 	int ret;
 	struct timeval start;
 
-	lcache_t* cache_htable;
+	lcache_shard_t* sh;
 	lcache_col_t* cache_col;
 
 	cache_col = ((lcache_con*)con->data)->col;
@@ -473,60 +725,35 @@ int lcache_htable_fetch_counter(cachedb_con* con,str* attr,int *val)
 		return -1;
 	}
 
-	cache_htable = cache_col->col_htable;
-
 	start_expire_timer(start,local_exec_threshold);
 
 	hash_code= core_hash( attr, 0, cache_col->size);
-	lock_get(&cache_htable[hash_code].lock);
+	sh = lcache_shard(cache_col, hash_code);
+	lock_get(&sh->lock);
 
-	it = cache_htable[hash_code].entries;
-
-	while(it)
-	{
-		if(it->attr.len == attr->len &&
-				(strncmp(it->attr.s, attr->s, attr->len) == 0))
-		{
-			if( it->expires != 0 && it->expires < get_ticks())
-			{
-				/* found an expired entry  -> delete it */
-				if(it_aux)
-					it_aux->next = it->next;
-				else
-					cache_htable[hash_code].entries = it->next;
-
-				shm_free(it);
-
-				lock_release(&cache_htable[hash_code].lock);
-				_stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local fetch_counter",attr->s,attr->len,0,
-					cdb_slow_queries, cdb_total_queries);
-				return -2;
-			}
-			if (str2sint(&it->value,&ret) != 0) {
-				LM_ERR("Not a counter key\n");
-				lock_release(&cache_htable[hash_code].lock);
-				_stop_expire_timer(start,local_exec_threshold,
-					"cachedb_local fetch_counter",attr->s,attr->len,0,
-					cdb_slow_queries, cdb_total_queries);
-				return -3;
-			}
-			if (val)
-				*val = ret;
-			lock_release(&cache_htable[hash_code].lock);
-			_stop_expire_timer(start,local_exec_threshold,
-				"cachedb_local fetch_counter",attr->s,attr->len,0,
-				cdb_slow_queries, cdb_total_queries);
-			return 1;
-		}
-
-		it_aux = it;
-		it = it->next;
+	it = lcache_htable_get(cache_col, sh,
+			&cache_col->col_htable[hash_code], attr);
+	if (!it) {
+		lock_release(&sh->lock);
+		_stop_expire_timer(start,local_exec_threshold,
+			"cachedb_local fetch_counter",attr->s,attr->len,0,
+			cdb_slow_queries, cdb_total_queries);
+		return -2;
 	}
 
-	lock_release(&cache_htable[hash_code].lock);
+	if (str2sint(&it->value,&ret) != 0) {
+		LM_ERR("Not a counter key\n");
+		lock_release(&sh->lock);
+		_stop_expire_timer(start,local_exec_threshold,
+			"cachedb_local fetch_counter",attr->s,attr->len,0,
+			cdb_slow_queries, cdb_total_queries);
+		return -3;
+	}
+	if (val)
+		*val = ret;
+	lock_release(&sh->lock);
 	_stop_expire_timer(start,local_exec_threshold,
 		"cachedb_local fetch_counter",attr->s,attr->len,0,
 		cdb_slow_queries, cdb_total_queries);
-	return -2;
+	return 1;
 }
@@ -32,24 +32,61 @@
 #include "../../lock_ops.h"
 #include "../../cachedb/cachedb.h"
 
+/* each bucket of a collection is a shard, with its own lock, LRU list and
+ * expiry timing wheel; the buckets of larger collections share them */
+#define LCACHE_MAX_SHARDS	4096
+#define LCACHE_WHEEL_SIZE	32 /* power of two, in ticks */
+
 typedef struct lcache_entry
 {
 	str attr;
 	str value;
 	unsigned int expires;
+	unsigned int size;	/* memory accounted for this entry */
 	struct lcache_entry* next;
+	/* LRU list of the shard, most recently used first */
+	struct lcache_entry* lru_prev;
+	struct lcache_entry* lru_next;
+	/* slot of the timing wheel, for entries which expire */
+	struct lcache_entry* wheel_prev;
+	struct lcache_entry* wheel_next;
 }lcache_entry_t;
 
 
 typedef struct lcache
 {
 	lcache_entry_t* entries;
-	gen_lock_t lock;
 }lcache_t;
 
 
-int lcache_htable_init(lcache_t** cache_htable_p, int size);
-void lcache_htable_destroy();
+typedef struct lcache_shard
+{
+	gen_lock_t lock;
+	lcache_entry_t* lru_head;
+	lcache_entry_t* lru_tail;
+	lcache_entry_t* wheel[LCACHE_WHEEL_SIZE];
+	unsigned int wheel_tick;	/* last tick the wheel was advanced to */
+	/* statistics */
+	unsigned long items;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	unsigned long expired;
+}lcache_shard_t;
+
+struct lcache_col;
+
+#define lcache_shard(_col, _hash) \
+	(&(_col)->shards[(_hash) & ((_col)->shards_no - 1)])
+
+
+int lcache_htable_init(struct lcache_col* col);
+void lcache_htable_destroy(struct lcache_col* col);
+void lcache_htable_set_limit(struct lcache_col* col, unsigned long max_mem);
+int lcache_htable_register_stats(struct lcache_col* col);
+void lcache_htable_expire(struct lcache_col* col, unsigned int ticks);
+void lcache_htable_unlink(struct lcache_col* col, lcache_shard_t* shard,
+		lcache_entry_t* me);
 int lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires);
 int _lcache_htable_insert(cachedb_con *con,str* attr, str* value, int expires, int isrepl);
 int lcache_htable_remove(cachedb_con *con,str* attr);
@@ -34,6 +34,9 @@
 #include "../../timer.h"
 #include "../../forward.h"
 #include "../../ipc.h"
+#include "../../context.h"
+#include "../../route.h"
+#include "../../statistics.h"
 
 #include "api.h"
 #include "node_info.h"
@@ -67,6 +70,40 @@ static str ei_srcid_pname = str_init("src_id");
 static str ei_msg_pname = str_init("msg");
 static str ei_tag_pname = str_init("tag");
 
+/* per capability send statistics */
+struct cl_cap_stats {
+	str name;
+	stat_var *sent;
+	stat_var *pending;
+	stat_var *failed;
+	struct cl_cap_stats *next;
+};
+
+#define CL_BATCH_MAX_CAPS 8
+
+/* small packets coalesced by this process for the same destination node,
+ * routed as a whole when flushed */
+struct cl_send_batch {
+	int cluster_id;
+	int node_id;
+	str buf;
+	int msgs;
+	int caps_no;
+	struct {
+		struct cl_cap_stats *stats;
+		int msgs;
+	} caps[CL_BATCH_MAX_CAPS];
+	struct cl_send_batch *next;
+};
+
+int send_batch_size = DEFAULT_SEND_BATCH_SIZE;
+
+static struct cl_cap_stats *cl_cap_stats_list;
+static struct cl_send_batch *cl_send_batches;
+static int cl_batch_ctx_idx = -1;
+static int cl_batch_depth;
+static int cl_batch_flush_queued;
+
 static evi_params_p ei_node_event_params;
 static evi_param_p ei_clusterid_p, ei_nodeid_p, ei_newstate_p;
 static str ei_clusterid_pname = str_init("cluster_id");
@@ -554,6 +591,274 @@ int get_next_hop(node_info_t *dest)
 	}
 }
 
+int cl_register_cap_stats(str *cap)
+{
+	struct cl_cap_stats *st;
+	char *name;
+
+	for (st = cl_cap_stats_list; st; st = st->next)
+		if (!str_strcmp(&st->name, cap))
+			return 0;
+
+	st = pkg_malloc(sizeof *st);
+	if (!st) {
+		LM_ERR("No more pkg memory\n");
+		return -1;
+	}
+	memset(st, 0, sizeof *st);
+	st->name = *cap;
+
+	if ((name = build_stat_name(cap, "sent_pkts")) == NULL ||
+		register_stat("clusterer", name, &st->sent, STAT_SHM_NAME) != 0 ||
+		(name = build_stat_name(cap, "pending_pkts")) == NULL ||
+		register_stat("clusterer", name, &st->pending,
+			STAT_SHM_NAME|STAT_NO_RESET) != 0 ||
+		(name = build_stat_name(cap, "failed_pkts")) == NULL ||
+		register_stat("clusterer", name, &st->failed, STAT_SHM_NAME) != 0) {
+		LM_ERR("failed to register statistics for capability: %.*s\n",
+			cap->len, cap->s);
+		pkg_free(st);
+		return -1;
+	}
+
+	st->next = cl_cap_stats_list;
+	cl_cap_stats_list = st;
+
+	return 0;
+}
+
+static struct cl_cap_stats *get_cap_stats(bin_packet_t *packet)
+{
+	struct cl_cap_stats *st;
+	str cap;
+
+	bin_get_capability(packet, &cap);
+
+	for (st = cl_cap_stats_list; st; st = st->next)
+		if (!str_strcmp(&st->name, &cap))
+			return st;
+
+	return NULL;
+}
+
+static void send_batch_done(struct cl_send_batch *b, int rc)
+{
+	int i;
+
+	for (i = 0; i < b->caps_no; i++) {
+		update_stat(b->caps[i].stats->pending, -b->caps[i].msgs);
+		if (rc < 0)
+			update_stat(b->caps[i].stats->failed, b->caps[i].msgs);
+		else
+			update_stat(b->caps[i].stats->sent, b->caps[i].msgs);
+	}
+
+	b->buf.len = 0;
+	b->msgs = 0;
+	b->caps_no = 0;
+}
+
+/* writes out all the packets coalesced for @dest with a single send, with
+ * the same failover as msg_send_retry(); the callers already got a positive
+ * answer for these packets, so a failure only gets logged and accounted;
+ * cl_list_lock must be held */
+static void flush_send_batch(struct cl_send_batch *b, node_info_t *dest,
+												int *ev_actions_required)
+{
+	node_info_t *chosen_dest = dest;
+	int rc;
+
+	if (b->msgs == 0)
+		return;
+
+	do {
+		lock_get(chosen_dest->lock);
+
+		if (chosen_dest->link_state != LS_UP) {
+			lock_release(chosen_dest->lock);
+
+			chosen_dest = get_next_hop_2(dest);
+			if (!chosen_dest) {
+				LM_ERR("no route to node [%d], dropped %d coalesced packets\n",
+					dest->node_id, b->msgs);
+				rc = -1;
+				break;
+			}
+		} else
+			lock_release(chosen_dest->lock);
+
+		rc = msg_send(chosen_dest->cluster->send_sock, clusterer_proto,
+			&chosen_dest->addr, 0, b->buf.s, b->buf.len, 0);
+		if (rc < 0) {
+			LM_ERR("msg_send() to node [%d] failed\n", chosen_dest->node_id);
+
+			/* this node was supposed to be up, retry pinging */
+			set_link_w_neigh_adv(-1, LS_RESTART_PINGING, chosen_dest);
+
+			*ev_actions_required = 1;
+		} else {
+			LM_DBG("sent %d coalesced bin packets to node [%d]\n",
+				b->msgs, chosen_dest->node_id);
+		}
+	} while (rc < 0);
+
+	send_batch_done(b, rc);
+}
+
+void cl_flush_send_batches(void)
+{
+	struct cl_send_batch *b;
+	cluster_info_t *cl;
+	node_info_t *node;
+	int ev_actions_required;
+
+	if (!cl_list_lock) {
+		for (b = cl_send_batches; b; b = b->next)
+			send_batch_done(b, -1);
+		return;
+	}
+	lock_start_read(cl_list_lock);
+
+	for (b = cl_send_batches; b; b = b->next) {
+		if (b->msgs == 0)
+			continue;
+
+		cl = get_cluster_by_id(b->cluster_id);
+		node = cl ? get_node_by_id(cl, b->node_id) : NULL;
+		if (!node) {
+			LM_ERR("node [%d] no longer in cluster [%d], dropped %d coalesced "
+				"packets\n", b->node_id, b->cluster_id, b->msgs);
+			send_batch_done(b, -1);
+			continue;
+		}
+
+		ev_actions_required = 0;
+		flush_send_batch(b, node, &ev_actions_required);
+		if (ev_actions_required)
+			do_actions_node_ev(cl, &ev_actions_required, 1);
+	}
+
+	lock_stop_read(cl_list_lock);
+}
+
+static void cl_batch_ctx_flush(void *p)
+{
+	cl_flush_send_batches();
+}
+
+static void cl_batch_rpc_flush(int sender, void *p)
+{
+	cl_batch_flush_queued = 0;
+	cl_flush_send_batches();
+}
+
+int cl_init_send_batching(void)
+{
+	if (send_batch_size <= 0) {
+		send_batch_size = 0;
+		return 0;
+	}
+
+	cl_batch_ctx_idx = context_register_ptr(CONTEXT_GLOBAL, cl_batch_ctx_flush);
+
+	return cl_register_cap_stats(&cl_extra_cap);
+}
+
+/* packets may only be held back if the current process is guaranteed to
+ * flush them soon: at the end of the current processing context (SIP
+ * message, async resume, timer route) or of a received module packet */
+static inline int cl_batching_allowed(void)
+{
+	if (!send_batch_size)
+		return 0;
+
+	if (cl_batch_depth)
+		return 1;
+
+	if (current_processing_ctx) {
+		/* a request route may suspend in async(), keeping its context
+		 * until the resume - so also flush once the process gets back
+		 * to its reactor */
+		if (route_type == REQUEST_ROUTE && !cl_batch_flush_queued) {
+			if (ipc_send_rpc(process_no, cl_batch_rpc_flush, NULL) < 0)
+				return 0;
+			cl_batch_flush_queued = 1;
+		}
+
+		if (!context_get_ptr(CONTEXT_GLOBAL, current_processing_ctx,
+			cl_batch_ctx_idx))
+			context_put_ptr(CONTEXT_GLOBAL, current_processing_ctx,
+				cl_batch_ctx_idx, &cl_send_batches);
+		return 1;
+	}
+
+	return 0;
+}
+
+static struct cl_send_batch *get_send_batch(node_info_t *node, int create)
+{
+	struct cl_send_batch *b;
+
+	for (b = cl_send_batches; b; b = b->next)
+		if (b->node_id == node->node_id &&
+			b->cluster_id == node->cluster->cluster_id)
+			break;
+
+	if (!b && create) {
+		b = pkg_malloc(sizeof *b + send_batch_size);
+		if (!b) {
+			LM_ERR("No more pkg memory\n");
+			return NULL;
+		}
+		memset(b, 0, sizeof *b);
+		b->buf.s = (char *)(b + 1);
+		b->cluster_id = node->cluster->cluster_id;
+		b->node_id = node->node_id;
+
+		b->next = cl_send_batches;
+		cl_send_batches = b;
+	}
+
+	return b;
+}
+
+/* appends the packet to the batch of @dest, to be sent later on along
+ * with the other small packets queued towards the same node */
+static int batch_send_msg(node_info_t *dest, str *buf, struct cl_cap_stats *st,
+												int *ev_actions_required)
+{
+	struct cl_send_batch *b;
+	int i;
+
+	b = get_send_batch(dest, 1);
+	if (!b)
+		return -1;
+
+	if (b->buf.len + buf->len > send_batch_size)
+		flush_send_batch(b, dest, ev_actions_required);
+
+	for (i = 0; i < b->caps_no; i++)
+		if (b->caps[i].stats == st)
+			break;
+	if (i == b->caps_no) {
+		if (b->caps_no == CL_BATCH_MAX_CAPS) {
+			flush_send_batch(b, dest, ev_actions_required);
+			i = 0;
+		}
+		b->caps[i].stats = st;
+		b->caps[i].msgs = 0;
+		b->caps_no = i + 1;
+	}
+
+	memcpy(b->buf.s + b->buf.len, buf->s, buf->len);
+	b->buf.len += buf->len;
+	b->msgs++;
+	b->caps[i].msgs++;
+	update_stat(st->pending, 1);
+
+	return 0;
+}
+
 /* @return:
  *  0 : success, message sent
  * -1 : error, unable to send
@@ -564,8 +869,12 @@ static int msg_send_retry(bin_packet_t *packet, node_info_t *dest,
 {
 	int retr_send = 0;
 	node_info_t *chosen_dest = dest;
+	struct cl_send_batch *b;
+	struct cl_cap_stats *st;
 	str send_buffer;
 
+	st = send_batch_size ? get_cap_stats(packet) : NULL;
+
 	do {
 		lock_get(chosen_dest->lock);
 
@@ -574,6 +883,8 @@ static int msg_send_retry(bin_packet_t *packet, node_info_t *dest,
 
 			chosen_dest = get_next_hop_2(dest);
 			if (!chosen_dest) {
+				if (st)
+					update_stat(st->failed, 1);
 				if (retr_send)
 					return -1;
 				else
@@ -589,6 +900,17 @@ static int msg_send_retry(bin_packet_t *packet, node_info_t *dest,
 		}
 		bin_get_buffer(packet, &send_buffer);
 
+		/* the packet carries its destination, so the batch may be routed
+		 * through another node once flushed */
+		if (st && send_buffer.len <= send_batch_size &&
+			cl_batching_allowed() &&
+			batch_send_msg(dest, &send_buffer, st, ev_actions_required) == 0)
+			return 0;
+
+		/* keep the ordering with the packets already held back */
+		if (send_batch_size && (b = get_send_batch(dest, 0)))
+			flush_send_batch(b, dest, ev_actions_required);
+
 		if (msg_send(chosen_dest->cluster->send_sock, clusterer_proto,
 			&chosen_dest->addr, 0, send_buffer.s, send_buffer.len, 0) < 0) {
 			LM_ERR("msg_send() to node [%d] failed\n", chosen_dest->node_id);
@@ -601,6 +923,8 @@ static int msg_send_retry(bin_packet_t *packet, node_info_t *dest,
 		} else {
 			LM_DBG("sent bin packet to node [%d]\n", chosen_dest->node_id);
 			retr_send = 0;
+			if (st)
+				update_stat(st->sent, 1);
 		}
 	} while (retr_send);
 
@@ -1887,7 +2211,11 @@ void run_mod_packet_cb(int sender, void *param)
 		next_data_chunk = NULL;
 	}
 
+	/* replies or replications triggered by the packet may be coalesced */
+	cl_batch_depth++;
 	p->cap->packet_cb(&packet);
+	if (--cl_batch_depth == 0)
+		cl_flush_send_batches();
 
 	shm_free(param);
 }
@@ -2766,6 +3094,10 @@ int cl_register_cap(str *cap, cl_packet_cb_f packet_cb, cl_event_cb_f event_cb,
 	bin_register_cb(cap, bin_rcv_mod_packets, &new_cl_cap->reg,
 		sizeof new_cl_cap->reg);
 
+	if (send_batch_size && cl_register_cap_stats(cap) < 0)
+		LM_WARN("no send statistics for capability: %.*s\n",
+			cap->len, cap->s);
+
 	LM_DBG("Registered capability: %.*s\n", cap->len, cap->s);
 
 	return 0;
@@ -40,6 +40,7 @@
 #define SEED_FB_CHECK_INTERVAL 500 /* ms */
 #define UPDATE_MAX_PATH_LEN 25
 #define SMALL_MSG 300
+#define DEFAULT_SEND_BATCH_SIZE 16384
 
 #define TAG_RAND_LEN 24
 #define TAG_FIX_MAXLEN 6	/* "XX-YY-" */
@@ -180,4 +181,9 @@ int run_rcv_mi_cmd(str *cmd_name, str *cmd_params_arr, int no_params);
 
 int ipc_dispatch_mod_packet(bin_packet_t *packet, struct capability_reg *cap);
 
+extern int send_batch_size;
+int cl_init_send_batching(void);
+int cl_register_cap_stats(str *cap);
+void cl_flush_send_batches(void);
+
 #endif  /* CLUSTERER_H */
@@ -155,6 +155,7 @@ static param_export_t params[] = {
 	{"sharing_tag",			STR_PARAM|USE_FUNC_PARAM,
 		(void*)&shtag_modparam_func},
 	{"sync_packet_size",	INT_PARAM,	&sync_packet_size	},
+	{"send_batch_size",		INT_PARAM,	&send_batch_size	},
 	{0, 0, 0}
 };
 
@@ -447,6 +448,11 @@ static int mod_init(void)
 		goto error;
 	}
 
+	if (cl_init_send_batching() < 0) {
+		LM_ERR("failed to init the coalescing of sent packets\n");
+		goto error;
+	}
+
 	/* create generic message receiving events */
 	if (gen_rcv_evs_init() < 0) {
 		LM_ERR("cannot create cluster message received event\n");
@@ -108,6 +108,8 @@ stat_var *delete_sent  = 0;
 stat_var *create_recv  = 0;
 stat_var *update_recv  = 0;
 stat_var *delete_recv  = 0;
+stat_var *batches_sent = 0;
+stat_var *batched_events = 0;
 
 struct tm_binds d_tmb;
 struct rr_binds d_rrb;
@@ -314,6 +316,8 @@ static param_export_t mod_params[]={
 	/* dialog replication through clusterer using TCP binary packets */
 	{ "dialog_replication_cluster",     INT_PARAM, &dialog_repl_cluster  },
 	{ "profile_replication_cluster",	INT_PARAM, &profile_repl_cluster },
+	{ "dialog_replication_batch_size",    INT_PARAM, &dlg_repl_batch_size    },
+	{ "dialog_replication_batch_timeout", INT_PARAM, &dlg_repl_batch_timeout },
 	{ "replicate_profiles_timer", INT_PARAM, &repl_prof_utimer      },
 	{ "replicate_profiles_check", INT_PARAM, &repl_prof_timer_check },
 	{ "replicate_profiles_buffer",INT_PARAM, &repl_prof_buffer_th   },
@@ -334,6 +338,12 @@ static stat_export_t mod_stats[] = {
 	{"create_recv",         0,              &create_recv       },
 	{"update_recv",         0,              &update_recv       },
 	{"delete_recv",         0,              &delete_recv       },
+	{"repl_batches_sent",   0,              &batches_sent      },
+	{"repl_batched_events", 0,              &batched_events    },
+	{"repl_batch_lag",      STAT_IS_FUNC,
+		(stat_var**)get_dlg_repl_batch_lag                         },
+	{"repl_batch_avg_size", STAT_IS_FUNC,
+		(stat_var**)get_dlg_repl_batch_avg                         },
 	{0,0,0}
 };
 
@@ -824,6 +834,11 @@ static int mod_init(void)
 
 		if (clusterer_api.request_sync(&dlg_repl_cap, dialog_repl_cluster) < 0)
 			LM_ERR("Sync request failed\n");
+
+		if (dlg_repl_batch_init() < 0) {
+			LM_ERR("failed to init dialog replication batching\n");
+			return -1;
+		}
 	}
 
 	if ( register_timer( "dlg-timer", dlg_timer_routine, NULL, 1,
@@ -941,6 +956,8 @@ static int child_init(int rank)
 
 static void mod_destroy(void)
 {
+	dlg_repl_batch_destroy();
+
 	if (dlg_db_mode != DB_MODE_NONE) {
 		dialog_update_db(0, 0/*do not do locking*/);
 		destroy_dlg_db();
@@ -951,6 +968,7 @@ static void mod_destroy(void)
 	destroy_dlg_table();
 	destroy_dlg_timer();
 	destroy_ping_timer();
+	destroy_reinvite_ping_timer();
 	destroy_dlg_callbacks( DLGCB_CREATED|DLGCB_LOADED );
 	destroy_dlg_handlers();
 	destroy_dlg_profiles();
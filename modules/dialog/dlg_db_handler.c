@@ -1218,12 +1218,15 @@ str* write_dialog_vars( struct dlg_val *vars)
 
 /* needs to be run under the dialog lock , since it iterates on the profile links, which might get
  * deallocated if the dialog ends */
-str* write_dialog_profiles( struct dlg_profile_link *links)
+str* write_dialog_profiles( struct dlg_profile_link *links,
+												unsigned int counters)
 {
 	static str o = {NULL,0},cached_marker={"/s",2}, bin_marker={"/b", 2};
+	static str counter_marker={"/c",2}, bin_counter_marker={"/bc",3};
 	static int o_l = 0;
 	struct dlg_profile_link *link;
-	unsigned int l,i;
+	struct dlg_profile_table *profile;
+	unsigned int l,i,idx;
 	char *p;
 
 	/* compute the required len */
@@ -1238,6 +1241,14 @@ str* write_dialog_profiles( struct dlg_profile_link *links)
 		if (link->profile->repl_type!=REPL_NONE/*==(CACHEDB||PROTOBIN)*/)
 			l+=cached_marker.len; /* same length for both */
 	}
+	/* counter-only profiles have no value and alphanumerical names */
+	for (idx = 0; idx < DLG_MAX_COUNTER_PROFILES && (counters >> idx);
+	idx++) {
+		if (!(counters & (1U << idx)) || !(profile = get_counter_profile(idx)))
+			continue;
+		l += profile->name.len + 1 + 1 + (profile->repl_type==REPL_PROTOBIN ?
+			bin_counter_marker.len : counter_marker.len);
+	}
 
 	/* allocate the string to be stored */
 	if ( o.s==NULL || o_l<l) {
@@ -1263,6 +1274,14 @@ str* write_dialog_profiles( struct dlg_profile_link *links)
 		else
 			p += write_pair( p, &link->profile->name, NULL, &link->value);
 	}
+	for (idx = 0; idx < DLG_MAX_COUNTER_PROFILES && (counters >> idx);
+	idx++) {
+		if (!(counters & (1U << idx)) || !(profile = get_counter_profile(idx)))
+			continue;
+		p += write_pair( p, &profile->name,
+			profile->repl_type == REPL_PROTOBIN ?
+				&bin_counter_marker : &counter_marker, NULL);
+	}
 	if (o.len!=p-o.s) {
 		LM_CRIT("BUG - buffer overflow allocated %d, written %d\n",
 			o.len,(int)(p-o.s));
@@ -1438,10 +1457,11 @@ static inline void set_final_update_cols(db_val_t *vals, struct dlg_cell *cell,
 				SET_STR_VALUE(vals, *s);
 			}
 		}
-		if (cell->profile_links==NULL) {
+		if (cell->profile_links==NULL && cell->counter_profiles==0) {
 			VAL_NULL(vals+1) = 1;
 		} else {
-			s = write_dialog_profiles( cell->profile_links );
+			s = write_dialog_profiles( cell->profile_links,
+				cell->counter_profiles );
 			if (s==NULL) {
 				VAL_NULL(vals+1) = 1;
 			} else {
@@ -1944,10 +1964,18 @@ static int sync_dlg_db_mem(void)
 						db_timeout = 0;
 					else
 						db_timeout -= (unsigned int)time(0);
-					db_timeout += get_ticks();
 
-					if (known_dlg->tl.timeout < db_timeout)
-						known_dlg->tl.timeout = db_timeout;
+					/* move it to the wheel slot of the new timeout */
+					if (known_dlg->tl.timeout < db_timeout + get_ticks())
+						switch (update_dlg_timer(&known_dlg->tl, db_timeout)) {
+						case -1:
+							LM_ERR("failed to update dialog lifetime\n");
+						case 0:
+							break;
+						case 1:
+							/* inserted in the timer list (reference it) */
+							ref_dlg_unsafe(known_dlg, 1);
+						}
 
 					/* check with is newer cseq for caller leg */
 					if (!VAL_NULL(values+9)) {
@@ -2051,13 +2079,22 @@ static int sync_dlg_db_mem(void)
 					/* set new state */
 					known_dlg->state = VAL_INT(values+7);
 
-					/* update timeout */
-					known_dlg->tl.timeout = (unsigned int)(VAL_INT(values+8));
-					if (known_dlg->tl.timeout<=(unsigned int)time(0))
-						known_dlg->tl.timeout = 0;
+					/* update timeout, moving it to the right wheel slot */
+					db_timeout = (unsigned int)(VAL_INT(values+8));
+					if (db_timeout<=(unsigned int)time(0))
+						db_timeout = 0;
 					else
-						known_dlg->tl.timeout -= (unsigned int)time(0);
-					known_dlg->tl.timeout += get_ticks();
+						db_timeout -= (unsigned int)time(0);
+
+					switch (update_dlg_timer(&known_dlg->tl, db_timeout)) {
+					case -1:
+						LM_ERR("failed to update dialog lifetime\n");
+					case 0:
+						break;
+					case 1:
+						/* inserted in the timer list (reference it) */
+						ref_dlg_unsafe(known_dlg, 1);
+					}
 
 					/* update cseqs */
 					if (!VAL_NULL(values+9)) {
@@ -117,7 +117,8 @@ void read_dialog_vars(char *b, int l, struct dlg_cell *dlg);
 void read_dialog_profiles(char *b, int l, struct dlg_cell *dlg,
                           int double_check, char is_replicated);
 str* write_dialog_vars(struct dlg_val *vars);
-str* write_dialog_profiles(struct dlg_profile_link *links);
+str* write_dialog_profiles(struct dlg_profile_link *links,
+                          unsigned int counters);
 
 mi_response_t *mi_sync_db_dlg(const mi_params_t *params,
 								struct mi_handler *async_hdl);
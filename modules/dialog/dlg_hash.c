@@ -194,7 +194,7 @@ static inline void free_dlg_dlg(struct dlg_cell *dlg)
 		destroy_dlg_callbacks_list(dlg->cbs.first);
 	context_destroy(CONTEXT_DIALOG, context_of(dlg));
 
-	if (dlg->profile_links) {
+	if (dlg->profile_links || dlg->counter_profiles) {
 		destroy_linkers_unsafe(dlg);
 		remove_dlg_prof_table(dlg, 0);
 	}
@@ -164,6 +164,8 @@ struct dlg_cell
 	unsigned char        legs_no[4];
 	struct dlg_head_cbl  cbs;
 	struct dlg_profile_link *profile_links;
+	unsigned int         counter_profiles; /* bitmask of the counter-only
+	                                        * profiles the dialog is in */
 	struct dlg_val       *vals;
 	str                  shtag;
 
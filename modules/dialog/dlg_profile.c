@@ -47,8 +47,16 @@ static int finished_allocating_locks = 0;
 
 extern int log_profile_hash_size;
 
+/* counter-only profiles, indexed by their bit in the dialog */
+static struct dlg_profile_table *counter_profiles[DLG_MAX_COUNTER_PROFILES];
+static unsigned int counter_profiles_no = 0;
+
+/* counter-only profiles the last destroyed dialog was counted in */
+static unsigned int tmp_counter_profiles;
+
 static struct dlg_profile_table* new_dlg_profile( str *name,
-		unsigned int size, unsigned int has_value, unsigned repl_type);
+		unsigned int size, unsigned int has_value, unsigned repl_type,
+		unsigned int counter_only);
 
 /* used by cachedb interface */
 static cachedb_funcs cdbf;
@@ -147,6 +155,7 @@ int add_profile_definitions( char* profiles, unsigned int has_value)
 	char *e;
 	str name;
 	unsigned int i;
+	unsigned int counter_only;
 	enum repl_types type;
 	if (profiles==NULL || strlen(profiles)==0 )
 		return 0;
@@ -155,6 +164,7 @@ int add_profile_definitions( char* profiles, unsigned int has_value)
 	do {
 		/* By default no replication (no CACHEDB nor BIN)*/
 		type = REPL_NONE;
+		counter_only = 0;
 
 		/* locate name of profile */
 		name.s = p;
@@ -180,30 +190,41 @@ int add_profile_definitions( char* profiles, unsigned int has_value)
 		if (p) {
 			name.len = p - name.s;
 			trim_spaces_lr( name );
-			/* skip spaces after p */
-			for (++p; *p == ' ' && p < e; p++);
-			if ( p < e && *p == 's') {
-				if (cdb_url.len && cdb_url.s) {
-					type= REPL_CACHEDB;
-				} else {
-					LM_WARN("profile %.*s configured to be stored in CacheDB, "
-							"but the cachedb_url was not defined\n",
-							name.len, name.s);
-				}
-			} else if ( p < e && *p == 'b') {
-				if (profile_repl_cluster) {
-					type = REPL_PROTOBIN;
-				} else {
-					LM_WARN("profile %.*s configured to be replicated over BIN, "
-							"but 'profile_replication_cluster' is not defined\n",
-							name.len, name.s);
+			for (++p; p < e; p++) {
+				/* skip spaces */
+				if (*p == ' ')
+					continue;
+				if (*p == 's') {
+					if (cdb_url.len && cdb_url.s) {
+						type= REPL_CACHEDB;
+					} else {
+						LM_WARN("profile %.*s configured to be stored in "
+								"CacheDB, but the cachedb_url was not defined\n",
+								name.len, name.s);
+					}
+				} else if (*p == 'b') {
+					if (profile_repl_cluster) {
+						type = REPL_PROTOBIN;
+					} else {
+						LM_WARN("profile %.*s configured to be replicated over "
+								"BIN, but 'profile_replication_cluster' is not "
+								"defined\n", name.len, name.s);
+					}
+				} else if (*p == 'c') {
+					counter_only = 1;
+				} else if (isalnum(*p)) {
+					LM_ERR("Invalid letter in profile definition </%c>!\n", *p);
+					return -1;
 				}
-			} else if (isalnum(*p)) {
-				LM_ERR("Invalid letter in profile definition </%c>!\n", *p);
-				return -1;
 			}
 		}
 
+		if (counter_only && (has_value || type == REPL_CACHEDB)) {
+			LM_ERR("counter-only profile <%.*s> cannot have a value nor be "
+					"stored in CacheDB\n", name.len, name.s);
+			return -1;
+		}
+
 		/* check the name format */
 		for(i=0;i<name.len;i++) {
 			if ( !isalnum(name.s[i]) ) {
@@ -214,12 +235,13 @@ int add_profile_definitions( char* profiles, unsigned int has_value)
 		}
 
 		/* name ok -> create the profile */
-		LM_DBG("creating profile <%.*s> %s\n", name.len, name.s,
+		LM_DBG("creating profile <%.*s> %s%s\n", name.len, name.s,
 				type ==REPL_CACHEDB ? "cached" :
-				(type==REPL_PROTOBIN ? "bin replicated": ""));
+				(type==REPL_PROTOBIN ? "bin replicated": ""),
+				counter_only ? " counter-only" : "");
 
 		if (new_dlg_profile( &name, 1 << log_profile_hash_size,
-					has_value, type)==NULL) {
+					has_value, type, counter_only)==NULL) {
 			LM_ERR("failed to create new profile <%.*s>\n",name.len,name.s);
 			return -1;
 		}
@@ -417,12 +439,13 @@ struct dlg_profile_table* search_dlg_profile(str *name)
 		e = profile_name.s + profile_name.len;
 		profile_name.len = p - profile_name.s;
 		trim_spaces_lr( profile_name );
-		/* skip spaces after p */
-		for (++p; *p == ' ' && p < e; p++);
-		if ( p < e && *p == 's')
-		repl_type=REPL_CACHEDB;
-		else if (p < e && *p == 'b')
-		repl_type=REPL_PROTOBIN;
+		/* the 'c' (counter-only) flag does not change the lookup */
+		for (++p; p < e; p++) {
+			if (*p == 's')
+				repl_type=REPL_CACHEDB;
+			else if (*p == 'b')
+				repl_type=REPL_PROTOBIN;
+		}
 	}
 
 	for( profile=profiles ; profile ; profile=profile->next ) {
@@ -435,8 +458,13 @@ struct dlg_profile_table* search_dlg_profile(str *name)
 	return NULL;
 }
 
+struct dlg_profile_table *get_counter_profile(unsigned int idx)
+{
+	return idx < counter_profiles_no ? counter_profiles[idx] : NULL;
+}
+
 static struct dlg_profile_table* new_dlg_profile( str *name, unsigned int size,
-		unsigned int has_value, unsigned repl_type)
+		unsigned int has_value, unsigned repl_type, unsigned int counter_only)
 {
 	struct dlg_profile_table *profile;
 	unsigned int len;
@@ -462,9 +490,17 @@ static struct dlg_profile_table* new_dlg_profile( str *name, unsigned int size,
 		return NULL;
 	}
 
+	if (counter_only && counter_profiles_no == DLG_MAX_COUNTER_PROFILES) {
+		LM_ERR("too many counter-only profiles, at most %d supported\n",
+			(int)DLG_MAX_COUNTER_PROFILES);
+		return NULL;
+	}
+
 	len = sizeof(struct dlg_profile_table) + name->len + 1;
 	/* anything else than only CACHEDB */
-	if (repl_type !=  REPL_CACHEDB)
+	if (counter_only)
+		len += size * sizeof(prof_counter_slot_t);
+	else if (repl_type !=  REPL_CACHEDB)
 		len += size * ((has_value==0) ? sizeof(struct prof_local_count*):sizeof(map_t));
 
 	profile = (struct dlg_profile_table *)shm_malloc(len);
@@ -517,6 +553,13 @@ static struct dlg_profile_table* new_dlg_profile( str *name, unsigned int size,
 
 		profile->name.s = ((char*)profile->entries) +
 			size*sizeof( map_t );
+	} else if (counter_only) {
+		profile->counter_only = 1;
+		profile->counters = (prof_counter_slot_t *)(profile + 1);
+		profile->name.s = (char *)(profile->counters + size);
+
+		profile->counter_idx = counter_profiles_no;
+		counter_profiles[counter_profiles_no++] = profile;
 	} else {
 		profile->noval_local_counters = (struct prof_local_count **)(profile + 1);
 		profile->name.s = ((char*)(profile->noval_local_counters)) +
@@ -567,6 +610,122 @@ void destroy_dlg_profiles(void)
 /* array of temporary copies of the dialog profile linkers */
 static struct dlg_profile_link *tmp_linkers;
 
+/* each process updates its own slot, the slots are summed up on read;
+ * the replicated dialogs with a sharing tag are kept aside, per tag, so
+ * the ones we only back up are not counted (same as regular profiles) */
+static inline void update_counter_profile(struct dlg_profile_table *profile,
+											struct dlg_cell *dlg, int n)
+{
+	unsigned int i = process_no & (profile->size - 1);
+	struct prof_local_count *cnt;
+
+	if (profile->repl_type == REPL_PROTOBIN && profile_repl_cluster &&
+	dialog_repl_cluster && dlg->shtag.s) {
+		lock_set_get(profile->locks, 0);
+		if (n > 0) {
+			cnt = get_local_counter(&profile->tag_counters, &dlg->shtag);
+			if (cnt)
+				cnt->n += n;
+		} else {
+			remove_local_counter(&profile->tag_counters, &dlg->shtag);
+		}
+		lock_set_release(profile->locks, 0);
+		return;
+	}
+
+#ifdef NO_ATOMIC_OPS
+	lock_set_get(profile->locks, i);
+	profile->counters[i].n += n;
+	lock_set_release(profile->locks, i);
+#else
+	if (n >= 0)
+		atomic_add(n, &profile->counters[i].n);
+	else
+		atomic_sub(-n, &profile->counters[i].n);
+#endif
+}
+
+static int get_counter_profile_size(struct dlg_profile_table *profile)
+{
+	struct prof_local_count *cnt;
+	unsigned int i;
+	long n = 0;
+	int rc;
+
+	/* a slot may go negative (dialog ended by another process),
+	 * only the sum is meaningful */
+	for (i = 0; i < profile->size; i++)
+#ifdef NO_ATOMIC_OPS
+		n += profile->counters[i].n;
+#else
+		n += (long)profile->counters[i].n.counter;
+#endif
+
+	if (profile->tag_counters) {
+		lock_set_get(profile->locks, 0);
+		for (cnt = profile->tag_counters; cnt; cnt = cnt->next) {
+			/* don't count dialogs for which we have a backup role */
+			if ((rc = clusterer_api.shtag_get(&cnt->shtag,
+				dialog_repl_cluster)) < 0)
+				LM_ERR("Failed to get state for sharing tag: <%.*s>\n",
+					cnt->shtag.len, cnt->shtag.s);
+
+			if (rc != SHTAG_STATE_BACKUP)
+				n += cnt->n;
+		}
+		lock_set_release(profile->locks, 0);
+	}
+
+	return n < 0 ? 0 : (int)n;
+}
+
+static int set_counter_profile(struct dlg_cell *dlg,
+										struct dlg_profile_table *profile)
+{
+	struct dlg_entry *d_entry = &d_table->entries[dlg->h_entry];
+
+	if (dlg->locked_by != process_no)
+		dlg_lock(d_table, d_entry);
+
+	if (dlg->counter_profiles & dlg_counter_bit(profile)) {
+		/* already counted */
+		if (dlg->locked_by != process_no)
+			dlg_unlock(d_table, d_entry);
+		return 0;
+	}
+	dlg->counter_profiles |= dlg_counter_bit(profile);
+	dlg->flags |= DLG_FLAG_VP_CHANGED;
+
+	if (dlg->locked_by != process_no)
+		dlg_unlock(d_table, d_entry);
+
+	update_counter_profile(profile, dlg, 1);
+	return 0;
+}
+
+static int unset_counter_profile(struct dlg_cell *dlg,
+										struct dlg_profile_table *profile)
+{
+	struct dlg_entry *d_entry = &d_table->entries[dlg->h_entry];
+
+	if (dlg->locked_by != process_no)
+		dlg_lock(d_table, d_entry);
+
+	if (!(dlg->counter_profiles & dlg_counter_bit(profile))) {
+		if (dlg->locked_by != process_no)
+			dlg_unlock(d_table, d_entry);
+		return -1;
+	}
+	dlg->counter_profiles &= ~dlg_counter_bit(profile);
+	dlg->flags |= DLG_FLAG_VP_CHANGED;
+
+	if (dlg->locked_by != process_no)
+		dlg_unlock(d_table, d_entry);
+
+	update_counter_profile(profile, dlg, -1);
+	return 1;
+}
+
 static int init_tmp_linkers(struct dlg_cell *dlg)
 {
 	struct dlg_profile_link *l;
@@ -615,6 +774,10 @@ void destroy_linkers_unsafe(struct dlg_cell *dlg)
 {
 	struct dlg_profile_link *l, *linker = dlg->profile_links;
 
+	/* same for the counter-only profiles, which only need the mask */
+	tmp_counter_profiles = dlg->counter_profiles;
+	dlg->counter_profiles = 0;
+
 	/* temporarily save a copy of the dialog profile links in order to remove the
 	 * dialog from the profile table structures _after_ actually distroying the
 	 * links from the dlg_cell; this is useful for avoiding deadlocks */
@@ -728,6 +891,14 @@ void remove_dlg_prof_table(struct dlg_cell *dlg, char is_replicated)
 {
 	struct dlg_profile_link *l;
 	struct dlg_profile_link *linker = tmp_linkers;
+	unsigned int i;
+
+	for (i = 0; tmp_counter_profiles; i++) {
+		if (tmp_counter_profiles & (1U << i)) {
+			update_counter_profile(counter_profiles[i], dlg, -1);
+			tmp_counter_profiles &= ~(1U << i);
+		}
+	}
 
 	while(linker) {
 		l = linker;
@@ -870,6 +1041,9 @@ int set_dlg_profile(struct dlg_cell *dlg, str *value,
 		return -1;
 	}
 
+	if (profile->counter_only)
+		return set_counter_profile(dlg, profile);
+
 	/* build new linker */
 	linker = (struct dlg_profile_link*)shm_malloc(
 		sizeof(struct dlg_profile_link) + (profile->has_value?value->len:0) );
@@ -915,6 +1089,9 @@ int unset_dlg_profile(struct dlg_cell *dlg, str *value,
 		return -1;
 	}
 
+	if (profile->counter_only)
+		return unset_counter_profile(dlg, profile);
+
 	/* check the dialog linkers */
 	d_entry = &d_table->entries[dlg->h_entry];
 	/* lock dialog (if not already locked via a callback triggering)*/
@@ -971,6 +1148,9 @@ int is_dlg_in_profile(struct dlg_cell *dlg, struct dlg_profile_table *profile,
 	if (dlg==NULL)
 		return -1;
 
+	if (profile->counter_only)
+		return (dlg->counter_profiles & dlg_counter_bit(profile)) ? 1 : -1;
+
 	/* check the dialog linkers */
 	d_entry = &d_table->entries[dlg->h_entry];
 	dlg_lock( d_table, d_entry);
@@ -1115,6 +1295,9 @@ int noval_get_local_count(struct dlg_profile_table *profile)
 	struct prof_local_count *cnt;
 	int rc;
 
+	if (profile->counter_only)
+		return get_counter_profile_size(profile);
+
 	for (i = 0; i < profile->size; i++) {
 		lock_set_get(profile->locks, i);
 
@@ -1379,6 +1562,10 @@ static mi_response_t *mi_profile_list(const mi_params_t *params, str *value)
 		{
 			found = 0;
 
+			if (profile->counter_only &&
+			(cur_dlg->counter_profiles & dlg_counter_bit(profile)))
+				found = 1;
+
 			cur_link = cur_dlg ->profile_links;
 
 			while(cur_link)
@@ -1483,6 +1670,7 @@ static mi_response_t *mi_profile_terminate(const mi_params_t *params, str *value
 	struct dlg_profile_link *cur_link;
 	struct dialog_list *deleted = NULL, *delete_entry ;
 	int shtag_state;
+	int found;
 
 	if (get_mi_string_param(params, "profile",
 		&profile_name.s, &profile_name.len) < 0)
@@ -1500,31 +1688,38 @@ static mi_response_t *mi_profile_terminate(const mi_params_t *params, str *value
 		cur_dlg = d_entry->first;
 		while( cur_dlg ) {
 
+			found = 0;
+
+			if (profile->counter_only &&
+			(cur_dlg->counter_profiles & dlg_counter_bit(profile)))
+				found = 1;
+
 			cur_link = cur_dlg ->profile_links;
 
-			while(cur_link) {
+			while(!found && cur_link) {
 				if( cur_link->profile == profile &&
 					( value == NULL ||
 					( value->len == cur_link->value.len
 					 && !strncmp(value->s,cur_link->value.s, value->len))
-					)) {
-					delete_entry = pkg_malloc(sizeof(struct dialog_list));
-					if (!delete_entry) {
-						lock_set_release(d_table->locks,d_entry->lock_idx);
-						pkg_free_all(deleted);
-						LM_CRIT("no more pkg memory\n");
-						return init_mi_error(400, MI_SSTR("Internal error"));
-					}
+					))
+					found = 1;
+				cur_link = cur_link->next;
+			}
 
-					delete_entry->dlg = cur_dlg;
-					delete_entry->next = deleted;
-					deleted = delete_entry;
+			if (found) {
+				delete_entry = pkg_malloc(sizeof(struct dialog_list));
+				if (!delete_entry) {
+					lock_set_release(d_table->locks,d_entry->lock_idx);
+					pkg_free_all(deleted);
+					LM_CRIT("no more pkg memory\n");
+					return init_mi_error(400, MI_SSTR("Internal error"));
+				}
 
-					ref_dlg_unsafe(cur_dlg, 1);
+				delete_entry->dlg = cur_dlg;
+				delete_entry->next = deleted;
+				deleted = delete_entry;
 
-					break;
-				}
-				cur_link = cur_link->next;
+				ref_dlg_unsafe(cur_dlg, 1);
 			}
 			cur_dlg = cur_dlg->next;
 		}
@@ -32,6 +32,7 @@
 
 #include "../../parser/msg_parser.h"
 #include "../../locking.h"
+#include "../../atomic.h"
 #include "../../str.h"
 
 
@@ -59,10 +60,26 @@ struct prof_local_count {
 	struct prof_local_count *next;
 };
 
+/* counter-only profiles are tracked as bits in the dialog */
+#define DLG_MAX_COUNTER_PROFILES  (8*sizeof(unsigned int))
+#define dlg_counter_bit(_profile)  (1U << (_profile)->counter_idx)
+
+/* per-process counter slot of a counter-only profile; each slot is
+ * padded to its own cache line so processes do not bounce them */
+typedef union prof_counter_slot {
+#ifdef NO_ATOMIC_OPS
+	long n;
+#else
+	atomic_t n;
+#endif
+	char pad[64];
+} prof_counter_slot_t;
+
 enum repl_types {REPL_NONE=0, REPL_CACHEDB=1, REPL_PROTOBIN};
 struct dlg_profile_table {
 	str name;
 	unsigned int has_value;
+	unsigned int counter_only;
 	enum repl_types repl_type;
 
 	unsigned int size;
@@ -79,6 +96,17 @@ struct dlg_profile_table {
 	struct prof_local_count **noval_local_counters;
 	struct prof_rcv_count *noval_rcv_counters;
 
+	/*
+	 * information for counter-only profiles (no dialog linkers)
+	 */
+	unsigned int counter_idx;
+	prof_counter_slot_t *counters;
+	/* dialogs with a sharing tag, counted per tag (under the first lock) */
+	struct prof_local_count *tag_counters;
+	/* last count replicated and when it was last fully synced */
+	int repl_sent_count;
+	time_t repl_sync_ts;
+
 	struct dlg_profile_table *next;
 };
 
@@ -109,6 +137,8 @@ struct dlg_profile_value_name {
 
 int add_profile_definitions( char* profiles, unsigned int has_value);
 
+struct dlg_profile_table *get_counter_profile(unsigned int idx);
+
 void destroy_dlg_profiles();
 
 struct dlg_profile_table* search_dlg_profile(str *name);
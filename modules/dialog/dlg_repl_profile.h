@@ -38,6 +38,8 @@ typedef struct repl_prof_count {
 	int counter;
 	time_t update;
     int node_id;
+	/* startup epoch of the node, used by the counter-only deltas */
+	unsigned int epoch;
     struct repl_prof_count *next;
 } repl_prof_count_t;
 
@@ -66,6 +68,11 @@ int replicate_profiles_count(prof_rcv_count_t *rp);
 void receive_prof_repl(bin_packet_t *packet);
 
 #define REPLICATION_DLG_PROFILE		4
+#define REPLICATION_DLG_PROFILE_DELTA	5
+
+/* counter-only profiles replicate deltas, with a periodic full sync */
+#define REPL_PROF_COUNT_DELTA	0
+#define REPL_PROF_COUNT_FULL	1
 #define DLG_REPL_PROF_TIMER			10
 #define DLG_REPL_PROF_EXPIRE_TIMER	10
 #define DLG_REPL_PROF_BUF_THRESHOLD	1400
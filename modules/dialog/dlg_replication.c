@@ -34,6 +34,7 @@
 #include "../../resolve.h"
 #include "../../forward.h"
 #include "../../pt.h"
+#include "../../locking.h"
 
 extern int active_dlgs_cnt;
 extern int early_dlgs_cnt;
@@ -46,6 +47,8 @@ extern stat_var *delete_sent;
 extern stat_var *create_recv;
 extern stat_var *update_recv;
 extern stat_var *delete_recv;
+extern stat_var *batches_sent;
+extern stat_var *batched_events;
 
 struct clusterer_binds clusterer_api;
 
@@ -577,7 +580,8 @@ void bin_push_dlg(bin_packet_t *packet, struct dlg_cell *dlg)
 		LM_ERR("Failed to store sharing tag name as dlg val\n");
 
 	vars = write_dialog_vars(dlg->vals);
-	profiles = write_dialog_profiles(dlg->profile_links);
+	profiles = write_dialog_profiles(dlg->profile_links,
+		dlg->counter_profiles);
 
 	bin_push_str(packet, vars);
 	bin_push_str(packet, profiles);
@@ -590,6 +594,289 @@ void bin_push_dlg(bin_packet_t *packet, struct dlg_cell *dlg)
 	bin_push_int(packet, dlg->legs[callee_leg].last_gen_cseq);
 }
 
+/*  Dialog replication batching   */
+
+int dlg_repl_batch_size = 0;	/* bytes, 0 disables batching */
+int dlg_repl_batch_timeout = DLG_REPL_BATCH_TIMEOUT;	/* ms */
+
+/* events pending replication, packed back to back as a
+ * (int type, str payload) pair of BIN fields each */
+struct dlg_repl_batch {
+	gen_lock_t lock;
+	/* serializes the flushes, so batches leave in the order they were
+	 * filled, even if built by different processes */
+	gen_lock_t send_lock;
+	int events;
+	int len;
+	/* per type count of the queued events, for the "*_sent" stats */
+	int type_events[REPLICATION_DLG_CSEQ + 1];
+	utime_t first_ts;
+	unsigned int last_lag;	/* ms */
+	/* totals since startup, under send_lock */
+	unsigned long total_batches;
+	unsigned long total_events;
+	char buf[0];
+};
+
+static struct dlg_repl_batch *dlg_batch;
+
+static void dlg_repl_batch_timer(utime_t ticks, void *param);
+
+unsigned long get_dlg_repl_batch_lag(unsigned short foo)
+{
+	return dlg_batch ? dlg_batch->last_lag : 0;
+}
+
+unsigned long get_dlg_repl_batch_avg(unsigned short foo)
+{
+	unsigned long avg;
+
+	if (!dlg_batch)
+		return 0;
+
+	lock_get(&dlg_batch->send_lock);
+	avg = dlg_batch->total_batches ?
+		dlg_batch->total_events / dlg_batch->total_batches : 0;
+	lock_release(&dlg_batch->send_lock);
+
+	return avg;
+}
+
+/* accounts @n replicated events of the given type as actually sent */
+static inline void dlg_repl_sent_stat(int type, int n)
+{
+	switch (type) {
+	case REPLICATION_DLG_CREATED:
+		if_update_stat(dlg_enable_stats, create_sent, n);
+		break;
+	case REPLICATION_DLG_UPDATED:
+		if_update_stat(dlg_enable_stats, update_sent, n);
+		break;
+	case REPLICATION_DLG_DELETED:
+		if_update_stat(dlg_enable_stats, delete_sent, n);
+		break;
+	}
+}
+
+int dlg_repl_batch_init(void)
+{
+	int max_size;
+
+	if (dlg_repl_batch_size == 0)
+		return 0;
+
+	/* the whole batch travels as a single BIN string */
+	max_size = BIN_MAX_BUF_LEN - MIN_BIN_PACKET_SIZE - dlg_repl_cap.len
+		- CMD_FIELD_SIZE - LEN_FIELD_SIZE;
+	if (max_size > USHRT_MAX)
+		max_size = USHRT_MAX;
+	if (dlg_repl_batch_size < 0 || dlg_repl_batch_size > max_size) {
+		LM_ERR("invalid dialog_replication_batch_size %d, must be between "
+			"0 and %d\n", dlg_repl_batch_size, max_size);
+		return -1;
+	}
+
+	if (dlg_repl_batch_timeout <= 0) {
+		LM_ERR("invalid dialog_replication_batch_timeout %d\n",
+			dlg_repl_batch_timeout);
+		return -1;
+	}
+
+	dlg_batch = shm_malloc(sizeof *dlg_batch + dlg_repl_batch_size);
+	if (!dlg_batch) {
+		LM_ERR("no more shm memory\n");
+		return -1;
+	}
+	memset(dlg_batch, 0, sizeof *dlg_batch);
+
+	if (!lock_init(&dlg_batch->lock) || !lock_init(&dlg_batch->send_lock)) {
+		LM_ERR("failed to init batch locks\n");
+		goto error;
+	}
+
+	if (register_utimer("dialog-repl-batch-utimer", dlg_repl_batch_timer,
+		NULL, dlg_repl_batch_timeout * 1000, TIMER_FLAG_DELAY_ON_DELAY) < 0) {
+		LM_ERR("failed to register batch utimer\n");
+		goto error;
+	}
+
+	return 0;
+error:
+	shm_free(dlg_batch);
+	dlg_batch = NULL;
+	return -1;
+}
+
+static inline void dlg_repl_send_err(int rc)
+{
+	switch (rc) {
+	case CLUSTERER_CURR_DISABLED:
+		LM_INFO("Current node is disabled in cluster: %d\n", dialog_repl_cluster);
+		break;
+	case CLUSTERER_DEST_DOWN:
+		LM_ERR("All destinations in cluster: %d are down or probing\n",
+			dialog_repl_cluster);
+		break;
+	case CLUSTERER_SEND_ERR:
+		LM_ERR("Error sending in cluster: %d\n", dialog_repl_cluster);
+		break;
+	}
+}
+
+/* must be called with the batch lock held, releases it */
+static int dlg_repl_flush_unsafe(void)
+{
+	bin_packet_t packet;
+	str body;
+	int events, rc, i;
+	int type_events[REPLICATION_DLG_CSEQ + 1];
+	unsigned int lag;
+
+	if (dlg_batch->events == 0) {
+		lock_release(&dlg_batch->lock);
+		return CLUSTERER_SEND_SUCCESS;
+	}
+
+	if (bin_init(&packet, &dlg_repl_cap, REPLICATION_DLG_BATCH, BIN_VERSION,
+			MIN_BIN_PACKET_SIZE + dlg_repl_cap.len + sizeof(int) +
+			LEN_FIELD_SIZE + dlg_batch->len) != 0) {
+		lock_release(&dlg_batch->lock);
+		return CLUSTERER_SEND_ERR;
+	}
+
+	body.s = dlg_batch->buf;
+	body.len = dlg_batch->len;
+	events = dlg_batch->events;
+	bin_push_int(&packet, events);
+	bin_push_str(&packet, &body);
+
+	lag = (unsigned int)((get_uticks() - dlg_batch->first_ts) / 1000);
+	dlg_batch->last_lag = lag;
+	dlg_batch->events = 0;
+	dlg_batch->len = 0;
+	memcpy(type_events, dlg_batch->type_events, sizeof type_events);
+	memset(dlg_batch->type_events, 0, sizeof dlg_batch->type_events);
+
+	lock_get(&dlg_batch->send_lock);
+	lock_release(&dlg_batch->lock);
+
+	rc = clusterer_api.send_all(&packet, dialog_repl_cluster);
+	if (rc == CLUSTERER_SEND_SUCCESS) {
+		dlg_batch->total_batches++;
+		dlg_batch->total_events += events;
+	}
+
+	lock_release(&dlg_batch->send_lock);
+
+	bin_free_packet(&packet);
+
+	if (rc != CLUSTERER_SEND_SUCCESS) {
+		dlg_repl_send_err(rc);
+		LM_ERR("Failed to replicate a batch of %d dialog events\n", events);
+		return rc;
+	}
+
+	for (i = 0; i <= REPLICATION_DLG_CSEQ; i++)
+		if (type_events[i])
+			dlg_repl_sent_stat(i, type_events[i]);
+	if_update_stat(dlg_enable_stats, batches_sent, 1);
+	if_update_stat(dlg_enable_stats, batched_events, events);
+	LM_DBG("sent a batch of %d dialog events, lag %ums\n", events, lag);
+
+	return CLUSTERER_SEND_SUCCESS;
+}
+
+static void dlg_repl_batch_timer(utime_t ticks, void *param)
+{
+	lock_get(&dlg_batch->lock);
+	dlg_repl_flush_unsafe();
+}
+
+void dlg_repl_batch_destroy(void)
+{
+	if (!dlg_batch)
+		return;
+
+	/* push out whatever is still pending before going down */
+	lock_get(&dlg_batch->lock);
+	if (dlg_repl_flush_unsafe() != CLUSTERER_SEND_SUCCESS)
+		LM_WARN("failed to flush the pending dialog replication batch\n");
+
+	lock_destroy(&dlg_batch->lock);
+	lock_destroy(&dlg_batch->send_lock);
+	shm_free(dlg_batch);
+	dlg_batch = NULL;
+}
+
+/* appends @src (@len bytes) to the batch, laid out as a BIN field */
+static inline void dlg_repl_batch_put(void *src, unsigned short len,
+																int is_str)
+{
+	if (is_str) {
+		memcpy(dlg_batch->buf + dlg_batch->len, &len, LEN_FIELD_SIZE);
+		dlg_batch->len += LEN_FIELD_SIZE;
+	}
+	memcpy(dlg_batch->buf + dlg_batch->len, src, len);
+	dlg_batch->len += len;
+}
+
+/**
+ * queues an already built dialog event in the replication batch,
+ * or sends it right away if batching is disabled
+ */
+static int dlg_repl_send(bin_packet_t *packet)
+{
+	str payload;
+	int rc, needed, offset;
+
+	if (!dlg_batch) {
+		rc = clusterer_api.send_all(packet, dialog_repl_cluster);
+		if (rc == CLUSTERER_SEND_SUCCESS)
+			dlg_repl_sent_stat(packet->type, 1);
+		return rc;
+	}
+
+	/* strip the BIN header, only the fields are batched */
+	offset = HEADER_SIZE + LEN_FIELD_SIZE + dlg_repl_cap.len + CMD_FIELD_SIZE;
+	payload.s = packet->buffer.s + offset;
+	payload.len = packet->buffer.len - offset;
+	needed = CMD_FIELD_SIZE + LEN_FIELD_SIZE + payload.len;
+
+	lock_get(&dlg_batch->lock);
+
+	if (dlg_batch->len + needed > dlg_repl_batch_size) {
+		/* no room left - push out what we have so far */
+		rc = dlg_repl_flush_unsafe();
+		if (rc != CLUSTERER_SEND_SUCCESS && rc != CLUSTERER_DEST_DOWN &&
+			rc != CLUSTERER_CURR_DISABLED)
+			LM_ERR("failed to flush the dialog replication batch\n");
+
+		if (needed > dlg_repl_batch_size) {
+			/* would never fit, send it on its own, still in order */
+			lock_get(&dlg_batch->send_lock);
+			rc = clusterer_api.send_all(packet, dialog_repl_cluster);
+			lock_release(&dlg_batch->send_lock);
+			if (rc == CLUSTERER_SEND_SUCCESS)
+				dlg_repl_sent_stat(packet->type, 1);
+			return rc;
+		}
+
+		lock_get(&dlg_batch->lock);
+	}
+
+	if (dlg_batch->events == 0)
+		dlg_batch->first_ts = get_uticks();
+
+	dlg_repl_batch_put(&packet->type, CMD_FIELD_SIZE, 0);
+	dlg_repl_batch_put(payload.s, payload.len, 1);
+	dlg_batch->events++;
+	dlg_batch->type_events[packet->type]++;
+
+	lock_release(&dlg_batch->lock);
+
+	return CLUSTERER_SEND_SUCCESS;
+}
+
 /*  Binary Packet sending functions   */
 
 
@@ -630,7 +917,7 @@ void replicate_dialog_created(struct dlg_cell *dlg)
 
 	dlg_unlock_dlg(dlg);
 
-	rc = clusterer_api.send_all(&packet, dialog_repl_cluster);
+	rc = dlg_repl_send(&packet);
 	switch (rc) {
 	case CLUSTERER_CURR_DISABLED:
 		LM_INFO("Current node is disabled in cluster: %d\n", dialog_repl_cluster);
@@ -644,7 +931,6 @@ void replicate_dialog_created(struct dlg_cell *dlg)
 		goto error;
 	}
 
-	if_update_stat(dlg_enable_stats,create_sent,1);
 	bin_free_packet(&packet);
 	return;
 
@@ -694,7 +980,7 @@ void replicate_dialog_updated(struct dlg_cell *dlg)
 
 	dlg_unlock_dlg(dlg);
 
-	rc = clusterer_api.send_all(&packet, dialog_repl_cluster);
+	rc = dlg_repl_send(&packet);
 	switch (rc) {
 	case CLUSTERER_CURR_DISABLED:
 		LM_INFO("Current node is disabled in cluster: %d\n", dialog_repl_cluster);
@@ -708,7 +994,6 @@ void replicate_dialog_updated(struct dlg_cell *dlg)
 		goto error;
 	}
 
-	if_update_stat(dlg_enable_stats,update_sent,1);
 	bin_free_packet(&packet);
 	return;
 
@@ -740,7 +1025,7 @@ void replicate_dialog_deleted(struct dlg_cell *dlg)
 	bin_push_str(&packet, &dlg->legs[DLG_CALLER_LEG].tag);
 	bin_push_str(&packet, &dlg->legs[callee_idx(dlg)].tag);
 
-	rc = clusterer_api.send_all(&packet, dialog_repl_cluster);
+	rc = dlg_repl_send(&packet);
 	switch (rc) {
 	case CLUSTERER_CURR_DISABLED:
 		LM_INFO("Current node is disabled in cluster: %d\n", dialog_repl_cluster);
@@ -754,7 +1039,6 @@ void replicate_dialog_deleted(struct dlg_cell *dlg)
 		goto error_free;
 	}
 
-	if_update_stat(dlg_enable_stats, delete_sent, 1);
 	bin_free_packet(&packet);
 	return;
 error_free:
@@ -782,7 +1066,7 @@ void replicate_dialog_cseq_updated(struct dlg_cell *dlg, int leg)
 	bin_push_str(&packet, &dlg->legs[leg].tag);
 	bin_push_int(&packet, dlg->legs[leg].last_gen_cseq);
 
-	rc = clusterer_api.send_all(&packet, dialog_repl_cluster);
+	rc = dlg_repl_send(&packet);
 	switch (rc) {
 	case CLUSTERER_CURR_DISABLED:
 		LM_INFO("Current node is disabled in cluster: %d\n", dialog_repl_cluster);
@@ -804,6 +1088,72 @@ error:
 	LM_ERR("Failed to replicate dialog cseq update\n");
 }
 
+static int dlg_repl_event(bin_packet_t *pkt)
+{
+	int rc;
+
+	switch (pkt->type) {
+	case REPLICATION_DLG_CREATED:
+		rc = dlg_replicated_create(pkt, NULL, NULL, NULL, 1);
+		if_update_stat(dlg_enable_stats, create_recv, 1);
+		break;
+	case REPLICATION_DLG_UPDATED:
+		rc = dlg_replicated_update(pkt);
+		if_update_stat(dlg_enable_stats, update_recv, 1);
+		break;
+	case REPLICATION_DLG_DELETED:
+		rc = dlg_replicated_delete(pkt);
+		if_update_stat(dlg_enable_stats, delete_recv, 1);
+		break;
+	case REPLICATION_DLG_CSEQ:
+		rc = dlg_replicated_cseq_updated(pkt);
+		break;
+	default:
+		rc = -1;
+		LM_WARN("Invalid dialog binary packet command: %d "
+			"(from node: %d in cluster: %d)\n", pkt->type, pkt->src_id,
+			dialog_repl_cluster);
+	}
+
+	return rc;
+}
+
+/* unpacks a batch and processes each event as a standalone packet */
+static int receive_dlg_batch(bin_packet_t *pkt)
+{
+	bin_packet_t batch, ev;
+	str body;
+	int events, type, rc = 0;
+
+	if (bin_pop_int(pkt, &events) != 0 || bin_pop_str(pkt, &body) != 0) {
+		LM_ERR("malformed dialog replication batch\n");
+		return -1;
+	}
+
+	memset(&batch, 0, sizeof batch);
+	batch.buffer = body;
+	batch.front_pointer = body.s;
+
+	memset(&ev, 0, sizeof ev);
+	ev.src_id = pkt->src_id;
+
+	while (events-- > 0) {
+		if (bin_pop_int(&batch, &type) != 0 ||
+			bin_pop_str(&batch, &ev.buffer) != 0) {
+			LM_ERR("truncated dialog replication batch (from node: %d)\n",
+				pkt->src_id);
+			return -1;
+		}
+
+		ev.type = type;
+		ev.front_pointer = ev.buffer.s;
+		if (dlg_repl_event(&ev) != 0)
+			rc = -1;
+	}
+
+	return rc;
+}
+
 void receive_dlg_repl(bin_packet_t *packet)
 {
 	int rc = 0;
@@ -812,25 +1162,17 @@ void receive_dlg_repl(bin_packet_t *packet)
 	for (pkt = packet; pkt; pkt = pkt->next) {
 		switch (pkt->type) {
 		case REPLICATION_DLG_CREATED:
-			ensure_bin_version(pkt, BIN_VERSION);
-
-			rc = dlg_replicated_create(pkt, NULL, NULL, NULL, 1);
-			if_update_stat(dlg_enable_stats, create_recv, 1);
-			break;
 		case REPLICATION_DLG_UPDATED:
+		case REPLICATION_DLG_DELETED:
 			ensure_bin_version(pkt, BIN_VERSION);
-
-			rc = dlg_replicated_update(pkt);
-			if_update_stat(dlg_enable_stats, update_recv, 1);
+			/* fall through */
+		case REPLICATION_DLG_CSEQ:
+			rc = dlg_repl_event(pkt);
 			break;
-		case REPLICATION_DLG_DELETED:
+		case REPLICATION_DLG_BATCH:
 			ensure_bin_version(pkt, BIN_VERSION);
 
-			rc = dlg_replicated_delete(pkt);
-			if_update_stat(dlg_enable_stats, delete_recv, 1);
-			break;
-		case REPLICATION_DLG_CSEQ:
-			rc = dlg_replicated_cseq_updated(pkt);
+			rc = receive_dlg_batch(pkt);
 			break;
 		case SYNC_PACKET_TYPE:
 			ensure_bin_version(pkt, BIN_VERSION);
@@ -972,6 +1314,9 @@ int repl_prof_timer_expire = DLG_REPL_PROF_EXPIRE_TIMER;
 static void broadcast_profiles(utime_t ticks, void *param);
 static void clean_profiles(unsigned int ticks, void *param);
 
+/* lets the other nodes detect our restarts */
+static unsigned int repl_prof_epoch;
+
 int repl_prof_init(void)
 {
 	if (!profile_repl_cluster)
@@ -1019,6 +1364,8 @@ int repl_prof_init(void)
 		return -1;
 	}
 
+	repl_prof_epoch = (unsigned int)time(0);
+
 	return 0;
 }
 
@@ -1064,6 +1411,8 @@ static repl_prof_count_t* find_destination(prof_rcv_count_t *noval, int node_id)
 			goto error;
 		}
 		head->node_id = node_id;
+		head->counter = 0;
+		head->epoch = 0;
 		head->next = noval->dsts;
 		noval->dsts = head;
 	}
@@ -1074,6 +1423,60 @@ error:
 }
 
 
+static void receive_prof_delta(bin_packet_t *packet)
+{
+	time_t now;
+	str name;
+	unsigned int epoch;
+	int kind, value;
+	struct dlg_profile_table *profile;
+	repl_prof_count_t *destination;
+
+	if (bin_pop_int(packet, &epoch) < 0) {
+		LM_ERR("cannot pop the node's epoch\n");
+		return;
+	}
+
+	now = time(0);
+
+	for (;;) {
+		if (bin_pop_str(packet ,&name) == 1)
+			break; /* pop'ed all profiles */
+
+		if (bin_pop_int(packet, &kind) < 0 || bin_pop_int(packet, &value) < 0) {
+			LM_ERR("cannot pop profile's counter\n");
+			return;
+		}
+
+		profile = get_dlg_profile(&name);
+		if (!profile || !profile->counter_only ||
+		profile->repl_type != REPL_PROTOBIN) {
+			LM_WARN("received unknown counter-only profile <%.*s> from node "
+				"%d\n", name.len, name.s, packet->src_id);
+			continue;
+		}
+
+		lock_get(&profile->noval_rcv_counters->lock);
+		destination = find_destination(profile->noval_rcv_counters,
+			packet->src_id);
+		if (destination == NULL) {
+			lock_release(&profile->noval_rcv_counters->lock);
+			return;
+		}
+		/* the node restarted - its previous counter is gone */
+		if (destination->epoch != epoch) {
+			destination->counter = 0;
+			destination->epoch = epoch;
+		}
+		if (kind == REPL_PROF_COUNT_FULL)
+			destination->counter = value;
+		else
+			destination->counter += value;
+		destination->update = now;
+		lock_release(&profile->noval_rcv_counters->lock);
+	}
+}
+
 void receive_prof_repl(bin_packet_t *packet)
 {
 	time_t now;
@@ -1094,6 +1497,11 @@ void receive_prof_repl(bin_packet_t *packet)
 	if (!profile_repl_cluster)
 		return;
 
+	if (packet->type == REPLICATION_DLG_PROFILE_DELTA) {
+		receive_prof_delta(packet);
+		return;
+	}
+
 	if (packet->type != REPLICATION_DLG_PROFILE) {
 		LM_WARN("Invalid dialog binary packet command: %d (from node: %d in cluster: %d)\n",
 			packet->type, packet->src_id, profile_repl_cluster);
@@ -1311,6 +1719,63 @@ next_entry:
 	}
 }
 
+/* counter-only profiles send only what changed since the last run, plus
+ * a full count every half of the expire interval, which also keeps the
+ * counter alive on the other nodes and fixes any lost delta */
+static void broadcast_counter_profiles(void)
+{
+	struct dlg_profile_table *profile;
+	bin_packet_t packet;
+	time_t now;
+	int count, kind, value;
+	int sync_interval;
+	int nr = 0;
+
+	now = time(0);
+	sync_interval = repl_prof_timer_expire / 2;
+	if (sync_interval <= 0)
+		sync_interval = 1;
+
+	for (profile = profiles; profile; profile = profile->next) {
+		if (!profile->counter_only || profile->repl_type != REPL_PROTOBIN)
+			continue;
+
+		count = noval_get_local_count(profile);
+		if (now - profile->repl_sync_ts >= sync_interval) {
+			kind = REPL_PROF_COUNT_FULL;
+			value = count;
+			profile->repl_sync_ts = now;
+		} else if (count != profile->repl_sent_count) {
+			kind = REPL_PROF_COUNT_DELTA;
+			value = count - profile->repl_sent_count;
+		} else {
+			continue;
+		}
+		profile->repl_sent_count = count;
+
+		if (nr == 0) {
+			if (bin_init(&packet, &prof_repl_cap, REPLICATION_DLG_PROFILE_DELTA,
+			BIN_VERSION, 0) < 0) {
+				LM_ERR("cannot initiate bin buffer\n");
+				return;
+			}
+			bin_push_int(&packet, repl_prof_epoch);
+		}
+
+		if (bin_push_str(&packet, &profile->name) < 0 ||
+		bin_push_int(&packet, kind) < 0 || bin_push_int(&packet, value) < 0) {
+			LM_ERR("cannot add any more profiles in buffer\n");
+			break;
+		}
+		nr++;
+	}
+
+	if (nr) {
+		dlg_replicate_profiles(&packet);
+		bin_free_packet(&packet);
+	}
+}
+
 static void broadcast_profiles(utime_t ticks, void *param)
 {
 #define REPL_PROF_TRYSEND() \
@@ -1340,7 +1805,7 @@ static void broadcast_profiles(utime_t ticks, void *param)
 	}
 
 	for (profile = profiles; profile; profile = profile->next) {
-		if (profile->repl_type != REPL_PROTOBIN)
+		if (profile->repl_type != REPL_PROTOBIN || profile->counter_only)
 			continue;
 
 		count = 0;
@@ -1398,6 +1863,8 @@ done:
 	if (nr)
 		dlg_replicate_profiles(&packet);
 	bin_free_packet(&packet);
+
+	broadcast_counter_profiles();
 #undef REPL_PROF_TRYSEND
 }
 
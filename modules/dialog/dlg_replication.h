@@ -38,11 +38,17 @@
 #define REPLICATION_DLG_UPDATED		2
 #define REPLICATION_DLG_DELETED		3
 #define REPLICATION_DLG_CSEQ		4
+#define REPLICATION_DLG_BATCH		5
+
+/* default flush interval of a dialog replication batch (ms) */
+#define DLG_REPL_BATCH_TIMEOUT		10
 
 #define BIN_VERSION 2
 
 extern int dialog_repl_cluster;
 extern int profile_repl_cluster;
+extern int dlg_repl_batch_size;
+extern int dlg_repl_batch_timeout;
 
 extern str dlg_repl_cap;
 extern str prof_repl_cap;
@@ -61,6 +67,11 @@ int dlg_replicated_create(bin_packet_t *packet, struct dlg_cell *cell, str *ftag
 int dlg_replicated_update(bin_packet_t *packet);
 int dlg_replicated_delete(bin_packet_t *packet);
 
+int dlg_repl_batch_init(void);
+void dlg_repl_batch_destroy(void);
+unsigned long get_dlg_repl_batch_lag(unsigned short foo);
+unsigned long get_dlg_repl_batch_avg(unsigned short foo);
+
 void receive_dlg_repl(bin_packet_t *packet);
 void rcv_cluster_event(enum clusterer_event ev, int node_id);
 
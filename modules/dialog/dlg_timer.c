@@ -36,7 +36,7 @@ struct dlg_timer *d_timer = 0;
 dlg_timer_handler timer_hdl = 0;
 
 struct dlg_ping_timer *ping_timer=0;
-struct dlg_reinvite_ping_timer *reinvite_ping_timer=0;
+struct dlg_ping_timer *reinvite_ping_timer=0;
 str options_str=str_init("OPTIONS");
 str invite_str=str_init("INVITE");
 
@@ -50,8 +50,20 @@ extern int options_ping_interval;
  */
 #define FAKE_DIALOG_TL ((struct dlg_tl*)-1)
 
+#define dlg_timer_slot(_tick) \
+	(&d_timer->slots[(_tick) & (DLG_TIMER_WHEEL_SIZE-1)])
+#define dlg_timer_lock_idx(_tick) \
+	((_tick) & (DLG_TIMER_LOCKS-1))
+
+#define dlg_ping_slot(_timer, _dlg) \
+	(&(_timer)->slots[(_dlg)->h_entry & (DLG_PING_TIMER_SLOTS-1)])
+#define dlg_ping_lock_idx(_dlg) \
+	((_dlg)->h_entry & (DLG_PING_TIMER_SLOTS-1))
+
 int init_dlg_timer( dlg_timer_handler hdl )
 {
+	int i;
+
 	d_timer = (struct dlg_timer*)shm_malloc(sizeof(struct dlg_timer));
 	if (d_timer==0) {
 		LM_ERR("no more shm mem\n");
@@ -59,23 +71,25 @@ int init_dlg_timer( dlg_timer_handler hdl )
 	}
 	memset( d_timer, 0, sizeof(struct dlg_timer) );
 
-	d_timer->first.next = d_timer->first.prev = &(d_timer->first);
+	for (i = 0; i < DLG_TIMER_WHEEL_SIZE; i++)
+		d_timer->slots[i].first.next = d_timer->slots[i].first.prev =
+			&(d_timer->slots[i].first);
 
-	d_timer->lock = lock_alloc();
-	if (d_timer->lock==0) {
-		LM_ERR("failed to alloc lock\n");
+	d_timer->locks = lock_set_alloc(DLG_TIMER_LOCKS);
+	if (d_timer->locks==0) {
+		LM_ERR("failed to alloc lock set\n");
 		goto error0;
 	}
 
-	if (lock_init(d_timer->lock)==0) {
-		LM_ERR("failed to init lock\n");
+	if (lock_set_init(d_timer->locks)==0) {
+		LM_ERR("failed to init lock set\n");
 		goto error1;
 	}
 
 	timer_hdl = hdl;
 	return 0;
 error1:
-	lock_dealloc(d_timer->lock);
+	lock_set_dealloc(d_timer->locks);
 error0:
 	shm_free(d_timer);
 	d_timer = 0;
@@ -105,16 +119,16 @@ void debug_detached_timer_list(struct dlg_tl *detached)
 
 }
 
-/* assumed to be always called under timer lock */
-void debug_main_timer_list(void)
+/* assumed to be always called under the lock of the slot */
+void debug_main_timer_list(struct dlg_tl *first)
 {
 	struct dlg_tl *start,*finish;
 	int visited=1;
 
-	start = finish = &(d_timer->first);
+	start = finish = first;
 	LM_DBG("testing forward loop with visited = %d\n",visited);
 
-	/* check the main list is circular in both directions from start to end,
+	/* check the slot list is circular in both directions from start to end,
 	 * with no loops in the middle */
 	while (start) {
 		start->visited=visited;
@@ -130,7 +144,7 @@ void debug_main_timer_list(void)
 	}
 
 	visited++;
-	start = &(d_timer->first);
+	start = first;
 
 	LM_DBG("testing backward loop with visited = %d\n",visited);
 
@@ -150,64 +164,55 @@ void debug_main_timer_list(void)
 
 #endif
 
-int init_dlg_ping_timer(void)
+static struct dlg_ping_timer *new_ping_timer(void)
 {
-	ping_timer = (struct dlg_ping_timer*)shm_malloc(sizeof(struct dlg_timer));
-	if (ping_timer==0) {
+	struct dlg_ping_timer *timer;
+
+	timer = (struct dlg_ping_timer*)shm_malloc(sizeof(struct dlg_ping_timer));
+	if (timer==0) {
 		LM_ERR("no more shm mem\n");
-		return -1;
+		return 0;
 	}
 
-	memset(ping_timer,0,sizeof(struct dlg_ping_timer));
-	ping_timer->lock = lock_alloc();
-	if (ping_timer->lock == 0) {
-		LM_ERR("failed to alloc lock\n");
+	memset(timer,0,sizeof(struct dlg_ping_timer));
+	timer->locks = lock_set_alloc(DLG_PING_TIMER_SLOTS);
+	if (timer->locks == 0) {
+		LM_ERR("failed to alloc lock set\n");
 		goto error0;
 	}
 
-	if (lock_init(ping_timer->lock) == 0) {
-		LM_ERR("failed to init lock\n");
+	if (lock_set_init(timer->locks) == 0) {
+		LM_ERR("failed to init lock set\n");
 		goto error1;
 	}
 
-	return 0;
+	return timer;
 
 error1:
-	lock_dealloc(ping_timer->lock);
+	lock_set_dealloc(timer->locks);
 error0:
-	shm_free(ping_timer);
-	ping_timer=0;
-	return -1;
+	shm_free(timer);
+	return 0;
 }
 
-int init_dlg_reinvite_ping_timer(void)
+static void free_ping_timer(struct dlg_ping_timer *timer)
 {
-	reinvite_ping_timer = (struct dlg_reinvite_ping_timer*)shm_malloc(sizeof(struct dlg_timer));
-	if (reinvite_ping_timer==0) {
-		LM_ERR("no more shm mem\n");
-		return -1;
-	}
+	lock_set_destroy(timer->locks);
+	lock_set_dealloc(timer->locks);
 
-	memset(reinvite_ping_timer,0,sizeof(struct dlg_reinvite_ping_timer));
-	reinvite_ping_timer->lock = lock_alloc();
-	if (reinvite_ping_timer->lock == 0) {
-		LM_ERR("failed to alloc lock\n");
-		goto error0;
-	}
-
-	if (lock_init(reinvite_ping_timer->lock) == 0) {
-		LM_ERR("failed to init lock\n");
-		goto error1;
-	}
+	shm_free(timer);
+}
 
-	return 0;
+int init_dlg_ping_timer(void)
+{
+	ping_timer = new_ping_timer();
+	return ping_timer ? 0 : -1;
+}
 
-error1:
-	lock_dealloc(reinvite_ping_timer->lock);
-error0:
-	shm_free(reinvite_ping_timer);
-	reinvite_ping_timer=0;
-	return -1;
+int init_dlg_reinvite_ping_timer(void)
+{
+	reinvite_ping_timer = new_ping_timer();
+	return reinvite_ping_timer ? 0 : -1;
 }
 
 void destroy_ping_timer(void)
@@ -215,90 +220,153 @@ void destroy_ping_timer(void)
 	if (ping_timer ==0)
 		return;
 
-	lock_destroy(ping_timer->lock);
-	lock_dealloc(ping_timer->lock);
-
-	shm_free(ping_timer);
+	free_ping_timer(ping_timer);
 	ping_timer=0;
 }
 
+void destroy_reinvite_ping_timer(void)
+{
+	if (reinvite_ping_timer ==0)
+		return;
+
+	free_ping_timer(reinvite_ping_timer);
+	reinvite_ping_timer=0;
+}
+
 
 void destroy_dlg_timer(void)
 {
 	if (d_timer==0)
 		return;
 
-	lock_destroy(d_timer->lock);
-	lock_dealloc(d_timer->lock);
+	lock_set_destroy(d_timer->locks);
+	lock_set_dealloc(d_timer->locks);
 
 	shm_free(d_timer);
 	d_timer = 0;
 }
 
 
+/* locks the wheel slots of the two ticks, in a deadlock-free order */
+static inline void lock_timer_slots(unsigned int tick1, unsigned int tick2)
+{
+	unsigned int l1 = dlg_timer_lock_idx(tick1);
+	unsigned int l2 = dlg_timer_lock_idx(tick2);
+
+	if (l1 == l2) {
+		lock_set_get(d_timer->locks, l1);
+	} else if (l1 < l2) {
+		lock_set_get(d_timer->locks, l1);
+		lock_set_get(d_timer->locks, l2);
+	} else {
+		lock_set_get(d_timer->locks, l2);
+		lock_set_get(d_timer->locks, l1);
+	}
+}
 
-static inline void insert_dlg_timer_unsafe(struct dlg_tl *tl)
+static inline void unlock_timer_slots(unsigned int tick1, unsigned int tick2)
 {
-	struct dlg_tl* ptr;
+	unsigned int l1 = dlg_timer_lock_idx(tick1);
+	unsigned int l2 = dlg_timer_lock_idx(tick2);
 
-#ifdef EXTRA_DEBUG
-	debug_main_timer_list();
-#endif
+	lock_set_release(d_timer->locks, l1);
+	if (l1 != l2)
+		lock_set_release(d_timer->locks, l2);
+}
 
-	for(ptr = d_timer->first.prev; ptr != &d_timer->first ; ptr = ptr->prev) {
-		if ( ptr->timeout <= tl->timeout )
-			break;
+/* locks the wheel slot the tl is linked into; the slot of a tl is changed
+ * only with its current slot locked, so re-check it once we get the lock */
+static inline unsigned int lock_dlg_tl(struct dlg_tl *tl)
+{
+	unsigned int tick;
+
+	for (;;) {
+		tick = tl->tick;
+		lock_set_get(d_timer->locks, dlg_timer_lock_idx(tick));
+		if (tick == tl->tick)
+			return tick;
+		lock_set_release(d_timer->locks, dlg_timer_lock_idx(tick));
 	}
+}
+
+/* the slot of @tick must be locked; if the slot was already expired for
+ * this tick, returns the next tick that can still be used, otherwise 0 */
+static inline unsigned int dlg_tick_passed(unsigned int tick)
+{
+	struct dlg_timer_slot *slot = dlg_timer_slot(tick);
+
+	return (tick > slot->last_run) ? 0 : slot->last_run + 1;
+}
+
+static inline void insert_dlg_timer_unsafe(struct dlg_tl *tl,
+															unsigned int tick)
+{
+	struct dlg_tl *first = &dlg_timer_slot(tick)->first;
 
-	LM_DBG("inserting %p for %d\n", tl,tl->timeout);
-	tl->prev = ptr;
-	tl->next = ptr->next;
+#ifdef EXTRA_DEBUG
+	debug_main_timer_list(first);
+#endif
+
+	LM_DBG("inserting %p for %d in slot of tick %u\n", tl, tl->timeout, tick);
+	/* the order inside a slot does not matter, just append */
+	tl->tick = tick;
+	tl->next = first;
+	tl->prev = first->prev;
 	tl->prev->next = tl;
-	tl->next->prev = tl;
+	first->prev = tl;
 
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+	debug_main_timer_list(first);
 #endif
 }
 
 int insert_dlg_timer(struct dlg_tl *tl, int interval)
 {
-	lock_get( d_timer->lock);
+	unsigned int timeout, tick, next_tick;
+
+	tick = timeout = get_ticks()+interval;
+	for (;;) {
+		lock_set_get( d_timer->locks, dlg_timer_lock_idx(tick));
+		if ((next_tick = dlg_tick_passed(tick)) == 0)
+			break;
+		lock_set_release( d_timer->locks, dlg_timer_lock_idx(tick));
+		tick = next_tick;
+	}
 
 	if (tl->next!=0 || tl->prev!=0) {
-		lock_release( d_timer->lock);
+		lock_set_release( d_timer->locks, dlg_timer_lock_idx(tick));
 		LM_CRIT("Trying to insert a bogus dlg tl=%p tl->next=%p tl->prev=%p\n",
 			tl, tl->next, tl->prev);
 		return -1;
 	}
-	tl->timeout = get_ticks()+interval;
+	tl->timeout = timeout;
 
-	insert_dlg_timer_unsafe( tl );
+	insert_dlg_timer_unsafe( tl, tick );
 
-	lock_release( d_timer->lock);
+	lock_set_release( d_timer->locks, dlg_timer_lock_idx(tick));
 
 	return 0;
 }
 
-void unsafe_insert_ping_timer(struct dlg_ping_list *node,int new_timeout)
+/* the ping intervals are fixed, so the new node is almost always the
+ * last one - the lookup is kept only as a safety net */
+static void unsafe_insert_ping_timer(struct dlg_ping_slot *slot,
+							struct dlg_ping_list *node,int new_timeout)
 {
 	struct dlg_ping_list *it;
 
 	node->timeout = get_ticks() + new_timeout;
 
-	if (ping_timer->first == 0) {
-		ping_timer->first = node;
-		ping_timer->last = node;
+	if (slot->first == 0) {
+		slot->first = node;
+		slot->last = node;
 	} else {
-		/* quick optimisation, always check if our timeout is bigger than last
-		if not, lookup our position, might be useful in the future if we want
-		to set different ping intervals per dialog */
-		if (node->timeout >= ping_timer->last->timeout) {
-			node->prev = ping_timer->last;
-			ping_timer->last->next = node;
-			ping_timer->last = node;
+		if (node->timeout >= slot->last->timeout) {
+			node->prev = slot->last;
+			slot->last->next = node;
+			slot->last = node;
 		} else {
-			for (it=ping_timer->first;it;it=it->next) {
+			for (it=slot->first;it;it=it->next) {
 				if (it->timeout >= node->timeout)
 					break;
 			}
@@ -307,16 +375,19 @@ void unsafe_insert_ping_timer(struct dlg_ping_list *node,int new_timeout)
 			if (it == NULL) {
 				/* we're going to be the last node 
 				should never get here due to the above optimisation ... paranoia */
-				node->prev = ping_timer->last;
-				ping_timer->last->next = node;
-				ping_timer->last = node;
+				node->prev = slot->last;
+				slot->last->next = node;
+				slot->last = node;
+			} else if (it->prev == NULL) {
+				node->next = it;
+				it->prev = node;
+				slot->first = node;
 			} else {
 				it->prev->next=node;
 				node->prev = it->prev;
 				node->next = it;
 				it->prev = node;
 			}
-
 		}
 	}
 }
@@ -335,60 +406,21 @@ int insert_ping_timer(struct dlg_cell* dlg)
 	node->next = 0;
 	node->prev = 0;
 
-	lock_get( ping_timer->lock );
+	lock_set_get( ping_timer->locks, dlg_ping_lock_idx(dlg));
 
-	unsafe_insert_ping_timer(node,options_ping_interval);
+	unsafe_insert_ping_timer(dlg_ping_slot(ping_timer, dlg),
+		node, options_ping_interval);
 	dlg->pl = node;
 
 	dlg->legs[DLG_CALLER_LEG].reply_received = DLG_PING_SUCCESS;
 	dlg->legs[callee_idx(dlg)].reply_received = DLG_PING_SUCCESS;
 
-	lock_release( ping_timer->lock);
+	lock_set_release( ping_timer->locks, dlg_ping_lock_idx(dlg));
 	LM_DBG("Inserted dlg [%p] in ping timer list\n",dlg);
 
 	return 0;
 }
 
-void unsafe_insert_reinvite_ping_timer(struct dlg_ping_list *node,int new_timeout)
-{
-	struct dlg_ping_list *it;
-
-	node->timeout = get_ticks() + new_timeout;
-
-	if (reinvite_ping_timer->first == 0) {
-		reinvite_ping_timer->first = node;
-		reinvite_ping_timer->last = node;
-	} else {
-		/* quick optimisation, always check if our timeout is bigger than last
-		if not, lookup our position, might be useful in the future if we want
-		to set different ping intervals per dialog */
-		if (node->timeout >= reinvite_ping_timer->last->timeout) {
-			node->prev = reinvite_ping_timer->last;
-			reinvite_ping_timer->last->next = node;
-			reinvite_ping_timer->last = node;
-		} else {
-			for (it=reinvite_ping_timer->first;it;it=it->next) {
-				if (it->timeout >= node->timeout)
-					break;
-			}
-
-			/* we need to insert ourselves before the found node */
-			if (it == NULL) {
-				/* we're going to be the last node 
-				should never get here due to the above optimisation ... paranoia */
-				node->prev = reinvite_ping_timer->last;
-				reinvite_ping_timer->last->next = node;
-				reinvite_ping_timer->last = node;
-			} else {
-				it->prev->next=node;
-				node->prev = it->prev;
-				node->next = it;
-				it->prev = node;
-			}
-		}
-	}
-}
-
 int insert_reinvite_ping_timer(struct dlg_cell* dlg)
 {
 	struct dlg_ping_list *node;
@@ -403,15 +435,16 @@ int insert_reinvite_ping_timer(struct dlg_cell* dlg)
 	node->next = 0;
 	node->prev = 0;
 
-	lock_get( reinvite_ping_timer->lock );
+	lock_set_get( reinvite_ping_timer->locks, dlg_ping_lock_idx(dlg));
 
-	unsafe_insert_reinvite_ping_timer(node,reinvite_ping_interval);
+	unsafe_insert_ping_timer(dlg_ping_slot(reinvite_ping_timer, dlg),
+		node, reinvite_ping_interval);
 	dlg->reinvite_pl = node;
 
 	dlg->legs[DLG_CALLER_LEG].reinvite_confirmed = DLG_PING_SUCCESS;
 	dlg->legs[callee_idx(dlg)].reinvite_confirmed = DLG_PING_SUCCESS;
 
-	lock_release( reinvite_ping_timer->lock);
+	lock_set_release( reinvite_ping_timer->locks, dlg_ping_lock_idx(dlg));
 	LM_DBG("Inserted dlg [%p] in reinvite ping timer list\n",dlg);
 
 	return 0;
@@ -420,14 +453,14 @@ int insert_reinvite_ping_timer(struct dlg_cell* dlg)
 static inline void remove_dlg_timer_unsafe(struct dlg_tl *tl)
 {
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+	debug_main_timer_list(&dlg_timer_slot(tl->tick)->first);
 #endif
 
 	tl->prev->next = tl->next;
 	tl->next->prev = tl->prev;
 
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+	debug_main_timer_list(&dlg_timer_slot(tl->tick)->first);
 #endif
 }
 
@@ -440,20 +473,22 @@ static inline void remove_dlg_timer_unsafe(struct dlg_tl *tl)
  */
 int remove_dlg_timer(struct dlg_tl *tl)
 {
-	lock_get( d_timer->lock);
+	unsigned int tick;
+
+	tick = lock_dlg_tl(tl);
 
 	if (tl->prev==NULL && tl->timeout==0) {
 		/* dialog is not in timer list; either it is completly removed
 		   (prev=next=timeout=0), either is in process by timeout routine
 		   (prev=timeout=0;next!=0) */
-		lock_release( d_timer->lock);
+		lock_set_release( d_timer->locks, dlg_timer_lock_idx(tick));
 		return 1;
 	}
 
 	if (tl->prev==NULL || tl->next==NULL || tl->next == FAKE_DIALOG_TL) {
 		LM_CRIT("bogus tl=%p tl->prev=%p tl->next=%p\n",
 			tl, tl->prev, tl->next);
-		lock_release( d_timer->lock);
+		lock_set_release( d_timer->locks, dlg_timer_lock_idx(tick));
 		return -1;
 	}
 
@@ -463,11 +498,12 @@ int remove_dlg_timer(struct dlg_tl *tl)
 	tl->prev = NULL;
 	tl->timeout = 0;
 
-	lock_release( d_timer->lock);
+	lock_set_release( d_timer->locks, dlg_timer_lock_idx(tick));
 	return 0;
 }
 
-static inline void detach_ping_node_unsafe(struct dlg_ping_list *it,int reinvite)
+static inline void detach_ping_node_unsafe(struct dlg_ping_slot *slot,
+														struct dlg_ping_list *it)
 {
 	if (it->next && it->prev) {
 		it->prev->next = it->next;
@@ -475,24 +511,13 @@ static inline void detach_ping_node_unsafe(struct dlg_ping_list *it,int reinvite
 	}
 	else if (it->next) {
 		it->next->prev = 0;
-		if (reinvite)
-			reinvite_ping_timer->first = it->next;
-		else
-			ping_timer->first = it->next;
+		slot->first = it->next;
 	} else if (it->prev) {
 		it->prev->next = 0;
-		if (reinvite)
-			reinvite_ping_timer->last = it->prev;
-		else
-			ping_timer->last = it->prev;
+		slot->last = it->prev;
 	} else {
-		if (reinvite) {
-			reinvite_ping_timer->first = 0;
-			reinvite_ping_timer->last = 0;
-		} else {
-			ping_timer->first = 0;
-			ping_timer->last = 0;
-		}
+		slot->first = 0;
+		slot->last = 0;
 	}
 
 	it->next = it->prev = 0;
@@ -504,19 +529,33 @@ static inline void detach_ping_node_unsafe(struct dlg_ping_list *it,int reinvite
     -1 - failure (dialog is expired, so it cannot be added again) */
 int update_dlg_timer( struct dlg_tl *tl, int timeout )
 {
+	unsigned int old_tick, tick, next_tick, new_timeout;
 	int ret;
 
-	lock_get( d_timer->lock);
+	tick = new_timeout = get_ticks()+timeout;
+	for (;;) {
+		/* moving the tl between slots requires both slots locked */
+		old_tick = tl->tick;
+		lock_timer_slots(old_tick, tick);
+		if (old_tick != tl->tick) {
+			unlock_timer_slots(old_tick, tick);
+			continue;
+		}
+		if ((next_tick = dlg_tick_passed(tick)) == 0)
+			break;
+		unlock_timer_slots(old_tick, tick);
+		tick = next_tick;
+	}
 
 	if ( tl->next == FAKE_DIALOG_TL ) {
 		/* previously removed from timer list - we will not add it again */
-		lock_release( d_timer->lock);
+		unlock_timer_slots(old_tick, tick);
 		return 0;
 	}
 
 	if ( tl->next ) {
 		if (tl->prev==0) {
-			lock_release( d_timer->lock);
+			unlock_timer_slots(old_tick, tick);
 			return -1;
 		}
 		remove_dlg_timer_unsafe(tl);
@@ -525,61 +564,66 @@ int update_dlg_timer( struct dlg_tl *tl, int timeout )
 		ret = 1;
 	}
 
-	tl->timeout = get_ticks()+timeout;
-	insert_dlg_timer_unsafe( tl );
+	tl->timeout = new_timeout;
+	insert_dlg_timer_unsafe( tl, tick );
 
-	lock_release( d_timer->lock);
+	unlock_timer_slots(old_tick, tick);
 	return ret;
 }
 
+/* expires the wheel slots up to @time and returns the expired entries
+ * chained through the next link and terminated by FAKE_DIALOG_TL */
 static inline struct dlg_tl* get_expired_dlgs(unsigned int time)
 {
-	struct dlg_tl *tl , *end, *ret;
+	struct dlg_timer_slot *slot;
+	struct dlg_tl *tl, *next, *ret, *last;
+	unsigned int tick;
 
-	lock_get( d_timer->lock);
-
-	if (d_timer->first.next==&(d_timer->first)
-	|| d_timer->first.next->timeout > time ) {
-		lock_release( d_timer->lock);
+	tick = d_timer->last_tick;
+	if (time <= tick)
 		return FAKE_DIALOG_TL;
-	}
 
-#ifdef EXTRA_DEBUG
-	debug_main_timer_list();
-#endif
+	/* no need to walk the wheel more than once */
+	if (time - tick > DLG_TIMER_WHEEL_SIZE)
+		tick = time - DLG_TIMER_WHEEL_SIZE;
 
-	end = &d_timer->first;
-	tl = d_timer->first.next;
-	LM_DBG("start with tl=%p tl->prev=%p tl->next=%p (%d) at %d "
-		"and end with end=%p end->prev=%p end->next=%p\n",
-		tl,tl->prev,tl->next,tl->timeout,time,
-		end,end->prev,end->next);
-	while( tl!=end && tl->timeout <= time) {
-		LM_DBG("getting tl=%p tl->prev=%p tl->next=%p with %d\n",
-			tl,tl->prev,tl->next,tl->timeout);
-		tl->prev = 0;
-		tl->timeout = 0;
-		tl=tl->next;
-	}
-	LM_DBG("end with tl=%p tl->prev=%p tl->next=%p and "
-		"d_timer->first.next->prev=%p\n",
-		tl,tl->prev,tl->next,d_timer->first.next->prev);
+	ret = FAKE_DIALOG_TL;
+	last = NULL;
 
-	if (tl==end && d_timer->first.next->prev) {
-		LM_DBG("no dialog to return\n");
-		ret = FAKE_DIALOG_TL;
-	} else {
-		ret = d_timer->first.next;
-		tl->prev->next = FAKE_DIALOG_TL;
-		d_timer->first.next = tl;
-		tl->prev = &d_timer->first;
-	}
+	for (tick++; tick <= time; tick++) {
+		slot = dlg_timer_slot(tick);
+
+		lock_set_get( d_timer->locks, dlg_timer_lock_idx(tick));
 
 #ifdef EXTRA_DEBUG
-	debug_main_timer_list();
+		debug_main_timer_list(&slot->first);
 #endif
 
-	lock_release( d_timer->lock);
+		for (tl = slot->first.next; tl != &slot->first; tl = next) {
+			next = tl->next;
+			/* entries due in a later turn of the wheel stay here */
+			if (tl->timeout > time)
+				continue;
+
+			LM_DBG("getting tl=%p tl->prev=%p tl->next=%p with %d\n",
+				tl,tl->prev,tl->next,tl->timeout);
+			remove_dlg_timer_unsafe(tl);
+			tl->prev = 0;
+			tl->timeout = 0;
+			tl->next = FAKE_DIALOG_TL;
+			if (last)
+				last->next = tl;
+			else
+				ret = tl;
+			last = tl;
+		}
+
+		slot->last_run = tick;
+
+		lock_set_release( d_timer->locks, dlg_timer_lock_idx(tick));
+	}
+
+	d_timer->last_tick = time;
 
 #ifdef EXTRA_DEBUG
 	debug_detached_timer_list(ret);
@@ -603,21 +647,17 @@ void dlg_timer_routine(unsigned int ticks , void * attr)
 	}
 }
 
-/* removes expired dlgs from main ping_timer list
+/* removes expired dlgs from a ping_timer slot
  * and links them back into a new list */
-void get_timeout_dlgs(struct dlg_ping_list **expired,
+static void get_timeout_dlgs(struct dlg_ping_slot *slot,
+		struct dlg_ping_list **expired,
 		struct dlg_ping_list **to_be_deleted,int reinvite)
 {
 	struct dlg_ping_list *exp = NULL,*del=NULL,*it=NULL,*next=NULL;
 	struct dlg_cell *current;
 	int detached;
 
-	if (reinvite)
-		lock_get(reinvite_ping_timer->lock);
-	else
-		lock_get(ping_timer->lock);
-
-	for (it=reinvite?reinvite_ping_timer->first:ping_timer->first;it;it=next) {
+	for (it=slot->first;it;it=next) {
 		/* FIXME - optimisation needed here : only iterate on the nodes that we need to
 		eg. where pinging is in progress */
 
@@ -628,7 +668,7 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 		if (current->state == DLG_STATE_DELETED) {
 			/* the dialog has terminated - we remove it as well
 			 * since we also have a ref */
-			detach_ping_node_unsafe(it,reinvite);
+			detach_ping_node_unsafe(slot,it);
 			if (reinvite)
 				it->dlg->reinvite_pl = 0;
 			else
@@ -648,7 +688,7 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 		(current->flags & DLG_FLAG_PING_CALLER)) {
 			if (reinvite?(current->legs[DLG_CALLER_LEG].reinvite_confirmed == DLG_PING_FAIL):
 			(current->legs[DLG_CALLER_LEG].reply_received == DLG_PING_FAIL)) {
-				detach_ping_node_unsafe(it,reinvite);
+				detach_ping_node_unsafe(slot,it);
 				detached=1;
 
 				if (reinvite)
@@ -670,7 +710,7 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 			(current->flags & DLG_FLAG_PING_CALLEE)) {
 				if (reinvite?(current->legs[callee_idx(current)].reinvite_confirmed == DLG_PING_FAIL):
 				current->legs[callee_idx(current)].reply_received == DLG_PING_FAIL) {
-					detach_ping_node_unsafe(it,reinvite);
+					detach_ping_node_unsafe(slot,it);
 					if (reinvite)
 						it->dlg->reinvite_pl = 0;
 					else
@@ -688,11 +728,6 @@ void get_timeout_dlgs(struct dlg_ping_list **expired,
 		}
 	}
 
-	if (reinvite)
-		lock_release(reinvite_ping_timer->lock);
-	else
-		lock_release(ping_timer->lock);
-
 	*to_be_deleted = del;
 	*expired = exp;
 }
@@ -842,13 +877,16 @@ void unref_dlg_cb(void *dlg)
 	unref_dlg_destroy_safe((struct dlg_cell*)dlg,1);
 }
 
-void dlg_options_routine(unsigned int ticks , void * attr)
+static void dlg_options_ping_slot(int idx)
 {
+	struct dlg_ping_slot *slot = &ping_timer->slots[idx];
 	struct dlg_ping_list *expired,*to_be_deleted,*it,*curr,*next;
 	struct dlg_cell *dlg;
 	int current_ticks;
 
-	get_timeout_dlgs(&expired,&to_be_deleted,0);
+	lock_set_get(ping_timer->locks, idx);
+	get_timeout_dlgs(slot,&expired,&to_be_deleted,0);
+	lock_set_release(ping_timer->locks, idx);
 
 	it = expired;
 	while (it) {
@@ -882,10 +920,10 @@ void dlg_options_routine(unsigned int ticks , void * attr)
 	tcp_no_new_conn = 1;
 
 	current_ticks = get_ticks();
-	/* ping_timer->first now contains all active dialogs
+	/* slot->first now contains all active dialogs
 	ping all dialogs with a lower timeout than now */
-	lock_get(ping_timer->lock);
-	it = ping_timer->first;
+	lock_set_get(ping_timer->locks, idx);
+	it = slot->first;
 	while (it) {
 		/* iterated across all the nodes that need pinging now */
 		if (it->timeout > current_ticks)
@@ -924,26 +962,39 @@ void dlg_options_routine(unsigned int ticks , void * attr)
 			}
 
 			/* we've pinged, now update the timeout & move the entry further down the list */
-			detach_ping_node_unsafe(it,0);
-			unsafe_insert_ping_timer(it,options_ping_interval);
+			detach_ping_node_unsafe(slot,it);
+			unsafe_insert_ping_timer(slot,it,options_ping_interval);
 		}
 		it = next;
 	}
 
-	lock_release(ping_timer->lock);
+	lock_set_release(ping_timer->locks, idx);
 	tcp_no_new_conn = 0;
 }
 
-void dlg_reinvite_routine(unsigned int ticks , void * attr)
+void dlg_options_routine(unsigned int ticks , void * attr)
+{
+	int i;
+
+	/* the slots are locked one by one, so pinging does not block
+	 * the dialogs hashed in the other slots */
+	for (i = 0; i < DLG_PING_TIMER_SLOTS; i++)
+		dlg_options_ping_slot(i);
+}
+
+static void dlg_reinvite_ping_slot(int idx)
 {
 	static str content_type = str_init("application/sdp");
+	struct dlg_ping_slot *slot = &reinvite_ping_timer->slots[idx];
 	struct dlg_ping_list *expired,*to_be_deleted,*it,*curr,*next;
 	struct dlg_cell *dlg;
 	str extra_headers;
 	str *sdp;
 	int current_ticks;
 
-	get_timeout_dlgs(&expired,&to_be_deleted,1);
+	lock_set_get(reinvite_ping_timer->locks, idx);
+	get_timeout_dlgs(slot,&expired,&to_be_deleted,1);
+	lock_set_release(reinvite_ping_timer->locks, idx);
 
 	it = expired;
 	while (it) {
@@ -977,10 +1028,10 @@ void dlg_reinvite_routine(unsigned int ticks , void * attr)
 	tcp_no_new_conn = 1;
 
 	current_ticks = get_ticks();
-	/* reinvite_ping_timer->first now contains all active dialogs
+	/* slot->first now contains all active dialogs
 	ping all dialogs with a lower timeout than now */
-	lock_get(reinvite_ping_timer->lock);
-	it = reinvite_ping_timer->first;
+	lock_set_get(reinvite_ping_timer->locks, idx);
+	it = slot->first;
 	while (it) {
 		/* iterated across all the nodes that need pinging now */
 		if (it->timeout > current_ticks)
@@ -1046,12 +1097,20 @@ void dlg_reinvite_routine(unsigned int ticks , void * attr)
 			}
 
 			/* we've pinged, now update the timeout & move the entry further down the list */
-			detach_ping_node_unsafe(it,1);
-			unsafe_insert_reinvite_ping_timer(it,reinvite_ping_interval);
+			detach_ping_node_unsafe(slot,it);
+			unsafe_insert_ping_timer(slot,it,reinvite_ping_interval);
 		}
 		it = next;
 	}
 
-	lock_release(reinvite_ping_timer->lock);
+	lock_set_release(reinvite_ping_timer->locks, idx);
 	tcp_no_new_conn = 0;
 }
+
+void dlg_reinvite_routine(unsigned int ticks , void * attr)
+{
+	int i;
+
+	for (i = 0; i < DLG_PING_TIMER_SLOTS; i++)
+		dlg_reinvite_ping_slot(i);
+}
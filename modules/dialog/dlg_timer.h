@@ -30,6 +30,16 @@
 #include "../../locking.h"
 
 
+/* number of slots in the dialog timer wheel (must be a power of 2); one
+ * slot is expired per tick, so a full wheel turn is DLG_TIMER_WHEEL_SIZE
+ * seconds - longer timeouts simply stay in their slot for more turns */
+#define DLG_TIMER_WHEEL_SIZE  (1<<12)
+/* number of locks shared by the wheel slots (must be a power of 2, not
+ * bigger than DLG_TIMER_WHEEL_SIZE) */
+#define DLG_TIMER_LOCKS       (1<<6)
+/* number of independently locked ping lists (must be a power of 2) */
+#define DLG_PING_TIMER_SLOTS  (1<<5)
+
 struct dlg_tl
 {
 	struct dlg_tl     *next;
@@ -38,13 +48,24 @@ struct dlg_tl
 	int visited;
 #endif
 	volatile unsigned int  timeout;
+	/* the tick of the wheel slot the entry is linked into */
+	volatile unsigned int  tick;
 };
 
 
-struct  dlg_timer
+struct dlg_timer_slot
 {
 	struct dlg_tl   first;
-	gen_lock_t      *lock;
+	/* last tick this slot was expired for */
+	unsigned int    last_run;
+};
+
+struct  dlg_timer
+{
+	struct dlg_timer_slot  slots[DLG_TIMER_WHEEL_SIZE];
+	/* last tick processed by the timer routine */
+	unsigned int           last_tick;
+	gen_lock_set_t         *locks;
 };
 
 struct dlg_ping_list
@@ -55,18 +76,16 @@ struct dlg_ping_list
 	struct dlg_ping_list *prev;
 };
 
-struct dlg_ping_timer
+struct dlg_ping_slot
 {
 	struct dlg_ping_list *first;
 	struct dlg_ping_list *last;
-	gen_lock_t *lock;
 };
 
-struct dlg_reinvite_ping_timer
+struct dlg_ping_timer
 {
-	struct dlg_ping_list *first;
-	struct dlg_ping_list *last;
-	gen_lock_t *lock;
+	struct dlg_ping_slot slots[DLG_PING_TIMER_SLOTS];
+	gen_lock_set_t *locks;
 };
 
 typedef void (*dlg_timer_handler)(struct dlg_tl *);
@@ -81,6 +100,8 @@ void destroy_dlg_timer();
 
 void destroy_ping_timer();
 
+void destroy_reinvite_ping_timer();
+
 int insert_dlg_timer(struct dlg_tl *tl, int interval);
 
 int insert_ping_timer(struct dlg_cell *dlg);
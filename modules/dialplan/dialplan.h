@@ -39,6 +39,11 @@
 #define DP_CASE_INSENSITIVE		1
 #define DP_INDEX_HASH_SIZE		16
 
+/* max length of the literal prefixes indexed for the regexp rules */
+#define DP_REGEX_PREFIX_MAX		32
+/* max number of prefixes a regexp rule may expand to (optional chars) */
+#define DP_REGEX_PREFIX_VARIANTS	8
+
 typedef struct dpl_node{
 	int dpid;
 	int table_id; /*choose between matching regexp/strings with same priority*/
@@ -63,10 +68,30 @@ typedef struct dpl_index{
 
 }dpl_index_t, *dpl_index_p;
 
+/* node of the automaton built over the literal prefixes of the regexp
+   rules - kids and siblings are indexes in the nodes array (0 = none) */
+typedef struct dpl_regex_node{
+	unsigned char c;
+	int kids;
+	int next;
+	int slots, slots_no; /*rules (ascending indexes) having this prefix*/
+}dpl_regex_node_t;
+
+/* the regexp bucket, indexed by the literal prefix each rule requires;
+   the root holds the rules without such a prefix */
+typedef struct dpl_regex_idx{
+	dpl_node_t ** rules; /*regexp rules, in priority order*/
+	int rules_no;
+	dpl_regex_node_t * nodes;
+	int nodes_no;
+	int * slots;
+}dpl_regex_idx_t, *dpl_regex_idx_p;
+
 /*For every DPID*/
 typedef struct dpl_id{
 	int dp_id;
 	dpl_index_t* rule_hash;/*fast access :string rules are hashed*/
+	dpl_regex_idx_t* regex_idx;/*prefix index of the regexp bucket*/
 	struct dpl_id * next;
 }dpl_id_t,*dpl_id_p;
 
@@ -114,6 +139,7 @@ int dp_load_all_db(void);
 void dp_disconnect_all_db(void);
 
 dpl_id_p select_dpid(dp_connection_list_p table, int id, int index);
+int build_regex_idx(dpl_id_p idp);
 
 struct subst_expr* repl_exp_parse(str subst);
 void repl_expr_free(struct subst_expr *se);
@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "../../dprint.h"
 #include "../../ut.h"
@@ -248,6 +249,7 @@ int dp_load_db(dp_connection_list_p dp_conn)
 	db_val_t cond_val[1];
 
 	dpl_node_t *rule;
+	dpl_id_p idp;
 	int no_rows = 10;
 
 
@@ -345,7 +347,12 @@ int dp_load_db(dp_connection_list_p dp_conn)
 
 
 end:
-
+	/* index the regexp buckets; if this fails, the rules of that dpid
+	 * are simply matched one by one */
+	for (idp = dp_conn->hash[dp_conn->next_index]; idp; idp = idp->next)
+		if (build_regex_idx(idp) != 0)
+			LM_WARN("failed to index the regexp rules of dpid %d\n",
+				idp->dp_id);
 
 	/*update data*/
 	lock_start_write( dp_conn->ref_lock );
@@ -670,6 +677,239 @@ err:
 }
 
 
+/* fills in the literal prefixes any input matching the rule must start
+ * with (an optional char doubles them) and returns their number, or 0 if
+ * the expression is not anchored to such a prefix */
+static int regex_prefixes(dpl_node_t *rule,
+		char pref[DP_REGEX_PREFIX_VARIANTS][DP_REGEX_PREFIX_MAX], int *len)
+{
+	char *p, *end, *next, c;
+	int i, n, depth;
+
+	p = rule->match_exp.s;
+	end = p + rule->match_exp.len;
+	if (p == end || *p != '^')
+		return 0;
+
+	/* a top-level alternative would not be bound to our prefix */
+	for (depth = 0; p < end; p++) {
+		if (*p == '\\') {
+			if (++p < end && *p == 'Q')
+				return 0;
+		} else if (*p == '[') {
+			/* skip the class, a leading ']' being a literal */
+			if (++p < end && *p == '^')
+				p++;
+			if (p < end && *p == ']')
+				p++;
+			for (; p < end && *p != ']'; p++) {
+				if (*p == '\\') {
+					p++;
+				} else if (*p == '[' && p + 1 < end && p[1] == ':') {
+					for (p += 2; p + 1 < end && (*p != ':' || p[1] != ']'); p++) ;
+					p++;
+				}
+			}
+		} else if (*p == '(') {
+			depth++;
+		} else if (*p == ')') {
+			depth--;
+		} else if (*p == '|' && depth == 0) {
+			return 0;
+		}
+	}
+
+	n = 1;
+	len[0] = 0;
+	for (p = rule->match_exp.s + 1; p < end; p = next) {
+		if (*p == '\\') {
+			if (p + 1 == end || isalnum((int)p[1]))
+				break;
+			c = p[1];
+			next = p + 2;
+		} else {
+			if (strchr(".[](){}|*+?^$", *p))
+				break;
+			c = *p;
+			next = p + 1;
+		}
+
+		if ((rule->match_flags & DP_CASE_INSENSITIVE) && isalpha((int)c))
+			break;
+
+		for (i = 0; i < n; i++)
+			if (len[i] == DP_REGEX_PREFIX_MAX)
+				return n;
+
+		if (next < end && (*next == '*' || *next == '+' || *next == '{'))
+			break;
+
+		if (next < end && *next == '?') {
+			if (2 * n > DP_REGEX_PREFIX_VARIANTS)
+				break;
+
+			for (i = 0; i < n; i++) {
+				memcpy(pref[n + i], pref[i], len[i]);
+				len[n + i] = len[i];
+			}
+			n *= 2;
+
+			next++;
+			if (next < end && (*next == '?' || *next == '+'))
+				next++;
+
+			for (i = 0; i < n / 2; i++)
+				pref[i][len[i]++] = c;
+		} else {
+			for (i = 0; i < n; i++)
+				pref[i][len[i]++] = c;
+		}
+	}
+
+	return n;
+}
+
+static int regex_idx_kid(dpl_regex_node_t **nodes, int *nodes_no,
+		int *nodes_size, int node, unsigned char c)
+{
+	dpl_regex_node_t *new_nodes;
+	int kid;
+
+	for (kid = (*nodes)[node].kids; kid; kid = (*nodes)[kid].next)
+		if ((*nodes)[kid].c == c)
+			return kid;
+
+	if (*nodes_no == *nodes_size) {
+		new_nodes = pkg_realloc(*nodes, 2 * *nodes_size * sizeof **nodes);
+		if (!new_nodes) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		*nodes = new_nodes;
+		*nodes_size *= 2;
+	}
+
+	kid = (*nodes_no)++;
+	memset(&(*nodes)[kid], 0, sizeof **nodes);
+	(*nodes)[kid].c = c;
+	(*nodes)[kid].next = (*nodes)[node].kids;
+	(*nodes)[node].kids = kid;
+
+	return kid;
+}
+
+/* builds an automaton over the literal prefixes of the regexp rules, so
+ * only the rules a given input may match are run, in priority order */
+int build_regex_idx(dpl_id_p idp)
+{
+	char pref[DP_REGEX_PREFIX_VARIANTS][DP_REGEX_PREFIX_MAX];
+	int len[DP_REGEX_PREFIX_VARIANTS];
+	dpl_regex_node_t *nodes = NULL;
+	int (*pairs)[2] = NULL, (*new_pairs)[2];
+	int nodes_no = 1, nodes_size = 64, pairs_no = 0, pairs_size = 64;
+	dpl_regex_idx_p ri;
+	dpl_node_p rulep;
+	int i, j, k, n, rules_no, node;
+
+	idp->regex_idx = NULL;
+
+	for (rules_no = 0, rulep = idp->rule_hash[DP_INDEX_HASH_SIZE].first_rule;
+		rulep; rulep = rulep->next, rules_no++) ;
+	if (rules_no == 0)
+		return 0;
+
+	nodes = pkg_malloc(nodes_size * sizeof *nodes);
+	pairs = pkg_malloc(pairs_size * sizeof *pairs);
+	if (!nodes || !pairs) {
+		LM_ERR("no more pkg memory\n");
+		goto error;
+	}
+	memset(&nodes[0], 0, sizeof *nodes);
+
+	for (i = 0, rulep = idp->rule_hash[DP_INDEX_HASH_SIZE].first_rule;
+	rulep; rulep = rulep->next, i++) {
+		n = regex_prefixes(rulep, pref, len);
+		if (n == 0) {
+			len[0] = 0;
+			n = 1;
+		}
+
+		for (j = 0; j < n; j++) {
+			for (node = 0, k = 0; k < len[j] && node >= 0; k++)
+				node = regex_idx_kid(&nodes, &nodes_no, &nodes_size, node,
+					(unsigned char)pref[j][k]);
+			if (node < 0)
+				goto error;
+
+			/* the same prefix may result from several variants */
+			for (k = pairs_no - 1; k >= 0 && pairs[k][1] == i; k--)
+				if (pairs[k][0] == node)
+					break;
+			if (k >= 0 && pairs[k][1] == i)
+				continue;
+
+			if (pairs_no == pairs_size) {
+				new_pairs = pkg_realloc(pairs, 2 * pairs_size * sizeof *pairs);
+				if (!new_pairs) {
+					LM_ERR("no more pkg memory\n");
+					goto error;
+				}
+				pairs = new_pairs;
+				pairs_size *= 2;
+			}
+			pairs[pairs_no][0] = node;
+			pairs[pairs_no++][1] = i;
+			nodes[node].slots_no++;
+		}
+	}
+
+	ri = shm_malloc(sizeof *ri + rules_no * sizeof *ri->rules +
+		nodes_no * sizeof *ri->nodes + pairs_no * sizeof *ri->slots);
+	if (!ri) {
+		LM_ERR("out of shm memory (regex_idx)\n");
+		goto error;
+	}
+
+	ri->rules = (dpl_node_t **)(ri + 1);
+	ri->rules_no = rules_no;
+	ri->nodes = (dpl_regex_node_t *)(ri->rules + rules_no);
+	ri->nodes_no = nodes_no;
+	ri->slots = (int *)(ri->nodes + nodes_no);
+
+	for (i = 0, rulep = idp->rule_hash[DP_INDEX_HASH_SIZE].first_rule;
+		rulep; rulep = rulep->next)
+		ri->rules[i++] = rulep;
+
+	for (i = 0, k = 0; i < nodes_no; i++) {
+		nodes[i].slots = k;
+		k += nodes[i].slots_no;
+		nodes[i].slots_no = 0;
+	}
+
+	/* the pairs are sorted by rule, so are the slots of each node */
+	for (i = 0; i < pairs_no; i++) {
+		node = pairs[i][0];
+		ri->slots[nodes[node].slots + nodes[node].slots_no++] = pairs[i][1];
+	}
+	memcpy(ri->nodes, nodes, nodes_no * sizeof *nodes);
+
+	LM_DBG("dpid %d: indexed %d regexp rules (%d unprefixed) in %d nodes\n",
+		idp->dp_id, rules_no, nodes[0].slots_no, nodes_no);
+
+	pkg_free(nodes);
+	pkg_free(pairs);
+	idp->regex_idx = ri;
+	return 0;
+
+error:
+	if (nodes)
+		pkg_free(nodes);
+	if (pairs)
+		pkg_free(pairs);
+	return -1;
+}
+
+
 void destroy_hash(dpl_id_t **rules_hash)
 {
 	dpl_id_p crt_idp;
@@ -697,6 +937,8 @@ void destroy_hash(dpl_id_t **rules_hash)
 		}
 		*rules_hash = crt_idp->next;
 
+		if (crt_idp->regex_idx)
+			shm_free(crt_idp->regex_idx);
 		shm_free(crt_idp);
 		crt_idp = NULL;
 	}
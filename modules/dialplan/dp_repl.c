@@ -360,6 +360,56 @@ static inline int check_time(tmrec_t *time_rec) {
 	return 1;
 }
 
+/* walks the input through the prefix automaton, then tries, in priority
+ * order, only the rules whose literal prefix (if any) the input starts with */
+static dpl_node_p match_regex_idx(dpl_regex_idx_p ri, str input)
+{
+	int path[DP_REGEX_PREFIX_MAX + 1], crt[DP_REGEX_PREFIX_MAX + 1];
+	int i, best, depth, node, kid;
+	dpl_node_p rulep;
+
+	path[0] = node = 0;
+	for (depth = 1; depth <= input.len && depth <= DP_REGEX_PREFIX_MAX;
+	depth++) {
+		for (kid = ri->nodes[node].kids;
+			kid && ri->nodes[kid].c != (unsigned char)input.s[depth - 1];
+			kid = ri->nodes[kid].next) ;
+		if (!kid)
+			break;
+		path[depth] = node = kid;
+	}
+
+	for (i = 0; i < depth; i++)
+		crt[i] = 0;
+
+	/* merge the (ascending) rule lists of the matched prefixes */
+	for (;;) {
+		best = -1;
+		for (i = 0; i < depth; i++)
+			if (crt[i] < ri->nodes[path[i]].slots_no && (best < 0 ||
+			ri->slots[ri->nodes[path[i]].slots + crt[i]] <
+			ri->slots[ri->nodes[path[best]].slots + crt[best]]))
+				best = i;
+		if (best < 0)
+			return NULL;
+
+		rulep = ri->rules[ri->slots[ri->nodes[path[best]].slots +
+			crt[best]++]];
+
+		if (rulep->parsed_timerec) {
+			LM_DBG("Timerec exists for rule checking: %.*s\n",
+				rulep->timerec.len, rulep->timerec.s);
+			if (!check_time(rulep->parsed_timerec)) {
+				LM_DBG("Time rule doesn't match: skip next!\n");
+				continue;
+			}
+		}
+
+		if (test_match(input, rulep->match_comp, matches, MAX_MATCHES) >= 0)
+			return rulep;
+	}
+}
+
 #define DP_MAX_ATTRS_LEN	256
 static char dp_attrs_buf[DP_MAX_ATTRS_LEN+1];
 int translate(struct sip_msg *msg, str input, str * output, dpl_id_p idp, str * attrs) {
@@ -408,25 +458,31 @@ int translate(struct sip_msg *msg, str input, str * output, dpl_id_p idp, str *
 	}
 
 	/* try to match the input in the regexp bucket */
-	for (rrulep = idp->rule_hash[DP_INDEX_HASH_SIZE].first_rule; rrulep; rrulep=rrulep->next) {
-
-		// Check for Time Period if Set
-		if(rrulep->parsed_timerec) {
-			LM_DBG("Timerec exists for rule checking: %.*s\n", rrulep->timerec.len, rrulep->timerec.s);
-			// Doesn't matches time period continue with next rule
-			if(!check_time(rrulep->parsed_timerec)) {
-				LM_DBG("Time rule doesn't match: skip next!\n");
-				continue;
+	if (idp->regex_idx) {
+		rrulep = match_regex_idx(idp->regex_idx, input);
+		regexp_res = rrulep ? 0 : -1;
+	} else {
+		for (rrulep = idp->rule_hash[DP_INDEX_HASH_SIZE].first_rule; rrulep;
+		rrulep = rrulep->next) {
+
+			// Check for Time Period if Set
+			if(rrulep->parsed_timerec) {
+				LM_DBG("Timerec exists for rule checking: %.*s\n", rrulep->timerec.len, rrulep->timerec.s);
+				// Doesn't matches time period continue with next rule
+				if(!check_time(rrulep->parsed_timerec)) {
+					LM_DBG("Time rule doesn't match: skip next!\n");
+					continue;
+				}
 			}
-		}
 
-		regexp_res = (test_match(input, rrulep->match_comp, matches, MAX_MATCHES)
-					>= 0 ? 0 : -1);
+			regexp_res = (test_match(input, rrulep->match_comp, matches, MAX_MATCHES)
+						>= 0 ? 0 : -1);
 
-		LM_DBG("Regex operator testing. Got result: %d\n", regexp_res);
+			LM_DBG("Regex operator testing. Got result: %d\n", regexp_res);
 
-		if (regexp_res == 0) {
-			break;
+			if (regexp_res == 0) {
+				break;
+			}
 		}
 	}
 
@@ -45,6 +45,7 @@
 #include "../../db/db_res.h"
 #include "../../str.h"
 #include "../../rw_locking.h"
+#include "../../timer.h"
 
 #include "dispatch.h"
 #include "ds_fixups.h"
@@ -121,6 +122,8 @@ static void ds_destroy_data_set( ds_data_t *d)
 			}while(dest);
 			shm_free(sp_curr->dlist);
 		}
+		if (sp_curr->ch_table)
+			shm_free(sp_curr->ch_table);
 		shm_free(sp_curr);
 	}
 
@@ -370,6 +373,160 @@ err:
 }
 
 
+/* MurmurHash3 (x86, 32 bits) of @s, chained over @h */
+static inline unsigned int ds_murmur3(const str *s, unsigned int h)
+{
+	const unsigned char *p = (const unsigned char *)s->s;
+	unsigned int k;
+	int i;
+
+	for (i = s->len / 4; i > 0; i--, p += 4) {
+		memcpy(&k, p, 4);
+		k *= 0xcc9e2d51;
+		k = (k << 15) | (k >> 17);
+		k *= 0x1b873593;
+		h ^= k;
+		h = (h << 13) | (h >> 19);
+		h = h * 5 + 0xe6546b64;
+	}
+
+	k = 0;
+	switch (s->len & 3) {
+		case 3:
+			k ^= p[2] << 16;
+			/* fall through */
+		case 2:
+			k ^= p[1] << 8;
+			/* fall through */
+		case 1:
+			k ^= p[0];
+			k *= 0xcc9e2d51;
+			k = (k << 15) | (k >> 17);
+			k *= 0x1b873593;
+			h ^= k;
+	}
+
+	h ^= s->len;
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+
+	return h;
+}
+
+/* hash used by the consistent hashing mode - unlike ds_get_hash(), its
+ * output is evenly spread over the whole 32 bits range */
+static unsigned int ds_get_fast_hash(str *x, str *y)
+{
+	unsigned int h = 0;
+
+	if (x)
+		h = ds_murmur3(x, h);
+	if (y)
+		h = ds_murmur3(y, h);
+
+	return h ? h : 1;
+}
+
+/* primes for the size of the consistent hashing table */
+static unsigned int ds_ch_sizes[] = {
+	251, 509, 1021, 2039, 4093, 8191, 16381, 32749, 65521
+};
+
+/* the table should have ~100 slots for each destination,
+ * in order to keep the load imbalance under 1% */
+static unsigned int ds_ch_table_size(int nr)
+{
+	int i, n = sizeof(ds_ch_sizes) / sizeof(ds_ch_sizes[0]);
+
+	for (i = 0; i < n - 1; i++)
+		if (ds_ch_sizes[i] >= 100 * nr)
+			break;
+
+	return ds_ch_sizes[i];
+}
+
+/* populates the Maglev lookup table of the set with its active
+ * destinations, each one taking a share of the slots proportional to its
+ * weight; a destination going up or down only moves the slots it owns */
+static void ds_build_ch_table(ds_set_p sp)
+{
+	unsigned int *pos, *skip, *credit;
+	unsigned int i, filled, max_w;
+	ds_dest_p dst;
+	int *table, weighted;
+
+	if (!sp->ch_table)
+		return;
+
+	/* weights are used if at least an active destination has one */
+	weighted = sp->dlist[sp->nr-1].active_running_weight != 0;
+
+	sp->ch_wsum = 0;
+	for (i = 0, max_w = 0; i < sp->nr; i++) {
+		dst = &sp->dlist[i];
+		if (!dst_is_active(*dst))
+			dst->ch_weight = 0;
+		else
+			dst->ch_weight = weighted ? dst->weight : 1;
+
+		sp->ch_wsum += dst->ch_weight;
+		if (dst->ch_weight > max_w)
+			max_w = dst->ch_weight;
+	}
+
+	/* no active destinations, keep the old table as the set
+	 * will not be used anyhow */
+	if (max_w == 0)
+		return;
+
+	/* build it aside, so the readers always find valid indexes */
+	table = pkg_malloc(sp->ch_size * sizeof(int) +
+		3 * sp->nr * sizeof(unsigned int));
+	if (!table) {
+		LM_ERR("no more pkg memory, consistent hashing table of "
+			"set %d not updated\n", sp->id);
+		return;
+	}
+	pos = (unsigned int *)(table + sp->ch_size);
+	skip = pos + sp->nr;
+	credit = skip + sp->nr;
+
+	for (i = 0; i < sp->ch_size; i++)
+		table[i] = -1;
+
+	for (i = 0; i < sp->nr; i++) {
+		dst = &sp->dlist[i];
+		pos[i] = ds_murmur3(&dst->uri, 0) % sp->ch_size;
+		skip[i] = ds_murmur3(&dst->uri, 0x9747b28c) % (sp->ch_size - 1) + 1;
+		credit[i] = 0;
+	}
+
+	/* in each round, every destination claims its next preferred free
+	 * slots, as many as its weight relative to the biggest one */
+	for (filled = 0; filled < sp->ch_size; ) {
+		for (i = 0; i < sp->nr && filled < sp->ch_size; i++) {
+			if (!sp->dlist[i].ch_weight)
+				continue;
+
+			credit[i] += sp->dlist[i].ch_weight;
+			while (credit[i] >= max_w && filled < sp->ch_size) {
+				credit[i] -= max_w;
+
+				while (table[pos[i]] >= 0)
+					pos[i] = (pos[i] + skip[i]) % sp->ch_size;
+				table[pos[i]] = i;
+				filled++;
+			}
+		}
+	}
+
+	memcpy(sp->ch_table, table, sp->ch_size * sizeof(int));
+	pkg_free(table);
+}
+
 /* iterates the whole set and calculates (1) the number of 
    active destinations and (2) the running and total weight
    sum for the active destinations */
@@ -416,6 +573,8 @@ static inline void re_calculate_active_dsts(ds_set_p sp)
 		LM_DBG("destination i=%d, j=%d, weight=%d, sum=%d, active_sum=%d\n",
 			i,j, dst->weight, dst->running_weight, dst->active_running_weight);
 	}
+
+	ds_build_ch_table(sp);
 }
 
 
@@ -459,6 +618,14 @@ int reindex_dests( ds_data_t *d_data)
 
 		sp->dlist=dp0;
 
+		sp->ch_size = ds_ch_table_size(sp->nr);
+		sp->ch_table = shm_malloc(sp->ch_size * sizeof(int));
+		if (sp->ch_table == NULL) {
+			LM_ERR("no more memory!\n");
+			goto err1;
+		}
+		memset(sp->ch_table, 0, sp->ch_size * sizeof(int));
+
 		re_calculate_active_dsts(sp);
 
 	}
@@ -1050,6 +1217,13 @@ unsigned int ds_get_hash(str *x, str *y)
 }
 
 
+static inline unsigned int ds_hash_keys(str *x, str *y, int ds_flags)
+{
+	return (ds_flags & DS_HASH_CONSISTENT) ?
+		ds_get_fast_hash(x, y) : ds_get_hash(x, y);
+}
+
+
 /*
  * gets the part of the uri we will use as a key for hashing
  * params:  key1       - will be filled with first part of the key
@@ -1147,7 +1321,7 @@ int ds_hash_fromuri(struct sip_msg *msg, unsigned int *hash, int ds_flags)
 	trim(&from);
 	if (get_uri_hash_keys(&key1, &key2, &from, 0, ds_flags)<0)
 		return -1;
-	*hash = ds_get_hash(&key1, &key2);
+	*hash = ds_hash_keys(&key1, &key2, ds_flags);
 
 	return 0;
 }
@@ -1181,7 +1355,7 @@ int ds_hash_touri(struct sip_msg *msg, unsigned int *hash, int ds_flags)
 
 	if (get_uri_hash_keys(&key1, &key2, &to, 0, ds_flags)<0)
 		return -1;
-	*hash = ds_get_hash(&key1, &key2);
+	*hash = ds_hash_keys(&key1, &key2, ds_flags);
 
 	return 0;
 }
@@ -1191,7 +1365,7 @@ int ds_hash_touri(struct sip_msg *msg, unsigned int *hash, int ds_flags)
 /**
  *
  */
-int ds_hash_callid(struct sip_msg *msg, unsigned int *hash)
+int ds_hash_callid(struct sip_msg *msg, unsigned int *hash, int ds_flags)
 {
 	str cid;
 	if(msg==NULL || hash == NULL)
@@ -1211,7 +1385,7 @@ int ds_hash_callid(struct sip_msg *msg, unsigned int *hash)
 	cid.len = msg->callid->body.len;
 	trim(&cid);
 
-	*hash = ds_get_hash(&cid, NULL);
+	*hash = ds_hash_keys(&cid, NULL, ds_flags);
 
 	return 0;
 }
@@ -1239,12 +1413,13 @@ int ds_hash_ruri(struct sip_msg *msg, unsigned int *hash, int ds_flags)
 	if (get_uri_hash_keys(&key1, &key2, uri, &msg->parsed_uri, ds_flags)<0)
 		return -1;
 
-	*hash = ds_get_hash(&key1, &key2);
+	*hash = ds_hash_keys(&key1, &key2, ds_flags);
 	return 0;
 }
 
 
-int ds_hash_authusername(struct sip_msg *msg, unsigned int *hash)
+int ds_hash_authusername(struct sip_msg *msg, unsigned int *hash,
+														int ds_flags)
 {
 	/* Header, which contains the authorization */
 	struct hdr_field* h = 0;
@@ -1299,13 +1474,13 @@ int ds_hash_authusername(struct sip_msg *msg, unsigned int *hash)
 
 	trim(&username);
 
-	*hash = ds_get_hash(&username, NULL);
+	*hash = ds_hash_keys(&username, NULL, ds_flags);
 
 	return 0;
 }
 
 
-int ds_hash_pvar(struct sip_msg *msg, unsigned int *hash)
+int ds_hash_pvar(struct sip_msg *msg, unsigned int *hash, int ds_flags)
 {
 	/* The String to create the hash */
 	str hash_str = {0, 0};
@@ -1328,7 +1503,7 @@ int ds_hash_pvar(struct sip_msg *msg, unsigned int *hash)
 	}
 	LM_DBG("Hashing %.*s!\n", hash_str.len, hash_str.s);
 
-	*hash = ds_get_hash(&hash_str, NULL);
+	*hash = ds_hash_keys(&hash_str, NULL, ds_flags);
 
 	return 0;
 }
@@ -1450,6 +1625,72 @@ static inline int push_ds_2_avps( ds_dest_t *ds, ds_partition_t *partition )
 /**
  *
  */
+/* picks the destination owning the @hash slot of the consistent hashing
+ * table; if it is not usable or it already got more than its share of the
+ * recent selections (bounded load), the following slots are tried */
+static int ds_ch_select(ds_set_p idx, unsigned int hash, int ds_flags)
+{
+	unsigned long long cap;
+	unsigned int k, slot, now, shift;
+	int i, fallback = -1;
+	ds_dest_p dst;
+
+	if (ds_hash_load_factor) {
+		/* halve the recent selections every second */
+		now = get_ticks();
+		if (idx->ch_load_tick != now) {
+			shift = now - idx->ch_load_tick;
+			if (shift > 31)
+				shift = 31;
+			idx->ch_load_tick = now;
+			idx->ch_load >>= shift;
+			for (i = 0; i < idx->nr; i++)
+				idx->dlist[i].ch_load >>= shift;
+		}
+	}
+
+	slot = hash % idx->ch_size;
+	for (k = 0; k < idx->ch_size; k++, slot++) {
+		if (slot == idx->ch_size)
+			slot = 0;
+
+		i = idx->ch_table[slot];
+		dst = &idx->dlist[i];
+		if (!dst_is_active(*dst) ||
+		(ds_flags&DS_USE_DEFAULT && idx->nr>1 && i==idx->nr-1))
+			continue;
+
+		if (!ds_hash_load_factor)
+			return i;
+
+		/* too little traffic to tell anything about the load */
+		if (idx->ch_load < idx->active_nr || !idx->ch_wsum)
+			goto found;
+
+		if (fallback < 0)
+			fallback = i;
+
+		/* allow up to load_factor% of its weighted share */
+		cap = ((unsigned long long)(idx->ch_load + 1) * ds_hash_load_factor *
+			dst->ch_weight + 100ULL * idx->ch_wsum - 1) / (100ULL * idx->ch_wsum);
+		if (dst->ch_load + 1 <= cap)
+			goto found;
+	}
+
+	if (fallback >= 0) {
+		i = fallback;
+	} else if (ds_flags&DS_USE_DEFAULT && dst_is_active(idx->dlist[idx->nr-1])) {
+		i = idx->nr-1;
+	} else {
+		return -1;
+	}
+
+found:
+	__sync_fetch_and_add(&idx->dlist[i].ch_load, 1);
+	__sync_fetch_and_add(&idx->ch_load, 1);
+	return i;
+}
+
 int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 								ds_selected_dst_p selected_dst, int ds_flags)
 {
@@ -1517,7 +1758,7 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 	switch(ds_select_ctl->alg)
 	{
 		case 0:
-			if(ds_hash_callid(msg, &ds_hash)!=0)
+			if(ds_hash_callid(msg, &ds_hash, ds_flags)!=0)
 			{
 				LM_ERR("can't get callid hash\n");
 				goto error;
@@ -1558,7 +1799,7 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 			}
 		break;
 		case 5:
-			i = ds_hash_authusername(msg, &ds_hash);
+			i = ds_hash_authusername(msg, &ds_hash, ds_flags);
 			switch (i)
 			{
 				case 0:
@@ -1579,7 +1820,7 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 			ds_hash = rand();
 		break;
 		case 7:
-			if (ds_hash_pvar(msg, &ds_hash)!=0)
+			if (ds_hash_pvar(msg, &ds_hash, ds_flags)!=0)
 			{
 				LM_ERR("can't get PV hash\n");
 				goto error;
@@ -1609,6 +1850,17 @@ int ds_select_dst(struct sip_msg *msg, ds_select_ctl_p ds_select_ctl,
 			ds_id = 0;
 	}
 
+	/* hash based algs may use the consistent hashing table */
+	if (selected==NULL && ds_id==-1 && ds_hash && ds_flags&DS_HASH_CONSISTENT) {
+		ds_id = ds_ch_select(idx, ds_hash, ds_flags);
+		if (ds_id < 0) {
+			LM_DBG("no usable destination in set [%d]\n", idx->id);
+			goto error;
+		}
+		LM_DBG("hash [%u], consistent hashing pick [%d]\n", ds_hash, ds_id);
+		selected = &idx->dlist[ds_id];
+	}
+
 	/* any destination selected yet? */
 	if (selected==NULL) {
 
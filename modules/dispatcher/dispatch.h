@@ -36,6 +36,8 @@
 #define DS_FAILOVER_ON		2  /* store the other dest in avps */
 #define DS_USE_DEFAULT		4  /* use last address in destination set as last option */
 #define DS_APPEND_MODE		8  /* append destinations instead of overwriting */
+#define DS_HASH_CONSISTENT	16 /* map the hash over the set's consistent
+                              hashing table */
 
 #define DS_INACTIVE_DST		1  /* inactive destination */
 #define DS_PROBING_DST		2  /* checking destination */
@@ -57,8 +59,11 @@
 
 #define MI_FULL_LISTING (1<<0)
 
+#define DS_HASH_LOAD_FACTOR	125	/* percent of the average load */
+
 
 extern int ds_persistent_state;
+extern int ds_hash_load_factor;
 
 typedef struct _ds_dest
 {
@@ -79,6 +84,8 @@ typedef struct _ds_dest
 	unsigned short ips_cnt;
 	unsigned short failure_count;
 	unsigned short chosen_count;
+	unsigned short ch_weight; /* weight used in the consistent hashing table */
+	unsigned int ch_load;     /* recent consistent hashing selections */
 	void *param;
 	fs_evs *fs_sock;
 	struct _ds_dest *next;
@@ -91,6 +98,11 @@ typedef struct _ds_set
 	int active_nr;		/* number of active items in dst set */
 	int last;			/* last used item in dst set */
 	int redo_weights;   /* whether at least one item has dynamic weight */
+	int *ch_table;      /* consistent hashing lookup table (Maglev) */
+	unsigned int ch_size;
+	unsigned int ch_wsum;      /* sum of the weights in the table */
+	unsigned int ch_load;      /* sum of the recent selections */
+	unsigned int ch_load_tick; /* last decay of the recent selections */
 	ds_dest_p dlist;
 	struct _ds_set *next;
 } ds_set_t, *ds_set_p;
@@ -73,6 +73,7 @@ static int ds_ping_interval = 0;
 int ds_ping_maxfwd = -1;
 int ds_probing_mode = 0;
 int ds_persistent_state = 1;
+int ds_hash_load_factor = DS_HASH_LOAD_FACTOR;
 int_list_t *ds_probing_list = NULL;
 
 /* db partiton info */
@@ -270,6 +271,7 @@ static param_export_t params[]={
 	{"ds_probing_list",       STR_PARAM|USE_FUNC_PARAM, (void*)set_probing_list},
 	{"ds_define_blacklist",   STR_PARAM|USE_FUNC_PARAM, (void*)set_ds_bl},
 	{"persistent_state",      INT_PARAM, &ds_persistent_state},
+	{"hash_load_factor",      INT_PARAM, &ds_hash_load_factor},
 	{"fetch_freeswitch_stats", INT_PARAM, &fetch_freeswitch_stats},
 	{"max_freeswitch_weight", INT_PARAM, &max_freeswitch_weight},
 	{"cluster_id",            INT_PARAM, &ds_cluster_id },
@@ -779,6 +781,14 @@ static int mod_init(void)
 	if (pvar_algo_param.len)
 		ds_pvar_parse_pattern(pvar_algo_param);
 
+	if (ds_hash_load_factor < 0) {
+		ds_hash_load_factor = 0;
+	} else if (ds_hash_load_factor > 0 && ds_hash_load_factor < 100) {
+		LM_WARN("hash_load_factor must be at least 100 (percent), "
+			"using 100\n");
+		ds_hash_load_factor = 100;
+	}
+
 
 	if (init_ds_bls()!=0) {
 		LM_ERR("failed to init DS blacklists\n");
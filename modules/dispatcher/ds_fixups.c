@@ -363,6 +363,10 @@ int fixup_flags(str* param)
 			case 'A':
 				ret |= DS_APPEND_MODE;
 				break;
+			case 'c':
+			case 'C':
+				ret |= DS_HASH_CONSISTENT;
+				break;
 
 			default:
 				LM_ERR("Invalid flag: '%c'\n", param->s[index]);
@@ -398,6 +402,10 @@ int fixup_ds_flags(void** param)
 			case 'A':
 				ret |= DS_APPEND_MODE;
 				break;
+			case 'c':
+			case 'C':
+				ret |= DS_HASH_CONSISTENT;
+				break;
 
 			default:
 				LM_ERR("Invalid definition\n");
@@ -90,15 +90,13 @@ static dr_head_p create_dr_head(void)
 	memset( new, 0, sizeof(dr_head_t));
 
 	/* data pointer in shm */
-	new->pt = shm_malloc(sizeof (ptree_t));
-	if (new->pt == NULL) {
-		LM_ERR("no more shm memory\n");
-		shm_free(new);
-		return NULL;
-	}
-	memset(new->pt, 0, sizeof(ptree_t));
+	INIT_PTREE_NODE(shm_malloc_func, NULL, new->pt);
 
 	return new;
+err_exit:
+	LM_ERR("no more shm memory\n");
+	shm_free(new);
+	return NULL;
 }
 
 static void del_rt_list_api(rt_info_wrp_t *rwl)
@@ -118,21 +116,18 @@ static void del_tree_api(ptree_t* t)
 	int i,j;
 	if(NULL == t)
 		return;
-	/* delete all the children */
-	for(i=0; i< ptree_children; i++) {
-		/* shm_free the rg array of rt_info */
-		if(NULL!=t->ptnode[i].rg) {
-			for(j=0;j<t->ptnode[i].rg_pos;j++) {
-				/* if non intermediate delete the routing info */
-				if(t->ptnode[i].rg[j].rtlw !=NULL)
-					del_rt_list_api(t->ptnode[i].rg[j].rtlw);
-			}
-			shm_free(t->ptnode[i].rg);
+	/* shm_free the rg array of rt_info */
+	if(NULL!=t->ptnode.rg) {
+		for(j=0;j<t->ptnode.rg_pos;j++) {
+			/* if non intermediate delete the routing info */
+			if(t->ptnode.rg[j].rtlw !=NULL)
+				del_rt_list_api(t->ptnode.rg[j].rtlw);
 		}
-		/* if non leaf delete all the children */
-		if(t->ptnode[i].next != NULL)
-			del_tree_api(t->ptnode[i].next);
+		shm_free(t->ptnode.rg);
 	}
+	/* delete all the children */
+	for(i=0; i< t->kids_no; i++)
+		del_tree_api(t->kids[i]);
 	shm_free(t);
 }
 
@@ -70,6 +70,8 @@ str priority_drr_col = str_init(PRIORITY_DRR_COL);
 str routeid_drr_col = str_init(ROUTEID_DRR_COL);
 str dstlist_drr_col = str_init(DSTLIST_DRR_COL);
 str attrs_drr_col = str_init(ATTRS_DRR_COL);
+/* optional, enables the delta reloads */
+str updated_drr_col = {NULL, 0};
 
 /* DR carrier table related defs */
 #define ID_DRC_COL     "id"
@@ -53,6 +53,7 @@ extern str priority_drr_col;
 extern str routeid_drr_col;
 extern str dstlist_drr_col;
 extern str attrs_drr_col;
+extern str updated_drr_col;
 
 /* DR carrier table related defs */
 extern str drc_table;
@@ -296,6 +296,173 @@ void dr_update_head_cache(struct head_db *head)
 #define STR_VALS_DSTLIST_DRR_COL  4
 #define STR_VALS_ATTRS_DRR_COL    5
 
+/* the tree slot holding the rules with the given prefix */
+static inline ptree_node_t* rule_node(rt_data_t *rdata, str *prefix)
+{
+	return prefix->len ? get_prefix_node(rdata->pt, prefix) : &rdata->noprefix;
+}
+
+
+/* drops the currently loaded version of the @id rule, if any */
+static void unlink_indexed_rule(rt_data_t *rdata, int id,
+		osips_free_f free_f)
+{
+	dr_rule_ref_t *ref;
+	str key;
+
+	key.s = (char *)&id;
+	key.len = sizeof id;
+	ref = (dr_rule_ref_t *)map_remove(rdata->rules_idx, key);
+	if (ref == NULL)
+		return;
+
+	del_rt_info(rule_node(rdata, &ref->prefix), ref->ri, free_f);
+	func_free(free_f, ref);
+}
+
+
+static int index_rule(rt_data_t *rdata, rt_info_t *ri, str *prefix,
+		osips_malloc_f malloc_f, osips_free_f free_f)
+{
+	dr_rule_ref_t *ref;
+	str key;
+
+	ref = (dr_rule_ref_t *)func_malloc(malloc_f,
+		sizeof(dr_rule_ref_t) + prefix->len);
+	if (ref == NULL) {
+		LM_ERR("no more shm mem for the rules index\n");
+		return -1;
+	}
+	ref->ri = ri;
+	ref->prefix.s = (char *)(ref + 1);
+	ref->prefix.len = prefix->len;
+	if (prefix->len)
+		memcpy(ref->prefix.s, prefix->s, prefix->len);
+
+	key.s = (char *)&ri->id;
+	key.len = sizeof ri->id;
+	ref = (dr_rule_ref_t *)map_put(rdata->rules_idx, key, ref);
+	if (ref)
+		/* duplicated rule id in DB, the last loaded one wins */
+		func_free(free_f, ref);
+
+	return 0;
+}
+
+
+/* builds and adds the rule from a dr_rules row; if the rules are indexed,
+ * any previously loaded rule with the same id is replaced
+ * Returns: 0 - rule added, 1 - rule skipped, -1 - bad row format */
+static int add_rule_row(struct head_db *part, rt_data_t *rdata,
+		db_row_t *row)
+{
+	int    int_vals[5];
+	char * str_vals[6];
+	str tmp;
+	rt_info_t *ri;
+	tmrec_t   *time_rec;
+	ptree_node_t *pn;
+
+	/* RULE_ID column */
+	check_val( rule_id_drr_col, ROW_VALUES(row), DB_INT, 1, 0);
+	int_vals[INT_VALS_RULE_ID_DRR_COL] = VAL_INT (ROW_VALUES(row));
+	/* GROUP column */
+	check_val( group_drr_col, ROW_VALUES(row)+1, DB_STRING, 1, 1);
+	str_vals[STR_VALS_GROUP_DRR_COL] =
+		(char*)VAL_STRING(ROW_VALUES(row)+1);
+	/* PREFIX column - it may be null or empty */
+	check_val( prefix_drr_col, ROW_VALUES(row)+2, DB_STRING, 0, 0);
+	if ((ROW_VALUES(row)+2)->nul || VAL_STRING(ROW_VALUES(row)+2)==0){
+		tmp.s = NULL;
+		tmp.len = 0;
+	} else {
+		str_vals[STR_VALS_PREFIX_DRR_COL] =
+			(char*)VAL_STRING(ROW_VALUES(row)+2);
+		tmp.s = str_vals[STR_VALS_PREFIX_DRR_COL];
+		tmp.len = strlen(str_vals[STR_VALS_PREFIX_DRR_COL]);
+	}
+	/* TIME column */
+	check_val( time_drr_col, ROW_VALUES(row)+3, DB_STRING, 0, 0);
+	/* PRIORITY column */
+	check_val2( priority_drr_col, ROW_VALUES(row)+4, DB_INT, DB_BIGINT, 1, 0);
+	int_vals[INT_VALS_PRIORITY_DRR_COL] = VAL_INT(ROW_VALUES(row)+4);
+	/* ROUTE_ID column */
+	check_val( routeid_drr_col, ROW_VALUES(row)+5, DB_STRING, 0, 0);
+	/* DSTLIST column */
+	check_val( dstlist_drr_col, ROW_VALUES(row)+6, DB_STRING, 1, 1);
+	str_vals[STR_VALS_DSTLIST_DRR_COL] =
+		(char*)VAL_STRING(ROW_VALUES(row)+6);
+	/* ATTRS column */
+	check_val( attrs_drr_col, ROW_VALUES(row)+7, DB_STRING, 0, 0);
+	str_vals[STR_VALS_ATTRS_DRR_COL] =
+		(char*)VAL_STRING(ROW_VALUES(row)+7);
+	/* UPDATED column, only with the rules index */
+	if (rdata->rules_idx) {
+		check_val( updated_drr_col, ROW_VALUES(row)+8, DB_DATETIME, 0, 0);
+		if (!VAL_NULL(ROW_VALUES(row)+8) &&
+		VAL_TIME(ROW_VALUES(row)+8) > rdata->rules_ts)
+			rdata->rules_ts = VAL_TIME(ROW_VALUES(row)+8);
+
+		/* a newer version of an already loaded rule? */
+		unlink_indexed_rule(rdata, int_vals[INT_VALS_RULE_ID_DRR_COL],
+			part->free);
+	}
+	/* parse the time definition */
+	if ( VAL_NULL(ROW_VALUES(row)+3) ||
+	((str_vals[STR_VALS_TIME_DRR_COL]=
+		(char*)VAL_STRING(ROW_VALUES(row)+3))==NULL ) ||
+	*(str_vals[STR_VALS_TIME_DRR_COL]) == 0)
+		time_rec = NULL;
+	else if ((time_rec=
+	parse_time_def(str_vals[STR_VALS_TIME_DRR_COL]))==0) {
+		LM_ERR("bad time definition <%s> for rule id %d -> skipping\n",
+			str_vals[STR_VALS_TIME_DRR_COL],
+			int_vals[INT_VALS_RULE_ID_DRR_COL]);
+		return 1;
+	}
+	/* set the script route ID */
+	if ( VAL_NULL(ROW_VALUES(row)+5) ||
+	((str_vals[STR_VALS_ROUTEID_DRR_COL]=
+		(char*)VAL_STRING(ROW_VALUES(row)+5))==NULL ) ||
+	str_vals[STR_VALS_ROUTEID_DRR_COL][0]==0 ) {
+		str_vals[STR_VALS_ROUTEID_DRR_COL] = NULL;
+	}
+	/* build the routing rule */
+	if ((ri = build_rt_info( int_vals[INT_VALS_RULE_ID_DRR_COL],
+					int_vals[INT_VALS_PRIORITY_DRR_COL], time_rec,
+					str_vals[STR_VALS_ROUTEID_DRR_COL],
+					str_vals[STR_VALS_DSTLIST_DRR_COL],
+					str_vals[STR_VALS_ATTRS_DRR_COL], rdata,
+					part->malloc, part->free))== 0 ) {
+		LM_ERR("failed to add routing info for rule id %d -> "
+				"skipping\n", int_vals[INT_VALS_RULE_ID_DRR_COL]);
+		tmrec_free( time_rec );
+		return 1;
+	}
+	/* add the rule */
+	if (add_rule(rdata, str_vals[STR_VALS_GROUP_DRR_COL], &tmp, ri,
+			part->malloc, part->free)!=0) {
+		LM_ERR("failed to add rule id %d -> skipping\n",
+				int_vals[INT_VALS_RULE_ID_DRR_COL]);
+		goto unlink;
+	}
+	if (rdata->rules_idx &&
+	index_rule(rdata, ri, &tmp, part->malloc, part->free) < 0)
+		goto unlink;
+
+	return 0;
+unlink:
+	/* the rule may already be linked under some of its groups */
+	if (ri->ref_cnt && (pn = rule_node(rdata, &tmp)) != NULL)
+		del_rt_info(pn, ri, part->free);
+	else
+		free_rt_info(ri, part->free);
+	return 1;
+error:
+	return -1;
+}
+
+
 /* loads routing info for given partition; if partition_name is NULL
  * loads all partitions
  */
@@ -305,7 +472,6 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 {
 	int    int_vals[5];
 	char * str_vals[6];
-	str tmp;
 	db_func_t *dr_dbf = &current_partition->db_funcs;
 	db_con_t* db_hdl = *current_partition->db_con;
 	str *drd_table = &current_partition->drd_table;
@@ -314,10 +480,8 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 	db_key_t columns[10];
 	db_res_t* res;
 	db_row_t* row;
-	rt_info_t *ri;
 	rt_data_t *rdata;
-	tmrec_t   *time_rec;
-	int i,n;
+	int i,n,rc;
 	int no_rows = 10;
 	int db_cols;
 	struct socket_info *sock;
@@ -326,7 +490,6 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 	char id_buf[INT2STR_MAX_LEN];
 
 	res = 0;
-	ri = 0;
 	rdata = 0;
 
 	/* init new data structure */
@@ -608,20 +771,26 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 	columns[5] = &routeid_drr_col;
 	columns[6] = &dstlist_drr_col;
 	columns[7] = &attrs_drr_col;
+	if (rdata->rules_idx) {
+		columns[8] = &updated_drr_col;
+		db_cols = 9;
+	} else {
+		db_cols = 8;
+	}
 
 	if (DB_CAPABILITY(*dr_dbf, DB_CAP_FETCH)) {
-		if ( dr_dbf->query( db_hdl, 0, 0, 0, columns, 0, 8, 0, 0) < 0) {
+		if ( dr_dbf->query( db_hdl, 0, 0, 0, columns, 0, db_cols, 0, 0) < 0) {
 			LM_ERR("DB query failed\n");
 			goto error;
 		}
-		no_rows = estimate_available_rows( 4+32+32+128+32+64+128, 8/*cols*/);
+		no_rows = estimate_available_rows( 4+32+32+128+32+64+128, db_cols);
 		if (no_rows==0) no_rows = 10;
 		if(dr_dbf->fetch_result(db_hdl, &res, no_rows)<0) {
 			LM_ERR("Error fetching rows\n");
 			goto error;
 		}
 	} else {
-		if ( dr_dbf->query( db_hdl, 0, 0, 0, columns, 0, 8, 0, &res) < 0) {
+		if ( dr_dbf->query( db_hdl, 0, 0, 0, columns, 0, db_cols, 0, &res) < 0) {
 			LM_ERR("DB query failed\n");
 			goto error;
 		}
@@ -638,80 +807,11 @@ rt_data_t* dr_load_routing_info(struct head_db *current_partition
 	do {
 		for(i=0; i < RES_ROW_N(res); i++) {
 			row = RES_ROWS(res) + i;
-			/* RULE_ID column */
-			check_val( rule_id_drr_col, ROW_VALUES(row), DB_INT, 1, 0);
-			int_vals[INT_VALS_RULE_ID_DRR_COL] = VAL_INT (ROW_VALUES(row));
-			/* GROUP column */
-			check_val( group_drr_col, ROW_VALUES(row)+1, DB_STRING, 1, 1);
-			str_vals[STR_VALS_GROUP_DRR_COL] =
-				(char*)VAL_STRING(ROW_VALUES(row)+1);
-			/* PREFIX column - it may be null or empty */
-			check_val( prefix_drr_col, ROW_VALUES(row)+2, DB_STRING, 0, 0);
-			if ((ROW_VALUES(row)+2)->nul || VAL_STRING(ROW_VALUES(row)+2)==0){
-				tmp.s = NULL;
-				tmp.len = 0;
-			} else {
-				str_vals[STR_VALS_PREFIX_DRR_COL] =
-					(char*)VAL_STRING(ROW_VALUES(row)+2);
-				tmp.s = str_vals[STR_VALS_PREFIX_DRR_COL];
-				tmp.len = strlen(str_vals[STR_VALS_PREFIX_DRR_COL]);
-			}
-			/* TIME column */
-			check_val( time_drr_col, ROW_VALUES(row)+3, DB_STRING, 0, 0);
-			/* PRIORITY column */
-			check_val2( priority_drr_col, ROW_VALUES(row)+4, DB_INT, DB_BIGINT, 1, 0);
-			int_vals[INT_VALS_PRIORITY_DRR_COL] = VAL_INT(ROW_VALUES(row)+4);
-			/* ROUTE_ID column */
-			check_val( routeid_drr_col, ROW_VALUES(row)+5, DB_STRING, 0, 0);
-			/* DSTLIST column */
-			check_val( dstlist_drr_col, ROW_VALUES(row)+6, DB_STRING, 1, 1);
-			str_vals[STR_VALS_DSTLIST_DRR_COL] =
-				(char*)VAL_STRING(ROW_VALUES(row)+6);
-			/* ATTRS column */
-			check_val( attrs_drr_col, ROW_VALUES(row)+7, DB_STRING, 0, 0);
-			str_vals[STR_VALS_ATTRS_DRR_COL] =
-				(char*)VAL_STRING(ROW_VALUES(row)+7);
-			/* parse the time definition */
-			if ( VAL_NULL(ROW_VALUES(row)+3) ||
-			((str_vals[STR_VALS_TIME_DRR_COL]=
-				(char*)VAL_STRING(ROW_VALUES(row)+3))==NULL ) ||
-			*(str_vals[STR_VALS_TIME_DRR_COL]) == 0)
-				time_rec = NULL;
-			else if ((time_rec=
-			parse_time_def(str_vals[STR_VALS_TIME_DRR_COL]))==0) {
-				LM_ERR("bad time definition <%s> for rule id %d -> skipping\n",
-					str_vals[STR_VALS_TIME_DRR_COL],
-					int_vals[INT_VALS_RULE_ID_DRR_COL]);
-				continue;
-			}
-			/* set the script route ID */
-			if ( VAL_NULL(ROW_VALUES(row)+5) ||
-			((str_vals[STR_VALS_ROUTEID_DRR_COL]=
-				(char*)VAL_STRING(ROW_VALUES(row)+5))==NULL ) ||
-			str_vals[STR_VALS_ROUTEID_DRR_COL][0]==0 ) {
-				str_vals[STR_VALS_ROUTEID_DRR_COL] = NULL;
-			}
-			/* build the routing rule */
-			if ((ri = build_rt_info( int_vals[INT_VALS_RULE_ID_DRR_COL],
-							int_vals[INT_VALS_PRIORITY_DRR_COL], time_rec,
-							str_vals[STR_VALS_ROUTEID_DRR_COL],
-							str_vals[STR_VALS_DSTLIST_DRR_COL],
-							str_vals[STR_VALS_ATTRS_DRR_COL], rdata,
-							current_partition->malloc,
-							current_partition->free))== 0 ) {
-				LM_ERR("failed to add routing info for rule id %d -> "
-						"skipping\n", int_vals[INT_VALS_RULE_ID_DRR_COL]);
-				tmrec_free( time_rec );
-				continue;
-			}
-			/* add the rule */
-			if (add_rule(rdata, str_vals[STR_VALS_GROUP_DRR_COL], &tmp, ri,
-					current_partition->malloc, current_partition->free)!=0) {
-				LM_ERR("failed to add rule id %d -> skipping\n",
-						int_vals[INT_VALS_RULE_ID_DRR_COL]);
-				free_rt_info(ri, current_partition->free);
+			rc = add_rule_row(current_partition, rdata, row);
+			if (rc < 0)
+				goto error;
+			if (rc > 0)
 				continue;
-			}
 			n++;
 		}
 		if (DB_CAPABILITY(*dr_dbf, DB_CAP_FETCH)) {
@@ -740,3 +840,81 @@ error:
 	rdata = NULL;
 	return 0;
 }
+
+
+/* applies on top of the current routing data only the rules changed
+ * (inserted or updated) since the last load, as per the updated column */
+int dr_load_routing_delta(struct head_db *current_partition)
+{
+	db_func_t *dr_dbf = &current_partition->db_funcs;
+	db_con_t* db_hdl = *current_partition->db_con;
+	str *drr_table = &current_partition->drr_table;
+	db_key_t columns[9];
+	db_key_t key;
+	db_op_t op = OP_GEQ;
+	db_val_t val;
+	db_res_t* res = NULL;
+	rt_data_t *rdata;
+	int i, n, rc = 0;
+
+	lock_start_read( current_partition->ref_lock );
+	rdata = current_partition->rdata;
+	if (rdata)
+		VAL_TIME(&val) = rdata->rules_ts;
+	lock_stop_read( current_partition->ref_lock );
+
+	if (rdata==NULL || rdata->rules_idx==NULL) {
+		LM_ERR("no data to apply the delta on (is the updated column set?)\n");
+		return -1;
+	}
+
+	if (dr_dbf->use_table( db_hdl, drr_table) < 0) {
+		LM_ERR("cannot select table \"%.*s\"\n", drr_table->len, drr_table->s);
+		return -1;
+	}
+
+	columns[0] = &rule_id_drr_col;
+	columns[1] = &group_drr_col;
+	columns[2] = &prefix_drr_col;
+	columns[3] = &time_drr_col;
+	columns[4] = &priority_drr_col;
+	columns[5] = &routeid_drr_col;
+	columns[6] = &dstlist_drr_col;
+	columns[7] = &attrs_drr_col;
+	columns[8] = &updated_drr_col;
+
+	/* same second updates may have been missed, so re-apply them too */
+	key = &updated_drr_col;
+	VAL_TYPE(&val) = DB_DATETIME;
+	VAL_NULL(&val) = 0;
+
+	if ( dr_dbf->query( db_hdl, &key, &op, &val, columns, 1, 9, 0, &res) < 0) {
+		LM_ERR("DB query failed\n");
+		return -1;
+	}
+
+	LM_DBG("%d changed records found in %.*s\n", RES_ROW_N(res),
+			drr_table->len, drr_table->s);
+
+	/* the readers are blocked only while the changes are linked */
+	lock_start_write( current_partition->ref_lock );
+
+	/* a full reload may have swapped the data meanwhile - still fine,
+	 * as replacing an already loaded rule is harmless */
+	rdata = current_partition->rdata;
+	for(i=0, n=0; i < RES_ROW_N(res); i++) {
+		rc = add_rule_row(current_partition, rdata, RES_ROWS(res) + i);
+		if (rc < 0)
+			break;
+		if (rc == 0)
+			n++;
+	}
+
+	lock_stop_write( current_partition->ref_lock );
+
+	dr_dbf->free_result(db_hdl, res);
+
+	LM_INFO("%d changed rules applied from table %.*s\n", n,
+			drr_table->len, drr_table->s);
+	return rc < 0 ? -1 : 0;
+}
@@ -38,5 +38,6 @@
 
 void dr_update_head_cache(struct head_db *head);
 rt_data_t* dr_load_routing_info(struct head_db * ,int persistent_state);
+int dr_load_routing_delta(struct head_db *);
 
 #endif
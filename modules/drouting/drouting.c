@@ -256,6 +256,10 @@ mi_response_t *dr_reload_cmd(const mi_params_t *params,
 								struct mi_handler *async_hdl);
 mi_response_t *dr_reload_cmd_1(const mi_params_t *params,
 								struct mi_handler *async_hdl);
+mi_response_t *dr_reload_delta_cmd(const mi_params_t *params,
+								struct mi_handler *async_hdl);
+mi_response_t *dr_reload_delta_cmd_1(const mi_params_t *params,
+								struct mi_handler *async_hdl);
 
 mi_response_t *mi_dr_gw_status_1(const mi_params_t *params,
 								struct mi_handler *async_hdl);
@@ -408,6 +412,7 @@ static param_export_t params[] = {
 	{"drr_table",        STR_PARAM, &drr_table.s      },
 	{"drg_table",        STR_PARAM, &drg_table.s      },
 	{"drc_table",        STR_PARAM, &drc_table.s      },
+	{"drr_updated_col",  STR_PARAM, &updated_drr_col.s },
 	{"use_domain",       INT_PARAM, &use_domain       },
 	{"drg_user_col",     STR_PARAM, &drg_user_col.s   },
 	{"drg_domain_col",   STR_PARAM, &drg_domain_col.s },
@@ -456,6 +461,9 @@ static param_export_t params[] = {
 	" (load from database) for all partitions if no parameter is supplied, or"\
 " for a partition given as parameter. If use_partitions is 0, you should"\
 " not specify a partition."
+#define HLP7 "Params: [partition] ; Applies on top of the loaded data only the "\
+	"rules inserted or updated in DB since the last load (requires the "\
+	"drr_updated_col parameter)."
 #define HLP6 "Params: [ enable ] ; Enables probing of gateways if parameter "\
 	"value greater than 0. Disables probing of gateways if parameter"\
 "value is 0. With no parameter, returns current probing status"
@@ -466,6 +474,11 @@ static mi_export_t mi_cmds[] = {
 		{dr_reload_cmd_1, {"partition_name", 0}},
 		{EMPTY_MI_RECIPE}}
 	},
+	{ "dr_reload_delta", HLP7, 0, 0, {
+		{dr_reload_delta_cmd, {0}},
+		{dr_reload_delta_cmd_1, {"partition_name", 0}},
+		{EMPTY_MI_RECIPE}}
+	},
 	{ "dr_gw_status", HLP2, MI_NAMED_PARAMS_ONLY, 0, {
 		{mi_dr_gw_status_1, {0}},
 		{mi_dr_gw_status_2, {"partition_name", 0}},
@@ -1047,6 +1060,29 @@ error:
 	return -1;
 }
 
+/* applies the rules changed in DB since the last (delta) reload */
+static int dr_reload_delta_head(struct head_db *hd)
+{
+	int ret;
+
+	lock_get( hd->ref_lock->lock );
+	if (hd->ongoing_reload) {
+		lock_release( hd->ref_lock->lock );
+		LM_WARN("Reload already in progress, discarding this one\n");
+		return -2;
+	}
+	hd->ongoing_reload = 1;
+	lock_release( hd->ref_lock->lock );
+
+	LM_INFO("loading drouting delta!\n");
+	ret = dr_load_routing_delta(hd);
+	if (ret == 0)
+		time(&hd->time_last_update);
+
+	hd->ongoing_reload = 0;
+	return ret;
+}
+
 static inline int dr_reload_data(int initial) {
 	struct head_db * it_head_db;
 	int ret_val = 0;
@@ -1372,6 +1408,8 @@ static int dr_init(void)
 	drg_table.len = strlen(drg_table.s);
 	drr_table.len = strlen(drr_table.s);
 	drc_table.len = strlen(drc_table.s);
+	if (updated_drr_col.s)
+		updated_drr_col.len = strlen(updated_drr_col.s);
 
 	if (dr_rpm_enable) {
 		/* if we are using cache, we need to fetch our dr zone */
@@ -2002,6 +2040,49 @@ mi_response_t *dr_reload_cmd_1(const mi_params_t *params,
 }
 
 
+mi_response_t *dr_reload_delta_cmd(const mi_params_t *params,
+								struct mi_handler *async_hdl)
+{
+	struct head_db * it_head_db;
+	int ret_val = 0;
+
+	LM_INFO("dr_reload_delta MI command received!\n");
+
+	for( it_head_db=head_db_start; it_head_db!=NULL;
+			it_head_db=it_head_db->next ) {
+		if( dr_reload_delta_head(it_head_db)!=0 )
+			ret_val = -1;
+	}
+
+	if (ret_val != 0) {
+		LM_CRIT("failed to load routing delta\n");
+		return init_mi_error(500, MI_SSTR("Failed to reload"));
+	}
+
+	return init_mi_result_ok();
+}
+
+mi_response_t *dr_reload_delta_cmd_1(const mi_params_t *params,
+								struct mi_handler *async_hdl)
+{
+	struct head_db * part;
+	mi_response_t *resp;
+
+	LM_INFO("dr_reload_delta MI command received!\n");
+
+	resp = mi_dr_get_partition(params, &part);
+	if (resp)
+		return resp;
+
+	if( dr_reload_delta_head(part)<0 ) {
+		LM_CRIT("Failed to load data head delta\n");
+		return init_mi_error(500, MI_SSTR("Failed to reload"));
+	}
+
+	return init_mi_result_ok();
+}
+
+
 static inline int get_group_id(struct sip_uri *uri, struct head_db *
 		current_partition)
 {
@@ -30,6 +30,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <limits.h>
 
 #include "../../str.h"
 #include "../../mem/shm_mem.h"
@@ -164,6 +165,22 @@ check_rt(
 }
 
 
+static inline ptree_t*
+get_kid(
+	ptree_t *ptree,
+	char c
+	)
+{
+	unsigned char idx = IDX_OF_CHAR(c);
+	int i;
+
+	for( i=0 ; i<ptree->kids_no ; i++ )
+		if (ptree->kids_idx[i]==idx)
+			return ptree->kids[i];
+	return NULL;
+}
+
+
 rt_info_t*
 get_prefix(
 	ptree_t *ptree,
@@ -174,59 +191,83 @@ get_prefix(
 	)
 {
 	rt_info_t *rt = NULL;
+	ptree_t *kid;
 	char *tmp=NULL;
-	char local=0;
-	int idx=0;
+	char *end;
+	int i;
 
 	if(NULL == ptree)
 		goto err_exit;
-	if(NULL == prefix)
+	if(NULL == prefix || NULL == prefix->s)
 		goto err_exit;
 	tmp = prefix->s;
-	/* go the tree down to the last digit in the
-	 * prefix string or down to a leaf */
-	while(tmp< (prefix->s+prefix->len)) {
-		if(NULL == tmp)
-			goto err_exit;
-		local=*tmp;
-		if( !IS_VALID_PREFIX_CHAR(local) ) {
+	end = prefix->s + prefix->len;
+	/* go the tree down, label by label, as long as the whole
+	 * label is matched by the prefix string */
+	while(tmp < end) {
+		if( !IS_VALID_PREFIX_CHAR(*tmp) ) {
 			/* unknown character in the prefix string */
 			goto err_exit;
 		}
-		if( tmp == (prefix->s+prefix->len-1) ) {
-			/* last digit in the prefix string */
-			break;
-		}
-		idx = IDX_OF_CHAR(local);
-		if( NULL == ptree->ptnode[idx].next) {
+		if( NULL == (kid=get_kid(ptree, *tmp)) ) {
 			/* this is a leaf */
 			break;
 		}
-		ptree = ptree->ptnode[idx].next;
-		tmp++;
+		for( i=1 ; i<kid->label_len && tmp+i<end ; i++ ) {
+			if (tmp[i]!=kid->label[i]) {
+				if( !IS_VALID_PREFIX_CHAR(tmp[i]) )
+					goto err_exit;
+				break;
+			}
+		}
+		if (i<kid->label_len)
+			/* the label is only partially matched */
+			break;
+		ptree = kid;
+		tmp += kid->label_len;
 	}
 	/* go in the tree up to the root trying to match the
 	 * prefix */
 	while(ptree !=NULL ) {
-		if(NULL == tmp)
-			goto err_exit;
 		/* is it a real node or an intermediate one */
-		idx = IDX_OF_CHAR(*tmp);
-		if(NULL != ptree->ptnode[idx].rg) {
+		if(NULL != ptree->ptnode.rg) {
 			/* real node; check the constraints on the routing info*/
-			if( NULL != (rt = internal_check_rt( &(ptree->ptnode[idx]), rgid, rgidx)))
+			if( NULL != (rt = internal_check_rt( &(ptree->ptnode), rgid, rgidx)))
 				break;
 		}
-		tmp--;
 		ptree = ptree->bp;
 	}
-	if (matched_len) *matched_len = tmp + 1 - prefix->s ;
+	if (matched_len) *matched_len = ptree ? ptree->depth : 0;
 	return rt;
 
 err_exit:
 	return NULL;
 }
 
+/* returns the routing info slot of the exact @prefix, if in the tree */
+ptree_node_t*
+get_prefix_node(
+	ptree_t *ptree,
+	str* prefix
+	)
+{
+	ptree_t *kid;
+	char *tmp, *end;
+
+	if(NULL == ptree || NULL == prefix->s)
+		return NULL;
+	tmp = prefix->s;
+	end = prefix->s + prefix->len;
+	while(tmp < end) {
+		if( !IS_VALID_PREFIX_CHAR(*tmp) || NULL == (kid=get_kid(ptree, *tmp))
+		|| kid->label_len > end-tmp || memcmp(tmp, kid->label, kid->label_len))
+			return NULL;
+		ptree = kid;
+		tmp += kid->label_len;
+	}
+	return &ptree->ptnode;
+}
+
 pgw_t*
 get_gw_by_internal_id(
 		map_t gw_tree,
@@ -277,6 +318,142 @@ get_carrier_by_id(
 
 
 
+/* allocates a node with room for @kids children; the kids indexes, the
+ * kids and the label are packed right after the node, so the whole node
+ * usually sits in one or two cache lines */
+static ptree_t*
+new_ptree_node(
+	ptree_t *parent,
+	char *label,
+	unsigned short len,
+	unsigned char kids,
+	osips_malloc_f malloc_f
+	)
+{
+	ptree_t *n;
+
+	n = (ptree_t*)func_malloc(malloc_f,
+		sizeof(ptree_t) + PTREE_KIDS_SIZE(kids) + len);
+	if (NULL == n) {
+		LM_ERR("no more shm mem for a prefix node\n");
+		return NULL;
+	}
+	tree_size += sizeof(ptree_t) + PTREE_KIDS_SIZE(kids) + len;
+	inode++;
+
+	memset(n, 0, sizeof(ptree_t));
+	n->bp = parent;
+	n->kids_size = kids;
+	n->kids_idx = (unsigned char*)(n+1);
+	n->kids = (ptree_t**)((char*)n->kids_idx +
+		PTREE_KIDS_SIZE(kids) - kids*sizeof(ptree_t*));
+	n->label = (char*)(n+1) + PTREE_KIDS_SIZE(kids);
+	memcpy(n->label, label, len);
+	n->label_len = len;
+	n->depth = parent->depth + len;
+
+	return n;
+}
+
+
+/* re-allocates @ptree with room for more children and fixes all the
+ * links pointing to it; returns the new node */
+static ptree_t*
+grow_ptree_node(
+	ptree_t *ptree,
+	osips_malloc_f malloc_f,
+	osips_free_f free_f
+	)
+{
+	ptree_t *n;
+	int i, size;
+
+	size = ptree->kids_size ? 2*ptree->kids_size : 2;
+	if (size > ptree_children)
+		size = ptree_children;
+
+	n = new_ptree_node(ptree->bp, ptree->label, ptree->label_len, size,
+		malloc_f);
+	if (NULL == n)
+		return NULL;
+	inode--;
+
+	n->ptnode = ptree->ptnode;
+	n->kids_no = ptree->kids_no;
+	memcpy(n->kids_idx, ptree->kids_idx, ptree->kids_no);
+	memcpy(n->kids, ptree->kids, ptree->kids_no*sizeof(ptree_t*));
+	for( i=0 ; i<n->kids_no ; i++ )
+		n->kids[i]->bp = n;
+	for( i=0 ; ptree->bp->kids[i]!=ptree ; i++ );
+	ptree->bp->kids[i] = n;
+
+	tree_size -= sizeof(ptree_t) + PTREE_KIDS_SIZE(ptree->kids_size) +
+		ptree->label_len;
+	func_free(free_f, ptree);
+
+	return n;
+}
+
+
+/* adds the @kid node to the children of @ptree; as @ptree may need to
+ * be re-allocated, the (new) parent node is returned */
+static ptree_t*
+link_kid(
+	ptree_t *ptree,
+	ptree_t *kid,
+	osips_malloc_f malloc_f,
+	osips_free_f free_f
+	)
+{
+	if (ptree->kids_no == ptree->kids_size) {
+		ptree = grow_ptree_node(ptree, malloc_f, free_f);
+		if (NULL == ptree)
+			return NULL;
+	}
+
+	ptree->kids[ptree->kids_no] = kid;
+	ptree->kids_idx[ptree->kids_no] = IDX_OF_CHAR(kid->label[0]);
+	ptree->kids_no++;
+	kid->bp = ptree;
+
+	return ptree;
+}
+
+
+/* splits the label of the @kid node after @len chars, by inserting
+ * an intermediate node between @kid and its parent */
+static ptree_t*
+split_kid(
+	ptree_t *kid,
+	unsigned short len,
+	osips_malloc_f malloc_f
+	)
+{
+	ptree_t *parent = kid->bp;
+	ptree_t *mid;
+	int i;
+
+	/* room for the kid and for the branch about to be added */
+	mid = new_ptree_node(parent, kid->label, len, 2, malloc_f);
+	if (NULL == mid)
+		return NULL;
+
+	/* take the place of the kid under the parent, same first char */
+	for( i=0 ; parent->kids[i]!=kid ; i++ );
+	parent->kids[i] = mid;
+
+	/* the kid keeps its chunk, only its label gets shorter */
+	kid->label += len;
+	kid->label_len -= len;
+	mid->kids[0] = kid;
+	mid->kids_idx[0] = IDX_OF_CHAR(kid->label[0]);
+	mid->kids_no = 1;
+	kid->bp = mid;
+
+	return mid;
+}
+
+
 int
 add_prefix(
 	ptree_t *ptree,
@@ -287,48 +464,65 @@ add_prefix(
 	osips_free_f free_f
 )
 {
-	char* tmp=NULL;
-	int res = 0;
+	ptree_t *kid;
+	char *tmp=NULL;
+	char *end;
+	int i;
+
 	if(NULL==ptree) {
 		LM_ERR("ptree is null\n");
 		goto err_exit;
 	}
-	tmp = prefix->s;
-	while(tmp < (prefix->s+prefix->len)) {
-		if(NULL == tmp) {
-			LM_ERR("prefix became null\n");
-			goto err_exit;
-		}
+	if(NULL==prefix->s || prefix->len==0)
+		goto ok_exit;
+	if(prefix->len > USHRT_MAX) {
+		LM_ERR("prefix too long (%d)\n", prefix->len);
+		goto err_exit;
+	}
+	end = prefix->s + prefix->len;
+	for( tmp=prefix->s ; tmp<end ; tmp++ ) {
 		if( !IS_VALID_PREFIX_CHAR(*tmp) ) {
 			/* unknown character in the prefix string */
 			LM_ERR("%c is not valid char in the prefix\n", *tmp);
 			goto err_exit;
 		}
-		if( tmp == (prefix->s+prefix->len-1) ) {
-			/* last digit in the prefix string */
-			LM_DBG("adding info %p, %d at: "
-				"%p (%d)\n", r, rg, &(ptree->ptnode[IDX_OF_CHAR(*tmp)]),
-				IDX_OF_CHAR(*tmp));
-			res = add_rt_info(&(ptree->ptnode[IDX_OF_CHAR(*tmp)]),
-					r,rg, malloc_f, free_f);
-			if(res < 0 ) {
-                LM_ERR("adding rt info doesn't work\n");
+	}
+
+	tmp = prefix->s;
+	while(tmp < end) {
+		kid = get_kid(ptree, *tmp);
+		if (NULL == kid) {
+			/* nothing shares this path, the rest goes into a leaf */
+			kid = new_ptree_node(ptree, tmp, end-tmp, 0, malloc_f);
+			if (NULL == kid)
 				goto err_exit;
-            }
-			unode++;
-			res = 1;
-			goto ok_exit;
+			if (NULL == link_kid(ptree, kid, malloc_f, free_f)) {
+				func_free(free_f, kid);
+				goto err_exit;
+			}
+			ptree = kid;
+			break;
 		}
-		/* process the current digit in the prefix */
-		if(NULL == ptree->ptnode[IDX_OF_CHAR(*tmp)].next) {
-			/* allocate new node */
-			INIT_PTREE_NODE(malloc_f, ptree,
-				ptree->ptnode[IDX_OF_CHAR(*tmp)].next);
-			inode+=10;
+		for( i=1 ; i<kid->label_len && tmp+i<end && tmp[i]==kid->label[i]
+			; i++ );
+		if (i < kid->label_len) {
+			/* the prefix diverges from (or ends inside) the label */
+			kid = split_kid(kid, i, malloc_f);
+			if (NULL == kid)
+				goto err_exit;
 		}
-		ptree = ptree->ptnode[IDX_OF_CHAR(*tmp)].next;
-		tmp++;
+		ptree = kid;
+		tmp += i;
+	}
+
+	/* the node matching the whole prefix */
+	LM_DBG("adding info %p, %d at: %p (depth %d)\n",
+		r, rg, &(ptree->ptnode), ptree->depth);
+	if(add_rt_info(&(ptree->ptnode), r, rg, malloc_f, free_f) < 0) {
+		LM_ERR("adding rt info doesn't work\n");
+		goto err_exit;
 	}
+	unode++;
 
 ok_exit:
 	return 0;
@@ -346,21 +540,18 @@ del_tree(
 	int i,j;
 	if(NULL == t)
 		goto exit;
-	/* delete all the children */
-	for(i=0; i< ptree_children; i++) {
-		/* shm_free the rg array of rt_info */
-		if(NULL!=t->ptnode[i].rg) {
-			for(j=0;j<t->ptnode[i].rg_pos;j++) {
-				/* if non intermediate delete the routing info */
-				if(t->ptnode[i].rg[j].rtlw !=NULL)
-					del_rt_list(t->ptnode[i].rg[j].rtlw, free_f);
-			}
-			func_free(free_f, t->ptnode[i].rg);
+	/* shm_free the rg array of rt_info */
+	if(NULL!=t->ptnode.rg) {
+		for(j=0;j<t->ptnode.rg_pos;j++) {
+			/* if non intermediate delete the routing info */
+			if(t->ptnode.rg[j].rtlw !=NULL)
+				del_rt_list(t->ptnode.rg[j].rtlw, free_f);
 		}
-		/* if non leaf delete all the children */
-		if(t->ptnode[i].next != NULL)
-			del_tree(t->ptnode[i].next, free_f);
+		func_free(free_f, t->ptnode.rg);
 	}
+	/* delete all the children */
+	for(i=0; i< t->kids_no; i++)
+		del_tree(t->kids[i], free_f);
 	func_free(free_f, t);
 exit:
 	return 0;
@@ -44,16 +44,24 @@ extern int ptree_children;
 extern int tree_size;
 struct head_db;
 
+/* space for @_k children slots, packed right after a node */
+#define PTREE_KIDS_SIZE(_k) \
+	((((_k)+sizeof(long)-1)&~(sizeof(long)-1)) + (_k)*sizeof(ptree_t*))
+
+/* allocates an empty tree (root) node, with room for all the children */
 #define INIT_PTREE_NODE(f, p, n) \
 do {\
 	(n) = (ptree_t*)func_malloc(f, sizeof(ptree_t) +\
-		ptree_children*sizeof(ptree_node_t));\
+		PTREE_KIDS_SIZE(ptree_children));\
 	if(NULL == (n))\
 		goto err_exit;\
-	tree_size+=sizeof(ptree_t);\
-	memset((n), 0, sizeof(ptree_t)+ptree_children*sizeof(ptree_node_t));\
+	tree_size+=sizeof(ptree_t) + PTREE_KIDS_SIZE(ptree_children);\
+	memset((n), 0, sizeof(ptree_t));\
 	(n)->bp=(p);\
-	(n)->ptnode=(ptree_node_t*)((n)+1);\
+	(n)->kids_size=ptree_children;\
+	(n)->kids_idx=(unsigned char*)((n)+1);\
+	(n)->kids=(ptree_t**)((char*)(n)->kids_idx +\
+		PTREE_KIDS_SIZE(ptree_children) - ptree_children*sizeof(ptree_t*));\
 }while(0);
 
 
@@ -156,13 +164,28 @@ typedef struct ptree_node_ {
 	unsigned int rg_len;
 	unsigned int rg_pos;
 	rg_entry_t *rg;
-	struct ptree_ *next;
 } ptree_node_t;
 
+/* path-compressed (radix) prefix tree node; a node stands for the
+ * prefix made of all the labels from the root down to it, so only the
+ * prefixes holding rules and the branching points get a node */
 typedef struct ptree_ {
 	/* backpointer */
 	struct ptree_ *bp;
-	ptree_node_t *ptnode;
+	/* routing info for the prefix ending in this node */
+	ptree_node_t ptnode;
+	/* chars leading from the parent to this node */
+	char *label;
+	unsigned short label_len;
+	/* length of the whole prefix ending in this node */
+	unsigned short depth;
+	/* used and allocated children slots */
+	unsigned char kids_no;
+	unsigned char kids_size;
+	/* char index of the first label char of each child, followed by
+	 * the children and the label, all packed in the node's own chunk */
+	unsigned char *kids_idx;
+	struct ptree_ **kids;
 } ptree_t;
 
 
@@ -196,6 +219,12 @@ add_prefix(
 	osips_free_f
 	);
 
+ptree_node_t*
+get_prefix_node(
+	ptree_t *ptree,
+	str* prefix
+	);
+
 rt_info_t*
 get_prefix(
 	ptree_t *ptree,
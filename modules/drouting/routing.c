@@ -43,6 +43,7 @@
 #include "../../time_rec.h"
 #include "prefix_tree.h"
 #include "parse.h"
+#include "dr_db_def.h"
 
 #define is_valid_gw_char(_c) \
 	(isalpha(_c) || isdigit(_c) || (_c)=='_' || (_c)=='-' || (_c)=='.')
@@ -76,6 +77,13 @@ build_rt_data(struct head_db *part)
 
 	}
 
+	/* the rules index is needed only to apply delta reloads */
+	if (updated_drr_col.s && (rdata->rules_idx = map_create(flags))==NULL) {
+		LM_ERR("Initializing rules index failed!\n");
+		map_destroy(rdata->pgw_tree, 0);
+		map_destroy(rdata->carriers_tree, 0);
+		goto err_exit;
+	}
 
 	return rdata;
 err_exit:
@@ -445,6 +453,47 @@ err_exit:
 	return -1;
 }
 
+
+/* unlinks the @r rule from all the groups of the @pn node; the rule is
+ * freed once no longer linked anywhere */
+int del_rt_info(
+	ptree_node_t *pn,
+	rt_info_t* r,
+	osips_free_f free_f
+	)
+{
+	rt_info_wrp_t **rtlw, *t;
+	int i, n = 0;
+
+	if((NULL == pn) || (NULL == r) || (NULL == pn->rg))
+		return 0;
+
+	for(i=0; i<pn->rg_pos; i++) {
+		for(rtlw=&pn->rg[i].rtlw; *rtlw; ) {
+			if((*rtlw)->rtl != r) {
+				rtlw = &(*rtlw)->next;
+				continue;
+			}
+			t = *rtlw;
+			*rtlw = t->next;
+			func_free(free_f, t);
+			n++;
+		}
+		if (NULL == pn->rg[i].rtlw) {
+			/* no rules left for this group, keep the array compact */
+			pn->rg[i] = pn->rg[--pn->rg_pos];
+			memset(&pn->rg[pn->rg_pos], 0, sizeof(rg_entry_t));
+			i--;
+		}
+	}
+
+	r->ref_cnt -= n;
+	if (r->ref_cnt == 0)
+		free_rt_info(r, free_f);
+
+	return n;
+}
+
 int
 add_dst(
 	rt_data_t *r,
@@ -720,6 +769,13 @@ free_rt_data(
 		/* del carriers */
 		del_carriers_list(rt_data->carriers_tree);
 		rt_data->carriers_tree=0;
+		/* del the rules index, the rules went with the tree */
+		if (rt_data->rules_idx) {
+			map_destroy(rt_data->rules_idx,
+				(rt_data->rules_idx->flags & AVLMAP_PERSISTENT?
+					rpm_free_w:shm_free_w));
+			rt_data->rules_idx=0;
+		}
 		/* del top level */
 		func_free(free_f, rt_data);
 	}
@@ -64,8 +64,19 @@ typedef struct rt_data_ {
 	ptree_node_t noprefix;
 	/* tree with routing prefixes */
 	ptree_t *pt;
+
+	/* rules indexed by their DB id, kept only for delta reloads */
+	map_t rules_idx;
+	/* the most recent update time of the loaded rules */
+	time_t rules_ts;
 }rt_data_t;
 
+/* where a rule was linked in the tree, as kept in the rules index */
+typedef struct dr_rule_ref_ {
+	rt_info_t *ri;
+	str prefix;
+} dr_rule_ref_t;
+
 
 struct head_cache_socket {
 	str host;
@@ -162,4 +173,11 @@ del_pgw_list(
 
 void
 free_rt_data(rt_data_t*, osips_free_f);
+
+int
+del_rt_info(
+	ptree_node_t *pn,
+	rt_info_t *r,
+	osips_free_f ff
+	);
 #endif
@@ -37,6 +37,7 @@
 
 /* dialog stuff */
 extern struct dlg_binds lb_dlg_binds;
+extern int *lb_untracked_dlgs;
 
 extern int fetch_freeswitch_stats;
 extern int initial_fs_load;
@@ -215,6 +216,151 @@ static int lb_set_resource_bitmask(struct lb_resource *res, unsigned int bit)
 }
 
 
+static inline void lb_heap_set(struct lb_heap *heap, int which,
+									unsigned int pos, struct lb_heap_node *node)
+{
+	heap->nodes[pos] = *node;
+	node->rmap->heap_pos[which] = pos;
+}
+
+static void lb_heap_sift(struct lb_heap *heap, int which, unsigned int pos)
+{
+	struct lb_heap_node node = heap->nodes[pos];
+	unsigned int child;
+
+	/* up */
+	while (pos > 0 && heap->nodes[(pos - 1) / 2].key < node.key) {
+		lb_heap_set(heap, which, pos, &heap->nodes[(pos - 1) / 2]);
+		pos = (pos - 1) / 2;
+	}
+
+	/* down */
+	while ((child = 2 * pos + 1) < heap->n) {
+		if (child + 1 < heap->n &&
+		heap->nodes[child + 1].key > heap->nodes[child].key)
+			child++;
+		if (heap->nodes[child].key <= node.key)
+			break;
+		lb_heap_set(heap, which, pos, &heap->nodes[child]);
+		pos = child;
+	}
+
+	lb_heap_set(heap, which, pos, &node);
+}
+
+static int lb_heap_reserve(struct lb_heap *heap, unsigned int no)
+{
+	struct lb_heap_node *nodes;
+	unsigned int size;
+
+	if (heap->n + no <= heap->size)
+		return 0;
+
+	for (size = heap->size ? heap->size : 8; size < heap->n + no; size *= 2) ;
+
+	nodes = shm_realloc(heap->nodes, size * sizeof *nodes);
+	if (!nodes) {
+		LM_ERR("no more shm mem\n");
+		return -1;
+	}
+	heap->nodes = nodes;
+	heap->size = size;
+
+	return 0;
+}
+
+/* room for the new node must be reserved first */
+static void lb_heap_push(struct lb_heap *heap, int which, int key,
+							struct lb_dst *dst, struct lb_resource_map *rm)
+{
+	heap->nodes[heap->n].key = key;
+	heap->nodes[heap->n].dst = dst;
+	heap->nodes[heap->n].rmap = rm;
+	rm->heap_pos[which] = heap->n;
+	lb_heap_sift(heap, which, heap->n++);
+}
+
+/* available load of a destination on a resource, as in get_dst_load() */
+static inline int lb_avail_load(struct lb_resource_map *rm, int relative,
+																int load)
+{
+	if (relative)
+		return rm->max_load ? 100 - (100 * load / rm->max_load) : 0;
+
+	return rm->max_load - load;
+}
+
+/* re-indexes the destination after a change of its load or max load on
+ * the @rm resource; the resource lock must be held */
+void lb_update_dst_load(struct lb_dst *dst, struct lb_resource_map *rm)
+{
+	struct lb_heap *heap;
+	int load, i;
+
+	load = lb_dlg_binds.get_profile_size(rm->resource->profile,
+		&dst->profile_id);
+
+	for (i = LB_HEAP_ABSOLUTE; i <= LB_HEAP_RELATIVE; i++) {
+		heap = &rm->rgrp->heap[i];
+		heap->nodes[rm->heap_pos[i]].key = lb_avail_load(rm, i, load);
+		lb_heap_sift(heap, i, rm->heap_pos[i]);
+	}
+}
+
+/* re-indexes the destination on all its resources */
+void lb_update_dst_loads(struct lb_dst *dst)
+{
+	int i;
+
+	for (i = 0; i < dst->rmap_no; i++) {
+		lock_get(dst->rmap[i].resource->lock);
+		lb_update_dst_load(dst, &dst->rmap[i]);
+		lock_release(dst->rmap[i].resource->lock);
+	}
+}
+
+/* picks up the load changes the module is not notified about (shared
+ * profiles, dialogs loaded from DB or replicated) */
+void lb_update_loads(struct lb_data *data)
+{
+	struct lb_dst *dst;
+
+	for (dst = data->dsts; dst; dst = dst->next)
+		lb_update_dst_loads(dst);
+}
+
+/* gets the heaps of the destination's group on the @rm resource ready
+ * for one more node */
+static int lb_prepare_index(struct lb_dst *dst, struct lb_resource_map *rm)
+{
+	struct lb_res_group *rgrp;
+
+	for (rgrp = rm->resource->groups; rgrp; rgrp = rgrp->next)
+		if (rgrp->group == dst->group)
+			break;
+
+	if (!rgrp) {
+		rgrp = shm_malloc(sizeof *rgrp);
+		if (!rgrp) {
+			LM_ERR("no more shm mem\n");
+			return -1;
+		}
+		memset(rgrp, 0, sizeof *rgrp);
+		rgrp->group = dst->group;
+		rgrp->next = rm->resource->groups;
+		rm->resource->groups = rgrp;
+	}
+	rm->rgrp = rgrp;
+
+	/* the destination may list the resource more than once */
+	if (lb_heap_reserve(&rgrp->heap[LB_HEAP_ABSOLUTE], dst->rmap_no) < 0 ||
+	lb_heap_reserve(&rgrp->heap[LB_HEAP_RELATIVE], dst->rmap_no) < 0)
+		return -1;
+
+	return 0;
+}
+
+
 int add_lb_dsturi( struct lb_data *data, int id, int group, char *uri,
 											char* resource, unsigned int flags)
 {
@@ -270,6 +416,7 @@ int add_lb_dsturi( struct lb_data *data, int id, int group, char *uri,
 
 	dst->id = id;
 	dst->group = group;
+	dst->index = data->dst_no;
 	dst->rmap_no = lb_rl->n;
 	dst->flags = flags;
 
@@ -339,6 +486,23 @@ int add_lb_dsturi( struct lb_data *data, int id, int group, char *uri,
 		}
 	}
 
+	/* index it in the heaps of its resources; there is no load yet (as
+	 * far as we know), the first update of the loads will fix that */
+	for( i=0 ; i<lb_rl->n ; i++) {
+		if (lb_prepare_index(dst, &dst->rmap[i]) < 0) {
+			LM_ERR("failed to index destination\n");
+			goto error;
+		}
+	}
+	for( i=0 ; i<lb_rl->n ; i++) {
+		lb_heap_push(&dst->rmap[i].rgrp->heap[LB_HEAP_ABSOLUTE],
+			LB_HEAP_ABSOLUTE, lb_avail_load(&dst->rmap[i], 0, 0),
+			dst, &dst->rmap[i]);
+		lb_heap_push(&dst->rmap[i].rgrp->heap[LB_HEAP_RELATIVE],
+			LB_HEAP_RELATIVE, lb_avail_load(&dst->rmap[i], 1, 0),
+			dst, &dst->rmap[i]);
+	}
+
 	/* link at the end */
 	if (data->last_dst==NULL) {
 		data->dsts = data->last_dst = dst;
@@ -360,6 +524,7 @@ error:
 void free_lb_data(struct lb_data *data)
 {
 	struct lb_resource *lbr1, *lbr2;
+	struct lb_res_group *rgrp1, *rgrp2;
 	struct lb_dst *lbd1, *lbd2;
 	str lb_str = { MI_SSTR("load_balancer") };
 
@@ -372,6 +537,15 @@ void free_lb_data(struct lb_data *data)
 		lbr1 = lbr1->next;
 		if (lbr2->dst_bitmap)
 			shm_free(lbr2->dst_bitmap);
+		for( rgrp1=lbr2->groups ; rgrp1 ; ) {
+			rgrp2 = rgrp1;
+			rgrp1 = rgrp1->next;
+			if (rgrp2->heap[LB_HEAP_ABSOLUTE].nodes)
+				shm_free(rgrp2->heap[LB_HEAP_ABSOLUTE].nodes);
+			if (rgrp2->heap[LB_HEAP_RELATIVE].nodes)
+				shm_free(rgrp2->heap[LB_HEAP_RELATIVE].nodes);
+			shm_free(rgrp2);
+		}
 		if (lbr2->lock) {
 			lock_destroy( lbr2->lock );
 			lock_dealloc( lbr2->lock );
@@ -431,6 +605,65 @@ static int get_dst_load(struct lb_resource **res, unsigned int res_no,
 }
 
 
+static struct lb_heap *lb_get_heap(struct lb_resource *res,
+								unsigned int group, unsigned int flags)
+{
+	struct lb_res_group *rgrp;
+
+	for (rgrp = res->groups; rgrp; rgrp = rgrp->next)
+		if (rgrp->group == group)
+			return &rgrp->heap[(flags & LB_FLAGS_RELATIVE) ?
+				LB_HEAP_RELATIVE : LB_HEAP_ABSOLUTE];
+
+	return NULL;
+}
+
+/* re-indexes @dst on @res, after changing its profile */
+static void lb_update_dst_res(struct lb_dst *dst, struct lb_resource *res)
+{
+	unsigned int l;
+
+	for (l = 0; l < dst->rmap_no; l++)
+		if (dst->rmap[l].resource == res) {
+			lb_update_dst_load(dst, &dst->rmap[l]);
+			return;
+		}
+}
+
+/* the heap is walked in order of the keys, by keeping its visited
+ * frontier in a second (smaller) heap of positions */
+static void lb_walk_push(struct lb_heap *heap, unsigned int *walk,
+								unsigned int *walk_n, unsigned int pos)
+{
+	unsigned int i = (*walk_n)++;
+
+	while (i > 0 && heap->nodes[walk[(i - 1) / 2]].key < heap->nodes[pos].key) {
+		walk[i] = walk[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	walk[i] = pos;
+}
+
+static unsigned int lb_walk_pop(struct lb_heap *heap, unsigned int *walk,
+														unsigned int *walk_n)
+{
+	unsigned int top = walk[0], last, i, child;
+
+	last = walk[--(*walk_n)];
+	for (i = 0; (child = 2 * i + 1) < *walk_n; i = child) {
+		if (child + 1 < *walk_n &&
+		heap->nodes[walk[child + 1]].key > heap->nodes[walk[child]].key)
+			child++;
+		if (heap->nodes[walk[child]].key <= heap->nodes[last].key)
+			break;
+		walk[i] = walk[child];
+	}
+	walk[i] = last;
+
+	return top;
+}
+
+
 /* Performce the LB logic. It may return:
  *   0 - success
  *  -1 - generic error
@@ -453,6 +686,9 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 	/* selected destinations buffer */
 	static struct lb_dst **dsts = NULL;
 	static unsigned int dsts_size = 0;
+	/* frontier of the heap walk */
+	static unsigned int *walk = NULL;
+	static unsigned int walk_size = 0;
 
 	/* control vars */
 	struct lb_resource **res_cur;
@@ -462,6 +698,9 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 	unsigned int dsts_size_cur, dsts_size_max;
 	unsigned int *dst_bitmap_cur;
 	unsigned int bitmap_size_cur;
+	struct lb_heap *heap, *it_h;
+	unsigned int walk_n, pos, child;
+	int bounded;
 	struct dlg_cell *dlg;
 
 	/* AVP related vars */
@@ -707,6 +946,38 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 		dsts_size_max = 1;
 	}
 
+	/* all the candidates are in the group's heap of any requested
+	 * resource, so walk the smallest one */
+	heap = NULL;
+	for( i=0 ; i<res_cur_n ; i++ ) {
+		it_h = lb_get_heap(res_cur[i], group, flags);
+		if( it_h == NULL || it_h->n == 0 ) {
+			heap = NULL;
+			break;
+		}
+		if( heap == NULL || it_h->n < heap->n )
+			heap = it_h;
+	}
+	if( heap && heap->n > walk_size ) {
+		walk = (unsigned int *)pkg_realloc(walk,
+			heap->n * sizeof(unsigned int));
+		if( walk == NULL ) {
+			walk_size = 0;
+			LM_ERR("no more pkg mem - walk buffer realloc failed\n");
+			return -1;
+		}
+		walk_size = heap->n;
+	}
+
+	/* the keys are refreshed on each local change of a load, including
+	 * the end of the dialogs routed here; the loads of shared profiles
+	 * and of untracked dialogs may drop behind them, so only use the keys
+	 * for ordering and check all the candidates */
+	bounded = (*lb_untracked_dlgs == 0);
+	for( i=0 ; i<res_cur_n && bounded ; i++ )
+		if( res_cur[i]->profile->repl_type != REPL_NONE )
+			bounded = 0;
+
 	/* be sure the dialog is created */
 	if ( (dlg=lb_dlg_binds.get_dlg())==NULL ) {
 		if( lb_dlg_binds.create_dlg(req, 0) != 1 ) {
@@ -730,6 +1001,9 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 					res_prev[i]->profile->name.len,
 					res_prev[i]->profile->name.s, last_dst->profile_id.len,
 					last_dst->profile_id.s );
+			lock_get(res_prev[i]->lock);
+			lb_update_dst_res(last_dst, res_prev[i]);
+			lock_release(res_prev[i]->lock);
 		}
 	}
 
@@ -745,58 +1019,81 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 	load = it_l = 0;
 	dsts_size_cur = 0;
 	cnt_aval_dst = 0;
-	for( it_d=data->dsts,i=0,j=0 ; it_d ; it_d=it_d->next ) {
-		if( it_d->group == group ) {
-			if( (dst_bitmap_cur[i] & (1 << j)) &&
-			((it_d->flags & LB_DST_STAT_DSBL_FLAG) == 0) ) {
-				/* valid destination (group & resources & status) */
-				cnt_aval_dst++;
-				if( get_dst_load(res_cur, res_cur_n, it_d, flags, &it_l) ) {
-					/* only valid load here */
-					if( (it_l > 0) || (flags & LB_FLAGS_NEGATIVE) ) {
-						/* only allowed load here */
-						if( !cond/*first pass*/ || (it_l > load)/*new max*/ ) {
-							cond = 1;
-							/* restart buffer */
-							dsts_size_cur = 0;
-						} else if( it_l < load ) {
-							/* lower availability -> new iteration */
-							if( ++j == (8 * sizeof(unsigned int)) ) { i++; j=0; }
-							continue;
-						}
-
-						/* add destination to to selected destinations buffer,
-						 * if we have a room for it */
-						if( dsts_size_cur < dsts_size_max ) {
-							load = it_l;
-							dsts_cur[dsts_size_cur++] = it_d;
-
-							LM_DBG("%s call of LB - destination %d <%.*s> "
-								"selected for LB set with free=%d\n",
-								(reuse ? "sequential" : "initial"),
-								it_d->id, it_d->uri.len, it_d->uri.s, it_l
-							);
-						}
+	/* walk the heap from the most available destination down; the load
+	 * of a destination is its lowest availability over all the requested
+	 * resources, so, if the keys are up to date, it is never above its
+	 * key in the heap */
+	walk_n = 0;
+	if( heap )
+		lb_walk_push(heap, walk, &walk_n, 0);
+	while( walk_n ) {
+		pos = lb_walk_pop(heap, walk, &walk_n);
+		/* no better (or equal) destination can follow */
+		if( bounded && cond && heap->nodes[pos].key < load )
+			break;
+		/* no allowed load can follow */
+		if( bounded && !(flags & LB_FLAGS_NEGATIVE) &&
+		heap->nodes[pos].key <= 0 && cnt_aval_dst )
+			break;
+		for( child=2*pos+1 ; child<=2*pos+2 && child<heap->n ; child++ )
+			lb_walk_push(heap, walk, &walk_n, child);
+
+		it_d = heap->nodes[pos].dst;
+		i = it_d->index / (8 * sizeof(unsigned int));
+		j = it_d->index % (8 * sizeof(unsigned int));
+		if( (i < bitmap_size_cur) && (dst_bitmap_cur[i] & (1 << j)) &&
+		((it_d->flags & LB_DST_STAT_DSBL_FLAG) == 0) ) {
+			/* valid destination (group & resources & status) */
+			cnt_aval_dst++;
+			if( get_dst_load(res_cur, res_cur_n, it_d, flags, &it_l) ) {
+				/* only valid load here */
+				if( (it_l > 0) || (flags & LB_FLAGS_NEGATIVE) ) {
+					/* only allowed load here */
+					if( !cond/*first pass*/ || (it_l > load)/*new max*/ ) {
+						cond = 1;
+						/* restart buffer */
+						dsts_size_cur = 0;
+					} else if( it_l < load ) {
+						/* lower availability -> new iteration */
+						continue;
+					} else if( dsts_size_max == 1 &&
+					dsts_cur[0]->index < it_d->index ) {
+						/* same availability -> keep the first defined */
+						continue;
+					} else if( dsts_size_max == 1 ) {
+						dsts_size_cur = 0;
+					}
+
+					/* add destination to to selected destinations buffer,
+					 * if we have a room for it */
+					if( dsts_size_cur < dsts_size_max ) {
+						load = it_l;
+						dsts_cur[dsts_size_cur++] = it_d;
+
+						LM_DBG("%s call of LB - destination %d <%.*s> "
+							"selected for LB set with free=%d\n",
+							(reuse ? "sequential" : "initial"),
+							it_d->id, it_d->uri.len, it_d->uri.s, it_l
+						);
 					}
-				} else {
-					LM_WARN("%s call of LB - skipping destination %d <%.*s> - "
-						"unable to calculate free resources\n",
-						(reuse ? "sequential" : "initial"),
-						it_d->id, it_d->uri.len, it_d->uri.s
-					);
 				}
-			}
-			else {
-				LM_DBG("%s call of LB - skipping destination %d <%.*s> "
-					"(filtered=%d , disabled=%d)\n",
+			} else {
+				LM_WARN("%s call of LB - skipping destination %d <%.*s> - "
+					"unable to calculate free resources\n",
 					(reuse ? "sequential" : "initial"),
-					it_d->id, it_d->uri.len, it_d->uri.s,
-					((dst_bitmap_cur[i] & (1 << j)) ? 0 : 1),
-					((it_d->flags & LB_DST_STAT_DSBL_FLAG) ? 1 : 0)
+					it_d->id, it_d->uri.len, it_d->uri.s
 				);
 			}
 		}
-		if( ++j == (8 * sizeof(unsigned int)) ) { i++; j=0; }
+		else {
+			LM_DBG("%s call of LB - skipping destination %d <%.*s> "
+				"(filtered=%d , disabled=%d)\n",
+				(reuse ? "sequential" : "initial"),
+				it_d->id, it_d->uri.len, it_d->uri.s,
+				((i < bitmap_size_cur && (dst_bitmap_cur[i] & (1 << j))) ? 0:1),
+				((it_d->flags & LB_DST_STAT_DSBL_FLAG) ? 1 : 0)
+			);
+		}
 	}
 	/* choose one destination among selected */
 	if( dsts_size_cur > 0 ) {
@@ -822,13 +1119,17 @@ int lb_route(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 					"[%.*s]\n", (reuse ? "sequential" : "initial"),
 					res_cur[i]->profile->name.len, res_cur[i]->profile->name.s,
 					dst->profile_id.len, dst->profile_id.s);
+			lb_update_dst_res(dst, res_cur[i]);
 		}
+		if( lb_dlg_binds.register_dlgcb(dlg,
+		DLGCB_TERMINATED|DLGCB_FAILED|DLGCB_EXPIRED, lb_dlg_end,
+		(void *)(long)dst->id, NULL) != 0 )
+			LM_ERR("%s call of LB - failed to register dialog callback\n",
+				(reuse ? "sequential" : "initial"));
 
 		/* set dst as used (not selected) */
-		for( it_d=data->dsts,i=0,j=0 ; it_d ; it_d=it_d->next ) {
-			if( it_d == dst ) { dst_bitmap_cur[i] &= ~(1 << j); break; }
-			if( ++j == (8 * sizeof(unsigned int)) ) { i++; j=0; }
-		}
+		dst_bitmap_cur[dst->index / (8 * sizeof(unsigned int))] &=
+			~(1 << (dst->index % (8 * sizeof(unsigned int))));
 	} else {
 		LM_DBG("%s call of LB - no destination found\n",
 			(reuse ? "sequential" : "initial"));
@@ -972,6 +1273,9 @@ int do_lb_reset(struct sip_msg *req, struct lb_data *data)
 					LM_ERR("reset LB - failed to remove from profile [%.*s]->"
 						"[%.*s]\n", res_val.s.len, res_val.s.s,
 						last_dst->profile_id.len, last_dst->profile_id.s );
+				lock_get(it_r->lock);
+				lb_update_dst_res(last_dst, it_r);
+				lock_release(it_r->lock);
 			} else {
 					LM_WARN("reset LB - ignore unknown previous resource "
 						"[%.*s]\n", res_val.s.len, res_val.s.s);
@@ -1150,12 +1454,18 @@ end_search:
 			call_res[i]->profile)!=1)
 				LM_ERR("failed to remove from profile\n");
 		}
+		lb_update_dst_res(dst, call_res[i]);
 	}
 
 	/* unlock the resources*/
 	for( i=0 ; i<rl->n ; i++)
 		lock_release( call_res[i]->lock );
 
+	if( !dir && lb_dlg_binds.register_dlgcb(dlg,
+	DLGCB_TERMINATED|DLGCB_FAILED|DLGCB_EXPIRED, lb_dlg_end,
+	(void *)(long)dst->id, NULL) != 0 )
+		LM_ERR("failed to register dialog callback\n");
+
 	return 0;
 }
 
@@ -47,12 +47,38 @@
 /* max number of IPs for a destination (DNS loookup) */
 #define LB_MAX_IPS  32
 
+/* indexes of the per group heaps */
+#define LB_HEAP_ABSOLUTE  0
+#define LB_HEAP_RELATIVE  1
+
+struct lb_heap_node {
+	int key;                       /* available load */
+	struct lb_dst *dst;
+	struct lb_resource_map *rmap;
+};
+
+/* max-heap of destinations, by their available load on a resource */
+struct lb_heap {
+	unsigned int n;
+	unsigned int size;
+	struct lb_heap_node *nodes;
+};
+
+/* the destinations of a group having a resource, indexed by the
+ * available load in both absolute and relative estimation */
+struct lb_res_group {
+	unsigned int group;
+	struct lb_heap heap[2];
+	struct lb_res_group *next;
+};
+
 struct lb_resource {
 	str name;
 	gen_lock_t *lock;
 	struct dlg_profile_table *profile;
 	unsigned int bitmap_size;
 	unsigned int *dst_bitmap;
+	struct lb_res_group *groups;
 	struct lb_resource *next;
 };
 
@@ -61,11 +87,15 @@ struct lb_resource_map {
 	unsigned int max_load;
 
 	int fs_enabled;
+
+	struct lb_res_group *rgrp;
+	unsigned int heap_pos[2];
 };
 
 struct lb_dst {
 	unsigned int group;
 	unsigned int id;
+	unsigned int index;  /* bit of the destination in the bitmaps */
 	str uri;
 	str profile_id;
 	unsigned int rmap_no;
@@ -94,6 +124,16 @@ int add_lb_dsturi( struct lb_data *data, int id, int group, char *uri,
 
 void free_lb_data(struct lb_data *data);
 
+void lb_update_dst_load(struct lb_dst *dst, struct lb_resource_map *rm);
+
+void lb_update_dst_loads(struct lb_dst *dst);
+
+void lb_update_loads(struct lb_data *data);
+
+/* dialog callback (load_balancer.c) re-indexing the destination whose id
+ * is the parameter, once the ended dialog left its profiles */
+void lb_dlg_end(struct dlg_cell *dlg, int type, struct dlg_cb_params *params);
+
 int do_lb_start(struct sip_msg *req, int group, struct lb_res_str_list *rl,
 		unsigned int flags, struct lb_data *data);
 
@@ -47,6 +47,9 @@ static char *table_name = NULL;
 
 /* dialog stuff */
 struct dlg_binds lb_dlg_binds;
+/* dialogs in the LB profiles which were not routed by this instance
+ * (loaded from DB or replicated), so their end is not notified */
+int *lb_untracked_dlgs = NULL;
 
 /* reader-writers lock for data reloading */
 static rw_lock_t *ref_lock = NULL;
@@ -114,6 +117,9 @@ static int w_lb_count_call(struct sip_msg *req, str *ip_str, int *port, char *gr
 static void lb_prob_handler(unsigned int ticks, void* param);
 
 static void lb_update_max_loads(unsigned int ticks, void *param);
+static void lb_update_loads_handler(unsigned int ticks, void *param);
+static void lb_dlg_loaded(struct dlg_cell *dlg, int type,
+		struct dlg_cb_params *params);
 
 static cmd_export_t cmds[]={
 	{"lb_start", (cmd_function)w_lb_start, {
@@ -369,6 +375,13 @@ static int mod_init(void)
 	}
 	*curr_data = 0;
 
+	lb_untracked_dlgs = (int *)shm_malloc(sizeof(int));
+	if (lb_untracked_dlgs==0) {
+		LM_CRIT("failed to get shm mem for dialogs counter\n");
+		return -1;
+	}
+	*lb_untracked_dlgs = 0;
+
 	/* create & init lock */
 	if ((ref_lock = lock_init_rw()) == NULL) {
 		LM_CRIT("failed to init lock\n");
@@ -395,6 +408,18 @@ static int mod_init(void)
 	/* close DB connection */
 	lb_close_db();
 
+	/* keep the destinations index in sync with the dialogs ending */
+	if (register_timer("lb-update-loads", lb_update_loads_handler, NULL,
+	1, TIMER_FLAG_SKIP_ON_DELAY)<0) {
+		LM_ERR("failed to register timer for load updates\n");
+		return -1;
+	}
+	if (lb_dlg_binds.register_dlgcb(NULL, DLGCB_LOADED, lb_dlg_loaded,
+	NULL, NULL) != 0) {
+		LM_ERR("failed to register callback for loaded dialogs\n");
+		return -1;
+	}
+
 	/* arm a function for probing */
 	if (lb_prob_interval) {
 		/* load TM API */
@@ -498,6 +523,11 @@ static void mod_destroy(void)
 		curr_data = 0;
 	}
 
+	if (lb_untracked_dlgs) {
+		shm_free(lb_untracked_dlgs);
+		lb_untracked_dlgs = 0;
+	}
+
 	/* destroy lock */
 	if (ref_lock) {
 		lock_destroy_rw( ref_lock );
@@ -740,6 +770,68 @@ static void lb_prob_handler(unsigned int ticks, void* param)
 	lock_stop_read( ref_lock );
 }
 
+static void lb_update_loads_handler(unsigned int ticks, void *param)
+{
+	lock_start_read( ref_lock );
+
+	lb_update_loads(*curr_data);
+
+	lock_stop_read( ref_lock );
+}
+
+void lb_dlg_end(struct dlg_cell *dlg, int type, struct dlg_cb_params *params)
+{
+	int id = (int)(long)*params->param;
+	struct lb_dst *dst;
+
+	lock_start_read( ref_lock );
+
+	for (dst = *curr_data ? (*curr_data)->dsts : NULL; dst; dst = dst->next)
+		if (dst->id == id) {
+			lb_update_dst_loads(dst);
+			break;
+		}
+
+	lock_stop_read( ref_lock );
+}
+
+static void lb_dlg_untracked_end(struct dlg_cell *dlg, int type,
+												struct dlg_cb_params *params)
+{
+	__sync_fetch_and_sub(lb_untracked_dlgs, 1);
+}
+
+static void lb_dlg_loaded(struct dlg_cell *dlg, int type,
+												struct dlg_cb_params *params)
+{
+	struct dlg_profile_link *l;
+	struct lb_resource *res;
+	int found = 0;
+
+	lock_start_read( ref_lock );
+
+	for (l = dlg->profile_links; l && !found; l = l->next)
+		for (res = *curr_data ? (*curr_data)->resources : NULL; res;
+		res = res->next)
+			if (res->profile == l->profile) {
+				found = 1;
+				break;
+			}
+
+	lock_stop_read( ref_lock );
+
+	if (!found)
+		return;
+
+	/* until it is gone, the destinations index may lag behind its end */
+	if (lb_dlg_binds.register_dlgcb(dlg, DLGCB_DESTROY, lb_dlg_untracked_end,
+	NULL, NULL) != 0) {
+		LM_ERR("failed to register callback for dialog destruction\n");
+		return;
+	}
+	__sync_fetch_and_add(lb_untracked_dlgs, 1);
+}
+
 static void lb_update_max_loads(unsigned int ticks, void *param)
 {
 	struct lb_dst *dst;
@@ -774,6 +866,10 @@ static void lb_update_max_loads(unsigned int ticks, void *param)
 					(dst->fs_sock->stats.id_cpu / (float)100) *
 						dst->fs_sock->stats.max_sess;
 				}
+				lock_get(dst->rmap[ri].resource->lock);
+				lb_update_dst_load(dst, &dst->rmap[ri]);
+				lock_release(dst->rmap[ri].resource->lock);
+
 				LM_DBG("load update on FS (%p) %s:%d: "
 				       "%d -> %d (%d %d %.3f), prof=%d\n",
 				       dst->fs_sock, dst->fs_sock->host.s, dst->fs_sock->port,
@@ -843,7 +939,10 @@ mi_response_t *mi_lb_resize(const mi_params_t *params,
 			return init_mi_error( 404,
 				MI_SSTR("Destination has no such resource"));
 		} else {
+			lock_get(dst->rmap[n].resource->lock);
 			dst->rmap[n].max_load = size;
+			lb_update_dst_load(dst, &dst->rmap[n]);
+			lock_release(dst->rmap[n].resource->lock);
 		}
 	}
 
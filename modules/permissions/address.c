@@ -69,7 +69,7 @@ int reload_address_table(struct pm_part_struct *part_struct)
 	db_val_t* val;
 
 	struct address_list **new_hash_table;
-	struct subnet *new_subnet_table;
+	struct subnet_table *new_subnet_table;
 	int i, mask, proto, group, port, id;
 	struct ip_addr *ip_addr;
 	struct net *subnet;
@@ -274,6 +274,11 @@ int reload_address_table(struct pm_part_struct *part_struct)
 
 	part_struct->perm_dbf.free_result(part_struct->db_handle, res);
 
+	if (subnet_table_build(new_subnet_table) < 0) {
+		LM_ERR("failed to build the subnet table\n");
+		return -1;
+	}
+
 	*part_struct->hash_table = new_hash_table;
 	*part_struct->subnet_table = new_subnet_table;
 	LM_DBG("address table reloaded successfully.\n");
@@ -354,7 +359,7 @@ int init_address(struct pm_partition *partition)
     part_struct->subnet_table_2 = new_subnet_table();
     if (!part_struct->subnet_table_2) goto error;
 
-	part_struct->subnet_table = (struct subnet **)shm_malloc(sizeof(struct subnet *));
+	part_struct->subnet_table = (struct subnet_table **)shm_malloc(sizeof(struct subnet_table *));
 	if (!part_struct->subnet_table) goto error;
 
 	*part_struct->subnet_table = part_struct->subnet_table_1;
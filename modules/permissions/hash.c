@@ -326,196 +326,422 @@ void empty_hash(struct address_list** table) {
 /*
  * Create and initialize a subnet table
  */
-struct subnet* new_subnet_table(void)
+struct subnet_table* new_subnet_table(void)
 {
-    struct subnet* ptr;
+	struct subnet_table* ptr;
 
-    /* subnet record [PERM_MAX_SUBNETS] contains in its grp field
-       the number of subnet records in the subnet table */
-    ptr = (struct subnet *)shm_malloc
-	(sizeof(struct subnet) * (PERM_MAX_SUBNETS + 1));
-
-    if (!ptr) {
+	ptr = (struct subnet_table *)shm_malloc(sizeof(struct subnet_table) +
+		sizeof(struct subnet) * PERM_SUBNETS_INIT);
+	if (!ptr) {
 		LM_ERR("no shm memory for subnet table\n");
 		return 0;
-    }
+	}
 
-    ptr[PERM_MAX_SUBNETS].grp = 0;
-    return ptr;
+	memset(ptr, 0, sizeof(struct subnet_table));
+	ptr->subnets = (struct subnet *)(ptr + 1);
+	ptr->size = PERM_SUBNETS_INIT;
+	ptr->root4 = ptr->root6 = -1;
+	return ptr;
 }
 
 
 /*
- * Add <grp, subnet, mask, port> into subnet table so that table is
- * kept in increasing ordered according to grp.
+ * Add <grp, subnet, mask, port> into subnet table; the table gets
+ * ordered by grp only when built
  */
-int subnet_table_insert(struct subnet* table, unsigned int grp,
+int subnet_table_insert(struct subnet_table* table, unsigned int grp,
 			struct net *subnet,
 			unsigned int port, int proto, str* pattern, str *info)
 {
-    int i;
-    unsigned int count;
+	struct subnet *subnets, *s;
 
-    count = table[PERM_MAX_SUBNETS].grp;
-
-    if (count == PERM_MAX_SUBNETS) {
-		LM_CRIT("subnet table is full\n");
-		return 0;
-    }
+	if (!subnet) {
+		LM_ERR("no subnet to insert\n");
+		return -1;
+	}
 
-    i = count - 1;
+	if (table->count == table->size) {
+		/* the first chunk is allocated along with the table */
+		if (table->subnets == (struct subnet *)(table + 1)) {
+			subnets = shm_malloc(2 * table->size * sizeof(struct subnet));
+			if (subnets)
+				memcpy(subnets, table->subnets,
+					table->count * sizeof(struct subnet));
+		} else {
+			subnets = shm_realloc(table->subnets,
+				2 * table->size * sizeof(struct subnet));
+		}
+		if (!subnets) {
+			LM_ERR("no shm memory to grow the subnet table\n");
+			return -1;
+		}
 
-    while (i >= 0 && table[i].grp > grp) {
-		table[i + 1] = table[i];
-		i--;
-    }
+		table->subnets = subnets;
+		table->size *= 2;
+	}
 
-    table[i + 1].grp = grp;
-    table[i + 1].port = port;
-	table[i + 1].proto = proto;
+	s = &table->subnets[table->count];
+	memset(s, 0, sizeof *s);
+	s->seq = table->count;
+	s->grp = grp;
+	s->port = port;
+	s->proto = proto;
 
-	if (subnet) {
-		table[i + 1].subnet = (struct net*) shm_malloc(sizeof(struct net));
-		if (!table[i + 1].subnet) {
-			LM_ERR("cannot allocate shm memory for table subnet\n");
-			return -1;
-		}
-		memcpy(table[i + 1].subnet, subnet, sizeof(struct net));
+	s->subnet = (struct net*) shm_malloc(sizeof(struct net));
+	if (!s->subnet) {
+		LM_ERR("cannot allocate shm memory for table subnet\n");
+		return -1;
 	}
-	else
-		table[i + 1].subnet = NULL;
+	memcpy(s->subnet, subnet, sizeof(struct net));
 
 	if (info->len) {
-		table[i + 1].info = (char*) shm_malloc(info->len + 1);
-		if (!table[i + 1].info) {
+		s->info = (char*) shm_malloc(info->len + 1);
+		if (!s->info) {
 			LM_ERR("cannot allocate shm memory for table info\n");
-			return -1;
+			goto error;
 		}
-		memcpy(table[i + 1].info, info->s, info->len);
-		table[i + 1].info[info->len] = 0;
+		memcpy(s->info, info->s, info->len);
+		s->info[info->len] = 0;
 	}
-	else
-		table[i + 1].info = NULL;
 
 	if (pattern->len) {
-		table[i + 1].pattern = (char*) shm_malloc(pattern->len + 1);
-		if (!table[i + 1].pattern) {
+		s->pattern = (char*) shm_malloc(pattern->len + 1);
+		if (!s->pattern) {
 			LM_ERR("cannot allocate shm memory for table pattern\n");
-			return -1;
+			goto error;
 		}
-		memcpy(table[i + 1].pattern, pattern->s, pattern->len);
-		table[i + 1].pattern[ pattern->len ] = 0;
+		memcpy(s->pattern, pattern->s, pattern->len);
+		s->pattern[ pattern->len ] = 0;
+	}
+
+	table->count++;
+
+	return 1;
+error:
+	if (s->info)
+		shm_free(s->info);
+	shm_free(s->subnet);
+	return -1;
+}
+
+
+static inline unsigned int subnet_bitlen(struct net *net)
+{
+	unsigned int i, len = 0;
+	unsigned char b;
+
+	for (i = 0; i < net->mask.len; i++) {
+		for (b = net->mask.u.addr[i]; b & 0x80; b <<= 1)
+			len++;
+		if (net->mask.u.addr[i] != 0xff)
+			break;
+	}
+
+	return len;
+}
+
+static inline int same_prefix(struct subnet *a, struct subnet *b)
+{
+	return a->subnet->ip.af == b->subnet->ip.af &&
+		subnet_bitlen(a->subnet) == subnet_bitlen(b->subnet) &&
+		!memcmp(a->subnet->ip.u.addr, b->subnet->ip.u.addr,
+			a->subnet->ip.len);
+}
+
+#define addr_bit(_a, _i) (((_a)[(_i) >> 3] >> (7 - ((_i) & 7))) & 1)
+
+/* number of leading bits (up to max) the two addresses have in common */
+static inline unsigned int common_bits(unsigned char *a, unsigned char *b,
+		unsigned int max)
+{
+	unsigned int i = 0;
+
+	while (i + 8 <= max && a[i >> 3] == b[i >> 3])
+		i += 8;
+	while (i < max && addr_bit(a, i) == addr_bit(b, i))
+		i++;
+
+	return i;
+}
+
+static struct subnet* sort_subnets;
+
+static int cmp_subnet_grp(const void *a, const void *b)
+{
+	const struct subnet *sa = a, *sb = b;
+
+	if (sa->grp != sb->grp)
+		return sa->grp < sb->grp ? -1 : 1;
+
+	return sa->seq < sb->seq ? -1 : (sa->seq > sb->seq);
+}
+
+/* by family, prefix length, prefix and group */
+static int cmp_subnet_prefix(const void *a, const void *b)
+{
+	struct subnet *sa = &sort_subnets[*(const unsigned int *)a];
+	struct subnet *sb = &sort_subnets[*(const unsigned int *)b];
+	unsigned int la, lb;
+	int rc;
+
+	if (sa->subnet->ip.af != sb->subnet->ip.af)
+		return sa->subnet->ip.af - sb->subnet->ip.af;
+
+	la = subnet_bitlen(sa->subnet);
+	lb = subnet_bitlen(sb->subnet);
+	if (la != lb)
+		return la < lb ? -1 : 1;
+
+	rc = memcmp(sa->subnet->ip.u.addr, sb->subnet->ip.u.addr,
+		sa->subnet->ip.len);
+	if (rc)
+		return rc;
+
+	if (sa->grp != sb->grp)
+		return sa->grp < sb->grp ? -1 : 1;
+
+	return *(const unsigned int *)a < *(const unsigned int *)b ? -1 : 1;
+}
+
+static int new_subnet_node(struct subnet_table *table, int *nodes_no,
+		unsigned char *addr, unsigned int bitlen,
+		unsigned int first, unsigned int no)
+{
+	struct subnet_node *node = &table->nodes[*nodes_no];
+
+	node->kids[0] = node->kids[1] = -1;
+	node->bitlen = bitlen;
+	memcpy(node->addr, addr, sizeof node->addr);
+	node->first = first;
+	node->no = no;
+
+	return (*nodes_no)++;
+}
+
+static void subnet_node_insert(struct subnet_table *table, int *root,
+		int *nodes_no, unsigned char *addr, unsigned int bitlen,
+		unsigned int first, unsigned int no)
+{
+	struct subnet_node *cur;
+	int *link = root, old, n, b;
+	unsigned int c;
+
+	while (*link >= 0) {
+		cur = &table->nodes[*link];
+		c = common_bits(cur->addr, addr,
+			cur->bitlen < bitlen ? cur->bitlen : bitlen);
+
+		if (c == cur->bitlen) {
+			if (bitlen == cur->bitlen) {
+				/* a former branching node */
+				cur->first = first;
+				cur->no = no;
+				return;
+			}
+
+			link = &cur->kids[addr_bit(addr, cur->bitlen)];
+			continue;
+		}
+
+		/* the prefix diverges inside this node - split it */
+		old = *link;
+		if (c == bitlen) {
+			n = new_subnet_node(table, nodes_no, addr, bitlen, first, no);
+			table->nodes[n].kids[addr_bit(table->nodes[old].addr, c)] = old;
+		} else {
+			n = new_subnet_node(table, nodes_no, addr, c, 0, 0);
+			b = new_subnet_node(table, nodes_no, addr, bitlen, first, no);
+			table->nodes[n].kids[addr_bit(addr, c)] = b;
+			table->nodes[n].kids[addr_bit(table->nodes[old].addr, c)] = old;
+		}
+		*link = n;
+		return;
+	}
+
+	*link = new_subnet_node(table, nodes_no, addr, bitlen, first, no);
+}
+
+
+/*
+ * Sort the subnet table by group and build the longest prefix match
+ * tries over it
+ */
+int subnet_table_build(struct subnet_table* table)
+{
+	struct subnet *s;
+	unsigned int i, j;
+	int nodes_no = 0;
+
+	if (table->count == 0)
+		return 0;
+
+	qsort(table->subnets, table->count, sizeof(struct subnet),
+		cmp_subnet_grp);
+
+	table->order = shm_malloc(table->count * sizeof(unsigned int));
+	/* each distinct prefix adds at most a leaf and a branching node */
+	table->nodes = shm_malloc(2 * table->count * sizeof(struct subnet_node));
+	if (!table->order || !table->nodes) {
+		LM_ERR("no shm memory for the subnet tries\n");
+		return -1;
+	}
+
+	for (i = 0; i < table->count; i++)
+		table->order[i] = i;
+	sort_subnets = table->subnets;
+	qsort(table->order, table->count, sizeof(unsigned int),
+		cmp_subnet_prefix);
+
+	for (i = 0; i < table->count; i = j) {
+		s = &table->subnets[table->order[i]];
+		for (j = i + 1; j < table->count &&
+			same_prefix(s, &table->subnets[table->order[j]]); j++) ;
+
+		subnet_node_insert(table, s->subnet->ip.af == AF_INET ?
+			&table->root4 : &table->root6, &nodes_no, s->subnet->ip.u.addr,
+			subnet_bitlen(s->subnet), i, j - i);
 	}
+
+	LM_DBG("built the subnet tries: %u subnets, %d nodes\n",
+		table->count, nodes_no);
+
+	return 0;
+}
+
+
+/* fills in the trie nodes holding subnets the IP belongs to, from the least
+ * to the most specific one, and returns their number */
+static int subnet_lookup(struct subnet_table *table, struct ip_addr *ip,
+		int *path)
+{
+	struct subnet_node *node;
+	int n, k = 0;
+
+	if (ip->af == AF_INET)
+		n = table->root4;
+	else if (ip->af == AF_INET6)
+		n = table->root6;
 	else
-		table[i + 1].pattern = NULL;
+		return 0;
 
+	while (n >= 0) {
+		node = &table->nodes[n];
+		if (common_bits(node->addr, ip->u.addr, node->bitlen) < node->bitlen)
+			break;
 
-    table[PERM_MAX_SUBNETS].grp = count + 1;
+		if (node->no)
+			path[k++] = n;
 
-    return 1;
+		if (node->bitlen == ip->len * 8)
+			break;
+		n = node->kids[addr_bit(ip->u.addr, node->bitlen)];
+	}
+
+	return k;
 }
 
 
 /*
  * Check if an entry exists in subnet table that matches given group, ip_addr,
- * and port.  Port 0 in subnet table matches any port.
+ * and port.  Port 0 in subnet table matches any port.  The first matching
+ * subnet, in group and insertion order, wins - just like a linear scan of
+ * the table would pick it.
  */
-int match_subnet_table(struct sip_msg *msg, struct subnet* table,
+int match_subnet_table(struct sip_msg *msg, struct subnet_table* table,
 			unsigned int grp, struct ip_addr *ip, unsigned int port, int proto,
 			char *pattern, pv_spec_t *info)
 {
-        unsigned int count, i;
+	int path[128 + 1];
+	unsigned int i, lo, hi, best;
+	struct subnet *s;
 	pv_value_t pvt;
-	int match_res, found_group = 0;
-
-	count = table[PERM_MAX_SUBNETS].grp;
+	int k;
 
-	if (count == 0) {
+	if (table->count == 0) {
 		LM_DBG("subnet table is empty\n");
 		return -2;
 	}
 
 	if (grp != GROUP_ANY) {
-		for (i = 0; i < count; i++) {
-			if (table[i].grp == grp) {
-				found_group = 1;
-				break;
-			} else if (table[i].grp > grp) {
-				break;
-			}
+		/* the table is sorted by group */
+		for (lo = 0, hi = table->count; lo < hi; ) {
+			i = lo + (hi - lo) / 2;
+			if (table->subnets[i].grp < grp)
+				lo = i + 1;
+			else
+				hi = i;
 		}
 
-		if (!found_group) {
+		if (lo == table->count || table->subnets[lo].grp != grp) {
 			LM_DBG("specified group %u does not exist in hash table\n", grp);
 			return -2;
 		}
 	}
 
-	i = 0;
-	do {
-		if ((table[i].grp == grp || table[i].grp == GROUP_ANY
-				|| grp == GROUP_ANY) &&
-			(table[i].port == port || table[i].port == PORT_ANY
-				|| port == PORT_ANY) &&
-			(table[i].proto == proto || table[i].proto == PROTO_NONE
-			 	|| proto == PROTO_NONE))
-			{
-
-				match_res = matchnet(ip, table[i].subnet);
-
-				if (match_res != 1) {
-					i++;
-					continue;
-				}
-
-				if (table[i].pattern && pattern) {
-					match_res = fnmatch(table[i].pattern, pattern, FNM_PERIOD);
+	/* every prefix on the path is a candidate - keep the lowest index; the
+	 * subnets of a prefix are ordered by index, so only the first match
+	 * of each one counts */
+	best = table->count;
+	for (k = subnet_lookup(table, ip, path) - 1; k >= 0; k--) {
+		for (i = table->nodes[path[k]].first;
+		i < table->nodes[path[k]].first + table->nodes[path[k]].no; i++) {
+			if (table->order[i] >= best)
+				break;
+			s = &table->subnets[table->order[i]];
 
-					if (match_res) {
-						i++;
-						continue;
-					}
-				}
+			if (!(s->grp == grp || s->grp == GROUP_ANY
+					|| grp == GROUP_ANY) ||
+				!(s->port == port || s->port == PORT_ANY
+					|| port == PORT_ANY) ||
+				!(s->proto == proto || s->proto == PROTO_NONE
+					|| proto == PROTO_NONE))
+				continue;
 
-				if (info) {
-					pvt.flags = PV_VAL_STR;
-					pvt.rs.s = table[i].info;
-					pvt.rs.len = table[i].info ? strlen(table[i].info) : 0;
+			if (s->pattern && pattern &&
+			fnmatch(s->pattern, pattern, FNM_PERIOD))
+				continue;
 
-					if (pv_set_value(msg, info, (int)EQ_T, &pvt) < 0) {
-						LM_ERR("setting of avp failed\n");
-						return -1;
-	    			}
-				}
+			best = table->order[i];
+			break;
+		}
+	}
 
-				LM_DBG("match found in the subnet table\n");
-				return 1;
-			}
+	if (best == table->count) {
+		LM_DBG("no match in the subnet table\n");
+		return -1;
+	}
 
-		if (table[i].grp > grp && grp != GROUP_ANY)
-			break;
-		i++;
+	if (info) {
+		s = &table->subnets[best];
+		pvt.flags = PV_VAL_STR;
+		pvt.rs.s = s->info;
+		pvt.rs.len = s->info ? strlen(s->info) : 0;
 
-	} while (i < count);
+		if (pv_set_value(msg, info, (int)EQ_T, &pvt) < 0) {
+			LM_ERR("setting of avp failed\n");
+			return -1;
+		}
+	}
 
-	LM_DBG("no match in the subnet table\n");
-    return -1;
+	LM_DBG("match found in the subnet table\n");
+	return 1;
 }
 
 
 /*
  * Print subnets stored in subnet table
  */
-int subnet_table_mi_print(struct subnet* table, mi_item_t *part_item,
+int subnet_table_mi_print(struct subnet_table* table, mi_item_t *part_item,
 		struct pm_part_struct *pm)
 {
     unsigned int count, i;
+	struct subnet *s;
 	char *p, *ip, *mask, prbuf[PROTO_NAME_MAX_SIZE];
 	int len;
 	static char ip_buff[IP_ADDR_MAX_STR_SIZE];
 	mi_item_t *dests_arr, *dest_item;
 
-	count = table[PERM_MAX_SUBNETS].grp;
+	count = table->count;
 
 	dests_arr = add_mi_array(part_item, MI_SSTR("Destinations"));
 	if (!dests_arr)
@@ -526,19 +752,21 @@ int subnet_table_mi_print(struct subnet* table, mi_item_t *part_item,
 		if (!dest_item)
 			return -1;
 
-		ip = ip_addr2a(&table[i].subnet->ip);
+		s = &table->subnets[i];
+
+		ip = ip_addr2a(&s->subnet->ip);
 		if (!ip) {
 			LM_ERR("cannot print ip address\n");
 			continue;
 		}
 		strcpy(ip_buff, ip);
-		mask = ip_addr2a(&table[i].subnet->mask);
+		mask = ip_addr2a(&s->subnet->mask);
 		if (!mask) {
 			LM_ERR("cannot print mask address\n");
 			continue;
 		}
 
-		if (add_mi_number(dest_item, MI_SSTR("grp"), table[i].grp) < 0)
+		if (add_mi_number(dest_item, MI_SSTR("grp"), s->grp) < 0)
 			return -1;
 
 		if (add_mi_string(dest_item, MI_SSTR("ip"), ip_buff, strlen(ip_buff)) < 0)
@@ -547,14 +775,14 @@ int subnet_table_mi_print(struct subnet* table, mi_item_t *part_item,
 		if (add_mi_string(dest_item, MI_SSTR("ip"), mask, strlen(mask)) < 0)
 			return -1;
 
-		if (add_mi_number(dest_item, MI_SSTR("port"), table[i].port) < 0)
+		if (add_mi_number(dest_item, MI_SSTR("port"), s->port) < 0)
 			return -1;
 
-		if (table[i].proto == PROTO_NONE) {
+		if (s->proto == PROTO_NONE) {
 			p = "any";
 			len = 3;
 		} else {
-			p = proto2str(table[i].proto, prbuf);
+			p = proto2str(s->proto, prbuf);
 			len = p - prbuf;
 			p = prbuf;
 		}
@@ -562,13 +790,13 @@ int subnet_table_mi_print(struct subnet* table, mi_item_t *part_item,
 			return -1;
 
 		if (add_mi_string(dest_item, MI_SSTR("pattern"),
-			table[i].pattern,
-		    table[i].pattern ? strlen(table[i].pattern) : 0) < 0)
+			s->pattern,
+		    s->pattern ? strlen(s->pattern) : 0) < 0)
 		    return -1;
 
 		if (add_mi_string(dest_item, MI_SSTR("context_info"),
-			table[i].info,
-		    table[i].info ? strlen(table[i].info) : 0) < 0)
+			s->info,
+		    s->info ? strlen(s->info) : 0) < 0)
 		    return -1;
     }
 
@@ -579,65 +807,78 @@ int subnet_table_mi_print(struct subnet* table, mi_item_t *part_item,
 /*
  * Check if an entry exists in subnet table that matches given ip_addr,
  * and port.  Port 0 in subnet table matches any port.  Return group of
- * first match or -1 if no match is found.
+ * the first match, in group and insertion order, or -1 if no match is
+ * found.
  */
-int find_group_in_subnet_table(struct subnet* table,
+int find_group_in_subnet_table(struct subnet_table* table,
 		                   struct ip_addr *ip, unsigned int port)
 {
-	unsigned int count, i, match_res;
-
-	count = table[PERM_MAX_SUBNETS].grp;
-
-	i = 0;
-	while (i < count) {
-		if	(table[i].port == port || table[i].port == 0) {
-			match_res = matchnet(ip, table[i].subnet);
-
-			if (match_res == 1)
-		        return table[i].grp;
-
+	int path[128 + 1];
+	unsigned int i, best;
+	struct subnet *s;
+	int k;
+
+	best = table->count;
+	for (k = subnet_lookup(table, ip, path) - 1; k >= 0; k--) {
+		for (i = table->nodes[path[k]].first;
+		i < table->nodes[path[k]].first + table->nodes[path[k]].no; i++) {
+			if (table->order[i] >= best)
+				break;
+			s = &table->subnets[table->order[i]];
+			if (s->port == port || s->port == 0) {
+				best = table->order[i];
+				break;
+			}
 		}
-	    i++;
 	}
 
-	return -1;
+	return best == table->count ? -1 : (int)table->subnets[best].grp;
 }
 
 
 /*
  * Empty contents of subnet table
  */
-void empty_subnet_table(struct subnet *table)
+void empty_subnet_table(struct subnet_table *table)
 {
-	int count, i;
+	unsigned int i;
 
 	if (!table)
 		return;
 
-	count = table[PERM_MAX_SUBNETS].grp;
-
-	for (i = 0; i < count; i++) {
-		if (table[i].info)
-    		        shm_free(table[i].info);
-		if (table[i].subnet)
-		        shm_free(table[i].subnet);
+	for (i = 0; i < table->count; i++) {
+		if (table->subnets[i].info)
+			shm_free(table->subnets[i].info);
+		if (table->subnets[i].pattern)
+			shm_free(table->subnets[i].pattern);
+		if (table->subnets[i].subnet)
+			shm_free(table->subnets[i].subnet);
 	}
+	table->count = 0;
 
-	table[PERM_MAX_SUBNETS].grp = 0;
+	if (table->order) {
+		shm_free(table->order);
+		table->order = NULL;
+	}
+	if (table->nodes) {
+		shm_free(table->nodes);
+		table->nodes = NULL;
+	}
+	table->root4 = table->root6 = -1;
 }
 
 
 /*
  * Release memory allocated for a subnet table
  */
-void free_subnet_table(struct subnet* table)
+void free_subnet_table(struct subnet_table* table)
 {
+	if (!table)
+		return;
+
 	empty_subnet_table(table);
 
-	if (table)
-	    shm_free(table);
+	if (table->subnets != (struct subnet *)(table + 1))
+		shm_free(table->subnets);
+	shm_free(table);
 }
-
-
-
-
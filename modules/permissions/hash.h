@@ -102,32 +102,58 @@ int find_group_in_hash_table(struct address_list** table,
 
 
 
-#define PERM_MAX_SUBNETS 128
+#define PERM_SUBNETS_INIT 128
 
 /*
  * Structure used to store a subnet
  */
 struct subnet {
-	unsigned int grp;        /* address group, subnet count in last record */
+	unsigned int grp;        /* address group */
 	struct net *subnet;		 /* IP subnet + mask */
 	int proto;                  /* Protocol -- UDP, TCP, TLS, or SCTP */
 	char *pattern;              /* Pattern matching From header field */
 	unsigned int port;       /* port or 0 */
 	char *info;				 /* extra information */
+	unsigned int seq;        /* insertion order, keeps the sort stable */
+};
+
+/*
+ * Node of the (path compressed) binary trie used for the longest prefix
+ * match of the subnets
+ */
+struct subnet_node {
+	int kids[2];             /* indexes of the kids, -1 if none */
+	unsigned int bitlen;     /* length of the prefix */
+	unsigned char addr[16];  /* the prefix */
+	unsigned int first, no;  /* subnets with exactly this prefix, in order[] */
+};
+
+/*
+ * Structure used to store the subnets; the tries are built by
+ * subnet_table_build() once all the subnets are inserted
+ */
+struct subnet_table {
+	struct subnet *subnets;  /* sorted by group, once built */
+	unsigned int count;
+	unsigned int size;
+	unsigned int *order;     /* subnet indexes, grouped by prefix */
+	struct subnet_node *nodes;
+	int root4, root6;        /* roots of the IPv4 and IPv6 tries */
 };
 
 
 /*
  * Create a subnet table
  */
-struct subnet* new_subnet_table(void);
+struct subnet_table* new_subnet_table(void);
 
 
 /*
  * Check if an entry exists in subnet table that matches given group, ip_addr,
- * and port.  Port 0 in subnet table matches any port.
+ * and port.  Port 0 in subnet table matches any port.  The first matching
+ * subnet, in group and insertion order, wins.
  */
-int match_subnet_table(struct sip_msg *msg, struct subnet* table,
+int match_subnet_table(struct sip_msg *msg, struct subnet_table* table,
 		unsigned int group, struct ip_addr *ip, unsigned int port, int proto,
 		char *pattern, pv_spec_t* info);
 
@@ -135,38 +161,45 @@ int match_subnet_table(struct sip_msg *msg, struct subnet* table,
 /*
  * Checks if an entry exists in subnet table that matches given ip_addr,
  * and port.  Port 0 in subnet table matches any port.  Returns group of
- * the first match or -1 if no match is found.
+ * the first match, in group and insertion order, or -1 if no match is
+ * found.
  */
-int find_group_in_subnet_table(struct subnet* table,
+int find_group_in_subnet_table(struct subnet_table* table,
 		struct ip_addr *ip, unsigned int port);
 
 /*
  * Empty contents of subnet table
  */
-void empty_subnet_table(struct subnet *table);
+void empty_subnet_table(struct subnet_table *table);
 
 
 /*
  * Release memory allocated for a subnet table
  */
-void free_subnet_table(struct subnet* table);
+void free_subnet_table(struct subnet_table* table);
 
 
 
 /*
- * Add <grp, subnet, mask, port> into subnet table so that table is
- * kept ordered according to subnet, port, grp.
+ * Add <grp, subnet, mask, port> into subnet table
  */
-int subnet_table_insert(struct subnet* table, unsigned int grp,
+int subnet_table_insert(struct subnet_table* table, unsigned int grp,
 		struct net *subnet, unsigned int port, int proto,
 		str* pattern, str *info);
 
 
+/*
+ * Sort the subnet table by group and build the longest prefix match
+ * tries over it, once all the subnets were inserted
+ */
+int subnet_table_build(struct subnet_table* table);
+
+
 /*
  * Print subnets stored in subnet table
  */
-/*void subnet_table_print(struct subnet* table, FILE* reply_file);*/
-int subnet_table_mi_print(struct subnet* table, mi_item_t *part_item,
+/*void subnet_table_print(struct subnet_table* table, FILE* reply_file);*/
+int subnet_table_mi_print(struct subnet_table* table, mi_item_t *part_item,
 		struct pm_part_struct *pm);
 
 
@@ -29,20 +29,45 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <assert.h>
 
 #include "../../dprint.h"
+#include "../../timer.h"
 #include "../../mem/shm_mem.h"
 #include "ip_tree.h"
 
 
 
+/* seconds between two "branch is full" warnings of the same branch */
+#define PIKE_FULL_WARN_INTERVAL  10
+
 static struct ip_tree*  root = 0;
 
+extern int pike_log_level;
+
+
+#define MAX_HITS_VAL  (NODE_HITS_MASK-1)
+
+#define is_hot_non_leaf(_prev,_curr) \
+	( (_prev)>=root->max_hits>>2 || (_curr)>=root->max_hits>>2 ||\
+	  (((_prev)+(_curr))>>1)>=root->max_hits>>2 )
+
+#define is_hot_leaf(_prev,_curr) \
+	( (_prev)>=root->max_hits || (_curr)>=root->max_hits ||\
+	  (((_prev)+(_curr))>>1)>=root->max_hits )
+
+#define next_gen(_c) \
+	((((_c)&NODE_GEN_MASK)+(1ULL<<NODE_GEN_SHIFT))&NODE_GEN_MASK)
+
+#define is_live(_c) \
+	(((_c)&(NODE_LIVE_FLAG|NODE_BUSY_FLAG))==NODE_LIVE_FLAG)
+
+#define is_empty(_c) \
+	(((_c)&(NODE_LIVE_FLAG|NODE_BUSY_FLAG))==0)
+
 
 static inline struct ip_node* prv_get_tree_branch(unsigned char b)
 {
-	return root->entries[b].node;
+	return root->nodes + (unsigned int)b*root->branch_size;
 }
 
 
@@ -62,8 +87,9 @@ static inline void prv_unlock_tree_branch(unsigned char b)
 
 
 /* wrapper functions */
-struct ip_node* get_tree_branch(unsigned char b)
+struct ip_node* get_tree_branch(unsigned char b, unsigned int *size)
 {
+	*size = root->branch_size;
 	return prv_get_tree_branch(b);
 }
 void lock_tree_branch(unsigned char b)
@@ -110,9 +136,11 @@ static gen_lock_set_t* init_lock_set(int *size)
 
 
 
-/* Builds and Inits a new IP tree */
-int init_ip_tree(int maximum_hits)
+/* Builds and Inits a new IP table */
+int init_ip_tree(int maximum_hits, unsigned int tsize, unsigned int timeout,
+														int v6_aggregate)
 {
+	unsigned int n;
 	int size;
 	int i;
 
@@ -124,6 +152,21 @@ int init_ip_tree(int maximum_hits)
 	}
 	memset( root, 0, sizeof(struct ip_tree));
 
+	/* the size of the table is a power of 2, within limits */
+	if (tsize<IP_TREE_MIN_SIZE)
+		tsize = IP_TREE_MIN_SIZE;
+	if (tsize>IP_TREE_MAX_SIZE)
+		tsize = IP_TREE_MAX_SIZE;
+	for( n=IP_TREE_MIN_SIZE ; n<tsize ; n<<=1 );
+	root->branch_size = n / MAX_IP_BRANCHES;
+
+	root->nodes = (struct ip_node*)shm_malloc(n*sizeof(struct ip_node));
+	if (root->nodes==0) {
+		LM_ERR("no more shm mem for %u table slots\n", n);
+		goto error;
+	}
+	memset( root->nodes, 0, n*sizeof(struct ip_node));
+
 	/* init lock set */
 	size = MAX_IP_BRANCHES;
 	root->entry_lock_set = init_lock_set( &size );
@@ -133,44 +176,32 @@ int init_ip_tree(int maximum_hits)
 	}
 	/* assign to each branch a lock */
 	for(i=0;i<MAX_IP_BRANCHES;i++) {
-		root->entries[i].node = 0;
+		root->entries[i].used = 0;
 		root->entries[i].lock_idx = i % size;
 	}
 
 	root->max_hits = maximum_hits;
+	root->timeout = timeout;
+	root->v6_aggregate = v6_aggregate;
+
+	LM_DBG("table with %u slots (%u per branch)\n", n, root->branch_size);
 
 	return 0;
 error:
-	if (root)
+	if (root) {
+		if (root->nodes)
+			shm_free(root->nodes);
 		shm_free(root);
-	return -1;
-}
-
-
-
-/* destroy an ip_node and all nodes under it; the nodes must be first removed
- * from any other lists/timers */
-static inline void destroy_ip_node(struct ip_node *node)
-{
-	struct ip_node *foo, *bar;
-
-	foo = node->kids;
-	while (foo){
-		bar = foo;
-		foo = foo->next;
-		destroy_ip_node(bar);
+		root = 0;
 	}
-
-	shm_free(node);
+	return -1;
 }
 
 
 
-/* destroy and free the IP tree */
+/* destroy and free the IP table */
 void destroy_ip_tree(void)
 {
-	int i;
-
 	if (root==0)
 		return;
 
@@ -180,10 +211,8 @@ void destroy_ip_tree(void)
 		lock_set_dealloc(root->entry_lock_set);
 	}
 
-	/* destroy all the nodes */
-	for(i=0;i<MAX_IP_BRANCHES;i++)
-		if (root->entries[i].node)
-			destroy_ip_node(root->entries[i].node);
+	if (root->nodes)
+		shm_free(root->nodes);
 
 	shm_free( root );
 	root = 0;
@@ -193,177 +222,401 @@ void destroy_ip_tree(void)
 
 
 
-/* builds a new ip_node corresponding to a byte value */
-static inline struct ip_node *new_ip_node(unsigned char byte)
+/* the key of an address - IPv6 ones may be aggregated by their /64 prefix */
+static inline int ip_key_len(int ip_len)
 {
-	struct ip_node *new_node;
+	return (ip_len==16 && root->v6_aggregate) ? 8 : ip_len;
+}
 
-	new_node = (struct ip_node*)shm_malloc(sizeof(struct ip_node));
-	if (!new_node) {
-		LM_ERR("no more shm mem\n");
-		return 0;
-	}
-	memset( new_node, 0, sizeof(struct ip_node));
-	new_node->byte = byte;
-	return new_node;
+
+static inline unsigned long long hash_ip(unsigned char *ip, int len, int full)
+{
+	unsigned long long a = 0, b = 0, h;
+
+	memcpy( &a, ip, len>8 ? 8 : len);
+	if (len>8)
+		memcpy( &b, ip+8, len-8);
+
+	h = a*0x9e3779b97f4a7c15ULL ^ (b+len+(full<<8))*0xc2b2ae3d27d4eb4fULL;
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
 }
 
 
+/* accounts one more hit on a live node, as seen with the "c" control word,
+ * and returns the updated word via "ctl"; only the complete addresses may
+ * turn red. Returns -1 if the node was meanwhile released or moved */
+static inline int hit_node(struct ip_node *node, unsigned long long c,
+		unsigned char *flag, unsigned long long *ctl)
+{
+	unsigned long long nc, o;
+	unsigned int prev, curr;
+
+	for(;;) {
+		if (!is_live(c))
+			return -1;
+		prev = node_prev_hits(c);
+		curr = node_curr_hits(c);
+		nc = c;
+		/* increment it, but be careful not to overflow the value */
+		if (curr<MAX_HITS_VAL) {
+			nc += 1ULL<<NODE_CURR_SHIFT;
+			curr++;
+		}
+		/* becoming red node? (prefixes never do) */
+		*flag = 0;
+		if (node->len==node->full) {
+			if ( (nc&NODE_ISRED_FLAG)==0 ) {
+				if (is_hot_leaf(prev,curr)) {
+					*flag = RED_NODE|NEWRED_NODE;
+					nc |= NODE_ISRED_FLAG;
+				}
+			} else {
+				*flag = RED_NODE;
+			}
+		}
+		o = __sync_val_compare_and_swap( &node->ctl, c, nc);
+		if (o==c) {
+			*ctl = nc;
+			return 0;
+		}
+		if ( (o^c)&(NODE_GEN_MASK|NODE_LIVE_FLAG|NODE_BUSY_FLAG) )
+			return -1;
+		c = o;
+	}
+}
+
 
-/* splits from the current node (dad) a new child */
-struct ip_node *split_node(struct ip_node* dad, unsigned char byte)
+/* looks for the given key into a branch, starting from its home slot;
+ * stops at the first empty slot and returns it via "empty" */
+static inline struct ip_node* find_node(struct ip_node *branch,
+		unsigned int home, unsigned char *ip, int len, int full,
+		unsigned long long *ctl, struct ip_node **empty)
 {
-	struct ip_node *new_node;
+	unsigned int mask = root->branch_size-1;
+	unsigned int i, n;
+	unsigned long long c;
+	struct ip_node *node;
 
-	/* create a new node */
-	if ( (new_node=new_ip_node(byte))==0 )
-		return 0;
-	/* the child node inherits a part of his father hits */
-	if (dad->hits[CURR_POS]>=1)
-		new_node->hits[CURR_POS] = (dad->hits[CURR_POS])-1;
-	if (dad->leaf_hits[CURR_POS]>=1)
-		new_node->leaf_hits[PREV_POS] = (dad->leaf_hits[PREV_POS])-1;
-	/* link the child into father's kids list -> insert it at the beginning,
-	 * is much faster */
-	if (dad->kids) {
-		dad->kids->prev = new_node;
-		new_node->next = dad->kids;
+	*empty = 0;
+	for( n=0,i=home ; n<root->branch_size ; n++,i=(i+1)&mask ) {
+		node = branch + i;
+		c = node->ctl;
+		if (is_empty(c)) {
+			*empty = node;
+			return 0;
+		}
+		/* nodes being moved/released are skipped; a lookup missing
+		 * them ends up in the locked path, where they are stable */
+		if (!is_live(c))
+			continue;
+		__sync_synchronize();
+		if (node->len==len && node->full==full &&
+		memcmp(node->ip, ip, len)==0) {
+			*ctl = c;
+			return node;
+		}
 	}
-	dad->kids = new_node;
-	new_node->branch = dad->branch;
-	new_node->prev = dad;
 
-	return new_node;
+	return 0;
 }
 
 
-#define is_hot_non_leaf(_node) \
-	( (_node)->hits[PREV_POS]>=root->max_hits>>2 ||\
-	  (_node)->hits[CURR_POS]>=root->max_hits>>2 ||\
-	  (((_node)->hits[PREV_POS]+(_node)->hits[CURR_POS])>>1)>=\
-		 root->max_hits>>2 )
+/* accounts one more hit on the given key, if already tracked - the lookup
+ * is done without locking */
+static struct ip_node* hit_key(unsigned char *ip, int len, int full,
+		unsigned char *flag, unsigned long long *ctl)
+{
+	struct ip_node *node;
+	struct ip_node *empty;
+	unsigned long long h, c;
 
-#define is_hot_leaf(_node) \
-	( (_node)->leaf_hits[PREV_POS]>=root->max_hits ||\
-	  (_node)->leaf_hits[CURR_POS]>=root->max_hits ||\
-	  (((_node)->leaf_hits[PREV_POS]+(_node)->leaf_hits[CURR_POS])>>1)>=\
-		 root->max_hits )
+	h = hash_ip( ip, len, full);
 
-#define is_warm_leaf(_node) \
-	( (_node)->hits[CURR_POS]>=root->max_hits>>2 )
+	while ( (node=find_node( prv_get_tree_branch((unsigned char)(h>>56)),
+	(unsigned int)h & (root->branch_size-1), ip, len, full, &c, &empty))!=0 )
+		if (hit_node( node, c, flag, ctl)==0)
+			return node;
 
-#define MAX_TYPE_VAL(_x) \
-	(( (1<<(8*sizeof(_x)-1))-1 )|( (1<<(8*sizeof(_x)-1)) ))
+	return 0;
+}
 
 
-int is_node_hot_leaf(struct ip_node *node)
+/* adds the given key with "hits" hits in the current window or, if added
+ * meanwhile by someone else, accounts one more hit on it; returns NULL if
+ * the key cannot be added (table full) */
+static struct ip_node* add_key(unsigned char *ip, int len, int full,
+		unsigned int hits, unsigned char *flag)
 {
-	return is_hot_leaf(node);
+	struct ip_node *branch;
+	struct ip_node *node;
+	struct ip_node *empty;
+	unsigned long long h, c;
+	unsigned int home, now, dropped;
+	unsigned char b;
+
+	h = hash_ip( ip, len, full);
+	b = (unsigned char)(h >> 56);
+	home = (unsigned int)h & (root->branch_size-1);
+	branch = prv_get_tree_branch(b);
+
+	/* lock the branch as no slot may be added, moved or released
+	 * meanwhile */
+	prv_lock_tree_branch(b);
+
+	while ( (node=find_node( branch, home, ip, len, full, &c, &empty))!=0 ) {
+		if (hit_node( node, c, flag, &c)==0) {
+			prv_unlock_tree_branch(b);
+			node->expires = get_ticks() + root->timeout;
+			return node;
+		}
+	}
+
+	/* keep the branch at most 7/8 full, so probing stays short */
+	if (empty==0 || root->entries[b].used >=
+	root->branch_size - (root->branch_size>>3)) {
+		/* this is what happens during a flood - do not flood the log too */
+		now = get_ticks();
+		dropped = ++root->entries[b].not_tracked;
+		if (root->entries[b].warn_ticks==0 ||
+		now - root->entries[b].warn_ticks >= PIKE_FULL_WARN_INTERVAL) {
+			root->entries[b].warn_ticks = now ? now : 1;
+			root->entries[b].not_tracked = 0;
+		} else {
+			dropped = 0;
+		}
+		prv_unlock_tree_branch(b);
+		if (dropped)
+			LM_WARN("pike table branch %d is full, %u IPs could not be "
+				"tracked\n", b, dropped);
+		return 0;
+	}
+
+	/* add a new node */
+	node = empty;
+	c = node->ctl;
+	node->ctl = (c&NODE_GEN_MASK) | NODE_BUSY_FLAG;
+	__sync_synchronize();
+	node->len = len;
+	node->full = full;
+	memcpy( node->ip, ip, len);
+	node->home = home;
+	node->expires = get_ticks() + root->timeout;
+	if (hits>MAX_HITS_VAL)
+		hits = MAX_HITS_VAL;
+	c = next_gen(c) | NODE_LIVE_FLAG | ((unsigned long long)hits<<NODE_CURR_SHIFT);
+	__sync_synchronize();
+	node->ctl = c;
+	root->entries[b].used++;
+
+	prv_unlock_tree_branch(b);
+
+	return node;
 }
 
 
-/* mark with one more hit the given IP address - */
-struct ip_node* mark_node(unsigned char *ip,int ip_len,
-							struct ip_node **father,unsigned char *flag)
+/* mark with one more hit the given IP address; returns NULL if the address
+ * cannot be accounted (table full) */
+struct ip_node* mark_node(unsigned char *ip,int ip_len, unsigned char *flag)
 {
 	struct ip_node *node;
 	struct ip_node *kid;
-	int    byte_pos;
+	unsigned long long c;
+	int full, len;
 
-	kid = root->entries[ ip[0] ].node;
-	node = 0;
-	byte_pos = 0;
+	full = ip_key_len(ip_len);
+	*flag = 0;
 
-	LM_DBG("search on branch %d (top=%p)\n", ip[0],kid);
-	/* search into the ip tree the longest prefix matching the given IP */
-	while (kid && byte_pos<ip_len) {
-		while (kid && kid->byte!=(unsigned char)ip[byte_pos]) {
-				kid = kid->next;
-		}
-		if (kid) {
-			node = kid;
-			kid = kid->kids;
-			byte_pos++;
-		}
+	/* fast path - the address is already tracked on its own */
+	if ( (node=hit_key( ip, full, full, flag, &c))!=0 ) {
+		node->expires = get_ticks() + root->timeout;
+		return node;
 	}
 
-	LM_DBG("only first %d were matched!\n",byte_pos);
-	*flag = 0;
-	*father = 0;
+	/* otherwise, the hit goes to the longest tracked prefix of it */
+	for( len=full-1 ; len>0 ; len-- )
+		if ( (node=hit_key( ip, len, full, flag, &c))!=0 )
+			break;
 
-	/* what have we found? */
-	if (byte_pos==ip_len) {
-		/* we found the entire address */
-		node->flags |= NODE_IPLEAF_FLAG;
-		/* increment it, but be careful not to overflow the value */
-		if(node->leaf_hits[CURR_POS]<MAX_TYPE_VAL(node->leaf_hits[CURR_POS])-1)
-			node->leaf_hits[CURR_POS]++;
-		/* becoming red node? */
-		if ( (node->flags&NODE_ISRED_FLAG)==0 ) {
-			if (is_hot_leaf(node) ) {
-				*flag |= RED_NODE|NEWRED_NODE;
-				node->flags |= NODE_ISRED_FLAG;
-			}
-		} else {
-			*flag |= RED_NODE;
-		}
-	} else if (byte_pos==0) {
-		/* we hit an empty branch in the IP tree */
-		assert(node==0);
-		/* add a new node containing the start byte of the IP address */
-		if ( (node=new_ip_node(ip[0]))==0)
-			return 0;
-		node->hits[CURR_POS] = 1;
-		node->branch = ip[0];
-		*flag = NEW_NODE ;
-		/* set this node as root of the branch starting with first byte of IP*/
-		root->entries[ ip[0] ].node = node;
-	} else{
-		/* only a non-empty prefix of the IP was found */
-		if ( node->hits[CURR_POS]<MAX_TYPE_VAL(node->hits[CURR_POS])-1 )
-			node->hits[CURR_POS]++;
-		if ( is_hot_non_leaf(node) ) {
-			/* we have to split the node */
-			*flag = NEW_NODE ;
-			LM_DBG("splitting node %p [%d]\n",node,node->byte);
-			*father = node;
-			node = split_node(node,ip[byte_pos]);
-		} else {
-			/* to reduce memory usage, force to expire non-leaf nodes if they
-			 * have just a few hits -> basically, don't update the timer for
-			 * them the nr of hits is small */
-			if ( !is_warm_leaf(node) )
-				*flag = NO_UPDATE;
-		}
+	if (node==0) {
+		/* we hit an empty branch of the "tree" */
+		return add_key( ip, 1, full, 1, flag);
 	}
 
-	return node;
+	/* to reduce memory usage, let the prefixes with just a few hits
+	 * expire - basically, don't update their timeout */
+	if ( !is_hot_non_leaf(node_prev_hits(c), node_curr_hits(c)) )
+		return node;
+	node->expires = get_ticks() + root->timeout;
+
+	/* hot prefix - "split" it; a new prefix inherits the hits of its
+	 * father, while a complete address starts counting from zero */
+	LM_DBG("splitting node %p [%d/%d]\n", node, len, full);
+	kid = add_key( ip, len+1, full,
+		len+1==full ? 0 : node_curr_hits(c)-1, flag);
+
+	return kid ? kid : node;
 }
 
 
 
-/* remove and destroy a IP node along with its subtree */
-void remove_node(struct ip_node *node)
+/* resets the counters of a blocked IP address; returns -1 if not found,
+ * 0 if found but not blocked and 1 if unblocked */
+int unmark_node(unsigned char *ip, int ip_len)
 {
-	LM_DBG("destroying node %p\n",node);
-	/* is it a branch root node? (these nodes have no prev (father)) */
-	if (node->prev==0) {
-		assert(root->entries[node->byte].node==node);
-		root->entries[node->byte].node = 0;
+	struct ip_node *node;
+	struct ip_node *empty;
+	unsigned long long h, c, o;
+	unsigned char b;
+	int len, ret;
+
+	len = ip_key_len(ip_len);
+	h = hash_ip( ip, len, len);
+	b = (unsigned char)(h >> 56);
+
+	prv_lock_tree_branch(b);
+
+	node = find_node( prv_get_tree_branch(b),
+		(unsigned int)h & (root->branch_size-1), ip, len, len, &c, &empty);
+	if (node==0) {
+		ret = -1;
 	} else {
-		/* unlink it from kids list */
-		if (node->prev->kids==node)
-			/* it's the head of the list! */
-			node->prev->kids = node->next;
-		else
-			/* it's somewhere in the list */
-			node->prev->next = node->next;
-		if (node->next)
-			node->next->prev = node->prev;
+		/* only the hits may change under lock */
+		while ( (c&NODE_ISRED_FLAG) && (o=__sync_val_compare_and_swap(
+		&node->ctl, c, c&(NODE_GEN_MASK|NODE_LIVE_FLAG)))!=c )
+			c = o;
+		ret = (c&NODE_ISRED_FLAG) ? 1 : 0;
+	}
+
+	prv_unlock_tree_branch(b);
+
+	return ret;
+}
+
+
+
+/* takes the node out of the lock-free lookups by setting it busy; returns
+ * the last control word of the node */
+static inline unsigned long long freeze_node(struct ip_node *node)
+{
+	unsigned long long c, o;
+
+	c = node->ctl;
+	while ( (o=__sync_val_compare_and_swap( &node->ctl, c,
+	(c&NODE_GEN_MASK)|NODE_BUSY_FLAG))!=c )
+		c = o;
+	return c;
+}
+
+
+/* releases the slot "i" of branch "b" and shifts back the nodes following
+ * it in the probing sequence, so no tombstones are needed;
+ * the branch must be locked */
+static void release_node(unsigned char b, unsigned int i)
+{
+	struct ip_node *branch = prv_get_tree_branch(b);
+	unsigned int mask = root->branch_size-1;
+	struct ip_node *hole, *node;
+	unsigned long long c;
+	unsigned int j;
+
+	hole = branch + i;
+	freeze_node(hole);
+
+	for( j=(i+1)&mask ; j!=i ; j=(j+1)&mask ) {
+		node = branch + j;
+		if (is_empty(node->ctl))
+			break;
+		/* the node may stay if its home is cyclically in (hole,node] */
+		if ( ((j - node->home)&mask) < ((j - (hole-branch))&mask) )
+			continue;
+		/* move it into the hole */
+		c = freeze_node(node);
+		hole->len = node->len;
+		hole->full = node->full;
+		memcpy( hole->ip, node->ip, node->len);
+		hole->home = node->home;
+		hole->expires = node->expires;
+		__sync_synchronize();
+		hole->ctl = next_gen(hole->ctl) | (c&~NODE_GEN_MASK);
+		hole = node;
 	}
 
-	/* destroy the node */
-	node->next = node->prev = 0;
-	destroy_ip_node(node);
+	__sync_synchronize();
+	hole->ctl = next_gen(hole->ctl);
+	root->entries[b].used--;
+}
+
+
+
+/* releases all the nodes with no hits for the last "timeout" ticks */
+void expire_nodes(unsigned int ticks)
+{
+	struct ip_node *branch;
+	struct ip_node *node;
+	unsigned int i;
+	int b;
+
+	for( b=0 ; b<MAX_IP_BRANCHES ; b++ ) {
+		if (root->entries[b].used==0)
+			continue;
+		branch = prv_get_tree_branch(b);
+
+		prv_lock_tree_branch(b);
+		for( i=0 ; i<root->branch_size ; ) {
+			node = branch + i;
+			if (is_live(node->ctl) && node->expires<=ticks) {
+				LM_DBG("rmv node %p\n", node);
+				release_node( b, i);
+				/* another node may have been shifted here */
+				continue;
+			}
+			i++;
+		}
+		prv_unlock_tree_branch(b);
+	}
 }
 
+
+
+/* moves to the next sampling window - the current hits become the
+ * previous ones and the nodes not hot anymore are unblocked */
+void refresh_nodes(void)
+{
+	struct ip_node *branch;
+	struct ip_node *node;
+	unsigned long long c, nc, o;
+	unsigned int i;
+	int b;
+
+	for( b=0 ; b<MAX_IP_BRANCHES ; b++ ) {
+		if (root->entries[b].used==0)
+			continue;
+		branch = prv_get_tree_branch(b);
+
+		prv_lock_tree_branch(b);
+		for( i=0 ; i<root->branch_size ; i++ ) {
+			node = branch + i;
+			c = node->ctl;
+			while (is_live(c)) {
+				nc = (c & (NODE_GEN_MASK|NODE_LIVE_FLAG|NODE_ISRED_FLAG)) |
+					((unsigned long long)node_curr_hits(c)<<NODE_PREV_SHIFT);
+				if ( (nc&NODE_ISRED_FLAG) &&
+				!is_hot_leaf(node_curr_hits(c),0) )
+					nc &= ~NODE_ISRED_FLAG;
+				if ( (o=__sync_val_compare_and_swap(&node->ctl, c, nc))==c ) {
+					if ( (c^nc)&NODE_ISRED_FLAG )
+						LM_GEN1( pike_log_level,
+							"PIKE - UNBLOCKing node %p\n",node);
+					break;
+				}
+				c = o;
+			}
+		}
+		prv_unlock_tree_branch(b);
+	}
+}
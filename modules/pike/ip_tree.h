@@ -33,66 +33,80 @@
 
 #include <stdio.h>
 #include "../../locking.h"
-#include "timer.h"
 
 
-#define NEW_NODE    (1<<0)
 #define RED_NODE    (1<<1)
 #define NEWRED_NODE (1<<2)
-#define NO_UPDATE   (1<<3)
 
+/* the table is split into this many branches (shards), each one being a
+ * contiguous, linear probed region of slots guarded by its own lock */
 #define MAX_IP_BRANCHES 256
 
-#define PREV_POS 0
-#define CURR_POS 1
-
-
-#define NODE_EXPIRED_FLAG  (1<<0)
-#define NODE_INTIMER_FLAG  (1<<1)
-#define NODE_IPLEAF_FLAG   (1<<2)
-#define NODE_ISRED_FLAG    (1<<3)
+#define IP_TREE_MIN_SIZE  (MAX_IP_BRANCHES*16)
+#define IP_TREE_MAX_SIZE  (MAX_IP_BRANCHES*65536)
+
+/* the key of a slot is either a complete address (len==full) or one of
+ * its prefixes, which are hit until they get hot - like the nodes of the
+ * former IP tree, an address gets tracked on its own only after that */
+
+/* layout of the control word of a slot: the hits of the current and of the
+ * previous sampling window, the state flags and a generation number which
+ * changes each time the slot is (re)assigned; all the updates of a
+ * tracked address are done with a compare-and-swap on this word */
+#define NODE_HITS_MASK     0xffffULL
+#define NODE_CURR_SHIFT    0
+#define NODE_PREV_SHIFT    16
+#define NODE_LIVE_FLAG     (1ULL<<32)
+#define NODE_BUSY_FLAG     (1ULL<<33)
+#define NODE_ISRED_FLAG    (1ULL<<34)
+#define NODE_GEN_SHIFT     40
+#define NODE_GEN_MASK      (~0ULL<<NODE_GEN_SHIFT)
+
+#define node_curr_hits(_c) \
+	((unsigned int)(((_c)>>NODE_CURR_SHIFT)&NODE_HITS_MASK))
+#define node_prev_hits(_c) \
+	((unsigned int)(((_c)>>NODE_PREV_SHIFT)&NODE_HITS_MASK))
 
 struct ip_node
 {
-	unsigned int      expires;
-	unsigned short    leaf_hits[2];
-	unsigned short    hits[2];
-	unsigned char     byte;
-	unsigned char     branch;
-	volatile unsigned short    flags;
-	struct list_link  timer_ll;
-	struct ip_node    *prev;
-	struct ip_node    *next;
-	struct ip_node    *kids;
+	volatile unsigned long long ctl;
+	volatile unsigned int       expires;
+	unsigned short              home;
+	unsigned char               len;   /* bytes of the key */
+	unsigned char               full;  /* bytes of the complete address */
+	unsigned char               ip[16];
 };
 
 
 struct ip_tree
 {
+	struct ip_node *nodes;
+	unsigned int   branch_size;
 	struct entry {
-		struct ip_node *node;
+		unsigned int   used;
 		int            lock_idx;
+		unsigned int   not_tracked;  /* IPs refused since the last warning */
+		unsigned int   warn_ticks;   /* when the last warning was logged */
 	} entries[MAX_IP_BRANCHES];
 	unsigned short   max_hits;
+	unsigned int     timeout;
+	int              v6_aggregate;
 	gen_lock_set_t  *entry_lock_set;
 };
 
 
-#define ll2ipnode(ptr) \
-	((struct ip_node*)((char *)(ptr)-\
-		(unsigned long)(&((struct ip_node*)0)->timer_ll)))
-
-
-int    init_ip_tree(int);
+int    init_ip_tree(int max_hits, unsigned int size, unsigned int timeout,
+		int v6_aggregate);
 void   destroy_ip_tree();
 struct ip_node* mark_node( unsigned char *ip, int ip_len,
-			struct ip_node **father, unsigned char *flag);
-void   remove_node(struct ip_node *node);
-int is_node_hot_leaf(struct ip_node *node);
+			unsigned char *flag);
+int    unmark_node( unsigned char *ip, int ip_len);
+void   expire_nodes(unsigned int ticks);
+void   refresh_nodes(void);
 
 void lock_tree_branch(unsigned char b);
 void unlock_tree_branch(unsigned char b);
-struct ip_node* get_tree_branch(unsigned char b);
+struct ip_node* get_tree_branch(unsigned char b, unsigned int *size);
 
 
 
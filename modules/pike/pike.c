@@ -46,7 +46,6 @@
 #include "../../timer.h"
 #include "../../locking.h"
 #include "ip_tree.h"
-#include "timer.h"
 #include "pike_mi.h"
 #include "pike_funcs.h"
 
@@ -63,13 +62,11 @@ static int pike_exit(void);
 static int time_unit = 2;
 static int max_reqs  = 30;
 static char *pike_route_s = NULL;
-int timeout   = 120;
+static int timeout   = 120;
+static int table_size = 65536;
+static int v6_aggregate = 0;
 int pike_log_level = L_WARN;
 
-/* global variables */
-gen_lock_t*             timer_lock=0;
-struct list_link*       timer = 0;
-
 /* event id */
 static str pike_block_event = str_init("E_PIKE_BLOCKED");
 event_id_t pike_event_id = EVI_ERROR;
@@ -86,6 +83,8 @@ static param_export_t params[]={
 	{"remove_latency",        INT_PARAM,  &timeout},
 	{"pike_log_level",        INT_PARAM,  &pike_log_level},
 	{"check_route",           STR_PARAM,  &pike_route_s},
+	{"table_size",            INT_PARAM,  &table_size},
+	{"ipv6_aggregation",      INT_PARAM,  &v6_aggregate},
 	{0,0,0}
 };
 
@@ -141,31 +140,16 @@ static int pike_init(void)
 		LM_NOTICE("Forcing remove_latency to %ds\n", timeout);
 	}
 
-	/* alloc the timer lock */
-	timer_lock=lock_alloc();
-	if (timer_lock==0) {
-		LM_ERR(" alloc locks failed!\n");
-		goto error1;
-	}
-	/* init the lock */
-	if (lock_init(timer_lock)==0){
-		LM_ERR(" init lock failed\n");
-		goto error1;
+	if (table_size <= 0) {
+		LM_ERR("invalid table_size %d\n", table_size);
+		return -1;
 	}
 
-	/* init the IP tree */
-	if ( init_ip_tree(max_reqs)!=0 ) {
+	/* init the IP table */
+	if ( init_ip_tree(max_reqs, table_size, timeout, v6_aggregate)!=0 ) {
 		LM_ERR(" ip_tree creation failed!\n");
-		goto error2;
-	}
-
-	/* init timer list */
-	timer = (struct list_link*)shm_malloc(sizeof(struct list_link));
-	if (timer==0) {
-		LM_ERR(" cannot alloc shm mem for timer!\n");
-		goto error3;
+		return -1;
 	}
-	timer->next = timer->prev = timer;
 
 	/* registering timing functions  */
 	register_timer( "pike-clean", clean_routine , 0, 1 ,
@@ -177,27 +161,22 @@ static int pike_init(void)
 		rt = get_script_route_ID_by_name(pike_route_s,sroutes->request,RT_NO);
 		if (rt<1) {
 			LM_ERR("route <%s> does not exist\n",pike_route_s);
-			return -1;
+			goto error;
 		}
 
 		/* register the script callback to get all requests and replies */
 		if (register_script_cb( run_pike_route ,
 		PARSE_ERR_CB|REQ_TYPE_CB|RPL_TYPE_CB|PRE_SCRIPT_CB, (void*)(long)rt )!=0 ) {
 			LM_ERR("failed to register script callbacks\n");
-			goto error3;
+			goto error;
 		}
 	}
 	if((pike_event_id = evi_publish_event(pike_block_event)) == EVI_ERROR)
 		LM_ERR("cannot register pike flood start event\n");
 
 	return 0;
-error3:
+error:
 	destroy_ip_tree();
-error2:
-	lock_destroy(timer_lock);
-error1:
-	if (timer_lock) lock_dealloc(timer_lock);
-	timer_lock = 0;
 	return -1;
 }
 
@@ -207,18 +186,6 @@ static int pike_exit(void)
 {
 	LM_INFO("destroying...\n");
 
-	/* destroy semaphore */
-	if (timer_lock) {
-		lock_destroy(timer_lock);
-		lock_dealloc(timer_lock);
-	}
-
-	/* empty the timer list head */
-	if (timer) {
-		shm_free(timer);
-		timer = 0;
-	}
-
 	/* destroy the IP tree */
 	destroy_ip_tree();
 
@@ -24,47 +24,43 @@
  *  2006-12-05  created (bogdan)
  */
 
-#include <assert.h>
-
 #include "../../resolve.h"
 
 #include "ip_tree.h"
 #include "pike_mi.h"
 
 #define IPv6_LEN 16
+#define IPv6_PREFIX_LEN 8
 #define IPv4_LEN 4
-#define MAX_IP_LEN IPv6_LEN
 
 
-static struct 		 ip_node *ip_stack[MAX_IP_LEN];
 extern int    		 pike_log_level;
 
 
-static inline int print_ip_stack( int level, mi_item_t *ips_arr)
+static inline int print_ip_node( struct ip_node *node, mi_item_t *ips_arr)
 {
-	if (level==IPv6_LEN) {
+	unsigned char *b = node->ip;
+
+	if (node->len==IPv6_LEN) {
 		/* IPv6 */
 		if (add_mi_string_fmt(ips_arr, 0, 0,
 			"%x%x:%x%x:%x%x:%x%x:%x%x:%x%x:%x%x:%x%x",
-			ip_stack[0]->byte,  ip_stack[1]->byte,
-			ip_stack[2]->byte,  ip_stack[3]->byte,
-			ip_stack[4]->byte,  ip_stack[5]->byte,
-			ip_stack[6]->byte,  ip_stack[7]->byte,
-			ip_stack[8]->byte,  ip_stack[9]->byte,
-			ip_stack[10]->byte, ip_stack[11]->byte,
-			ip_stack[12]->byte, ip_stack[13]->byte,
-			ip_stack[14]->byte, ip_stack[15]->byte) < 0)
+			b[0],  b[1],  b[2],  b[3],  b[4],  b[5],  b[6],  b[7],
+			b[8],  b[9],  b[10], b[11], b[12], b[13], b[14], b[15]) < 0)
+			return -1;
+	} else if (node->len==IPv6_PREFIX_LEN) {
+		/* aggregated IPv6 /64 network */
+		if (add_mi_string_fmt(ips_arr, 0, 0,
+			"%x%x:%x%x:%x%x:%x%x::/64",
+			b[0],  b[1],  b[2],  b[3],  b[4],  b[5],  b[6],  b[7]) < 0)
 			return -1;
-	} else if (level==IPv4_LEN) {
+	} else if (node->len==IPv4_LEN) {
 		/* IPv4 */
 		if (add_mi_string_fmt(ips_arr, 0, 0, "%d.%d.%d.%d",
-			ip_stack[0]->byte,
-			ip_stack[1]->byte,
-			ip_stack[2]->byte,
-			ip_stack[3]->byte) < 0)
+			b[0], b[1], b[2], b[3]) < 0)
 			return -1;
 	} else {
-		LM_CRIT("leaf node at depth %d!!!\n", level);
+		LM_CRIT("node with %d bytes long key!!!\n", node->len);
 		return -1;
 	}
 
@@ -72,40 +68,12 @@ static inline int print_ip_stack( int level, mi_item_t *ips_arr)
 }
 
 
-static int print_red_ips( struct ip_node *ip, int level, mi_item_t *ips_arr)
-{
-	struct ip_node *foo;
-
-	if (level==MAX_IP_LEN) {
-		LM_CRIT("tree deeper than %d!!!\n", MAX_IP_LEN);
-		return -1;
-	}
-	ip_stack[level] = ip;
-
-	/* is the node marked red? */
-	if ( ip->flags&NODE_ISRED_FLAG)
-		if (print_ip_stack(level+1,ips_arr) < 0)
-			return -1;
-
-	/* go through all kids */
-	foo = ip->kids;
-	while(foo){
-		if (print_red_ips( foo, level+1, ips_arr) < 0)
-			return -1;
-		foo = foo->next;
-	}
-
-	return 0;
-}
-
 mi_response_t *mi_pike_rm(const mi_params_t *params,
 								struct mi_handler *async_hdl)
 {
-    struct ip_node   *node;
-    struct ip_node   *kid;
     struct ip_addr   *ip;
-    int byte_pos;
     str ip_param;
+    int rc;
 
     if (get_mi_string_param(params, "ip", &ip_param.s, &ip_param.len) < 0)
 		return init_mi_param_error();
@@ -114,43 +82,20 @@ mi_response_t *mi_pike_rm(const mi_params_t *params,
     if (ip==0)
 	return init_mi_error(500, MI_SSTR("Bad IP"));
 
-    node = 0;
-    byte_pos = 0;
-
-    kid = get_tree_branch((unsigned char)ip->u.addr[byte_pos]);
-
-    /* pilfered from ip_tree.c:mark_node(..) */
-    while (kid && byte_pos < ip->len) {
-	while (kid && kid->byte!=(unsigned char)ip->u.addr[byte_pos]) {
-	    kid = kid->next;
-	}
-	if (kid) {
-	    node = kid;
-	    kid = kid->kids;
-	    byte_pos++;
-	}
-    }
+    /* reset the node block flag and counters */
+    rc = unmark_node(ip->u.addr, ip->len);
 
-    /* If all octets weren't matched, 404 */
-    if (byte_pos!=ip->len) {
+    if (rc<0) {
 	return init_mi_error(404, MI_SSTR("Match not found"));
     }
 
     /* If the node exists, check to see if it's really blocked */
-    if (!(node->flags&NODE_ISRED_FLAG)) {
+    if (rc==0) {
 	return init_mi_error(400, MI_SSTR("IP not blocked"));
     }
 
-    /* reset the node block flag and counters */
-    node->flags &= ~(NODE_ISRED_FLAG);
-
-    node->hits[PREV_POS] = 0;
-    node->hits[CURR_POS] = 0;
-    node->leaf_hits[PREV_POS] = 0;
-    node->leaf_hits[CURR_POS] = 0;
-
     LM_GEN1(pike_log_level,
-	    "PIKE - UNBLOCKing ip %s, node=%p\n",ip_addr2a(ip),node);
+	    "PIKE - UNBLOCKing ip %s\n",ip_addr2a(ip));
 
     return init_mi_result_ok();
 }
@@ -163,7 +108,8 @@ mi_response_t *mi_pike_rm(const mi_params_t *params,
 mi_response_t *mi_pike_list(const mi_params_t *params,
 								struct mi_handler *async_hdl)
 {
-	struct ip_node *ip;
+	struct ip_node *nodes;
+	unsigned int size, j;
 	int i;
 	mi_response_t *resp;
 	mi_item_t *resp_obj;
@@ -179,14 +125,18 @@ mi_response_t *mi_pike_list(const mi_params_t *params,
 
 	for( i=0 ; i<MAX_IP_BRANCHES ; i++ ) {
 
-		if (get_tree_branch(i)==0)
-			continue;
+		nodes = get_tree_branch(i, &size);
 
 		lock_tree_branch(i);
 
-		if ( (ip=get_tree_branch(i))!=NULL )
-			if (print_red_ips(ip, 0, ips_arr) < 0)
+		/* under lock, the keys of the nodes are stable */
+		for( j=0 ; j<size ; j++ )
+			if ( (nodes[j].ctl&(NODE_LIVE_FLAG|NODE_ISRED_FLAG))==
+			(NODE_LIVE_FLAG|NODE_ISRED_FLAG) &&
+			print_ip_node(&nodes[j], ips_arr) < 0) {
+				unlock_tree_branch(i);
 				goto error;
+			}
 
 		unlock_tree_branch(i);
 	}
@@ -197,5 +147,3 @@ error:
 	free_mi_response(resp);
 	return 0;
 }
-
-
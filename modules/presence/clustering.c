@@ -516,24 +516,31 @@ static void handle_presentity_query(bin_packet_t *packet)
 		goto error_all;
 	}
 
-	res = pres_search_db( &uri,&ev.text, &body_col, &extra_hdrs_col,
-		&expires_col, &etag_col);
+	memset( &pres, 0, sizeof(pres));
+	pres.event = search_event(&ev);
+
+	if (memory_presentity) {
+		if (pres.event==NULL)
+			return;
+		res = pres_search_mem( &pres_uri, pres.event, &body_col,
+			&extra_hdrs_col, &expires_col, &etag_col);
+	} else
+		res = pres_search_db( &uri,&ev.text, &body_col, &extra_hdrs_col,
+			&expires_col, &etag_col);
 	if(res==NULL)
 		goto error_all;
 	if (res->n<=0 ) {
 		LM_DBG("presentity not found in DB: [username]='%.*s'"
 			" [domain]='%.*s' [event]='%.*s'\n",uri.user.len, uri.user.s,
 			uri.host.len, uri.host.s, ev.text.len, ev.text.s);
-		pa_dbf.free_result(pa_db, res);
+		pres_free_result(res);
 		/* we do not answer back, do nothing */
 		return ;
 	}
 
 	/* we have a valid presentity to send back as reply */
-	memset( &pres, 0, sizeof(pres));
 	pres.user = uri.user;
 	pres.domain = uri.host;
-	pres.event = search_event(&ev);
 	pres.new_etag.s = (char*)VAL_STRING(ROW_VALUES(RES_ROWS(res))+etag_col);
 	pres.new_etag.len = strlen(pres.new_etag.s);
 	pres.expires = VAL_INT(ROW_VALUES(RES_ROWS(res))+expires_col) -
@@ -551,8 +558,10 @@ static void handle_presentity_query(bin_packet_t *packet)
 	if (pack_replicated_publish( &reply_packet, &pres)<0) {
 		LM_ERR("failed to build replicated publish\n");
 		bin_free_packet(&reply_packet);
+		pres_free_result(res);
 		goto error_all;
 	}
+	pres_free_result(res);
 
 	cluster_send_to_node( &reply_packet, pres_cluster_id, packet->src_id);
 
@@ -26,6 +26,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
 #include "../../mem/shm_mem.h"
 #include "../../dprint.h"
 #include "../../str.h"
@@ -461,6 +462,8 @@ void destroy_phtable(void)
 			p= p->next;
 			if(prev_p->sphere)
 				shm_free(prev_p->sphere);
+			if(prev_p->doc)
+				shm_free(prev_p->doc);
 			shm_free(prev_p);
 		}
 
@@ -618,6 +621,7 @@ void next_turn_phtable(pres_entry_t* p_p, unsigned int hash_code)
 int delete_phtable(pres_entry_t* p, unsigned int hash_code)
 {
 	pres_entry_t* prev_p= NULL;
+	str etag;
 
 	LM_DBG("Count = 0, delete\n");
 	/* delete record */
@@ -636,11 +640,108 @@ int delete_phtable(pres_entry_t* p, unsigned int hash_code)
 	prev_p->next= p->next;
 	if(p->sphere)
 		shm_free(p->sphere);
+	if(p->doc)
+	{
+		/* a document not written yet has nothing to remove from database */
+		if(p->db_flag!= INSERTDB_FLAG)
+		{
+			etag.s= p->db_etag;
+			etag.len= p->db_etag_len;
+			queue_pres_db_delete(&p->pres_uri, &p->ev_name, &etag);
+		}
+		shm_free(p->doc);
+	}
 	shm_free(p);
 
 	return 0;
 }
 
+static inline void doc_copy(char* doc, int* size, str* dest, str* src)
+{
+	dest->s= doc+ *size;
+	if(src->len)
+		memcpy(dest->s, src->s, src->len);
+	dest->len= src->len;
+	dest->s[dest->len]= 0;
+	*size+= src->len+ 1;
+}
+
+/* entry must be locked before calling this function;
+ * a NULL body or extra_hdrs keeps the ones already stored */
+int set_phtable_doc(pres_entry_t* p, str* ev_name, str* body, str* extra_hdrs,
+		str* sender, int expires, int received_time, int db_flag)
+{
+	static str empty= {"", 0};
+	str ev, b, eh, snd;
+	char* doc;
+	int size;
+
+	if(body== NULL)
+		body= &p->body;
+	if(extra_hdrs== NULL)
+		extra_hdrs= &p->extra_hdrs;
+	if(sender== NULL)
+		sender= &empty;
+
+	size= ev_name->len+ body->len+ extra_hdrs->len+ sender->len+ 4;
+	doc= (char*)shm_malloc(size);
+	if(doc== NULL)
+	{
+		LM_ERR("No more %s memory\n", SHARE_MEM);
+		return -1;
+	}
+	/* copy everything before releasing the old document,
+	 * the new one may reuse parts of it */
+	size= 0;
+	doc_copy(doc, &size, &ev, ev_name);
+	doc_copy(doc, &size, &b, body);
+	doc_copy(doc, &size, &eh, extra_hdrs);
+	doc_copy(doc, &size, &snd, sender);
+
+	if(p->doc)
+		shm_free(p->doc);
+	p->doc= doc;
+	p->ev_name= ev;
+	p->body= b;
+	p->extra_hdrs= eh;
+	p->sender= snd;
+	p->expires= expires;
+	p->received_time= received_time;
+	p->doc_version++;
+
+	if(db_flag== NO_UPDATEDB_FLAG)
+	{
+		/* loaded from database */
+		memcpy(p->db_etag, p->etag, p->etag_len);
+		p->db_etag_len= p->etag_len;
+	}
+	if(db_flag!= UPDATEDB_FLAG || p->db_flag!= INSERTDB_FLAG)
+		p->db_flag= db_flag;
+
+	return 0;
+}
+
+int update_phtable_doc(pres_entry_t* p_p, unsigned int hash_code,
+		presentity_t* presentity, str* body, int db_flag)
+{
+	pres_entry_t* p;
+	int ret= 0;
+
+	lock_get(&pres_htable[hash_code].lock);
+	for ( p=pres_htable[hash_code].entries->next ; p ; p=p->next ) {
+		if(p==p_p) {
+			ret= set_phtable_doc(p, &presentity->event->name, body,
+				presentity->extra_hdrs, presentity->sender,
+				presentity->expires+ (int)time(NULL),
+				presentity->received_time, db_flag);
+			break;
+		}
+	}
+	lock_release(&pres_htable[hash_code].lock);
+
+	return ret;
+}
+
 int update_phtable(presentity_t* presentity, str pres_uri, str body)
 {
 	char* sphere= NULL;
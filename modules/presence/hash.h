@@ -132,6 +132,20 @@ typedef struct pres_entry
 	/* ordering */
 	unsigned int current_turn;
 	unsigned int last_turn;
+	/* the published document, kept only with memory_presentity */
+	char* doc;
+	str ev_name;
+	str body;
+	str extra_hdrs;
+	str sender;
+	int expires;
+	int received_time;
+	int db_flag;
+	/* bumped on every change of the document */
+	unsigned int doc_version;
+	/* etag of the document as last written in database */
+	char db_etag[ETAG_LEN];
+	int db_etag_len;
 	struct pres_entry* next;
 }pres_entry_t;
 
@@ -172,6 +186,12 @@ int delete_phtable(pres_entry_t* p, unsigned int hash_code);
 
 int delete_phtable_query(str *pres_uri, int event, str* etag);
 
+int set_phtable_doc(pres_entry_t* p, str* ev_name, str* body, str* extra_hdrs,
+		str* sender, int expires, int received_time, int db_flag);
+
+int update_phtable_doc(pres_entry_t* p_p, unsigned int hash_code,
+		struct presentity* presentity, str* body, int db_flag);
+
 
 
 cluster_query_entry_t* insert_cluster_query(str* pres_uri, int event,
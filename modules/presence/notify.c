@@ -803,6 +803,126 @@ db_res_t* pres_search_db(struct sip_uri* uri,str* ev_name, int* body_col,
 	return result;
 }
 
+static int pres_mem_val(db_val_t* val, str* s)
+{
+	VAL_TYPE(val)= DB_STRING;
+	VAL_STRING(val)= (char*)pkg_malloc(s->len+ 1);
+	if(VAL_STRING(val)== NULL)
+	{
+		LM_ERR("No more %s memory\n", PKG_MEM_STR);
+		return -1;
+	}
+	memcpy((char*)VAL_STRING(val), s->s, s->len);
+	((char*)VAL_STRING(val))[s->len]= 0;
+	VAL_FREE(val)= 1;
+	return 0;
+}
+
+#define pres_mem_match(_p, _uri, _ev) \
+	((_p)->doc && (_p)->event== (_ev)->evp->parsed && \
+	(_p)->ev_name.len== (_ev)->name.len && \
+	strncasecmp((_p)->ev_name.s, (_ev)->name.s, (_ev)->name.len)== 0 && \
+	(_p)->pres_uri.len== (_uri)->len && \
+	strncmp((_p)->pres_uri.s, (_uri)->s, (_uri)->len)== 0)
+
+/* same result as pres_search_db(), but built from the documents kept in
+ * the presentity hash table (memory_presentity) */
+db_res_t* pres_search_mem(str* pres_uri, pres_ev_t* ev, int* body_col,
+		int* extra_hdrs_col, int* expires_col, int* etag_col)
+{
+	db_res_t *result;
+	db_row_t *rows, row;
+	db_val_t *vals;
+	pres_entry_t* p;
+	unsigned int hash_code;
+	str etag;
+	int n= 0, i, j;
+
+	*body_col= 0;
+	*extra_hdrs_col= 1;
+	*expires_col= 2;
+	*etag_col= 3;
+
+	result= db_new_result();
+	if(result== NULL)
+		return NULL;
+	/* the last column, received_time, only orders the documents */
+	RES_COL_N(result)= 5;
+
+	hash_code= core_hash(pres_uri, NULL, phtable_size);
+	lock_get(&pres_htable[hash_code].lock);
+
+	for(p= pres_htable[hash_code].entries->next; p; p= p->next)
+		if(pres_mem_match(p, pres_uri, ev))
+			n++;
+
+	if(n> 0 && db_allocate_rows(result, n)< 0)
+		goto error;
+
+	for(p= pres_htable[hash_code].entries->next; p; p= p->next)
+	{
+		if(!pres_mem_match(p, pres_uri, ev))
+			continue;
+
+		vals= ROW_VALUES(&RES_ROWS(result)[RES_ROW_N(result)]);
+		ROW_N(&RES_ROWS(result)[RES_ROW_N(result)])= RES_COL_N(result);
+		RES_ROW_N(result)++;
+
+		if(pres_mem_val(vals, &p->body)< 0)
+			goto error;
+
+		if(p->extra_hdrs.len)
+		{
+			if(pres_mem_val(vals+ 1, &p->extra_hdrs)< 0)
+				goto error;
+		}
+		else
+		{
+			VAL_TYPE(vals+ 1)= DB_STRING;
+			VAL_NULL(vals+ 1)= 1;
+		}
+
+		VAL_TYPE(vals+ 2)= DB_INT;
+		VAL_INT(vals+ 2)= p->expires;
+
+		etag.s= p->etag;
+		etag.len= p->etag_len;
+		if(pres_mem_val(vals+ 3, &etag)< 0)
+			goto error;
+
+		VAL_TYPE(vals+ 4)= DB_INT;
+		VAL_INT(vals+ 4)= p->received_time;
+	}
+
+	lock_release(&pres_htable[hash_code].lock);
+
+	/* oldest first, as returned by the database query */
+	rows= RES_ROWS(result);
+	for(i= 1; i< n; i++)
+	{
+		row= rows[i];
+		for(j= i- 1; j>= 0 &&
+		VAL_INT(ROW_VALUES(rows+ j)+ 4)> VAL_INT(ROW_VALUES(&row)+ 4); j--)
+			rows[j+ 1]= rows[j];
+		rows[j+ 1]= row;
+	}
+
+	return result;
+
+error:
+	lock_release(&pres_htable[hash_code].lock);
+	db_free_result(result);
+	return NULL;
+}
+
+void pres_free_result(db_res_t* result)
+{
+	if(memory_presentity)
+		db_free_result(result);
+	else
+		pa_dbf.free_result(pa_db, result);
+}
+
 str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 		unsigned int hash_code)
 {
@@ -831,7 +951,11 @@ str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 			return NULL;
 	}
 
-	result = pres_search_db(uri, &((*dialog_event_p)->name),
+	if(memory_presentity)
+		result = pres_search_mem(pres_uri, *dialog_event_p,
+			&body_col, &extra_hdrs_col, &expires_col, &etag_col);
+	else
+		result = pres_search_db(uri, &((*dialog_event_p)->name),
 			&body_col, &extra_hdrs_col, &expires_col, &etag_col);
 	if(result== NULL)
 		return NULL;
@@ -840,7 +964,7 @@ str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 	{
 		LM_DBG("The query returned no result, pres_uri=[%.*s] event=[dialog]\n",
 				pres_uri->len, pres_uri->s);
-		pa_dbf.free_result(pa_db, result);
+		pres_free_result(result);
 		return NULL;
 	}
 
@@ -872,7 +996,7 @@ str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 			ringing_state = dlg_state;
 		}
 	}
-	pa_dbf.free_result(pa_db, result);
+	pres_free_result(result);
 
 	LM_DBG("i = %d, ringing_inde = %d\n", i, ringing_index);
 
@@ -894,7 +1018,7 @@ str* get_presence_from_dialog(str* pres_uri, struct sip_uri* uri,
 
 error:
 	if(result)
-		pa_dbf.free_result(pa_db, result);
+		pres_free_result(result);
 	return NULL;
 }
 
@@ -1009,7 +1133,11 @@ static str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag,
 		}
 	}
 
-	result = pres_search_db(&uri,&event->name,&body_col,&extra_hdrs_col,&expires_col,&etag_col);
+	if(memory_presentity)
+		result = pres_search_mem(&pres_uri, event, &body_col, &extra_hdrs_col,
+			&expires_col, &etag_col);
+	else
+		result = pres_search_db(&uri,&event->name,&body_col,&extra_hdrs_col,&expires_col,&etag_col);
 	if(result== NULL)
 		return NULL;
 	if (result->n<=0 )
@@ -1018,7 +1146,7 @@ static str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag,
 			" [domain]='%.*s' [event]='%.*s'\n",uri.user.len, uri.user.s,
 			uri.host.len, uri.host.s, event->name.len, event->name.s);
 
-		pa_dbf.free_result(pa_db, result);
+		pres_free_result(result);
 		result= NULL;
 
 		/* we do not have the presentity */
@@ -1112,7 +1240,7 @@ static str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag,
 			}
 			memcpy(notify_body->s, row_vals[body_col].val.string_val, len);
 			notify_body->len= len;
-			pa_dbf.free_result(pa_db, result);
+			pres_free_result(result);
 			*free_fct = (free_body_t*)pkg_free_w;
 
 			return notify_body;
@@ -1229,7 +1357,7 @@ static str* get_p_notify_body(str pres_uri, pres_ev_t* event, str* etag,
 			}
 		}
 
-		pa_dbf.free_result(pa_db, result);
+		pres_free_result(result);
 		result= NULL;
 
 		/* put the dialog info extracted body if present */
@@ -1295,7 +1423,7 @@ done:
 
 error:
 	if(result!=NULL)
-		pa_dbf.free_result(pa_db, result);
+		pres_free_result(result);
 
 	if(local_dialog_body && local_dialog_body!=FAKED_BODY
 			&& local_dialog_body->s)
@@ -1868,6 +1996,16 @@ int publ_notify(presentity_t* p, str pres_uri, str* body, str* offline_etag,
 				p->extra_hdrs?p->extra_hdrs:&notify_extra_hdrs, &free_fct,
 				from_publish, 0);
 	}
+	else if(body== NULL && !(p->event->type & WINFO_TYPE) &&
+	p->event->build_notify_body== NULL)
+	{
+		/* all the watchers get the last published document - look it
+		 * up once, not for each of them */
+		notify_body = get_p_notify_body(pres_uri, p->event, NULL, NULL,
+				NULL, NULL,
+				p->extra_hdrs?p->extra_hdrs:&notify_extra_hdrs, &free_fct,
+				from_publish, 1);
+	}
 
 	s= subs_array;
 	while(s)
@@ -1905,6 +2043,243 @@ done:
 }
 
 
+/* Coalescing of the NOTIFYs triggered by PUBLISH: the first change of a
+ * presentity is notified right away and opens a window of
+ * notify_coalesce_window ms; all the changes arriving within the window
+ * are notified once, when it closes, with the state at that time */
+typedef struct ncoal_entry
+{
+	str pres_uri;
+	pres_ev_t* ev;
+	utime_t end;
+	int pending;
+	struct ncoal_entry* next;
+}ncoal_entry_t;
+
+typedef struct ncoal_htable
+{
+	ncoal_entry_t* entries;
+	gen_lock_t lock;
+}ncoal_htable_t;
+
+static ncoal_htable_t* ncoal_htable= NULL;
+
+int init_notify_coalesce(void)
+{
+	int i;
+
+	ncoal_htable= (ncoal_htable_t*)shm_malloc(phtable_size*
+		sizeof(ncoal_htable_t));
+	if(ncoal_htable== NULL)
+	{
+		LM_ERR("No more %s memory\n", SHARE_MEM);
+		return -1;
+	}
+	memset(ncoal_htable, 0, phtable_size* sizeof(ncoal_htable_t));
+
+	for(i= 0; i< phtable_size; i++)
+	{
+		if(lock_init(&ncoal_htable[i].lock)== 0)
+		{
+			LM_ERR("initializing lock [%d]\n", i);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+void destroy_notify_coalesce(void)
+{
+	ncoal_entry_t* e;
+	int i;
+
+	if(ncoal_htable== NULL)
+		return;
+
+	for(i= 0; i< phtable_size; i++)
+	{
+		lock_destroy(&ncoal_htable[i].lock);
+		while(ncoal_htable[i].entries)
+		{
+			e= ncoal_htable[i].entries;
+			ncoal_htable[i].entries= e->next;
+			shm_free(e);
+		}
+	}
+	shm_free(ncoal_htable);
+	ncoal_htable= NULL;
+}
+
+/* returns 1 if the NOTIFY is left for the end of the window,
+ * 0 if it has to be sent now */
+int coalesce_notify(str* pres_uri, pres_ev_t* ev)
+{
+	ncoal_entry_t* e;
+	unsigned int hash_code;
+	utime_t now= get_uticks();
+
+	hash_code= core_hash(pres_uri, NULL, phtable_size);
+	lock_get(&ncoal_htable[hash_code].lock);
+
+	for(e= ncoal_htable[hash_code].entries; e; e= e->next)
+	{
+		if(e->ev== ev && e->pres_uri.len== pres_uri->len &&
+		strncmp(e->pres_uri.s, pres_uri->s, pres_uri->len)== 0)
+			break;
+	}
+
+	if(e && e->end> now)
+	{
+		e->pending= 1;
+		lock_release(&ncoal_htable[hash_code].lock);
+		return 1;
+	}
+
+	if(e== NULL)
+	{
+		e= (ncoal_entry_t*)shm_malloc(sizeof(ncoal_entry_t)+ pres_uri->len);
+		if(e== NULL)
+		{
+			lock_release(&ncoal_htable[hash_code].lock);
+			LM_ERR("No more %s memory\n", SHARE_MEM);
+			return 0;
+		}
+		e->pres_uri.s= (char*)(e+ 1);
+		memcpy(e->pres_uri.s, pres_uri->s, pres_uri->len);
+		e->pres_uri.len= pres_uri->len;
+		e->ev= ev;
+		e->next= ncoal_htable[hash_code].entries;
+		ncoal_htable[hash_code].entries= e;
+	}
+	/* (re)open the window, this NOTIFY covers what was pending */
+	e->end= now+ (utime_t)notify_coalesce_window* 1000;
+	e->pending= 0;
+
+	lock_release(&ncoal_htable[hash_code].lock);
+	return 0;
+}
+
+static void coalesced_notify(str* pres_uri, pres_ev_t* ev)
+{
+	presentity_t pres;
+	struct sip_uri uri;
+	str* rules_doc= NULL;
+
+	memset(&pres, 0, sizeof(presentity_t));
+	pres.event= ev;
+
+	if(ev->req_auth && ev->get_rules_doc)
+	{
+		if(parse_uri(pres_uri->s, pres_uri->len, &uri)< 0)
+		{
+			LM_ERR("failed to parse presentity uri [%.*s]\n",
+				pres_uri->len, pres_uri->s);
+			return;
+		}
+		if(ev->get_rules_doc(&uri.user, &uri.host, &rules_doc)< 0)
+		{
+			LM_ERR("getting rules doc\n");
+			return;
+		}
+	}
+
+	/* the body is built from what is stored now */
+	if(publ_notify(&pres, *pres_uri, NULL, NULL, rules_doc, NULL, 1,
+	NULL)< 0)
+		LM_ERR("while sending Notify requests to watchers\n");
+
+	/* the presence watchers get the dialog states mixed in, from all
+	 * the stored dialog publications */
+	if(mix_dialog_presence && *pres_event_p &&
+	ev->evp->parsed== EVENT_DIALOG)
+	{
+		pres.event= *pres_event_p;
+		if(publ_notify(&pres, *pres_uri, NULL, NULL, NULL, NULL, 1,
+		NULL)< 0)
+			LM_ERR("while sending Notify requests to presence watchers\n");
+	}
+
+	if(rules_doc)
+	{
+		if(rules_doc->s)
+			pkg_free(rules_doc->s);
+		pkg_free(rules_doc);
+	}
+}
+
+void timer_notify_coalesce(utime_t uticks, void* param)
+{
+	ncoal_entry_t *e, *prev, *list, *n;
+	utime_t now= get_uticks();
+	int i;
+
+	for(i= 0; i< phtable_size; i++)
+	{
+		list= NULL;
+
+		lock_get(&ncoal_htable[i].lock);
+		prev= NULL;
+		e= ncoal_htable[i].entries;
+		while(e)
+		{
+			if(e->end> now)
+			{
+				prev= e;
+				e= e->next;
+				continue;
+			}
+
+			if(e->pending)
+			{
+				n= (ncoal_entry_t*)pkg_malloc(sizeof(ncoal_entry_t)+
+					e->pres_uri.len);
+				if(n== NULL)
+				{
+					/* retried at the next run */
+					LM_ERR("No more %s memory\n", PKG_MEM_STR);
+					prev= e;
+					e= e->next;
+					continue;
+				}
+				n->pres_uri.s= (char*)(n+ 1);
+				memcpy(n->pres_uri.s, e->pres_uri.s, e->pres_uri.len);
+				n->pres_uri.len= e->pres_uri.len;
+				n->ev= e->ev;
+				n->next= list;
+				list= n;
+
+				/* keep coalescing while the changes go on */
+				e->pending= 0;
+				e->end= now+ (utime_t)notify_coalesce_window* 1000;
+				prev= e;
+				e= e->next;
+			}
+			else
+			{
+				/* quiet for a whole window, the next change goes out
+				 * right away */
+				n= e->next;
+				if(prev)
+					prev->next= n;
+				else
+					ncoal_htable[i].entries= n;
+				shm_free(e);
+				e= n;
+			}
+		}
+		lock_release(&ncoal_htable[i].lock);
+
+		while(list)
+		{
+			n= list;
+			list= list->next;
+			coalesced_notify(&n->pres_uri, n->ev);
+			pkg_free(n);
+		}
+	}
+}
+
+
 int virtual_notify(str *pres_uri, pres_ev_t *ev, str *body)
 {
 	presentity_t pres;
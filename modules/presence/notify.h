@@ -26,6 +26,7 @@
  */
 
 #include "../../str.h"
+#include "../../timer.h"
 #include "../tm/dlg.h"
 #include "subscribe.h"
 #include "presentity.h"
@@ -120,6 +121,17 @@ int presentity_has_subscribers(str* pres_uri, pres_ev_t* event);
 db_res_t* pres_search_db(struct sip_uri* uri,str* ev_name, int* body_col,
 		int* extra_hdrs_col, int* expires_col, int* etag_col);
 
+db_res_t* pres_search_mem(str* pres_uri, pres_ev_t* ev, int* body_col,
+		int* extra_hdrs_col, int* expires_col, int* etag_col);
+
+/* frees the result of pres_search_db() or pres_search_mem() */
+void pres_free_result(db_res_t* result);
+
+int init_notify_coalesce(void);
+void destroy_notify_coalesce(void);
+int coalesce_notify(str* pres_uri, pres_ev_t* ev);
+void timer_notify_coalesce(utime_t uticks, void* param);
+
 str* create_winfo_xml(watcher_t* watchers, char* version,
 		str resource, str event, int STATE_FLAG );
 str* xml_dialog2presence(str* pres_uri, str* body);
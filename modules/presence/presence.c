@@ -125,9 +125,12 @@ int max_expires_publish= 3600;
 int shtable_size= 9;
 shtable_t subs_htable= NULL;
 int fallback2db= 0;
+int memory_presentity= 0;
 int sphere_enable= 0;
 int mix_dialog_presence= 0;
 int notify_offline_body= 0;
+/* ms to coalesce the NOTIFYs of successive PUBLISHs */
+int notify_coalesce_window= 0;
 /* if subscription should be automatically ended on SIP timeout 408 */
 int end_sub_on_timeout= 1;
 /* holder for the pointer to presence event */
@@ -175,12 +178,14 @@ static param_export_t params[]={
 	{ "subs_htable_size",       INT_PARAM, &shtable_size},
 	{ "pres_htable_size",       INT_PARAM, &phtable_size},
 	{ "fallback2db",            INT_PARAM, &fallback2db},
+	{ "memory_presentity",      INT_PARAM, &memory_presentity},
 	{ "enable_sphere_check",    INT_PARAM, &sphere_enable},
 	{ "waiting_subs_daysno",    INT_PARAM, &waiting_subs_daysno},
 	{ "mix_dialog_presence",    INT_PARAM, &mix_dialog_presence},
 	{ "bla_presentity_spec",    STR_PARAM, &bla_presentity_spec_param},
 	{ "bla_fix_remote_target",  INT_PARAM, &fix_remote_target},
 	{ "notify_offline_body",    INT_PARAM, &notify_offline_body},
+	{ "notify_coalesce_window", INT_PARAM, &notify_coalesce_window},
 	{ "end_sub_on_timeout",     INT_PARAM, &end_sub_on_timeout},
 	{ "cluster_id",             INT_PARAM, &pres_cluster_id},
 	{ "cluster_federation_mode",INT_PARAM, &cluster_federation},
@@ -386,6 +391,25 @@ static int mod_init(void)
 	else
 		phtable_size= 1<< phtable_size;
 
+	if(memory_presentity)
+	{
+		if(fallback2db)
+		{
+			LM_ERR("memory_presentity cannot be used with fallback2db\n");
+			return -1;
+		}
+		if(db_update_period<= 0)
+		{
+			LM_ERR("memory_presentity requires a positive db_update_period\n");
+			return -1;
+		}
+		if(init_pres_db_queue()< 0)
+		{
+			LM_ERR("initializing presentity database queue\n");
+			return -1;
+		}
+	}
+
 	pres_htable= new_phtable();
 	if(pres_htable== NULL)
 	{
@@ -411,6 +435,25 @@ static int mod_init(void)
 		register_timer("presence-dbupdate", timer_db_update, 0,
 			db_update_period, TIMER_FLAG_SKIP_ON_DELAY);
 
+	if(memory_presentity)
+		register_timer("presence-pdbupdate", timer_pres_db_update, 0,
+			db_update_period, TIMER_FLAG_SKIP_ON_DELAY);
+
+	if(notify_coalesce_window>0)
+	{
+		if(init_notify_coalesce()< 0)
+		{
+			LM_ERR("initializing NOTIFY coalescing\n");
+			return -1;
+		}
+		if(register_utimer("presence-ncoalesce", timer_notify_coalesce, 0,
+		notify_coalesce_window* 1000, TIMER_FLAG_DELAY_ON_DELAY)< 0)
+		{
+			LM_ERR("failed to register NOTIFY coalescing timer\n");
+			return -1;
+		}
+	}
+
 	if (pa_dbf.use_table(pa_db, &watchers_table) < 0)
 	{
 		LM_ERR("unsuccessful use table sql operation\n");
@@ -497,12 +540,21 @@ static void destroy(void)
 	if(subs_htable && pa_db)
 		timer_db_update(0, 0);
 
+	if(memory_presentity && pres_htable && pa_db)
+		timer_pres_db_update(0, 0);
+
 	if(subs_htable)
 		destroy_shtable(subs_htable, shtable_size);
 
 	if(pres_htable)
 		destroy_phtable();
 
+	if(memory_presentity)
+		destroy_pres_db_queue();
+
+	if(notify_coalesce_window>0)
+		destroy_notify_coalesce();
+
 	if(pa_db && pa_dbf.close)
 		pa_dbf.close(pa_db);
 
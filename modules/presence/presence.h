@@ -58,11 +58,13 @@ extern str contact_user;
 extern int max_expires_publish;
 extern int max_expires_subscribe;
 extern int fallback2db;
+extern int memory_presentity;
 extern int sphere_enable;
 extern int shtable_size;
 extern shtable_t subs_htable;
 extern int mix_dialog_presence;
 extern int notify_offline_body;
+extern int notify_coalesce_window;
 extern int end_sub_on_timeout;
 
 extern int phtable_size;
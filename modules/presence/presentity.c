@@ -38,6 +38,9 @@
 #include "../../usr_avp.h"
 #include "../alias_db/alias_db.h"
 #include "../../data_lump_rpl.h"
+#include "../../locking.h"
+#include "../../parser/parse_uri.h"
+#include "../pua/hash.h"
 #include "presentity.h"
 #include "presence.h"
 #include "notify.h"
@@ -412,6 +415,7 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity,
 	str body = presentity->body;
 	str *extra_hdrs = presentity->extra_hdrs;
 	db_res_t *result= NULL;
+	int ret;
 
 	*sent_reply= 0;
 	if(presentity->event->req_auth)
@@ -475,6 +479,18 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity,
 			goto error;
 		}
 
+		if (memory_presentity)
+		{
+			/* written in database later, by the update timer */
+			if (update_phtable_doc(p, hash_code, presentity, &body,
+			INSERTDB_FLAG) < 0)
+			{
+				LM_ERR("storing the document in hash table\n");
+				goto error;
+			}
+			goto send_notify;
+		}
+
 		/* insert new record into database */
 		query_cols[n_query_cols] = &str_etag_col;
 		query_ops[n_query_cols] = OP_EQ;
@@ -572,6 +588,20 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity,
 					hash_code);
 			}
 
+		} else if (memory_presentity) {
+
+			lock_release(&pres_htable[hash_code].lock);
+			/* all the published documents are in the hash table */
+			LM_ERR("No E_Tag match [%.*s]\n", presentity->old_etag.len,
+					presentity->old_etag.s);
+			if (msg && sigb.reply(msg, 412, &pu_412_rpl, 0)==-1 )
+			{
+				LM_ERR("sending '412 Conditional request failed' reply\n");
+				goto error;
+			}
+			*sent_reply= 1;
+			goto done;
+
 		} else {
 
 			lock_release(&pres_htable[hash_code].lock);
@@ -613,13 +643,17 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity,
 		/* record found */
 		if(presentity->expires == 0)
 		{
-			/* delete from hash table */
-			if(p && delete_phtable(p, hash_code)< 0)
+			/* delete from hash table - with memory_presentity, only after
+			 * the first NOTIFY, which still needs the document */
+			if(!memory_presentity)
 			{
-					LM_ERR("deleting record from hash table failed\n");
+				if(p && delete_phtable(p, hash_code)< 0)
+				{
+						LM_ERR("deleting record from hash table failed\n");
+				}
+				/* presentity removed, pointer no longer valid */
+				p = NULL;
 			}
-			/* presentity removed, pointer no longer valid */
-			p = NULL;
 
 			lock_release(&pres_htable[hash_code].lock);
 			if(msg && publ_send200ok(msg, presentity->expires,
@@ -630,26 +664,44 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity,
 			}
 			*sent_reply= 1;
 
-			if(publ_notify(presentity, pres_uri, body.s ? &body : 0,
-			&presentity->old_etag, rules_doc, NULL, 1, NULL) < 0)
+			ret = publ_notify(presentity, pres_uri, body.s ? &body : 0,
+				&presentity->old_etag, rules_doc, NULL, 1, NULL);
+
+			if(memory_presentity)
 			{
-				LM_ERR("while sending notify\n");
-				goto error;
+				if(delete_phtable_query(&pres_uri,
+				presentity->event->evp->parsed, &presentity->old_etag)< 0)
+				{
+					LM_ERR("deleting record from hash table failed\n");
+				}
+				/* presentity removed, pointer no longer valid */
+				p = NULL;
 			}
 
-			if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+			if(ret < 0)
 			{
-				LM_ERR("unsuccessful sql use table\n");
+				LM_ERR("while sending notify\n");
 				goto error;
 			}
-			//CON_PS_REFERENCE(pa_db) = &my_ps_delete;
-			if(pa_dbf.delete(pa_db,query_cols,0,query_vals,n_query_cols)<0)
+
+			/* with memory_presentity, the hash table removal already
+			 * queued the delete for the update timer */
+			if (!memory_presentity)
 			{
-				LM_ERR("unsuccessful sql delete operation");
-				goto error;
+				if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+				{
+					LM_ERR("unsuccessful sql use table\n");
+					goto error;
+				}
+				//CON_PS_REFERENCE(pa_db) = &my_ps_delete;
+				if(pa_dbf.delete(pa_db,query_cols,0,query_vals,n_query_cols)<0)
+				{
+					LM_ERR("unsuccessful sql delete operation");
+					goto error;
+				}
+				LM_DBG("Expires=0, deleted from db %.*s\n",
+					presentity->user.len,presentity->user.s);
 			}
-			LM_DBG("Expires=0, deleted from db %.*s\n",
-				presentity->user.len,presentity->user.s);
 			/* Send another NOTIFY, this time rely on whatever is on the DB,
 			 *  so in case there are no documents an empty
 			 * NOTIFY will be sent to the watchers */
@@ -782,17 +834,29 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity,
 			//CON_PS_REFERENCE(pa_db) = &my_ps_update_no_body;
 		}
 
-		if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+		if (memory_presentity)
 		{
-			LM_ERR("unsuccessful sql use table\n");
-			goto error;
+			if (update_phtable_doc(p, hash_code, presentity,
+			body.s ? &body : NULL, UPDATEDB_FLAG) < 0)
+			{
+				LM_ERR("updating the document in hash table\n");
+				goto error;
+			}
 		}
-
-		if( pa_dbf.update( pa_db,query_cols, query_ops, query_vals,
-				update_keys, update_vals, n_query_cols, n_update_cols )<0)
+		else
 		{
-			LM_ERR("updating published info in database\n");
-			goto error;
+			if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
+			{
+				LM_ERR("unsuccessful sql use table\n");
+				goto error;
+			}
+
+			if( pa_dbf.update( pa_db,query_cols, query_ops, query_vals,
+					update_keys, update_vals, n_query_cols, n_update_cols )<0)
+			{
+				LM_ERR("updating published info in database\n");
+				goto error;
+			}
 		}
 
 		/* send 200OK */
@@ -810,6 +874,13 @@ int update_presentity(struct sip_msg* msg, presentity_t* presentity,
 
 send_notify:
 
+	/* within the window of a previous change, the watchers get
+	 * this one (and the next ones) when the window closes, the
+	 * mixed presence NOTIFY included */
+	if (notify_coalesce_window>0 &&
+	coalesce_notify(&pres_uri, presentity->event))
+		goto done;
+
 	if (publ_notify(presentity, pres_uri, body.s?&body:0,
 				NULL, rules_doc, NULL, 1, NULL)<0)
 	{
@@ -907,28 +978,38 @@ int pres_htable_restore(void)
 {
 	/* query all records from presentity table and insert records
 	 * in presentity table */
-	db_key_t result_cols[6];
+	db_key_t result_cols[9];
 	db_res_t *result= NULL;
 	db_row_t *rows= NULL ;
 	db_val_t *row_vals;
 	int  i;
-	str user, domain, ev_str, uri, body;
+	str user, domain, ev_str, uri, body, extra_hdrs, sender;
 	int n_result_cols= 0;
 	int user_col, domain_col, event_col, expires_col, body_col = 0, etag_col;
+	int extra_hdrs_col = 0, sender_col = 0, received_time_col = 0;
 	int event;
 	event_t ev;
 	char* sphere= NULL;
 	int nr_rows;
 	str etag;
 	int no_rows = 10;
+	pres_entry_t* p;
+	unsigned int hash_code;
 
 	result_cols[user_col= n_result_cols++]= &str_username_col;
 	result_cols[domain_col= n_result_cols++]= &str_domain_col;
 	result_cols[event_col= n_result_cols++]= &str_event_col;
 	result_cols[expires_col= n_result_cols++]= &str_expires_col;
 	result_cols[etag_col= n_result_cols++]= &str_etag_col;
-	if(sphere_enable)
+	if(sphere_enable || memory_presentity)
 		result_cols[body_col= n_result_cols++]= &str_body_col;
+	if(memory_presentity)
+	{
+		result_cols[extra_hdrs_col= n_result_cols++]= &str_extra_hdrs_col;
+		result_cols[sender_col= n_result_cols++]= &str_sender_col;
+		result_cols[received_time_col= n_result_cols++]=
+			&str_received_time_col;
+	}
 
 	if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
 	{
@@ -1026,7 +1107,7 @@ int pres_htable_restore(void)
 				sphere= extract_sphere(body);
 			}
 
-			if(insert_phtable(&uri, event, &etag, sphere, 0, 0)== NULL)
+			if((p= insert_phtable(&uri, event, &etag, sphere, 0, 0))== NULL)
 			{
 				LM_ERR("inserting record in presentity hash table\n");
 				pkg_free(uri.s);
@@ -1036,6 +1117,33 @@ int pres_htable_restore(void)
 			}
 			if(sphere)
 				pkg_free(sphere);
+
+			if(memory_presentity)
+			{
+				body.s= (char*)row_vals[body_col].val.string_val;
+				body.len= (!VAL_NULL(row_vals+body_col) && body.s) ?
+					strlen(body.s) : 0;
+				extra_hdrs.s= (char*)row_vals[extra_hdrs_col].val.string_val;
+				extra_hdrs.len= (!VAL_NULL(row_vals+extra_hdrs_col) &&
+					extra_hdrs.s) ? strlen(extra_hdrs.s) : 0;
+				sender.s= (char*)row_vals[sender_col].val.string_val;
+				sender.len= (!VAL_NULL(row_vals+sender_col) && sender.s) ?
+					strlen(sender.s) : 0;
+
+				hash_code= core_hash(&uri, NULL, phtable_size);
+				lock_get(&pres_htable[hash_code].lock);
+				if(set_phtable_doc(p, &ev_str, &body, &extra_hdrs, &sender,
+				row_vals[expires_col].val.int_val,
+				row_vals[received_time_col].val.int_val,
+				NO_UPDATEDB_FLAG)< 0)
+				{
+					lock_release(&pres_htable[hash_code].lock);
+					LM_ERR("storing the document in presentity hash table\n");
+					pkg_free(uri.s);
+					goto error;
+				}
+				lock_release(&pres_htable[hash_code].lock);
+			}
 			pkg_free(uri.s);
 		}
 
@@ -1063,6 +1171,401 @@ error:
 	return -1;
 }
 
+/* database write-behind for memory_presentity: the hash table holds the
+ * published documents, the update timer writes the changed ones and the
+ * removed ones are deleted from database by the same timer */
+struct pres_db_op
+{
+	str pres_uri;
+	str ev_name;
+	str etag;
+	str db_etag;
+	str body;
+	str extra_hdrs;
+	str sender;
+	int expires;
+	int received_time;
+	int db_flag;
+	unsigned int doc_version;
+	int written;
+	struct pres_db_op* next;
+};
+
+struct pres_db_del
+{
+	str pres_uri;
+	str ev_name;
+	str etag;
+	struct pres_db_del* next;
+};
+
+/* one flush at a time, so that the versions of a document are written
+ * in order */
+static gen_lock_t* pres_db_lock= NULL;
+static gen_lock_t* pres_del_lock= NULL;
+static struct pres_db_del** pres_del_list= NULL;
+
+int init_pres_db_queue(void)
+{
+	pres_db_lock= lock_alloc();
+	pres_del_lock= lock_alloc();
+	pres_del_list= (struct pres_db_del**)shm_malloc(
+		sizeof(struct pres_db_del*));
+	if(pres_db_lock== NULL || pres_del_lock== NULL || pres_del_list== NULL)
+	{
+		LM_ERR("No more %s memory\n", SHARE_MEM);
+		return -1;
+	}
+	*pres_del_list= NULL;
+
+	if(lock_init(pres_db_lock)== NULL || lock_init(pres_del_lock)== NULL)
+	{
+		LM_ERR("failed to init locks\n");
+		return -1;
+	}
+	return 0;
+}
+
+void destroy_pres_db_queue(void)
+{
+	struct pres_db_del* del;
+
+	if(pres_del_list)
+	{
+		while(*pres_del_list)
+		{
+			del= *pres_del_list;
+			*pres_del_list= del->next;
+			shm_free(del);
+		}
+		shm_free(pres_del_list);
+		pres_del_list= NULL;
+	}
+	if(pres_db_lock)
+	{
+		lock_destroy(pres_db_lock);
+		lock_dealloc(pres_db_lock);
+		pres_db_lock= NULL;
+	}
+	if(pres_del_lock)
+	{
+		lock_destroy(pres_del_lock);
+		lock_dealloc(pres_del_lock);
+		pres_del_lock= NULL;
+	}
+}
+
+int queue_pres_db_delete(str* pres_uri, str* ev_name, str* etag)
+{
+	struct pres_db_del* del;
+	int size;
+
+	size= sizeof(struct pres_db_del)+ pres_uri->len+ ev_name->len+ etag->len;
+	del= (struct pres_db_del*)shm_malloc(size);
+	if(del== NULL)
+	{
+		LM_ERR("No more %s memory, presentity [%.*s] left in database\n",
+			SHARE_MEM, pres_uri->len, pres_uri->s);
+		return -1;
+	}
+	size= sizeof(struct pres_db_del);
+	CONT_COPY(del, del->pres_uri, (*pres_uri));
+	CONT_COPY(del, del->ev_name, (*ev_name));
+	CONT_COPY(del, del->etag, (*etag));
+
+	lock_get(pres_del_lock);
+	del->next= *pres_del_list;
+	*pres_del_list= del;
+	lock_release(pres_del_lock);
+
+	return 0;
+}
+
+static int pres_db_keys(str* pres_uri, str* ev_name, db_key_t* keys,
+		db_val_t* vals)
+{
+	struct sip_uri uri;
+
+	if(parse_uri(pres_uri->s, pres_uri->len, &uri)< 0)
+	{
+		LM_ERR("failed to parse presentity uri [%.*s]\n",
+			pres_uri->len, pres_uri->s);
+		return -1;
+	}
+
+	keys[0]= &str_domain_col;
+	vals[0].type= DB_STR;
+	vals[0].nul= 0;
+	vals[0].val.str_val= uri.host;
+
+	keys[1]= &str_username_col;
+	vals[1].type= DB_STR;
+	vals[1].nul= 0;
+	vals[1].val.str_val= uri.user;
+
+	keys[2]= &str_event_col;
+	vals[2].type= DB_STR;
+	vals[2].nul= 0;
+	vals[2].val.str_val= *ev_name;
+
+	return 3;
+}
+
+static int pres_db_write(struct pres_db_op* op)
+{
+	db_key_t keys[10];
+	db_val_t vals[10];
+	int n, insert= (op->db_flag== INSERTDB_FLAG);
+
+	if((n= pres_db_keys(&op->pres_uri, &op->ev_name, keys, vals))< 0)
+		return -1;
+
+	/* the row to update is the one with the etag last written */
+	keys[n]= &str_etag_col;
+	vals[n].type= DB_STR;
+	vals[n].nul= 0;
+	vals[n].val.str_val= insert ? op->etag : op->db_etag;
+	n++;
+
+	if(!insert)
+	{
+		keys[n]= &str_etag_col;
+		vals[n].type= DB_STR;
+		vals[n].nul= 0;
+		vals[n].val.str_val= op->etag;
+		n++;
+	}
+
+	keys[n]= &str_expires_col;
+	vals[n].type= DB_INT;
+	vals[n].nul= 0;
+	vals[n].val.int_val= op->expires;
+	n++;
+
+	keys[n]= &str_received_time_col;
+	vals[n].type= DB_INT;
+	vals[n].nul= 0;
+	vals[n].val.int_val= op->received_time;
+	n++;
+
+	keys[n]= &str_sender_col;
+	vals[n].type= DB_STR;
+	vals[n].nul= 0;
+	vals[n].val.str_val= op->sender;
+	n++;
+
+	keys[n]= &str_body_col;
+	vals[n].type= DB_BLOB;
+	vals[n].nul= 0;
+	vals[n].val.str_val= op->body;
+	n++;
+
+	if(!insert || op->extra_hdrs.len)
+	{
+		keys[n]= &str_extra_hdrs_col;
+		vals[n].type= DB_BLOB;
+		vals[n].nul= 0;
+		vals[n].val.str_val= op->extra_hdrs;
+		n++;
+	}
+
+	if(pa_dbf.use_table(pa_db, &presentity_table)< 0)
+	{
+		LM_ERR("unsuccessful sql use table\n");
+		return -1;
+	}
+
+	if(insert)
+	{
+		if(pa_dbf.insert(pa_db, keys, vals, n)< 0)
+		{
+			LM_ERR("inserting presentity [%.*s] in database\n",
+				op->pres_uri.len, op->pres_uri.s);
+			return -1;
+		}
+	}
+	else
+	{
+		if(pa_dbf.update(pa_db, keys, 0, vals, keys+ 4, vals+ 4, 4, n- 4)< 0)
+		{
+			LM_ERR("updating presentity [%.*s] in database\n",
+				op->pres_uri.len, op->pres_uri.s);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* the entry of a written document is the one still pointing to the row
+ * it was written over; bucket must be locked */
+static void pres_db_written(int i, struct pres_db_op* op)
+{
+	pres_entry_t* p;
+
+	for(p= pres_htable[i].entries->next; p; p= p->next)
+	{
+		if(p->doc && p->db_etag_len== op->db_etag.len &&
+		memcmp(p->db_etag, op->db_etag.s, op->db_etag.len)== 0 &&
+		str_strcmp(&p->pres_uri, &op->pres_uri)== 0 &&
+		str_strcmp(&p->ev_name, &op->ev_name)== 0)
+			break;
+	}
+
+	if(p== NULL)
+	{
+		/* removed meanwhile - only the row it had before was queued
+		 * for removal, if any */
+		queue_pres_db_delete(&op->pres_uri, &op->ev_name, &op->etag);
+		return;
+	}
+
+	memcpy(p->db_etag, op->etag.s, op->etag.len);
+	p->db_etag_len= op->etag.len;
+	/* if changed again while written, the next run updates the row */
+	if(p->doc_version== op->doc_version)
+		p->db_flag= NO_UPDATEDB_FLAG;
+	else if(p->db_flag== INSERTDB_FLAG)
+		p->db_flag= UPDATEDB_FLAG;
+}
+
+static void pres_db_delete(struct pres_db_del* del)
+{
+	db_key_t keys[4];
+	db_val_t vals[4];
+	int n;
+
+	if((n= pres_db_keys(&del->pres_uri, &del->ev_name, keys, vals))< 0)
+		return;
+
+	keys[n]= &str_etag_col;
+	vals[n].type= DB_STR;
+	vals[n].nul= 0;
+	vals[n].val.str_val= del->etag;
+	n++;
+
+	if(pa_dbf.use_table(pa_db, &presentity_table)< 0)
+	{
+		LM_ERR("unsuccessful sql use table\n");
+		return;
+	}
+	if(pa_dbf.delete(pa_db, keys, 0, vals, n)< 0)
+		LM_ERR("deleting presentity [%.*s] from database\n",
+			del->pres_uri.len, del->pres_uri.s);
+}
+
+static void pres_db_flush_locked(int no_lock)
+{
+	struct pres_db_op *ops, *op;
+	struct pres_db_del *dels, *del;
+	pres_entry_t* p;
+	str etag;
+	int i, size;
+
+	for(i= 0; i< phtable_size; i++)
+	{
+		ops= NULL;
+
+		if(!no_lock)
+			lock_get(&pres_htable[i].lock);
+		for(p= pres_htable[i].entries->next; p; p= p->next)
+		{
+			if(p->doc== NULL || p->db_flag== NO_UPDATEDB_FLAG)
+				continue;
+
+			/* a row not inserted yet is looked up by its own etag */
+			if(p->db_flag== INSERTDB_FLAG)
+			{
+				memcpy(p->db_etag, p->etag, p->etag_len);
+				p->db_etag_len= p->etag_len;
+			}
+
+			size= sizeof(struct pres_db_op)+ p->pres_uri.len+
+				p->ev_name.len+ p->etag_len+ p->db_etag_len+ p->body.len+
+				p->extra_hdrs.len+ p->sender.len;
+			op= (struct pres_db_op*)pkg_malloc(size);
+			if(op== NULL)
+			{
+				/* the rest is written at the next run */
+				LM_ERR("No more %s memory\n", PKG_MEM_STR);
+				break;
+			}
+			size= sizeof(struct pres_db_op);
+			CONT_COPY(op, op->pres_uri, p->pres_uri);
+			CONT_COPY(op, op->ev_name, p->ev_name);
+			etag.s= p->etag;
+			etag.len= p->etag_len;
+			CONT_COPY(op, op->etag, etag);
+			etag.s= p->db_etag;
+			etag.len= p->db_etag_len;
+			CONT_COPY(op, op->db_etag, etag);
+			CONT_COPY(op, op->body, p->body);
+			CONT_COPY(op, op->extra_hdrs, p->extra_hdrs);
+			CONT_COPY(op, op->sender, p->sender);
+			op->expires= p->expires;
+			op->received_time= p->received_time;
+			op->db_flag= p->db_flag;
+			op->doc_version= p->doc_version;
+			op->next= ops;
+			ops= op;
+		}
+		if(!no_lock)
+			lock_release(&pres_htable[i].lock);
+
+		if(ops== NULL)
+			continue;
+
+		/* the entries are marked written only once in database, the
+		 * failed ones are retried at the next run */
+		for(op= ops; op; op= op->next)
+			op->written= (pres_db_write(op)== 0);
+
+		if(!no_lock)
+			lock_get(&pres_htable[i].lock);
+		while(ops)
+		{
+			op= ops;
+			ops= ops->next;
+			if(op->written)
+				pres_db_written(i, op);
+			pkg_free(op);
+		}
+		if(!no_lock)
+			lock_release(&pres_htable[i].lock);
+	}
+
+	/* the removals queued so far come after the writes above */
+	if(!no_lock)
+		lock_get(pres_del_lock);
+	dels= *pres_del_list;
+	*pres_del_list= NULL;
+	if(!no_lock)
+		lock_release(pres_del_lock);
+
+	while(dels)
+	{
+		del= dels;
+		dels= dels->next;
+		pres_db_delete(del);
+		shm_free(del);
+	}
+}
+
+void pres_db_flush(void)
+{
+	lock_get(pres_db_lock);
+	pres_db_flush_locked(0);
+	lock_release(pres_db_lock);
+}
+
+void timer_pres_db_update(unsigned int ticks, void *param)
+{
+	/* called with no ticks and param from destroy */
+	if(ticks== 0 && param== NULL)
+		pres_db_flush_locked(1);
+	else
+		pres_db_flush();
+}
+
 int pres_expose_evi(pres_ev_t *ev, str *filter)
 {
 	int user_col, domain_col, expires_col, body_col, etag_col;
@@ -1078,6 +1581,10 @@ int pres_expose_evi(pres_ev_t *ev, str *filter)
 	db_val_t *row_vals;
 	int nr_vals = 0;
 
+	/* expose what was published so far, not only what was written */
+	if (memory_presentity)
+		pres_db_flush();
+
 	if (pa_dbf.use_table(pa_db, &presentity_table) < 0) {
 		LM_ERR("cannot select table \"%.*s\"\n",
 				presentity_table.len, presentity_table.s);
@@ -66,6 +66,13 @@ int generate_ETag(int etag_count, str* etag);
 
 int pres_htable_restore(void);
 
+/* database write-behind for memory_presentity */
+int init_pres_db_queue(void);
+void destroy_pres_db_queue(void);
+int queue_pres_db_delete(str* pres_uri, str* ev_name, str* etag);
+void pres_db_flush(void);
+void timer_pres_db_update(unsigned int ticks, void *param);
+
 char* extract_sphere(str body);
 
 char* get_sphere(str* pres_uri);
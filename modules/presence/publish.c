@@ -168,6 +168,88 @@ static inline void build_extra_hdrs(struct sip_msg* msg, const str* map, str* ex
 	}
 }
 
+/* collects the documents expired before 'limit' from the presentity hash
+ * table (memory_presentity), as msg_presentity_clean() reads them from
+ * database otherwise */
+static int get_expired_mem(struct p_modif** p_array, int limit)
+{
+	struct p_modif* p= NULL, *tmp;
+	pres_entry_t* e;
+	presentity_t* pres;
+	struct sip_uri uri;
+	str etag;
+	int i, n= 0, max= 0, size;
+
+	for(i= 0; i< phtable_size; i++)
+	{
+		lock_get(&pres_htable[i].lock);
+		for(e= pres_htable[i].entries->next; e; e= e->next)
+		{
+			if(e->doc== NULL || e->expires>= limit)
+				continue;
+
+			if(n== max)
+			{
+				max= max ? 2* max : 16;
+				tmp= (struct p_modif*)pkg_realloc(p,
+					max* sizeof(struct p_modif));
+				if(tmp== NULL)
+				{
+					LM_ERR("failed to PKG allocate presentity array of %d\n",
+						max);
+					lock_release(&pres_htable[i].lock);
+					goto done;
+				}
+				p= tmp;
+			}
+
+			size= sizeof(presentity_t)+ e->etag_len;
+			pres= (presentity_t*)pkg_malloc(size);
+			if(pres== NULL)
+			{
+				LM_ERR("failed to PKG allocate new presentity\n");
+				continue;
+			}
+			memset(pres, 0, size);
+			size= sizeof(presentity_t);
+			etag.s= e->etag;
+			etag.len= e->etag_len;
+			CONT_COPY(pres, pres->new_etag, etag);
+
+			pres->event= contains_event(&e->ev_name, NULL);
+			if(pres->event== NULL)
+			{
+				LM_DBG("event not found\n");
+				pkg_free(pres);
+				continue;
+			}
+
+			/* user and domain point in the uri, released along */
+			if(pkg_str_dup(&p[n].uri, &e->pres_uri)< 0)
+			{
+				LM_ERR("failed to PKG allocate the uri\n");
+				pkg_free(pres);
+				continue;
+			}
+			if(parse_uri(p[n].uri.s, p[n].uri.len, &uri)< 0)
+			{
+				LM_ERR("failed to parse presentity uri\n");
+				pkg_free(p[n].uri.s);
+				pkg_free(pres);
+				continue;
+			}
+			pres->user= uri.user;
+			pres->domain= uri.host;
+			p[n++].p= pres;
+		}
+		lock_release(&pres_htable[i].lock);
+	}
+
+done:
+	*p_array= p;
+	return n;
+}
+
 void msg_presentity_clean(unsigned int ticks,void *interval)
 {
 	static db_ps_t my_ps_delete = NULL;
@@ -217,6 +299,16 @@ void msg_presentity_clean(unsigned int ticks,void *interval)
 
 	last_expire_check = db_vals[1].val.int_val - 1;
 
+	if(memory_presentity)
+	{
+		/* the expires of the documents are up to date only in memory */
+		n= get_expired_mem(&p, db_vals[1].val.int_val);
+		if(n<= 0)
+			goto delete;
+		LM_DBG("found n= %d expires messages\n", n);
+		goto notify;
+	}
+
 	result_cols[user_col= n_result_cols++] = &str_username_col;
 	result_cols[domain_col=n_result_cols++] = &str_domain_col;
 	result_cols[etag_col=n_result_cols++] = &str_etag_col;
@@ -315,6 +407,7 @@ void msg_presentity_clean(unsigned int ticks,void *interval)
 	pa_dbf.free_result(pa_db, result);
 	result= NULL;
 
+notify:
 	for(i= 0; i<n ; i++)
 	{
 		if(p[i].p == 0)
@@ -346,7 +439,8 @@ void msg_presentity_clean(unsigned int ticks,void *interval)
 		}
 		rules_doc= NULL;
 		/* delete from hash table */
-		if(delete_phtable_query(&p[i].uri, ev.parsed, &p[i].p->new_etag)< 0)
+		if(delete_phtable_query(&p[i].uri, p[i].p->event->evp->parsed,
+		&p[i].p->new_etag)< 0)
 		{
 			LM_ERR("deleting from pres hash table\n");
 		}
@@ -359,6 +453,7 @@ void msg_presentity_clean(unsigned int ticks,void *interval)
 	 * that the presentity was handled (as expired) on all presence 
 	 * servers (if DB is shared), remove from only presentities older
 	 * than 3 times the timer cycle */
+delete:
 	db_vals[1].val.int_val -= 3 * ((int)(long)interval);
 
 	if (pa_dbf.use_table(pa_db, &presentity_table) < 0)
@@ -41,6 +41,7 @@
 #include "../../proxy.h"
 #include "../../forward.h"
 #include "../../mod_fix.h"
+#include "../../ipc.h"
 
 #include "hep.h"
 #include "../compression/compression_api.h"
@@ -78,6 +79,33 @@ extern str homer5_delim;
 
 extern compression_api_t compression_api;
 
+extern int hep_batch_size;
+extern int hep_batch_timeout;
+
+/* HEP packets are encoded in a per process buffer which only grows, so
+ * tracing a message does not cost an allocation */
+#define HEP_BUF_CHUNK 4096
+static char *hep_enc_buf=NULL;
+static int hep_enc_buf_size=0;
+
+/* packets waiting to be written, all at once, on a HEP TCP destination */
+struct hep_batch {
+	int proto;
+	struct socket_info *send_sock;
+	union sockaddr_union to;
+
+	char *buf;
+	int size;
+	int len;
+
+	struct hep_batch *next;
+};
+
+static struct hep_batch *hep_batches=NULL;
+/* per process (shm) time of the oldest packet in the process batches;
+ * set up by the flush timer once the process table is known */
+static utime_t **hep_batch_since=NULL;
+
 struct hep_message_id hep_ids[] = {
 	{ "sip" ,  0x01},
 	{ "xlog",  0x56},
@@ -1181,7 +1209,32 @@ static int add_generic_chunk(struct hep_desc* hep_msg, void* data, int len, int
 
 
 
-static char* build_hep12_buf(struct hep_desc* hep_msg, int* len)
+/* makes room for need bytes (from the start) in a growing buffer */
+static char *hep_buf_reserve(char **buf, int *size, int need)
+{
+	char *p;
+	int new_size;
+
+	if (need <= *size)
+		return *buf;
+
+	new_size = (need + HEP_BUF_CHUNK - 1) & ~(HEP_BUF_CHUNK - 1);
+	p = pkg_realloc(*buf, new_size);
+	if (p == NULL) {
+		LM_ERR("no more pkg mem!\n");
+		return NULL;
+	}
+
+	*buf = p;
+	*size = new_size;
+
+	return p;
+}
+
+/* the packet is encoded at offset off of the *buf buffer (grown if needed);
+ * returns the start of the packet */
+static char* build_hep12_buf(struct hep_desc* hep_msg, char **out,
+												int *size, int off, int* len)
 {
 	int buflen, p;
 	char* buf;
@@ -1198,11 +1251,9 @@ static char* build_hep12_buf(struct hep_desc* hep_msg, int* len)
 		buflen += sizeof(struct hep_timehdr);
 	}
 
-	buf = pkg_malloc(buflen);
-	if (buf == NULL) {
-		LM_ERR("no more pkg mem!\n");
+	if (hep_buf_reserve(out, size, off + buflen) == NULL)
 		return NULL;
-	}
+	buf = *out + off;
 
 	memset(buf, 0, buflen);
 
@@ -1243,7 +1294,8 @@ static inline void JSON_free(void* root)
 	cJSON_Delete(root);
 }
 
-static char* build_hep3_buf(struct hep_desc* hep_msg, int* len)
+static char* build_hep3_buf(struct hep_desc* hep_msg, char **out,
+												int *size, int off, int* len)
 {
 	#define UPDATE_CHECK_REMAINING(__rem, __len, __curr) \
 		do { \
@@ -1344,15 +1396,12 @@ static char* build_hep3_buf(struct hep_desc* hep_msg, int* len)
 	}
 
 
-	buf = pkg_malloc(rem);
+	if (hep_buf_reserve(out, size, off + rem) == NULL)
+		return NULL;
+	buf = *out + off;
 
 	hep_msg->u.hepv3.hg.header.length = htons(rem);
 
-	if (buf == NULL) {
-		LM_ERR("no more pkg mem!\n");
-		return NULL;
-	}
-
 	memcpy(buf, &hep_msg->u.hepv3.hg, sizeof(hep_generic_t));
 	UPDATE_CHECK_REMAINING(rem, *len, sizeof(hep_generic_t));
 
@@ -1674,13 +1723,165 @@ int add_hep_payload(trace_message message, char* pld_name, str* pld_value)
 }
 
 
+/* writes out all the packets batched by this process */
+static void hep_batch_flush(void)
+{
+	struct hep_batch *b;
+
+	for (b=hep_batches; b; b=b->next) {
+		if (!b->len)
+			continue;
+
+		if (msg_send(b->send_sock, b->proto, &b->to, 0, b->buf, b->len,
+		NULL) < 0)
+			LM_ERR("cannot send batch of %d bytes of hep messages!\n", b->len);
+		b->len = 0;
+	}
+
+	if (hep_batch_since && *hep_batch_since)
+		(*hep_batch_since)[process_no] = 0;
+}
+
+static void hep_batch_flush_rpc(int sender, void *param)
+{
+	hep_batch_flush();
+}
+
+/* timer routine (timer process) asking the processes holding batches older
+ * than hep_batch_timeout to write them out */
+void hep_batch_timer(utime_t ticks, void *param)
+{
+	utime_t *since, t;
+	int i;
+
+	if (*hep_batch_since == NULL) {
+		/* the process table is known by now */
+		since = shm_malloc(counted_max_processes * sizeof *since);
+		if (since == NULL) {
+			LM_ERR("no more shm mem!\n");
+			return;
+		}
+		memset(since, 0, counted_max_processes * sizeof *since);
+		*hep_batch_since = since;
+		return;
+	}
+
+	since = *hep_batch_since;
+	for (i = 0; i < counted_max_processes; i++) {
+		t = since[i];
+		if (!t || ticks - t < (utime_t)hep_batch_timeout * 1000)
+			continue;
+
+		/* reset before the request, so whatever the process adds meanwhile
+		 * is still flushed by it */
+		since[i] = 0;
+		if (ipc_send_rpc(i, hep_batch_flush_rpc, NULL) < 0)
+			LM_ERR("failed to ask process %d to flush its hep batch\n", i);
+	}
+}
+
+int init_hep_batch(void)
+{
+	hep_batch_since = shm_malloc(sizeof *hep_batch_since);
+	if (hep_batch_since == NULL) {
+		LM_ERR("no more shm mem!\n");
+		return -1;
+	}
+	*hep_batch_since = NULL;
+
+	if (register_utimer("hep-batch-flush", hep_batch_timer, NULL,
+	hep_batch_timeout * 1000, TIMER_FLAG_DELAY_ON_DELAY) < 0) {
+		LM_ERR("failed to register hep batch utimer\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct hep_batch *get_hep_batch(int proto,
+					struct socket_info *send_sock, union sockaddr_union *to)
+{
+	struct hep_batch *b;
+
+	for (b=hep_batches; b; b=b->next)
+		if (b->proto == proto && b->send_sock == send_sock &&
+		su_cmp(&b->to, to))
+			return b;
+
+	b = pkg_malloc(sizeof *b);
+	if (b == NULL) {
+		LM_ERR("no more pkg mem!\n");
+		return NULL;
+	}
+	memset(b, 0, sizeof *b);
+
+	b->proto = proto;
+	b->send_sock = send_sock;
+	b->to = *to;
+
+	b->next = hep_batches;
+	hep_batches = b;
+
+	return b;
+}
+
+static inline char *build_hep_buf(struct hep_desc *hep_msg, char **buf,
+												int *size, int off, int *len)
+{
+	if (hep_msg->version == 3)
+		return build_hep3_buf(hep_msg, buf, size, off, len);
+	else
+		return build_hep12_buf(hep_msg, buf, size, off, len);
+}
+
+/* encodes the message right at the end of the destination's batch; the
+ * batch is written out once it reaches hep_batch_size bytes or gets older
+ * than hep_batch_timeout */
+static int send_hep_batched(struct hep_desc *hep_msg, int proto,
+					struct socket_info *send_sock, union sockaddr_union *to)
+{
+	struct hep_batch *b;
+	utime_t *since;
+	int len;
+
+	if (send_sock == NULL)
+		send_sock = get_send_socket(0, to, proto);
+	if (send_sock == NULL) {
+		LM_ERR("no sending socket found for proto %d\n", proto);
+		return -1;
+	}
+
+	b = get_hep_batch(proto, send_sock, to);
+	if (b == NULL)
+		return -1;
+
+	if (build_hep_buf(hep_msg, &b->buf, &b->size, b->len, &len) == NULL) {
+		LM_ERR("failed to build hep buffer!\n");
+		return -1;
+	}
+	b->len += len;
+
+	since = *hep_batch_since;
+	if (b->len >= hep_batch_size ||
+	(since[process_no] &&
+	get_uticks() - since[process_no] >= (utime_t)hep_batch_timeout * 1000)) {
+		hep_batch_flush();
+		return 0;
+	}
+
+	if (!since[process_no])
+		since[process_no] = get_uticks();
+
+	return 0;
+}
+
 int send_hep_message(trace_message message, trace_dest dest, struct socket_info* send_sock)
 {
 	int len, ret=-1;
 	char* buf=0;
 
 	struct proxy_l* p;
-	union sockaddr_union* to;
+	union sockaddr_union to;
 
 	hid_list_p hep_dest = (hid_list_p) dest;
 
@@ -1689,53 +1890,45 @@ int send_hep_message(trace_message message, trace_dest dest, struct socket_info*
 		goto end;
 	}
 
-
-	if (((struct hep_desc *)message)->version == 3) {
-		/* hep msg will be freed after */
-		if ((buf=build_hep3_buf((struct hep_desc *)message, &len))==NULL) {
-			LM_ERR("failed to build hep buffer!\n");
-			goto end;
-		}
-	} else {
-		if ((buf=build_hep12_buf((struct hep_desc *)message, &len))==NULL) {
-			LM_ERR("failed to build hep buffer!\n");
-			goto end;
-		}
-	}
-
 	/* */
 	p=mk_proxy( &hep_dest->ip, hep_dest->port_no ? hep_dest->port_no : HEP_PORT, hep_dest->transport, 0);
 	if (p == NULL) {
-		pkg_free(buf);
 		LM_ERR("bad hep host name!\n");
 		goto end;
 	}
 
-	to=(union sockaddr_union *)pkg_malloc(sizeof(union sockaddr_union));
-	if (to == 0) {
-		LM_ERR("no more pkg mem!\n");
-		pkg_free(buf);
-		free_proxy(p);
-		pkg_free(p);
-		goto end;
+	hostent2su(&to, &p->host, p->addr_idx, p->port?p->port:HEP_PORT);
+
+	/* stream destinations may carry several messages per write; until the
+	 * flush timer is up, or in processes the timer cannot reach over IPC,
+	 * messages are sent one by one */
+	if (hep_batch_size && hep_dest->transport != PROTO_HEP_UDP &&
+	hep_batch_since && *hep_batch_since &&
+	!(pt[process_no].flags & OSS_PROC_NO_IPC)) {
+		ret = send_hep_batched((struct hep_desc *)message,
+			hep_dest->transport, send_sock, &to);
+		goto free_proxy;
 	}
 
-	hostent2su(to, &p->host, p->addr_idx, p->port?p->port:HEP_PORT);
+	/* hep msg will be freed after */
+	if ((buf=build_hep_buf((struct hep_desc *)message, &hep_enc_buf,
+	&hep_enc_buf_size, 0, &len))==NULL) {
+		LM_ERR("failed to build hep buffer!\n");
+		goto free_proxy;
+	}
 
 	do {
-		if (msg_send(send_sock, hep_dest->transport, to, 0, buf, len, NULL) < 0) {
+		if (msg_send(send_sock, hep_dest->transport, &to, 0, buf, len, NULL) < 0) {
 			LM_ERR("Cannot send hep message!\n");
 			continue;
 		}
 		ret=0;
 		break;
-	} while ( get_next_su( p, to, 0)==0);
+	} while ( get_next_su( p, &to, 0)==0);
 
+free_proxy:
 	free_proxy(p);
 	pkg_free(p);
-	pkg_free(to);
-	pkg_free(buf);
-
 end:
 	return ret;
 }
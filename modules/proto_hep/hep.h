@@ -285,6 +285,7 @@ int unpack_hep(char *buf, int len, int version, struct hep_desc* h);
 void free_extra_chunks(struct hep_desc* h);
 
 int init_hep_id(void);
+int init_hep_batch(void);
 void destroy_hep_id(void);
 int parse_hep_id(unsigned int type, void *val);
 
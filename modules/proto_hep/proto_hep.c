@@ -79,6 +79,11 @@ int hep_ctx_idx=0;
 int hep_capture_id = 1;
 int payload_compression=0;
 
+/* bytes of HEP messages to gather per TCP destination before writing them
+ * out; 0 sends each message on its own */
+int hep_batch_size=0;
+int hep_batch_timeout=100;
+
 int homer5_on=1;
 str homer5_delim = {":", 0};
 
@@ -142,6 +147,8 @@ static param_export_t params[] = {
 	{ "hep_id",						 STR_PARAM|USE_FUNC_PARAM, parse_hep_id },
 	{ "homer5_on",						 INT_PARAM, &homer5_on              },
 	{ "homer5_delim",					 STR_PARAM, &homer5_delim.s },
+	{ "hep_batch_size",					 INT_PARAM, &hep_batch_size },
+	{ "hep_batch_timeout",				 INT_PARAM, &hep_batch_timeout },
 	{0, 0, 0}
 };
 
@@ -219,6 +226,19 @@ static int mod_init(void)
 		}
 	}
 
+	if (hep_batch_size < 0)
+		hep_batch_size = 0;
+	if (hep_batch_size) {
+		if (hep_batch_timeout <= 0) {
+			LM_ERR("hep_batch_timeout must be positive\n");
+			return -1;
+		}
+		if (init_hep_batch() < 0) {
+			LM_ERR("could not initialize HEP batching!\n");
+			return -1;
+		}
+	}
+
 	hep_ctx_idx = context_register_ptr(CONTEXT_GLOBAL, 0);
 	homer5_delim.len = strlen(homer5_delim.s);
 
@@ -71,6 +71,9 @@ struct clusterer_binds clusterer_api;
 
 int rl_window_size=10;   /* how many seconds the window shall hold*/
 int rl_slot_period=200;  /* how many milisecs a slot from the window has  */
+/* how much (percents of the limit) the pipes may be under-counted, due to
+ * the hits buffered by each process before adding them to the pipe */
+int rl_counters_accuracy = 10;
 
 static str db_url = {0,0};
 str db_prefix = str_init("rl_pipe_");
@@ -148,6 +151,7 @@ static param_export_t params[] = {
 	{ "window_size",            INT_PARAM,  &rl_window_size},
 	{ "slot_period",            INT_PARAM,  &rl_slot_period},
 	{ "limit_per_interval",     INT_PARAM,  &rl_limit_per_interval},
+	{ "counters_accuracy",      INT_PARAM,  &rl_counters_accuracy},
 	{ 0, 0, 0}
 };
 
@@ -342,6 +346,10 @@ static int mod_init(void)
 		LM_ERR("invalid expire time\n");
 		return -1;
 	}
+	if (rl_counters_accuracy < 0 || rl_counters_accuracy > 100) {
+		LM_ERR("invalid counters accuracy (must be between 0 and 100)\n");
+		return -1;
+	}
 
 	if (rl_repl_cluster < 0) {
 		LM_ERR("Invalid replication_cluster, must be 0 or a positive cluster id\n");
@@ -441,6 +449,20 @@ static int mod_child(int rank)
 void mod_destroy(void)
 {
 	unsigned int i;
+	rl_pipe_t *pipe;
+
+	if (rl_htable.gc) {
+		while ((pipe = *rl_htable.gc)) {
+			*rl_htable.gc = pipe->gc_next;
+			shm_free(pipe);
+		}
+		shm_free(rl_htable.gc);
+		rl_htable.gc = 0;
+	}
+	if (rl_htable.gen) {
+		shm_free(rl_htable.gen);
+		rl_htable.gen = 0;
+	}
 	if (rl_htable.maps) {
 		for (i = 0; i < rl_htable.size; i++)
 			map_destroy(rl_htable.maps[i], 0);
@@ -483,111 +505,95 @@ int hash[100] = {18, 50, 51, 39, 49, 68, 8, 78, 61, 75, 53, 32, 45, 77, 31,
 	54, 33, 92, 76, 85, 5, 72, 9, 83, 56, 17, 95, 55, 80, 98, 66, 14, 16,
 	38, 71, 23, 2, 67, 36, 65, 27, 1, 19, 59, 89, 48};
 
+#define RL_WIN_SLOT(_w)		((unsigned int)((_w)>>32))
+#define RL_WIN_COUNT(_w)	((int)(unsigned int)(_w))
+#define RL_WIN_MAKE(_s, _c) \
+	(((unsigned long long)(_s)<<32)|(unsigned long long)(unsigned int)(_c))
+
+/* the absolute time slot we are currently in */
+static inline unsigned int hist_now_slot(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (unsigned int)(((unsigned long long)tv.tv_sec * 1000 +
+		tv.tv_usec / 1000) / rl_slot_period);
+}
+
 /**
- * the algorithm keeps a circular window of requests in a fixed size buffer
+ * the algorithm keeps a circular window of requests in a fixed size buffer;
+ * each position holds the counter of one time slot, tagged with the slot,
+ * so a position belonging to an older window is simply ignored and it is
+ * re-initialized by the first update in its new slot (with an atomic
+ * compare and swap - no locking needed)
  *
  * @param pipe   containing the window
  * @param update whether or not to inc call number
  * @return number of calls in the window
  */
-static inline int hist_check(rl_pipe_t *pipe, int update)
+static inline int hist_count(rl_pipe_t *pipe, int update)
 {
-	#define U2MILI(__usec__) (__usec__/1000)
-	#define S2MILI(__sec__)  (__sec__ *1000)
-	int i;
-	int now_index;
-	int rl_win_ms = rl_window_size * 1000;
-	unsigned long long now_time, start_time;
-
-	struct timeval tv;
-
-	pipe->counter = 0;
-	pipe->counter = rl_get_all_counters(pipe);
-
-	gettimeofday(&tv, NULL);
-	now_time = S2MILI(tv.tv_sec) + U2MILI(tv.tv_usec);
-	now_index = (now_time%rl_win_ms) / rl_slot_period;
-
-	start_time = S2MILI(pipe->rwin.start_time.tv_sec)
-		+ U2MILI(pipe->rwin.start_time.tv_usec);
-
-	if ( (pipe->rwin.start_time.tv_sec == 0) ||   /* first run*/
-	(now_time - start_time >= rl_win_ms) ) {      /* or more than one window */
-		//LM_DBG("case 1 - start=%lld/%d, now=%lld/%d, diff=%lld\n",
-		//	start_time, pipe->rwin.start_index, now_time, now_index,
-		//	now_time-start_time);
-		memset(pipe->rwin.window, 0,
-			pipe->rwin.window_size * sizeof(long int));
-		pipe->rwin.start_time = tv;
-		pipe->rwin.start_index = now_index;
-		pipe->rwin.window[now_index] = update;
-
-	} else
-	if (now_time - start_time >= rl_slot_period) {
-		/* different slot */
-		//LM_DBG("case 2 - start=%lld/%d, now=%lld/%d, diff=%lld\n",
-		//	start_time, pipe->rwin.start_index, now_time, now_index,
-		//	now_time-start_time);
-		/* zero the gap between old/start index and current/now index */
-		for ( i=(pipe->rwin.start_index+1)%pipe->rwin.window_size;
-			i != now_index;
-			i=(i+1)%pipe->rwin.window_size)
-				pipe->rwin.window[i] = 0;
-		/* update the time/index of the last counting */
-		pipe->rwin.start_time = tv;
-		pipe->rwin.start_index = now_index;
-
-		/* count current call; it will be the last element in the window */
-		pipe->rwin.window[now_index] = update;
-
-	} else {
-		/* index the same slot */
-		/* we just need to increment the number of calls for
-		 * the current slot*/
-		//LM_DBG("case 3 - start=%lld/%d, now=%lld/%d, diff=%lld\n",
-		//	start_time, pipe->rwin.start_index, now_time, now_index,
-		//	now_time-start_time);
-		pipe->rwin.window[pipe->rwin.start_index] += update;
+	unsigned long long w, nw, o;
+	unsigned int now_slot;
+	int i, counter;
+
+	now_slot = hist_now_slot();
+
+	if (update) {
+		i = now_slot % pipe->rwin.window_size;
+		w = pipe->rwin.window[i];
+		for (;;) {
+			nw = RL_WIN_MAKE(now_slot, (RL_WIN_SLOT(w) == now_slot ?
+				RL_WIN_COUNT(w) : 0) + update);
+			o = __sync_val_compare_and_swap(&pipe->rwin.window[i], w, nw);
+			if (o == w)
+				break;
+			w = o;
+		}
 	}
 
 	/* count the total number of calls in the window */
-	for (i=0; i < pipe->rwin.window_size; i++)
-		pipe->counter += pipe->rwin.window[i];
+	counter = rl_get_all_counters(pipe);
+	for (i = 0; i < pipe->rwin.window_size; i++) {
+		w = pipe->rwin.window[i];
+		if (now_slot - RL_WIN_SLOT(w) < (unsigned int)pipe->rwin.window_size)
+			counter += RL_WIN_COUNT(w);
+	}
 
-	return pipe->counter > pipe->limit ? -1 : 1;
+	return counter;
+}
 
-	#undef U2MILI
-	#undef S2MILI
+static inline int hist_check(rl_pipe_t *pipe, int update)
+{
+	return hist_count(pipe, update) > pipe->limit ? -1 : 1;
 }
 
 int hist_get_count(rl_pipe_t *pipe)
 {
-	/* do a NOP to validate the interval, then return the unchanged counter */
-	hist_check(pipe, 0);
-
-	return pipe->counter;
+	return hist_count(pipe, 0);
 }
 
 void hist_set_count(rl_pipe_t *pipe, long int value)
 {
+	int i;
+
 	if (value == 0) {
 		/* if 0, we need to clear all counters */
-		memset(pipe->rwin.window, 0,
-				pipe->rwin.window_size * sizeof(long int));
-		pipe->rwin.start_time.tv_sec = 0; /* force init */
+		for (i = 0; i < pipe->rwin.window_size; i++)
+			pipe->rwin.window[i] = 0;
 	} else
-		hist_check(pipe, value);
+		hist_count(pipe, value);
 }
 
 
 /**
  * runs the pipe's algorithm
- * (expects rl_lock to be taken)
+ * \param	pending hits of this process not yet added to the pipe's counter
  * \return	-1 if drop needed, 1 if allowed
  */
-int rl_pipe_check(rl_pipe_t *pipe)
+int rl_pipe_check(rl_pipe_t *pipe, int pending)
 {
-	unsigned counter = rl_get_all_counters(pipe);
+	unsigned counter = rl_get_all_counters(pipe) + pending;
 
 	switch (pipe->algo) {
 		case PIPE_ALGO_NOP:
@@ -57,17 +57,16 @@ typedef struct rl_repl_counter {
 
 typedef struct rl_window {
 	int window_size;   /* how big the window array is */
-	int start_index;   /* where the window starts; the window uses
-						* a circular buffer so we will need to know
-						* where is the start of the buffer */
-	struct timeval start_time; /* time from where the window starts */
 
-	long int *window;  /* actual array of messages */
+	/* circular array of messages; each slot is tagged with the
+	 * absolute time slot it counts for (upper 32 bits), so it can be
+	 * updated and expired without locking */
+	volatile unsigned long long *window;
 } rl_window_t;
 
 typedef struct rl_pipe {
 	int limit;					/* limit used by algorithm */
-	int counter;				/* countes the accesses */
+	volatile int counter;		/* countes the accesses */
 	int my_counter;				/* countes the accesses of this instance */
 	int my_last_counter;		/* countes the last accesses of this instance */
 	int last_counter;			/* last counter */
@@ -76,6 +75,7 @@ typedef struct rl_pipe {
 	unsigned long last_used;	/* timestamp when the pipe was last accessed */
 	rl_repl_counter_t *dsts;	/* counters per destination */
 	rl_window_t rwin;			/* window of requests */
+	struct rl_pipe *gc_next;	/* link in the list of deleted pipes */
 } rl_pipe_t;
 
 typedef struct rl_repl_dst {
@@ -91,6 +91,8 @@ typedef struct {
 	map_t * maps;
 	gen_lock_set_t *locks;
 	unsigned int locks_no;
+	unsigned int *gen;			/* changes each time pipes are deleted */
+	rl_pipe_t **gc;				/* deleted pipes, to be freed on next timer */
 } rl_big_htable;
 
 extern gen_lock_t * rl_lock;
@@ -107,6 +109,7 @@ extern str db_prefix;
 extern int rl_repl_cluster;
 extern int rl_window_size;
 extern int rl_slot_period;
+extern int rl_counters_accuracy;
 
 extern struct clusterer_binds clusterer_api;
 
@@ -120,7 +123,7 @@ int w_rl_dec(struct sip_msg*, str *);
 int w_rl_reset(struct sip_msg*, str *);
 int w_rl_set_count(str, int);
 int rl_stats(mi_item_t *, str *);
-int rl_pipe_check(rl_pipe_t *);
+int rl_pipe_check(rl_pipe_t *, int);
 int rl_get_counter_value(str *);
 /* update load */
 int get_cpuload(void);
@@ -140,6 +143,7 @@ extern int rl_buffer_th;
 extern unsigned int rl_repl_timer_expire;
 int rl_repl_init(void);
 int rl_get_all_counters(rl_pipe_t *pipe);
+int rl_get_dsts_counters(rl_pipe_t *pipe);
 int rl_add_repl_dst(modparam_t type, void *val);
 
 void hist_set_count(rl_pipe_t *pipe, long int value);
@@ -35,10 +35,12 @@
 #include "../../cachedb/cachedb.h"
 #include "../../cachedb/cachedb_cap.h"
 #include "../../forward.h"
+#include "../../pt.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "ratelimit.h"
 
@@ -89,6 +91,106 @@ static str pipe_repl_cap = str_init("ratelimit-pipe-repl");
 
 
 
+/* the pipes already used by this process - they are accounted without
+ * taking the hash table locks, each process buffering a few hits before
+ * adding them to the shared counter of the pipe */
+typedef struct rl_local_pipe {
+	rl_pipe_t *pipe;
+	int pending;		/* hits not yet added to the pipe's counter */
+} rl_local_pipe_t;
+
+static map_t rl_local_pipes;
+static unsigned int rl_local_gen;
+
+static void rl_free_local_pipe(void *val)
+{
+	pkg_free(val);
+}
+
+/* looks up the pipe in the cache of this process; the cache is dropped
+ * as soon as the timer deletes any pipe, so it never points to freed ones */
+static rl_local_pipe_t *rl_get_local_pipe(str *name)
+{
+	rl_local_pipe_t **lp;
+	unsigned int gen = *rl_htable.gen;
+
+	if (rl_local_pipes && gen != rl_local_gen) {
+		map_destroy(rl_local_pipes, rl_free_local_pipe);
+		rl_local_pipes = 0;
+	}
+	if (!rl_local_pipes) {
+		rl_local_pipes = map_create(0);
+		if (!rl_local_pipes) {
+			LM_ERR("cannot create the local pipes map\n");
+			return NULL;
+		}
+		rl_local_gen = gen;
+	}
+
+	lp = (rl_local_pipe_t **)map_find(rl_local_pipes, *name);
+	return lp ? *lp : NULL;
+}
+
+static rl_local_pipe_t *rl_add_local_pipe(str *name, rl_pipe_t *pipe)
+{
+	rl_local_pipe_t **lp;
+
+	if (!rl_local_pipes)
+		return NULL;
+
+	lp = (rl_local_pipe_t **)map_get(rl_local_pipes, *name);
+	if (!lp) {
+		LM_ERR("cannot add pipe %.*s in the local map\n", name->len, name->s);
+		return NULL;
+	}
+	if (!*lp) {
+		*lp = pkg_malloc(sizeof(rl_local_pipe_t));
+		if (!*lp) {
+			LM_ERR("no more pkg memory\n");
+			map_remove(rl_local_pipes, *name);
+			return NULL;
+		}
+		(*lp)->pending = 0;
+	}
+	(*lp)->pipe = pipe;
+
+	return *lp;
+}
+
+/* how many hits a process may buffer for a pipe, so that all the hits
+ * buffered by all the processes stay below rl_counters_accuracy percents
+ * of the pipe's limit */
+static inline int rl_pipe_batch(rl_pipe_t *pipe)
+{
+	long long batch;
+
+	if (!rl_counters_accuracy || !counted_max_processes)
+		return 1;
+
+	batch = (long long)pipe->limit *
+		(rl_limit_per_interval ? 1 : rl_timer_interval) *
+		rl_counters_accuracy / 100 / counted_max_processes;
+
+	return batch > 1 ? (batch > INT_MAX ? INT_MAX : (int)batch) : 1;
+}
+
+/* accounts one more hit on a pipe and runs its algorithm */
+static inline int rl_pipe_hit(rl_local_pipe_t *lp)
+{
+	rl_pipe_t *pipe = lp->pipe;
+
+	/* the SBT window is updated in place */
+	if (pipe->algo == PIPE_ALGO_HISTORY)
+		return rl_pipe_check(pipe, 0);
+
+	if (++lp->pending >= rl_pipe_batch(pipe)) {
+		__sync_fetch_and_add(&pipe->counter, lp->pending);
+		lp->pending = 0;
+	}
+
+	return rl_pipe_check(pipe, lp->pending);
+}
+
 static str rl_name_buffer = {0, 0};
 
 static inline int rl_set_name(str * name)
@@ -225,6 +327,15 @@ int init_rl_table(unsigned int size)
 		rl_htable.size++;
 	}
 
+	rl_htable.gen = shm_malloc(sizeof(unsigned int));
+	rl_htable.gc = shm_malloc(sizeof(rl_pipe_t *));
+	if (!rl_htable.gen || !rl_htable.gc) {
+		LM_ERR("no more shm memory\n");
+		goto error;
+	}
+	*rl_htable.gen = 0;
+	*rl_htable.gc = NULL;
+
 	if (!rl_default_algo_s.s) {
 		LM_ERR("Default algorithm was not specified\n");
 		return -1;
@@ -318,7 +429,8 @@ rl_pipe_t *rl_create_pipe(int limit, rl_algo_t algo)
 		algo = rl_default_algo;
 
 	if (algo == PIPE_ALGO_HISTORY)
-		size += (rl_window_size * 1000) / rl_slot_period * sizeof(long int);
+		size += (rl_window_size * 1000) / rl_slot_period *
+			sizeof(unsigned long long);
 
 	pipe = shm_malloc(size);
 	if (!pipe) {
@@ -331,7 +443,7 @@ rl_pipe_t *rl_create_pipe(int limit, rl_algo_t algo)
 	pipe->limit = limit;
 
 	if (algo == PIPE_ALGO_HISTORY) {
-		pipe->rwin.window = (long int *)(pipe + 1);
+		pipe->rwin.window = (unsigned long long *)(pipe + 1);
 		pipe->rwin.window_size = (rl_window_size * 1000) / rl_slot_period;
 		/* everything else is already cleared */
 	}
@@ -342,7 +454,10 @@ int w_rl_check(struct sip_msg *_m, str *name, int *limit, str *algorithm)
 {
 	int ret = 1, should_update = 0;
 	unsigned int hash_idx;
+	unsigned long now;
 	rl_pipe_t **pipe;
+	rl_pipe_t *p = NULL;
+	rl_local_pipe_t *lp;
 
 	rl_algo_t algo = -1;
 
@@ -351,7 +466,7 @@ int w_rl_check(struct sip_msg *_m, str *name, int *limit, str *algorithm)
 	}
 
 	/* get limit for FEEDBACK algorithm */
-	if (algo == PIPE_ALGO_FEEDBACK) {
+	if (algo == PIPE_ALGO_FEEDBACK && *rl_feedback_limit != *limit) {
 		lock_get(rl_lock);
 		if (*rl_feedback_limit) {
 			if (*rl_feedback_limit != *limit) {
@@ -373,6 +488,19 @@ int w_rl_check(struct sip_msg *_m, str *name, int *limit, str *algorithm)
 		lock_release(rl_lock);
 	}
 
+	/* a pipe already used by this process needs no locking */
+	lp = rl_get_local_pipe(name);
+	if (lp) {
+		p = lp->pipe;
+		LM_DBG("Pipe %.*s found locally: %p - last used %lu\n",
+			name->len, name->s, p, p->last_used);
+		if (algo != PIPE_ALGO_NOP && p->algo != algo) {
+			LM_WARN("algorithm %d different from the initial one %d for pipe "
+				"%.*s", algo, p->algo, name->len, name->s);
+		}
+		goto account;
+	}
+
 	hash_idx = RL_GET_INDEX(*name);
 	RL_GET_LOCK(hash_idx);
 
@@ -411,15 +539,19 @@ int w_rl_check(struct sip_msg *_m, str *name, int *limit, str *algorithm)
 			LM_ERR("cannot increase counter\n");
 			goto release;
 		}
-	} else {
-		(*pipe)->counter++;
+		ret = rl_pipe_check(*pipe, 0);
+	} else if (!(lp = rl_add_local_pipe(name, *pipe))) {
+		/* account it directly */
+		if ((*pipe)->algo != PIPE_ALGO_HISTORY)
+			__sync_fetch_and_add(&(*pipe)->counter, 1);
+		ret = rl_pipe_check(*pipe, 0);
 	}
+	p = *pipe;
 
-	ret = rl_pipe_check(*pipe);
-	LM_DBG("Pipe %.*s counter:%d load:%d limit:%d should %sbe blocked (%p)\n",
-		name->len, name->s, (*pipe)->counter, (*pipe)->load,
-		(*pipe)->limit, ret == 1 ? "NOT " : "", *pipe);
-
+	if (!lp)
+		LM_DBG("Pipe %.*s counter:%d load:%d limit:%d should %sbe blocked "
+			"(%p)\n", name->len, name->s, p->counter, p->load,
+			p->limit, ret == 1 ? "NOT " : "", p);
 
 release:
 	RL_RELEASE_LOCK(hash_idx);
@@ -428,6 +560,21 @@ release:
 		(*rl_network_count)++;
 		lock_release(rl_lock);
 	}
+	if (!lp)
+		goto end;
+
+account:
+	/* only write in the shared pipe if something changed */
+	if (p->limit != *limit)
+		p->limit = *limit;
+	now = time(0);
+	if (p->last_used != now)
+		p->last_used = now;
+
+	ret = rl_pipe_hit(lp);
+	LM_DBG("Pipe %.*s counter:%d+%d load:%d limit:%d should %sbe blocked "
+		"(%p)\n", name->len, name->s, p->counter, lp->pending, p->load,
+		p->limit, ret == 1 ? "NOT " : "", p);
 end:
 	return ret;
 }
@@ -438,10 +585,18 @@ void rl_timer(unsigned int ticks, void *param)
 	unsigned int i = 0;
 	map_iterator_t it, del;
 	rl_pipe_t **pipe;
+	rl_pipe_t *deleted;
 	str *key;
 	void *value;
+	int counter, deletes = 0;
 	unsigned long now = time(0);
 
+	/* the pipes deleted by the previous run are not referred anymore */
+	while ((deleted = *rl_htable.gc)) {
+		*rl_htable.gc = deleted->gc_next;
+		shm_free(deleted);
+	}
+
 	/* get CPU load */
 	if (get_cpuload() < 0) {
 		LM_ERR("cannot update CPU load\n");
@@ -492,9 +647,13 @@ void rl_timer(unsigned int ticks, void *param)
 				LM_DBG("Deleting ratelimit pipe key \"%.*s\"\n",
 					key->len, key->s);
 				value = iterator_delete(&del);
-				/* free resources */
-				if (value)
-					shm_free(value);
+				/* the processes may still use it for a while, so only
+				 * free it on the next run */
+				if (value) {
+					((rl_pipe_t *)value)->gc_next = *rl_htable.gc;
+					*rl_htable.gc = value;
+					deletes++;
+				}
 				continue;
 			} else {
 				/* leave the lock if a cachedb query should be done*/
@@ -520,14 +679,22 @@ void rl_timer(unsigned int ticks, void *param)
 				default:
 					break;
 				}
-				(*pipe)->my_last_counter = (*pipe)->counter;
-				(*pipe)->last_counter = rl_get_all_counters(*pipe);
 				if (RL_USE_CDB(*pipe)) {
+					(*pipe)->my_last_counter = (*pipe)->counter;
+					(*pipe)->last_counter = rl_get_all_counters(*pipe);
 					if (rl_change_counter(key, *pipe, 0) < 0) {
 						LM_ERR("cannot reset counter\n");
 					}
+				} else if ((*pipe)->algo == PIPE_ALGO_HISTORY) {
+					counter = hist_get_count(*pipe);
+					(*pipe)->my_last_counter = counter;
+					(*pipe)->last_counter = counter;
 				} else {
-					(*pipe)->counter = 0;
+					/* the processes keep on adding to it */
+					counter = __sync_fetch_and_and(&(*pipe)->counter, 0);
+					(*pipe)->my_last_counter = counter;
+					(*pipe)->last_counter = counter +
+						rl_get_dsts_counters(*pipe);
 				}
 			}
 next_pipe:
@@ -537,6 +704,10 @@ next_pipe:
 next_map:
 		RL_RELEASE_LOCK(i);
 	}
+
+	/* make the processes drop their references to the deleted pipes */
+	if (deletes)
+		(*rl_htable.gen)++;
 }
 
 static int rl_map_print(void *param, str key, void *value)
@@ -630,11 +801,48 @@ error:
 	return -1;
 }
 
+/* NOTE: the pipe must not use the cachedb interface */
+static void rl_pipe_set_count(rl_pipe_t *pipe, rl_local_pipe_t *lp, int val)
+{
+	int counter, new_counter;
+
+	if (pipe->algo == PIPE_ALGO_HISTORY) {
+		hist_set_count(pipe, val);
+		return;
+	}
+
+	/* first add what this process has buffered */
+	if (lp) {
+		if (val && lp->pending)
+			__sync_fetch_and_add(&pipe->counter, lp->pending);
+		lp->pending = 0;
+	}
+
+	do {
+		counter = pipe->counter;
+		if (val && (val + counter >= 0)) {
+			new_counter = counter + val;
+		} else {
+			new_counter = 0;
+		}
+	} while (__sync_val_compare_and_swap(&pipe->counter, counter,
+		new_counter) != counter);
+}
+
 int w_rl_set_count(str key, int val)
 {
 	unsigned int hash_idx;
 	int ret = -1;
 	rl_pipe_t **pipe;
+	rl_local_pipe_t *lp;
+
+	lp = rl_get_local_pipe(&key);
+	if (lp) {
+		rl_pipe_set_count(lp->pipe, lp, val);
+		LM_DBG("new counter for key %.*s is %d\n",
+			key.len, key.s, lp->pipe->counter);
+		return 0;
+	}
 
 	hash_idx = RL_GET_INDEX(key);
 	RL_GET_LOCK(hash_idx);
@@ -651,14 +859,8 @@ int w_rl_set_count(str key, int val)
 			LM_ERR("cannot decrease counter\n");
 			goto release;
 		}
-	} else if ((*pipe)->algo == PIPE_ALGO_HISTORY) {
-		hist_set_count(*pipe, val);
 	} else {
-		if (val && (val + (*pipe)->counter >= 0)) {
-			(*pipe)->counter += val;
-		} else {
-			(*pipe)->counter = 0;
-		}
+		rl_pipe_set_count(*pipe, NULL, val);
 	}
 
 	LM_DBG("new counter for key %.*s is %d\n",
@@ -708,7 +910,11 @@ static rl_repl_counter_t* find_destination(rl_pipe_t *pipe, int machine_id)
 			goto error;
 		}
 		head->machine_id = machine_id;
+		head->counter = 0;
+		head->update = 0;
 		head->next = pipe->dsts;
+		/* the list is also walked without locking */
+		__sync_synchronize();
 		pipe->dsts = head;
 	}
 
@@ -806,57 +1012,6 @@ release:
 	RL_RELEASE_LOCK(hash_idx);
 }
 
-/*
- * same as hist_check() in ratelimit.c but this one
- * only counts, no updates on the window ==> faster
- */
-static inline int ALLOW_UNUSED hist_count(rl_pipe_t *pipe)
-{
-	/* Window ELement*/
-	#define U2MILI(__usec__) (__usec__/1000)
-	#define S2MILI(__sec__)  (__sec__ *1000)
-	int i;
-	int first_good_index;
-	int rl_win_ms = rl_window_size * 1000;
-
-	int count=0;
-
-	unsigned long long now_total, start_total;
-
-	struct timeval tv;
-
-	gettimeofday(&tv, NULL);
-	if (pipe->rwin.start_time.tv_sec == 0) {
-		return 0;
-	} else {
-		start_total = S2MILI(pipe->rwin.start_time.tv_sec)
-							+ U2MILI(pipe->rwin.start_time.tv_usec);
-		now_total = S2MILI(tv.tv_sec) + U2MILI(tv.tv_usec);
-
-		if (now_total - start_total >= 2*rl_win_ms) {
-			/* nothing here; window is expired */
-		} else if (now_total - start_total >= rl_win_ms) {
-			first_good_index = ((((now_total - rl_win_ms) - start_total)
-						/rl_slot_period + 1) + pipe->rwin.start_index) %
-						pipe->rwin.window_size;
-
-			count = 0;
-			for (i=first_good_index; i != pipe->rwin.start_index;
-											i=(i+1)%pipe->rwin.window_size)
-				count += pipe->rwin.window[i];
-
-		} else {
-			/* count all of them; valid window */
-			for (i=0; i < pipe->rwin.window_size; i++)
-				count += pipe->rwin.window[i];
-		}
-	}
-	return count;
-
-	#undef U2MILI
-	#undef S2MILI
-}
-
 int rl_repl_init(void)
 {
 	if (rl_buffer_th > (BUF_SIZE * 0.9)) {
@@ -952,7 +1107,7 @@ void rl_timer_repl(utime_t ticks, void *param)
 			 */
 			if ((ret = bin_push_int(&packet,
 						((*pipe)->algo == PIPE_ALGO_HISTORY ?
-						 (*pipe)->counter : (*pipe)->my_last_counter))) < 0)
+						 hist_get_count(*pipe) : (*pipe)->my_last_counter))) < 0)
 				goto error;
 			nr++;
 
@@ -984,7 +1139,7 @@ error:
 	bin_free_packet(&packet);
 }
 
-int rl_get_all_counters(rl_pipe_t *pipe)
+int rl_get_dsts_counters(rl_pipe_t *pipe)
 {
 	unsigned counter = 0;
 	time_t now = time(0);
@@ -997,7 +1152,12 @@ int rl_get_all_counters(rl_pipe_t *pipe)
 			d->counter = 0;
 		counter += d->counter;
 	}
-	return counter + pipe->counter;
+	return counter;
+}
+
+int rl_get_all_counters(rl_pipe_t *pipe)
+{
+	return rl_get_dsts_counters(pipe) + pipe->counter;
 }
 
 int rl_get_counter_value(str *key)
@@ -40,6 +40,7 @@
 #include <sys/un.h>
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <poll.h>
 #include <stdio.h>
@@ -56,6 +57,7 @@
 #include "../../error.h"
 #include "../../forward.h"
 #include "../../context.h"
+#include "../../async.h"
 #include "../../mem/mem.h"
 #include "../../parser/parse_from.h"
 #include "../../parser/parse_to.h"
@@ -78,6 +80,7 @@
 #include "../../modules/tm/tm_load.h"
 #include "../../modules/dialog/dlg_load.h"
 #include "../../lib/cJSON.h"
+#include "../../lib/timerfd.h"
 #include "rtpengine.h"
 #include "rtpengine_funcs.h"
 #include "bencode.h"
@@ -218,6 +221,22 @@ static const char *command_strings[] = {
 	[OP_UNBLOCK_DTMF] = "unblock DTMF",
 };
 
+/* upper limits of the latency histogram buckets, in ms */
+static const unsigned int rtpe_lat_limits[RTPE_LAT_BUCKETS - 1] = {
+	1, 5, 10, 50, 100, 500, 1000
+};
+
+static const str rtpe_lat_names[RTPE_LAT_BUCKETS] = {
+	str_init("1ms"),
+	str_init("5ms"),
+	str_init("10ms"),
+	str_init("50ms"),
+	str_init("100ms"),
+	str_init("500ms"),
+	str_init("1000ms"),
+	str_init("slower"),
+};
+
 static const str stat_maps[] = {
 	[STAT_MOS_AVERAGE]			= str_init("mos-average"),
 	[STAT_MOS_MIN]				= str_init("mos-min"),
@@ -252,6 +271,14 @@ static int rtpengine_answer_f(struct sip_msg *msg, str *flags, pv_spec_t *spvar,
 static int rtpengine_manage_f(struct sip_msg *msg, str *flags, pv_spec_t *spvar,
 		pv_spec_t *bpvar, str *body);
 static int rtpengine_delete_f(struct sip_msg* msg, str *flags, pv_spec_t *spvar);
+#ifdef HAVE_TIMER_FD
+static int rtpengine_offer_async_f(struct sip_msg *msg, async_ctx *ctx,
+		str *flags, pv_spec_t *spvar, pv_spec_t *bpvar, str *body);
+static int rtpengine_answer_async_f(struct sip_msg *msg, async_ctx *ctx,
+		str *flags, pv_spec_t *spvar, pv_spec_t *bpvar, str *body);
+static int rtpengine_delete_async_f(struct sip_msg *msg, async_ctx *ctx,
+		str *flags, pv_spec_t *spvar);
+#endif
 static void free_rtpe_nodes(struct rtpe_set *list);
 static int rtpengine_playmedia_f(struct sip_msg* msg, str *flags,
 		pv_spec_t *duration, pv_spec_t *spvar);
@@ -317,6 +344,8 @@ struct rtpe_set **default_rtpe_set=0;
 
 /* array with the sockets used by rtpengine (per process)*/
 static int *rtpe_socks = 0;
+/* sockets multiplexing the async requests, watched by the reactor */
+static int *rtpe_async_socks = 0;
 static str db_url = {NULL, 0};
 static str db_table = str_init("rtpengine");
 static str db_rtpe_set_col = str_init("set_id");
@@ -407,6 +436,25 @@ static cmd_export_t cmds[] = {
 	{0,0,{{0,0,0}},0}
 };
 
+#ifdef HAVE_TIMER_FD
+static acmd_export_t acmds[] = {
+	{"rtpengine_offer", (acmd_function)rtpengine_offer_async_f, {
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0}, {0,0,0}}},
+	{"rtpengine_answer", (acmd_function)rtpengine_answer_async_f, {
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0}, {0,0,0}}},
+	{"rtpengine_delete", (acmd_function)rtpengine_delete_async_f, {
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0}, {0,0,0}}},
+	{0,0,{{0,0,0}}}
+};
+#endif
+
 static int pv_rtpengine_stats_used(pv_spec_p sp, int param)
 {
 	rtpengine_stats_used = 1;
@@ -638,7 +686,11 @@ struct module_exports exports = {
 	0,				 /* load function */
 	&deps,           /* OpenSIPS module dependencies */
 	cmds,
+#ifdef HAVE_TIMER_FD
+	acmds,
+#else
 	0,
+#endif
 	params,
 	0,           /* exported statistics */
 	mi_cmds,     /* exported MI functions */
@@ -1053,9 +1105,10 @@ static mi_response_t *mi_show_rtpengines(const mi_params_t *params,
 								struct mi_handler *async_hdl)
 {
 	mi_response_t *resp;
-	mi_item_t *sets_arr, *set_item, *nodes_arr, *node_item;
+	mi_item_t *sets_arr, *set_item, *nodes_arr, *node_item, *lat_item;
 	struct rtpe_set * rtpe_list;
 	struct rtpe_node * crt_rtpe;
+	int i;
 
 	resp = init_mi_result_array(&sets_arr);
 	if (!resp)
@@ -1102,6 +1155,17 @@ static mi_response_t *mi_show_rtpengines(const mi_params_t *params,
 			if (add_mi_number(node_item, MI_RECHECK_TICKS, MI_RECHECK_T_LEN,
 				crt_rtpe->rn_recheck_ticks) < 0)
 				goto error;
+
+			lat_item = add_mi_object(node_item, MI_SSTR("latency"));
+			if (!lat_item)
+				goto error;
+			for (i = 0; i < RTPE_LAT_BUCKETS; i++)
+				if (add_mi_number(lat_item, rtpe_lat_names[i].s,
+					rtpe_lat_names[i].len, crt_rtpe->rn_lat_hist[i]) < 0)
+					goto error;
+			if (add_mi_number(lat_item, MI_SSTR("timeouts"),
+				crt_rtpe->rn_timeouts) < 0)
+				goto error;
 		}
 	}
 	RTPE_STOP_READ();
@@ -1350,22 +1414,18 @@ static int mi_child_init(void)
 	return 0;
 }
 
-static inline int rtpengine_connect_node(struct rtpe_node *pnode)
+/* returns a new UDP socket connected to the node, or -1 */
+static int rtpengine_node_socket(struct rtpe_node *pnode)
 {
-	int n;
+	int n, fd;
 	char *cp;
 	char *hostname;
 	struct addrinfo hints, *res;
 
-	if (pnode->rn_umode == 0) {
-		rtpe_socks[pnode->idx] = -1;
-		return 1;
-	}
-
 	hostname = (char*)pkg_malloc(strlen(pnode->rn_address) + 1);
 	if (hostname==NULL) {
 		LM_ERR("no more pkg memory\n");
-		return 0;
+		return -1;
 	}
 	strcpy(hostname, pnode->rn_address);
 
@@ -1384,33 +1444,44 @@ static inline int rtpengine_connect_node(struct rtpe_node *pnode)
 	if ((n = getaddrinfo(hostname, cp, &hints, &res)) != 0) {
 		LM_ERR("%s\n", gai_strerror(n));
 		pkg_free(hostname);
-		return 0;
+		return -1;
 	}
 	pkg_free(hostname);
 
-	rtpe_socks[pnode->idx] = socket((pnode->rn_umode == 6)
-			? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
-	if ( rtpe_socks[pnode->idx] == -1) {
+	fd = socket((pnode->rn_umode == 6) ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
 		LM_ERR("can't create socket\n");
 		freeaddrinfo(res);
-		return 0;
+		return -1;
 	}
 
-	if (connect(rtpe_socks[pnode->idx], res->ai_addr, res->ai_addrlen) == -1) {
+	if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
 		LM_ERR("can't connect to a RTP proxy\n");
-		close( rtpe_socks[pnode->idx] );
-		rtpe_socks[pnode->idx] = -1;
+		close(fd);
 		freeaddrinfo(res);
-		return 0;
+		return -1;
 	}
 	freeaddrinfo(res);
-	return 1;
+	return fd;
+}
+
+static inline int rtpengine_connect_node(struct rtpe_node *pnode)
+{
+	if (pnode->rn_umode == 0) {
+		rtpe_socks[pnode->idx] = -1;
+		return 1;
+	}
+
+	rtpe_socks[pnode->idx] = rtpengine_node_socket(pnode);
+
+	return rtpe_socks[pnode->idx] == -1 ? 0 : 1;
 }
 
 static int connect_rtpengines(void)
 {
 	struct rtpe_set  *rtpe_list;
 	struct rtpe_node *pnode;
+	int i;
 
 	LM_DBG("[RTPEngine] set list %p\n", *rtpe_set_list);
 	if(!(*rtpe_set_list) )
@@ -1424,6 +1495,14 @@ static int connect_rtpengines(void)
 			LM_ERR("no more pkg memory\n");
 			return -1;
 		}
+		rtpe_async_socks = (int*)pkg_realloc(rtpe_async_socks,
+			*rtpe_no * sizeof(int));
+		if (rtpe_async_socks==NULL) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		for (i = rtpe_number; i < *rtpe_no; i++)
+			rtpe_async_socks[i] = -1;
 	}
 	rtpe_number = *rtpe_no;
 
@@ -1464,6 +1543,12 @@ static int update_rtpengines(void)
 		shutdown(rtpe_socks[i], SHUT_RDWR);
 		close(rtpe_socks[i]);
 		rtpe_socks[i] = -1;
+
+		/* the reactor notices the shutdown and the socket gets closed */
+		if (rtpe_async_socks[i] != -1) {
+			shutdown(rtpe_async_socks[i], SHUT_RDWR);
+			rtpe_async_socks[i] = -1;
+		}
 	}
 
 	return connect_rtpengines();
@@ -1854,18 +1939,16 @@ error:
 #undef BCHECK
 
 
-static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_msg *msg,
-	enum rtpe_operation op, str *flags_str, str *body_in, pv_spec_t *spvar)
+/* builds the command of @op for @msg; the returned dictionary may point
+ * into @flags_nt, which is to be released by the caller */
+static bencode_item_t *rtpe_build_command(bencode_buffer_t *bencbuf,
+		struct sip_msg *msg, enum rtpe_operation op, str *flags_str,
+		str *body_in, str *call_id, str *flags_nt)
 {
 	struct ng_flags_parse ng_flags;
-	bencode_item_t *item, *resp;
-	str viabranch, error;
+	bencode_item_t *item;
+	str viabranch;
 	int ret;
-	struct rtpe_node *node;
-	struct rtpe_set *set;
-	char *cp;
-	pv_value_t val;
-	str flags_nt = {0,0};
 
 	/*** get & init basic stuff needed ***/
 
@@ -1902,12 +1985,12 @@ static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_
 
 	ng_flags.to = (op == OP_DELETE) ? 0 : 1;
 
-	if (flags_str && pkg_nt_str_dup(&flags_nt, flags_str) < 0) {
+	if (flags_str && pkg_nt_str_dup(flags_nt, flags_str) < 0) {
 		LM_ERR("No more pkg mem\n");
 		goto error;
 	}
 
-	if (parse_flags(&ng_flags, msg, &op, flags_nt.s))
+	if (parse_flags(&ng_flags, msg, &op, flags_nt->s))
 		goto error;
 
 	/* only add those if any flags were given at all */
@@ -1970,26 +2053,77 @@ static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_
 
 	bencode_dictionary_add_string(ng_flags.dict, "command", command_strings[op]);
 
-	/*** send it out ***/
-
 	if (bencbuf->error) {
 		LM_ERR("out of memory - bencode failed\n");
 		goto error;
 	}
 
+	*call_id = ng_flags.call_id;
+	return ng_flags.dict;
+
+error:
+	if (flags_nt->s) {
+		pkg_free(flags_nt->s);
+		flags_nt->s = NULL;
+	}
+	bencode_buffer_free(bencbuf);
+	return NULL;
+}
+
+/* decodes the reply of a node and checks it does not report an error */
+static bencode_item_t *rtpe_check_reply(bencode_buffer_t *bencbuf,
+		char *cp, int len)
+{
+	bencode_item_t *resp;
+	str error;
+
+	resp = bencode_decode_expect(bencbuf, cp, len, BENCODE_DICTIONARY);
+	if (!resp) {
+		LM_ERR("failed to decode bencoded reply from proxy: %.*s\n", len, cp);
+		return NULL;
+	}
+	if (!bencode_dictionary_get_strcmp(resp, "result", "error")) {
+		if (!bencode_dictionary_get_str(resp, "error-reason", &error))
+			LM_ERR("proxy return error but didn't give an error reason: %.*s\n", len, cp);
+		else
+			LM_ERR("proxy replied with error: %.*s\n", error.len, error.s);
+		return NULL;
+	}
+
+	return resp;
+}
+
+static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_msg *msg,
+	enum rtpe_operation op, str *flags_str, str *body_in, pv_spec_t *spvar)
+{
+	bencode_item_t *dict, *resp;
+	int ret;
+	struct rtpe_node *node;
+	struct rtpe_set *set;
+	char *cp;
+	pv_value_t val;
+	str call_id, flags_nt = {0,0};
+
+	dict = rtpe_build_command(bencbuf, msg, op, flags_str, body_in,
+			&call_id, &flags_nt);
+	if (!dict)
+		return NULL;
+
+	/*** send it out ***/
+
 	if ( (set=rtpe_ctx_set_get())==NULL )
 		set = *default_rtpe_set;
 
 	RTPE_START_READ();
 	do {
-		node = select_rtpe_node(ng_flags.call_id, 1, set);
+		node = select_rtpe_node(call_id, 1, set);
 		if (!node) {
 			LM_ERR("no available proxies\n");
 			RTPE_STOP_READ();
 			goto error;
 		}
 
-		cp = send_rtpe_command(node, ng_flags.dict, &ret);
+		cp = send_rtpe_command(node, dict, &ret);
 	} while (cp == NULL);
 	RTPE_STOP_READ();
 	LM_DBG("proxy reply: %.*s\n", ret, cp);
@@ -2005,18 +2139,9 @@ static bencode_item_t *rtpe_function_call(bencode_buffer_t *bencbuf, struct sip_
 
 	/*** process reply ***/
 
-	resp = bencode_decode_expect(bencbuf, cp, ret, BENCODE_DICTIONARY);
-	if (!resp) {
-		LM_ERR("failed to decode bencoded reply from proxy: %.*s\n", ret, cp);
-		goto error;
-	}
-	if (!bencode_dictionary_get_strcmp(resp, "result", "error")) {
-		if (!bencode_dictionary_get_str(resp, "error-reason", &error))
-			LM_ERR("proxy return error but didn't give an error reason: %.*s\n", ret, cp);
-		else
-			LM_ERR("proxy replied with error: %.*s\n", error.len, error.s);
+	resp = rtpe_check_reply(bencbuf, cp, ret);
+	if (!resp)
 		goto error;
-	}
 
 	if (flags_nt.s)
 		pkg_free(flags_nt.s);
@@ -2059,11 +2184,38 @@ set_rtpengine_set_from_avp(struct sip_msg *msg)
 }
 
 
+/* keeps the reply of a delete command in the ctx, for the statistics;
+ * returns 1 if the ctx took over the buffer */
+static int rtpe_store_delete_stats(bencode_buffer_t *bencbuf,
+		bencode_item_t *ret)
+{
+	struct rtpe_ctx *ctx;
+
+	if (!rtpengine_stats_used)
+		return 0;
+
+	/* if statistics are to be used, store stats in the ctx, if possible */
+	if ((ctx = rtpe_ctx_get())) {
+		if (ctx->stats)
+			rtpe_stats_free(ctx->stats); /* release the buffer */
+		else
+			ctx->stats = pkg_malloc(sizeof *ctx->stats);
+		if (ctx->stats) {
+			ctx->stats->buf = *bencbuf;
+			ctx->stats->dict = ret;
+			ctx->stats->json.s = 0;
+			return 1;
+		} else
+			LM_WARN("no more pkg memory - cannot cache stats!\n");
+	}
+
+	return 0;
+}
+
 static int rtpe_function_call_simple(struct sip_msg *msg, enum rtpe_operation op,
 		str *flags_str, pv_spec_t *spvar)
 {
 	bencode_buffer_t bencbuf;
-	struct rtpe_ctx *ctx;
 	bencode_item_t *ret;
 
 	if (set_rtpengine_set_from_avp(msg) == -1)
@@ -2073,23 +2225,9 @@ static int rtpe_function_call_simple(struct sip_msg *msg, enum rtpe_operation op
 	if (!ret)
 		return -1;
 
-	if (op == OP_DELETE && rtpengine_stats_used) {
-		/* if statistics are to be used, store stats in the ctx, if possible */
-		if ((ctx = rtpe_ctx_get())) {
-			if (ctx->stats)
-				rtpe_stats_free(ctx->stats); /* release the buffer */
-			else
-				ctx->stats = pkg_malloc(sizeof *ctx->stats);
-			if (ctx->stats) {
-				ctx->stats->buf = bencbuf;
-				ctx->stats->dict = ret;
-				ctx->stats->json.s = 0;
-				/* return here to prevent buffer from being freed */
-				return 1;
-			} else
-				LM_WARN("no more pkg memory - cannot cache stats!\n");
-		}
-	}
+	/* do not free the buffer if it was stored in the ctx */
+	if (op == OP_DELETE && rtpe_store_delete_stats(&bencbuf, ret))
+		return 1;
 
 	bencode_buffer_free(&bencbuf);
 	return 1;
@@ -2177,6 +2315,24 @@ error:
 		} \
 	} while (0)
 
+/* accounts the time elapsed since @start in the latency histogram of @node */
+static void rtpe_account_latency(struct rtpe_node *node, struct timeval *start)
+{
+	struct timeval now;
+	unsigned long ms;
+	int i;
+
+	gettimeofday(&now, NULL);
+	ms = (now.tv_sec - start->tv_sec) * 1000 +
+		(now.tv_usec - start->tv_usec) / 1000;
+
+	for (i = 0; i < RTPE_LAT_BUCKETS - 1; i++)
+		if (ms < rtpe_lat_limits[i])
+			break;
+
+	__sync_fetch_and_add(&node->rn_lat_hist[i], 1);
+}
+
 static char *
 send_rtpe_command(struct rtpe_node *node, bencode_item_t *dict, int *outlen)
 {
@@ -2186,6 +2342,7 @@ send_rtpe_command(struct rtpe_node *node, bencode_item_t *dict, int *outlen)
 	static char buf[0x10000];
 	struct pollfd fds[1];
 	struct iovec *v;
+	struct timeval start;
 
 	v = bencode_iovec(dict, &vcnt, 1, 0);
 	if (!v) {
@@ -2193,6 +2350,8 @@ send_rtpe_command(struct rtpe_node *node, bencode_item_t *dict, int *outlen)
 		return NULL;
 	}
 
+	gettimeofday(&start, NULL);
+
 	len = 0;
 	cp = buf;
 	if (node->rn_umode == 0) {
@@ -2300,11 +2459,13 @@ send_rtpe_command(struct rtpe_node *node, bencode_item_t *dict, int *outlen)
 	}
 
 out:
+	rtpe_account_latency(node, &start);
 	cp[len] = '\0';
 	*outlen = len;
 	return cp;
 badproxy:
 	LM_ERR("proxy <%s> does not respond, disable it\n", node->rn_url.s);
+	__sync_fetch_and_add(&node->rn_timeouts, 1);
 	node->rn_disabled = 1;
 	node->rn_recheck_ticks = get_ticks() + rtpengine_disable_tout;
 
@@ -2569,15 +2730,64 @@ rtpengine_answer_f(struct sip_msg *msg, str *flags, pv_spec_t *spvar,
 	return rtpengine_offer_answer(msg, flags, spvar, bpvar, body, OP_ANSWER);
 }
 
+/* stores the SDP returned by the node into @bpvar or into the message;
+ * @oldbody is the body sent to the node, NULL if it was given by script */
+static int rtpe_apply_sdp(struct sip_msg *msg, bencode_item_t *dict,
+		str *oldbody, pv_spec_t *bpvar)
+{
+	str body, newbody;
+	struct lump *anchor;
+	pv_value_t val;
+
+	if (!bencode_dictionary_get_str_dup(dict, "sdp", &newbody)) {
+		LM_ERR("failed to extract sdp body from proxy reply\n");
+		return -1;
+	}
+
+	/* if we have a variable to store into, use it */
+	if (bpvar) {
+		memset(&val, 0, sizeof(pv_value_t));
+		val.flags = PV_VAL_STR;
+		val.rs = newbody;
+		if(pv_set_value(msg, bpvar, (int)EQ_T, &val)<0)
+			LM_ERR("setting PV failed\n");
+		pkg_free(newbody.s);
+	} else {
+		if (!oldbody) {
+			if (extract_body(msg, &body) <= 0) {
+				LM_ERR("cannot parse old body!\n");
+				goto error_free;
+			}
+			oldbody = &body;
+		}
+
+		/* otherwise directly set the body of the message */
+		anchor = del_lump(msg, oldbody->s - msg->buf, oldbody->len, 0);
+		if (!anchor) {
+			LM_ERR("del_lump failed\n");
+			goto error_free;
+		}
+		if (!insert_new_lump_after(anchor, newbody.s, newbody.len, 0)) {
+			LM_ERR("insert_new_lump_after failed\n");
+			goto error_free;
+		}
+	}
+
+	return 1;
+
+error_free:
+	pkg_free(newbody.s);
+	return -1;
+}
+
 static int
 rtpengine_offer_answer(struct sip_msg *msg, str *flags,
 		pv_spec_t *spvar, pv_spec_t *bpvar, str *body, int op)
 {
 	bencode_buffer_t bencbuf;
 	bencode_item_t *dict;
-	str oldbody, newbody;
-	struct lump *anchor;
-	pv_value_t val;
+	str oldbody;
+	int rc;
 
 	if (!body) {
 		if (extract_body(msg, &oldbody) == -1) {
@@ -2592,45 +2802,529 @@ rtpengine_offer_answer(struct sip_msg *msg, str *flags,
 	if (!dict)
 		return -1;
 
-	if (!bencode_dictionary_get_str_dup(dict, "sdp", &newbody)) {
-		LM_ERR("failed to extract sdp body from proxy reply\n");
+	rc = rtpe_apply_sdp(msg, dict, body ? NULL : &oldbody, bpvar);
+
+	bencode_buffer_free(&bencbuf);
+	return rc;
+}
+
+#ifdef HAVE_TIMER_FD
+
+#define RTPE_ASYNC_HASH_SIZE	64
+
+/* a command sent without waiting for the reply; each request owns a timer
+ * FD which the script waits on - the timer fires either on timeout (time to
+ * retransmit or to fail over) or right away, when the reply arrives */
+struct rtpe_async_req {
+	unsigned int seqn;
+	str cookie;
+	str cmd;
+	str callid;
+	str url;			/* of the node the command was sent to */
+	unsigned int set_id;
+	unsigned int node_idx;
+	unsigned int version;
+	int tries;			/* sends left towards the current node */
+	struct timeval sent;
+	int tfd;
+	enum rtpe_operation op;
+	pv_spec_t *spvar;
+	pv_spec_t *bpvar;
+	int body_given;
+	char *reply;
+	int reply_len;
+	int done;			/* 1 - got the reply, -1 - failed */
+	struct rtpe_async_req *next;
+};
+
+/* the pending requests of this process, indexed by cookie sequence */
+static struct rtpe_async_req *rtpe_async_reqs[RTPE_ASYNC_HASH_SIZE];
+
+static void rtpe_pkg_free(void *p)
+{
+	pkg_free(p);
+}
+
+static void rtpe_async_free(struct rtpe_async_req *req)
+{
+	struct rtpe_async_req **it;
+
+	for (it = &rtpe_async_reqs[req->seqn % RTPE_ASYNC_HASH_SIZE]; *it;
+			it = &(*it)->next)
+		if (*it == req) {
+			*it = req->next;
+			break;
+		}
+
+	if (req->cmd.s)
+		pkg_free(req->cmd.s);
+	if (req->url.s)
+		pkg_free(req->url.s);
+	if (req->reply)
+		pkg_free(req->reply);
+	pkg_free(req);
+}
+
+static struct rtpe_async_req *rtpe_async_lookup(char *cookie, int len)
+{
+	struct rtpe_async_req *req;
+	unsigned int seqn;
+	str seqn_s;
+	char *p;
+
+	p = memchr(cookie, '_', len);
+	if (!p)
+		return NULL;
+	seqn_s.s = p + 1;
+	seqn_s.len = cookie + len - seqn_s.s;
+	if (str2int(&seqn_s, &seqn) < 0)
+		return NULL;
+
+	for (req = rtpe_async_reqs[seqn % RTPE_ASYNC_HASH_SIZE]; req;
+			req = req->next)
+		if (req->seqn == seqn && req->cookie.len - 1 == len &&
+				memcmp(req->cookie.s, cookie, len) == 0)
+			return req;
+
+	return NULL;
+}
+
+static inline int rtpe_async_arm(struct rtpe_async_req *req, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = ms / 1000;
+	/* a zero value would disarm the timer */
+	its.it_value.tv_nsec = (ms % 1000) * 1000000 + 1;
+
+	if (timerfd_settime(req->tfd, 0, &its, NULL) < 0) {
+		LM_ERR("failed to set timer FD (%d) <%s>\n", errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* reads all the replies available on the socket of a node and wakes up
+ * the requests they belong to */
+static int rtpe_async_reply(int fd, void *param)
+{
+	static char buf[0x10000];
+	struct rtpe_async_req *req;
+	struct rtpe_set *set;
+	struct rtpe_node *node;
+	char *p;
+	int len, i;
+
+	for (i = 0; i < rtpe_number; i++)
+		if (rtpe_async_socks[i] == fd)
+			break;
+	if (i == rtpe_number) {
+		/* socket shut down on rtpengines reload */
+		async_status = ASYNC_DONE_CLOSE_FD;
+		return 0;
+	}
+
+	async_status = ASYNC_CONTINUE;
+
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR || errno == ECONNREFUSED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				LM_WARN("error while reading rtpengine socket %d (%d:%s)\n",
+					fd, errno, strerror(errno));
+			return 0;
+		}
+
+		p = memchr(buf, ' ', len);
+		if (!p) {
+			LM_WARN("no cookie in the reply from a RTP proxy\n");
+			continue;
+		}
+
+		req = rtpe_async_lookup(buf, p - buf);
+		if (!req || req->done) {
+			LM_DBG("late or unknown reply: %.*s\n", (int)(p - buf), buf);
+			continue;
+		}
+
+		req->reply_len = len - (p + 1 - buf);
+		req->reply = pkg_malloc(req->reply_len + 1);
+		if (!req->reply) {
+			LM_ERR("no more pkg memory\n");
+			req->done = -1;
+		} else {
+			memcpy(req->reply, p + 1, req->reply_len);
+			req->reply[req->reply_len] = '\0';
+			req->done = 1;
+
+			RTPE_START_READ();
+			if (req->version == *list_version &&
+					(set = select_rtpe_set(req->set_id)))
+				for (node = set->rn_first; node; node = node->rn_next)
+					if (node->idx == req->node_idx) {
+						rtpe_account_latency(node, &req->sent);
+						break;
+					}
+			RTPE_STOP_READ();
+		}
+
+		rtpe_async_arm(req, 0);
+	}
+}
+
+static int rtpe_async_sock(struct rtpe_node *node)
+{
+	int fd, flags;
+
+	if (rtpe_async_socks[node->idx] != -1)
+		return rtpe_async_socks[node->idx];
+
+	fd = rtpengine_node_socket(node);
+	if (fd == -1)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		LM_ERR("failed to make the socket non-blocking (%d:%s)\n",
+			errno, strerror(errno));
 		goto error;
 	}
 
-	/* if we have a variable to store into, use it */
-	if (bpvar) {
+	if (register_async_fd(fd, rtpe_async_reply, NULL) < 0) {
+		LM_ERR("failed to watch the rtpengine socket\n");
+		goto error;
+	}
+
+	rtpe_async_socks[node->idx] = fd;
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+/* sends (or re-sends) the command of the request and arms its timer; once
+ * the current node used up all its sends, it is disabled and another node
+ * of the set is chosen
+ * @return: 0 - sent, -1 - no node left, -2 - node reachable only in sync */
+static int rtpe_async_send(struct rtpe_async_req *req)
+{
+	struct rtpe_set *set;
+	struct rtpe_node *node = NULL;
+	struct iovec v[2];
+	int fd, len, rc = 0;
+
+	RTPE_START_READ();
+
+	/* check last list version */
+	if (my_version != *list_version && update_rtpengines() < 0) {
+		LM_ERR("cannot update rtpengines list\n");
+		rc = -1;
+		goto out;
+	}
+
+	set = select_rtpe_set(req->set_id);
+	if (!set) {
+		LM_ERR("rtpengine set %d is gone\n", req->set_id);
+		rc = -1;
+		goto out;
+	}
+
+	/* the node the command was last sent to, if not reloaded since */
+	if (req->url.s && req->version == *list_version)
+		for (node = set->rn_first; node; node = node->rn_next)
+			if (node->idx == req->node_idx)
+				break;
+
+	if (node && req->tries == 0) {
+		LM_ERR("proxy <%s> does not respond, disable it\n", node->rn_url.s);
+		__sync_fetch_and_add(&node->rn_timeouts, 1);
+		node->rn_disabled = 1;
+		node->rn_recheck_ticks = get_ticks() + rtpengine_disable_tout;
+	}
+
+	if (!node || node->rn_disabled) {
+		for (node = set->rn_first; node; node = node->rn_next)
+			if (!node->rn_disabled)
+				break;
+		/* do not block the process waiting for all the nodes to be
+		 * probed again */
+		if (!node || !(node = select_rtpe_node(req->callid, 0, set))) {
+			LM_ERR("no available proxies\n");
+			rc = -1;
+			goto out;
+		}
+
+		if (node->rn_umode == 0) {
+			rc = -2;
+			goto out;
+		}
+
+		if (req->url.s)
+			pkg_free(req->url.s);
+		if (pkg_str_dup(&req->url, &node->rn_url) < 0) {
+			LM_ERR("no more pkg memory\n");
+			req->url.s = NULL;
+			rc = -1;
+			goto out;
+		}
+
+		req->node_idx = node->idx;
+		req->version = *list_version;
+		req->tries = rtpengine_retr;
+		gettimeofday(&req->sent, NULL);
+	}
+
+	fd = rtpe_async_sock(node);
+	if (fd != -1) {
+		v[0].iov_base = req->cookie.s;
+		v[0].iov_len = req->cookie.len;
+		v[1].iov_base = req->cmd.s;
+		v[1].iov_len = req->cmd.len;
+		do {
+			len = writev(fd, v, 2);
+		} while (len == -1 && errno == EINTR);
+		if (len <= 0)
+			LM_ERR("can't send command to a RTP proxy (%d:%s)\n",
+					errno, strerror(errno));
+	}
+	req->tries--;
+
+out:
+	RTPE_STOP_READ();
+	if (rc == 0)
+		rc = rtpe_async_arm(req, rtpengine_tout * 1000);
+	return rc;
+}
+
+static int rtpe_async_finish(struct sip_msg *msg, struct rtpe_async_req *req)
+{
+	bencode_buffer_t bencbuf;
+	bencode_item_t *dict;
+	pv_value_t val;
+	str oldbody;
+	char *reply;
+	int rc = 1;
+
+	LM_DBG("proxy reply: %.*s\n", req->reply_len, req->reply);
+
+	if (bencode_buffer_init(&bencbuf)) {
+		LM_ERR("could not initialize bencode_buffer_t\n");
+		return -1;
+	}
+	/* the decoded items point into the reply */
+	reply = req->reply;
+	bencode_buffer_destroy_add(&bencbuf, rtpe_pkg_free, reply);
+	req->reply = NULL;
+
+	/* store the value of the selected node */
+	if (req->spvar) {
 		memset(&val, 0, sizeof(pv_value_t));
 		val.flags = PV_VAL_STR;
-		val.rs = newbody;
-		if(pv_set_value(msg, bpvar, (int)EQ_T, &val)<0)
-			LM_ERR("setting PV failed\n");
-		pkg_free(newbody.s);
-	} else if (!body || (extract_body(msg, &oldbody) > 0)) {
-		/* otherwise directly set the body of the message */
-		anchor = del_lump(msg, oldbody.s - msg->buf, oldbody.len, 0);
-		if (!anchor) {
-			LM_ERR("del_lump failed\n");
-			goto error_free;
+		val.rs = req->url;
+		if(pv_set_value(msg, req->spvar, (int)EQ_T, &val)<0)
+			LM_ERR("setting rtpengine pvar failed\n");
+	}
+
+	dict = rtpe_check_reply(&bencbuf, reply, req->reply_len);
+	if (!dict) {
+		rc = -1;
+		goto out;
+	}
+
+	if (req->op == OP_DELETE) {
+		if (rtpe_store_delete_stats(&bencbuf, dict))
+			return 1;
+		goto out;
+	}
+
+	if (bencode_dictionary_get_strcmp(dict, "result", "ok")) {
+		LM_ERR("proxy didn't return \"ok\" result\n");
+		rc = -1;
+		goto out;
+	}
+
+	if (req->body_given) {
+		rc = rtpe_apply_sdp(msg, dict, NULL, req->bpvar);
+	} else if (extract_body(msg, &oldbody) == -1) {
+		LM_ERR("can't extract body from the message\n");
+		rc = -1;
+	} else {
+		rc = rtpe_apply_sdp(msg, dict, &oldbody, req->bpvar);
+	}
+
+out:
+	bencode_buffer_free(&bencbuf);
+	return rc;
+}
+
+static int rtpe_async_resume(int fd, struct sip_msg *msg, void *param)
+{
+	struct rtpe_async_req *req = (struct rtpe_async_req *)param;
+	uint64_t exp;
+	int rc;
+
+	while (read(fd, &exp, sizeof exp) < 0 && errno == EINTR) ;
+
+	if (!req->done) {
+		/* no reply in due time - retransmit or fail over */
+		if (rtpe_async_send(req) == 0) {
+			async_status = ASYNC_CONTINUE;
+			return 1;
 		}
-		if (!insert_new_lump_after(anchor, newbody.s, newbody.len, 0)) {
-			LM_ERR("insert_new_lump_after failed\n");
-			goto error_free;
+		req->done = -1;
+	}
+
+	rc = req->done > 0 ? rtpe_async_finish(msg, req) : -1;
+
+	rtpe_async_free(req);
+	async_status = ASYNC_DONE_CLOSE_FD;
+	return rc;
+}
+
+static int rtpe_async_call(struct sip_msg *msg, async_ctx *ctx,
+		enum rtpe_operation op, str *flags, pv_spec_t *spvar,
+		pv_spec_t *bpvar, str *body)
+{
+	bencode_buffer_t bencbuf;
+	bencode_item_t *dict;
+	struct rtpe_async_req *req;
+	struct rtpe_set *set;
+	str oldbody, call_id, flags_nt = {0,0};
+	char *cookie;
+	int rc;
+
+	if (set_rtpengine_set_from_avp(msg) == -1)
+		return -1;
+
+	if ( (set=rtpe_ctx_set_get())==NULL )
+		set = *default_rtpe_set;
+	if (!set) {
+		LM_ERR("script error -no valid set selected\n");
+		return -1;
+	}
+
+	if (op != OP_DELETE) {
+		if (!body) {
+			if (extract_body(msg, &oldbody) == -1) {
+				LM_ERR("can't extract body from the message\n");
+				return -1;
+			}
+		} else {
+			oldbody = *body;
 		}
-	} else {
-		LM_ERR("cannot parse old body!\n");
-		goto error_free;
 	}
 
+	dict = rtpe_build_command(&bencbuf, msg, op, flags,
+			op == OP_DELETE ? NULL : &oldbody, &call_id, &flags_nt);
+	if (!dict)
+		return -1;
+
+	req = pkg_malloc(sizeof *req + call_id.len + 34);
+	if (!req) {
+		LM_ERR("no more pkg memory\n");
+		goto error;
+	}
+	memset(req, 0, sizeof *req);
+
+	req->cmd.s = bencode_collapse_dup(dict, &req->cmd.len);
+	if (!req->cmd.s) {
+		LM_ERR("failed to collapse the bencoded command\n");
+		pkg_free(req);
+		goto error;
+	}
+
+	/* call_id may point into flags_nt or bencbuf */
+	req->callid.s = (char *)(req + 1);
+	req->callid.len = call_id.len;
+	memcpy(req->callid.s, call_id.s, call_id.len);
+
+	if (flags_nt.s)
+		pkg_free(flags_nt.s);
 	bencode_buffer_free(&bencbuf);
+
+	req->seqn = myseqn;
+	cookie = gencookie();
+	req->cookie.s = req->callid.s + call_id.len;
+	req->cookie.len = strlen(cookie);
+	memcpy(req->cookie.s, cookie, req->cookie.len);
+
+	req->set_id = set->id_set;
+	req->op = op;
+	req->spvar = spvar;
+	req->bpvar = bpvar;
+	req->body_given = body ? 1 : 0;
+
+	req->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (req->tfd < 0) {
+		LM_ERR("failed to create new timer FD (%d) <%s>\n",
+			errno, strerror(errno));
+		rtpe_async_free(req);
+		goto sync;
+	}
+
+	req->next = rtpe_async_reqs[req->seqn % RTPE_ASYNC_HASH_SIZE];
+	rtpe_async_reqs[req->seqn % RTPE_ASYNC_HASH_SIZE] = req;
+
+	rc = rtpe_async_send(req);
+	if (rc < 0) {
+		close(req->tfd);
+		rtpe_async_free(req);
+		if (rc == -2)
+			goto sync;
+		return -1;
+	}
+
+	ctx->resume_param = req;
+	ctx->resume_f = rtpe_async_resume;
+	async_status = req->tfd;
 	return 1;
 
-error_free:
-	pkg_free(newbody.s);
 error:
+	if (flags_nt.s)
+		pkg_free(flags_nt.s);
 	bencode_buffer_free(&bencbuf);
 	return -1;
+
+sync:
+	/* UNIX socket nodes can only be used in blocking mode */
+	ctx->resume_param = NULL;
+	ctx->resume_f = NULL;
+	async_status = ASYNC_NO_IO;
+
+	if (op == OP_DELETE)
+		return rtpengine_delete(msg, flags, spvar);
+	return rtpengine_offer_answer(msg, flags, spvar, bpvar, body, op);
 }
 
+static int rtpengine_offer_async_f(struct sip_msg *msg, async_ctx *ctx,
+		str *flags, pv_spec_t *spvar, pv_spec_t *bpvar, str *body)
+{
+	return rtpe_async_call(msg, ctx, OP_OFFER, flags, spvar, bpvar, body);
+}
+
+static int rtpengine_answer_async_f(struct sip_msg *msg, async_ctx *ctx,
+		str *flags, pv_spec_t *spvar, pv_spec_t *bpvar, str *body)
+{
+	if (msg->first_line.type == SIP_REQUEST)
+		if (msg->first_line.u.request.method_value != METHOD_ACK)
+			return -1;
+
+	return rtpe_async_call(msg, ctx, OP_ANSWER, flags, spvar, bpvar, body);
+}
+
+static int rtpengine_delete_async_f(struct sip_msg *msg, async_ctx *ctx,
+		str *flags, pv_spec_t *spvar)
+{
+	return rtpe_async_call(msg, ctx, OP_DELETE, flags, spvar, NULL, NULL);
+}
+
+#endif /* HAVE_TIMER_FD */
+
 
 static int
 start_recording_f(struct sip_msg* msg, str *flags, pv_spec_t *spvar)
@@ -29,6 +29,9 @@
 #include "bencode.h"
 #include "../../str.h"
 
+/* <1ms, <5ms, <10ms, <50ms, <100ms, <500ms, <1s, slower */
+#define RTPE_LAT_BUCKETS	8
+
 struct rtpe_node {
 	unsigned int		idx;			/* overall index */
 	str					rn_url;			/* unparsed, deletable */
@@ -39,6 +42,8 @@ struct rtpe_node {
 	unsigned int		rn_recheck_ticks;
 	int                     rn_rep_supported;
 	int                     rn_ptl_supported;
+	unsigned int		rn_lat_hist[RTPE_LAT_BUCKETS]; /* reply latencies */
+	unsigned int		rn_timeouts;	/* commands left unanswered */
 	struct rtpe_node	*rn_next;
 };
 
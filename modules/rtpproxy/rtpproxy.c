@@ -153,6 +153,8 @@
 #include <poll.h>
 #include <stdlib.h>
 #include <sys/uio.h>
+#include <sys/time.h>
+#include <fcntl.h>
 
 #include "../../dprint.h"
 #include "../../data_lump.h"
@@ -162,6 +164,7 @@
 #include "../../mem/mem.h"
 #include "../../mod_fix.h"
 #include "../../timer.h"
+#include "../../hash_func.h"
 #include "../../parser/parse_from.h"
 #include "../../parser/parse_to.h"
 #include "../../parser/parse_uri.h"
@@ -174,6 +177,8 @@
 #include "../../parser/parse_body.h"
 #include "../../msg_callbacks.h"
 #include "../../evi/evi_modules.h"
+#include "../../async.h"
+#include "../../lib/timerfd.h"
 
 #include "../dialog/dlg_load.h"
 #include "../tm/tm_load.h"
@@ -219,6 +224,8 @@
 #define MI_WEIGHT_LEN				(sizeof(MI_WEIGHT)-1)
 #define MI_RECHECK_TICKS			"recheck_ticks"
 #define MI_RECHECK_T_LEN			(sizeof(MI_RECHECK_TICKS)-1)
+#define MI_RTT						"rtt"
+#define MI_RTT_LEN					(sizeof(MI_RTT)-1)
 
 #define	CPORT		"22222"
 
@@ -263,16 +270,29 @@ static char *gencookie();
 static int rtpp_test(struct rtpp_node*, int, int);
 static int unforce_rtp_proxy_f(struct sip_msg* msg, nh_set_param_t *pset,
 				pv_spec_t *var);
+static int unforce_rtp_proxy(struct sip_msg* msg, nh_set_param_t *pset,
+				pv_spec_t *var, struct rtpp_async_req *areq);
 static int engage_rtp_proxy5_f(struct sip_msg *msg, str *param1, str *param2,
 				nh_set_param_t *param3, pv_spec_t *param4, pv_spec_t *param5);
 static int force_rtp_proxy(struct sip_msg* msg, char* str1, char* str2, nh_set_param_t *setid,
-					pv_spec_t *var, pv_spec_t *ipvar, int offer);
+					pv_spec_t *var, pv_spec_t *ipvar, int offer,
+					struct rtpp_async_req *areq);
 static int rtpproxy_recording(struct sip_msg* msg, nh_set_param_t *setid,
 	pv_spec_t *var, str *flags, str *destination, int *stream_no);
 static int rtpproxy_answer5_f(struct sip_msg *msg, str *param1, str *param2,
 				nh_set_param_t *param3, pv_spec_t *param4, pv_spec_t *param5);
 static int rtpproxy_offer5_f(struct sip_msg *msg, str *param1, str *param2,
 				nh_set_param_t *param3, pv_spec_t *param4, pv_spec_t *param5);
+#ifdef HAVE_TIMER_FD
+static int rtpproxy_offer_async_f(struct sip_msg *msg, async_ctx *ctx,
+				str *param1, str *param2, nh_set_param_t *param3,
+				pv_spec_t *param4, pv_spec_t *param5);
+static int rtpproxy_answer_async_f(struct sip_msg *msg, async_ctx *ctx,
+				str *param1, str *param2, nh_set_param_t *param3,
+				pv_spec_t *param4, pv_spec_t *param5);
+static int rtpproxy_unforce_async_f(struct sip_msg *msg, async_ctx *ctx,
+				nh_set_param_t *pset, pv_spec_t *var);
+#endif
 static inline int rtpproxy_stats_f(struct sip_msg *msg,
 	pv_spec_t *pup, pv_spec_t *pdown, pv_spec_t *psent, pv_spec_t *pfail,
 	nh_set_param_t *pset, pv_spec_t *pvar);
@@ -290,7 +310,10 @@ static int rtpproxy_set_store(modparam_t type, void * val);
 static int rtpproxy_add_rtpproxy_set( char * rtp_proxies, int set_id);
 static int _add_proxies_from_database();
 static int unforce_rtpproxy(struct sip_msg* msg, str callid,
-		str from_tag, str to_tag, nh_set_param_t *pset, pv_spec_t *var);
+		str from_tag, str to_tag, nh_set_param_t *pset, pv_spec_t *var,
+		struct rtpp_async_req *areq);
+static int rtpp_async_add_cmd(struct rtpp_async_req *req,
+		struct rtpp_node *node, struct iovec *v, int vcnt, int create);
 
 static int mod_init(void);
 static int child_init(int);
@@ -321,6 +344,7 @@ struct rtpp_notify_head * rtpp_notify_h = 0;
 
 int connect_rtpproxies();
 int update_rtpp_proxies();
+static void rtpp_recheck_nodes(unsigned int ticks, void *param);
 
 static inline void raise_rtpproxy_event(struct rtpp_node *node, int status);
 
@@ -345,6 +369,7 @@ static int rtpproxy_retr = 5;
 static int rtpproxy_tout = -1;
 static char *rtpproxy_timeout = 0;
 static int rtpproxy_autobridge = 0;
+static int rtpp_rtt_weighting = 0;
 static pid_t mypid;
 static unsigned int myseqn = 0;
 static str nortpproxy_str = str_init("a=nortpproxy:yes");
@@ -366,6 +391,8 @@ static int default_rtpp_set_no = DEFAULT_RTPP_SET_ID;
 
 /* array with the sockets used by rtpporxy (per process)*/
 static int *rtpp_socks = 0;
+/* sockets used by the async commands, opened on demand (per process) */
+static int *rtpp_async_socks = 0;
 static unsigned int *rtpp_no = 0;
 static unsigned int *list_version;
 static unsigned int my_version = 0;
@@ -454,6 +481,27 @@ static cmd_export_t cmds[] = {
 	{0,0,{{0,0,0}},0}
 };
 
+#ifdef HAVE_TIMER_FD
+static acmd_export_t acmds[] = {
+	{"rtpproxy_unforce", (acmd_function)rtpproxy_unforce_async_f, {
+		{CMD_PARAM_INT | CMD_PARAM_OPT, fixup_set_id, fixup_free_set_id},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0}, {0,0,0}}},
+	{"rtpproxy_offer", (acmd_function)rtpproxy_offer_async_f, {
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_INT | CMD_PARAM_OPT, fixup_set_id, fixup_free_set_id},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0}, {0,0,0}}},
+	{"rtpproxy_answer", (acmd_function)rtpproxy_answer_async_f, {
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_STR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_INT | CMD_PARAM_OPT, fixup_set_id, fixup_free_set_id},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_VAR | CMD_PARAM_OPT, 0, 0}, {0,0,0}}},
+	{0,0,{{0,0,0}}}
+};
+#endif
+
 static param_export_t params[] = {
 	{"nortpproxy_str",        STR_PARAM, &nortpproxy_str.s        },
 	{"rtpproxy_sock",         STR_PARAM|USE_FUNC_PARAM,
@@ -463,6 +511,7 @@ static param_export_t params[] = {
 	{"rtpproxy_tout",         INT_PARAM, &rtpproxy_tout           },
 	{"rtpproxy_timeout",      STR_PARAM, &rtpproxy_timeout        },
 	{"rtpproxy_autobridge",   INT_PARAM, &rtpproxy_autobridge     },
+	{"rtt_weighting",         INT_PARAM, &rtpp_rtt_weighting      },
 	{"default_set",           INT_PARAM, &default_rtpp_set_no     },
 	{"db_url",                STR_PARAM, &db_url.s                },
 	{"db_table",              STR_PARAM, &table.s                 },
@@ -514,7 +563,11 @@ struct module_exports exports = {
 	0,				 /* load function */
 	&deps,           /* OpenSIPS module dependencies */
 	cmds,
-	NULL,
+#ifdef HAVE_TIMER_FD
+	acmds,
+#else
+	0,
+#endif
 	params,
 	0,           /* exported statistics */
 	mi_cmds,     /* exported MI functions */
@@ -992,6 +1045,9 @@ static mi_response_t *mi_show_rtpproxies(const mi_params_t *params,
 			if (add_mi_number(node_item, MI_RECHECK_TICKS, MI_RECHECK_T_LEN,
 				crt_rtpp->rn_recheck_ticks) < 0)
 				goto error;
+			if (add_mi_number(node_item, MI_RTT, MI_RTT_LEN,
+				crt_rtpp->rn_rtt) < 0)
+				goto error;
 		}
 	}
 
@@ -1244,6 +1300,12 @@ mod_init(void)
 		}
 	}
 
+	if (register_timer("rtpproxy-recheck", rtpp_recheck_nodes, NULL, 1,
+			TIMER_FLAG_DELAY_ON_DELAY) < 0) {
+		LM_ERR("failed to register the node recheck timer\n");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1362,11 +1424,63 @@ child_init(int rank)
 	return connect_rtpproxies();
 }
 
-int connect_rtpproxies(void)
+/*
+ * This is UDP or UDP6. Detect host and port; lookup host;
+ * do connect() in order to specify peer address
+ */
+static int rtpp_node_socket(struct rtpp_node *pnode)
 {
-	int n;
+	int n, fd;
 	char *cp;
+	char *hostname;
 	struct addrinfo hints, *res;
+
+	hostname = (char*)pkg_malloc(sizeof(char) * (strlen(pnode->rn_address) + 1));
+	if (hostname==NULL) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	strcpy(hostname, pnode->rn_address);
+
+	cp = strrchr(hostname, ':');
+	if (cp != NULL) {
+		*cp = '\0';
+		cp++;
+	}
+	if (cp == NULL || *cp == '\0')
+		cp = CPORT;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_flags = 0;
+	hints.ai_family = (pnode->rn_umode == 6) ? AF_INET6 : AF_INET;
+	hints.ai_socktype = SOCK_DGRAM;
+	if ((n = getaddrinfo(hostname, cp, &hints, &res)) != 0) {
+		LM_ERR("%s\n", gai_strerror(n));
+		pkg_free(hostname);
+		return -1;
+	}
+	pkg_free(hostname);
+
+	fd = socket((pnode->rn_umode == 6) ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+	if (fd == -1) {
+		LM_ERR("can't create socket\n");
+		freeaddrinfo(res);
+		return -1;
+	}
+
+	if (connect(fd, res->ai_addr, res->ai_addrlen) == -1) {
+		LM_ERR("can't connect to a RTP proxy\n");
+		close(fd);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+int connect_rtpproxies(void)
+{
+	unsigned int i;
 	struct rtpp_set  *rtpp_list;
 	struct rtpp_node *pnode;
 
@@ -1381,6 +1495,14 @@ int connect_rtpproxies(void)
 			LM_ERR("no more pkg memory\n");
 			return -1;
 		}
+		rtpp_async_socks = (int*)pkg_realloc(rtpp_async_socks,
+			*rtpp_no * sizeof(int));
+		if (rtpp_async_socks==NULL) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		for (i = rtpp_number; i < *rtpp_no; i++)
+			rtpp_async_socks[i] = -1;
 	}
 	rtpp_number = *rtpp_no;
 
@@ -1388,59 +1510,15 @@ int connect_rtpproxies(void)
 		rtpp_list = rtpp_list->rset_next){
 
 		for (pnode=rtpp_list->rn_first; pnode!=0; pnode = pnode->rn_next){
-			char *hostname;
 
 			if (pnode->rn_umode == 0) {
 				rtpp_socks[pnode->idx] = -1;
 				goto rptest;
 			}
 
-			/*
-			 * This is UDP or UDP6. Detect host and port; lookup host;
-			 * do connect() in order to specify peer address
-			 */
-			hostname = (char*)pkg_malloc(sizeof(char) * (strlen(pnode->rn_address) + 1));
-			if (hostname==NULL) {
-				LM_ERR("no more pkg memory\n");
-				return -1;
-			}
-			strcpy(hostname, pnode->rn_address);
-
-			cp = strrchr(hostname, ':');
-			if (cp != NULL) {
-				*cp = '\0';
-				cp++;
-			}
-			if (cp == NULL || *cp == '\0')
-				cp = CPORT;
-
-			memset(&hints, 0, sizeof(hints));
-			hints.ai_flags = 0;
-			hints.ai_family = (pnode->rn_umode == 6) ? AF_INET6 : AF_INET;
-			hints.ai_socktype = SOCK_DGRAM;
-			if ((n = getaddrinfo(hostname, cp, &hints, &res)) != 0) {
-				LM_ERR("%s\n", gai_strerror(n));
-				pkg_free(hostname);
+			rtpp_socks[pnode->idx] = rtpp_node_socket(pnode);
+			if (rtpp_socks[pnode->idx] == -1)
 				return -1;
-			}
-			pkg_free(hostname);
-
-			rtpp_socks[pnode->idx] = socket((pnode->rn_umode == 6)
-			    ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
-			if ( rtpp_socks[pnode->idx] == -1) {
-				LM_ERR("can't create socket\n");
-				freeaddrinfo(res);
-				return -1;
-			}
-
-			if (connect( rtpp_socks[pnode->idx], res->ai_addr, res->ai_addrlen) == -1) {
-				LM_ERR("can't connect to a RTP proxy\n");
-				close( rtpp_socks[pnode->idx] );
-				rtpp_socks[pnode->idx] = -1;
-				freeaddrinfo(res);
-				return -1;
-			}
-			freeaddrinfo(res);
 			LM_DBG("connected %s\n", pnode->rn_address);
 rptest:
 			pnode->rn_disabled = rtpp_test(pnode, 0, 1);
@@ -1459,6 +1537,12 @@ int update_rtpp_proxies(void) {
 	for (i = 0; i < rtpp_number; i++) {
 		shutdown(rtpp_socks[i], SHUT_RDWR);
 		close(rtpp_socks[i]);
+
+		/* the reactor notices the shutdown and the socket gets closed */
+		if (rtpp_async_socks[i] != -1) {
+			shutdown(rtpp_async_socks[i], SHUT_RDWR);
+			rtpp_async_socks[i] = -1;
+		}
 	}
 
 	return connect_rtpproxies();
@@ -2012,6 +2096,70 @@ error:
 
 
 
+#define RTPP_RTT_MAX_SHIFT	3
+
+/* accounts the time elapsed since @start in the smoothed reply time of
+ * @node - same smoothing as the TCP SRTT (RFC 6298), alpha = 1/8 */
+static void rtpp_account_rtt(struct rtpp_node *node, struct timeval *start)
+{
+	struct timeval now;
+	unsigned long us;
+	unsigned int srtt;
+
+	gettimeofday(&now, NULL);
+	us = (now.tv_sec - start->tv_sec) * 1000000 +
+		(now.tv_usec - start->tv_usec);
+	if (us == 0)
+		us = 1;
+
+	srtt = node->rn_rtt;
+	node->rn_rtt = srtt ? srtt - (srtt >> 3) + (us >> 3) : us;
+}
+
+/* halves the share of traffic of a node for each doubling of its reply
+ * time over the one of the fastest node of the set; a derating is only
+ * dropped once the node got well under the limit, so that the calls do
+ * not flap between the nodes */
+static void rtpp_update_rtt_shifts(struct rtpp_set *set)
+{
+	struct rtpp_node *node;
+	unsigned long best = 0;
+	unsigned int shift;
+
+	for (node = set->rn_first; node; node = node->rn_next)
+		if (!node->rn_disabled && node->rn_rtt &&
+				(!best || node->rn_rtt < best))
+			best = node->rn_rtt;
+
+	for (node = set->rn_first; node; node = node->rn_next) {
+		if (!best || !node->rn_rtt) {
+			node->rn_rtt_shift = 0;
+			continue;
+		}
+		shift = node->rn_rtt_shift;
+		while (shift < RTPP_RTT_MAX_SHIFT &&
+				node->rn_rtt >= (best << (shift + 1)))
+			shift++;
+		while (shift > 0 && node->rn_rtt * 4UL < (best << shift) * 3)
+			shift--;
+		node->rn_rtt_shift = shift;
+	}
+}
+
+static inline unsigned int rtpp_node_weight(struct rtpp_node *node)
+{
+	if (!rtpp_rtt_weighting)
+		return node->rn_weight;
+	return (node->rn_weight << RTPP_RTT_MAX_SHIFT) >> node->rn_rtt_shift;
+}
+
+static inline void rtpp_disable_node(struct rtpp_node *node)
+{
+	node->rn_disabled = 1;
+	node->rn_recheck_ticks = get_ticks() + rtpproxy_disable_tout;
+	raise_rtpproxy_event(node, 0);
+}
+
 #define RTPPROXY_BUF_SIZE 256
 
 char *
@@ -2022,6 +2170,7 @@ send_rtpp_command(struct rtpp_node *node, struct iovec *v, int vcnt)
 	char *cp;
 	static char buf[RTPPROXY_BUF_SIZE];
 	struct pollfd fds[1];
+	struct timeval start;
 
 
 #ifdef IOV_MAX
@@ -2052,6 +2201,7 @@ send_rtpp_command(struct rtpp_node *node, struct iovec *v, int vcnt)
 
 	len = 0;
 	cp = buf;
+	gettimeofday(&start, NULL);
 
 	if (node->rn_umode == 0) {
 		int s_errno;
@@ -2156,6 +2306,7 @@ send_rtpp_command(struct rtpp_node *node, struct iovec *v, int vcnt)
 	}
 
 out:
+	rtpp_account_rtt(node, &start);
 	cp[len] = '\0';
 	return cp;
 badproxy:
@@ -2216,7 +2367,8 @@ select_rtpp_node(struct sip_msg * msg,
 	/* Most popular case: 1 proxy, nothing to calculate */
 	if (set->rtpp_node_count == 1) {
 		node = set->rn_first;
-		if (node->rn_disabled && node->rn_recheck_ticks <= get_ticks())
+		if (node->rn_disabled && do_test != RTPP_SELECT_NO_PROBE &&
+				node->rn_recheck_ticks <= get_ticks())
 			node->rn_disabled = rtpp_test(node, 1, 0);
 		if (node->rn_disabled)
 			return NULL;
@@ -2224,10 +2376,17 @@ select_rtpp_node(struct sip_msg * msg,
 		goto done;
 	}
 
-	/* XXX Use quick-and-dirty hashing algo */
-	for(sum = 0; callid.len > 0; callid.len--)
-		sum += callid.s[callid.len - 1];
-	sum &= 0xff;
+	if (rtpp_rtt_weighting) {
+		/* the weights are scaled up to be derated, so the 8 bits of the
+		 * sum below would not reach the nodes at the end of the set */
+		sum = core_hash(&callid, NULL, 0);
+		rtpp_update_rtt_shifts(set);
+	} else {
+		/* XXX Use quick-and-dirty hashing algo */
+		for(sum = 0; callid.len > 0; callid.len--)
+			sum += callid.s[callid.len - 1];
+		sum &= 0xff;
+	}
 
 	was_forced = 0;
 retry:
@@ -2236,19 +2395,20 @@ retry:
 	found = 0;
 	for (node=set->rn_first; node!=NULL; node=node->rn_next) {
 
-		if (node->rn_disabled && node->rn_recheck_ticks <= get_ticks()){
+		if (node->rn_disabled && do_test != RTPP_SELECT_NO_PROBE &&
+				node->rn_recheck_ticks <= get_ticks()){
 			/* Try to enable if it's time to try. */
 			node->rn_disabled = rtpp_test(node, 1, 0);
 		}
-		constant_weight_sum += node->rn_weight;
+		constant_weight_sum += rtpp_node_weight(node);
 		if (!node->rn_disabled) {
-			weight_sum += node->rn_weight;
+			weight_sum += rtpp_node_weight(node);
 			found = 1;
 		}
 	}
 	if (found == 0) {
 		/* No proxies? Force all to be re-detected, if not yet */
-		if (was_forced)
+		if (was_forced || do_test == RTPP_SELECT_NO_PROBE)
 			return NULL;
 		was_forced = 1;
 		for(node=set->rn_first; node!=NULL; node=node->rn_next) {
@@ -2263,7 +2423,7 @@ retry:
 	 */
 	was_forced = 0;
 	for (node=set->rn_first; node!=NULL;) {
-		if (sumcut < (int)node->rn_weight) {
+		if (sumcut < (int)rtpp_node_weight(node)) {
 			if (!node->rn_disabled)
 				goto found;
 			if (was_forced == 0) {
@@ -2274,13 +2434,13 @@ retry:
 				continue;
 			}
 		}
-		sumcut -= node->rn_weight;
+		sumcut -= rtpp_node_weight(node);
 		node = node->rn_next;
 	}
 	/* No node list */
 	return NULL;
 found:
-	if (do_test) {
+	if (do_test > 0) {
 		node->rn_disabled = rtpp_test(node, node->rn_disabled, 0);
 		if (node->rn_disabled)
 			goto retry;
@@ -2298,6 +2458,38 @@ done:
 	return node;
 }
 
+/* the async requests never probe the disabled nodes, so they are probed
+ * from here once their recheck time comes */
+static void rtpp_recheck_nodes(unsigned int ticks, void *param)
+{
+	static int connected = 0;
+	struct rtpp_set *set;
+	struct rtpp_node *node;
+
+	if (!*rtpp_set_list)
+		return;
+
+	if (nh_lock)
+		lock_start_read(nh_lock);
+
+	/* the timer process only gets its sockets here */
+	if ((!connected || my_version != *list_version) &&
+			update_rtpp_proxies() < 0) {
+		LM_ERR("cannot update rtpp proxies list\n");
+		goto out;
+	}
+	connected = 1;
+
+	for (set = (*rtpp_set_list)->rset_first; set; set = set->rset_next)
+		for (node = set->rn_first; node; node = node->rn_next)
+			if (node->rn_disabled && node->rn_recheck_ticks <= ticks)
+				node->rn_disabled = rtpp_test(node, 1, 0);
+
+out:
+	if (nh_lock)
+		lock_stop_read(nh_lock);
+}
+
 struct rtpp_node *get_rtpp_node(str *node)
 {
 	struct rtpp_node *rnode;
@@ -2317,6 +2509,12 @@ struct rtpp_node *get_rtpp_node(str *node)
 
 static int
 unforce_rtp_proxy_f(struct sip_msg* msg, nh_set_param_t *pset, pv_spec_t *var)
+{
+	return unforce_rtp_proxy(msg, pset, var, NULL);
+}
+
+static int unforce_rtp_proxy(struct sip_msg* msg, nh_set_param_t *pset,
+		pv_spec_t *var, struct rtpp_async_req *areq)
 {
 	str callid, from_tag, to_tag;
 
@@ -2337,11 +2535,12 @@ unforce_rtp_proxy_f(struct sip_msg* msg, nh_set_param_t *pset, pv_spec_t *var)
 		return -1;
 	}
 
-	return unforce_rtpproxy(msg, callid, from_tag, to_tag, pset, var);
+	return unforce_rtpproxy(msg, callid, from_tag, to_tag, pset, var, areq);
 }
 
 static int unforce_rtpproxy(struct sip_msg* msg, str callid,
-		str from_tag, str to_tag, nh_set_param_t *pset, pv_spec_t *var)
+		str from_tag, str to_tag, nh_set_param_t *pset, pv_spec_t *var,
+		struct rtpp_async_req *areq)
 {
 	struct rtpp_node *node;
 	struct rtpp_set *set;
@@ -2361,13 +2560,20 @@ static int unforce_rtpproxy(struct sip_msg* msg, str callid,
 		goto error;
 	}
 
-	node = select_rtpp_node(msg, callid, set, var, 1);
+	node = select_rtpp_node(msg, callid, set, var,
+			areq ? RTPP_SELECT_NO_PROBE : 1);
 	if (!node) {
 		LM_ERR("no available proxies\n");
 		goto error;
 	}
-	send_rtpp_command(node, v, (to_tag.len > 0) ? 8 : 6);
-	LM_DBG("sent unforce command\n");
+	if (areq) {
+		/* only queue it, the async request sends it */
+		if (rtpp_async_add_cmd(areq, node, v, (to_tag.len > 0) ? 8 : 6, 0) < 0)
+			goto error;
+	} else {
+		send_rtpp_command(node, v, (to_tag.len > 0) ? 8 : 6);
+		LM_DBG("sent unforce command\n");
+	}
 
 	if(nh_lock)
 	{
@@ -2419,12 +2625,8 @@ static inline void rtpp_get_nt_str_param(str *param, str *val, int n)
 	val->s[val->len] = 0;
 }
 
-static int
-rtpproxy_offer5_f(struct sip_msg *msg, str *param1, str *param2,
-				nh_set_param_t *param3, pv_spec_t *param4, pv_spec_t *param5)
+static int rtpproxy_offer_dlg(struct sip_msg *msg)
 {
-	str param1_val={0,0},param2_val={0,0};
-
 	if(rtpp_notify_socket.s)
 	{
 		if ( (!msg->to && parse_headers(msg, HDR_TO_F,0)<0) || !msg->to ) {
@@ -2437,12 +2639,24 @@ rtpproxy_offer5_f(struct sip_msg *msg, str *param1, str *param2,
 			dlg_api.create_dlg(msg,0);
 	}
 
+	return 0;
+}
+
+static int
+rtpproxy_offer5_f(struct sip_msg *msg, str *param1, str *param2,
+				nh_set_param_t *param3, pv_spec_t *param4, pv_spec_t *param5)
+{
+	str param1_val={0,0},param2_val={0,0};
+
+	if (rtpproxy_offer_dlg(msg) < 0)
+		return -1;
+
 	if (param1)
 		rtpp_get_nt_str_param(param1, &param1_val, 0);
 	if (param2)
 		rtpp_get_nt_str_param(param2, &param2_val, 1);
 
-	return force_rtp_proxy(msg, param1_val.s,param2_val.s, param3, param4, param5, 1);
+	return force_rtp_proxy(msg, param1_val.s,param2_val.s, param3, param4, param5, 1, NULL);
 }
 
 static int
@@ -2456,7 +2670,7 @@ rtpproxy_answer5_f(struct sip_msg *msg, str *param1, str *param2,
 	if (param2)
 		rtpp_get_nt_str_param(param2, &param2_val, 1);
 
-	return force_rtp_proxy(msg, param1_val.s,param2_val.s, param3, param4, param5, 0);
+	return force_rtp_proxy(msg, param1_val.s,param2_val.s, param3, param4, param5, 0, NULL);
 }
 
 static void engage_callback(struct dlg_cell *dlg, int type,
@@ -2489,7 +2703,7 @@ static void engage_close_callback(struct dlg_cell *dlg, int type,
 
 	if (unforce_rtpproxy(_params->msg, dlg->callid,
 			dlg->legs[DLG_CALLER_LEG].tag, dlg->legs[callee_idx(dlg)].tag,
-			&param, NULL) < 0) {
+			&param, NULL, NULL) < 0) {
 		LM_ERR("cannot unforce rtp proxy\n");
 	}
 }
@@ -2747,7 +2961,7 @@ static int engage_force_rtpproxy(struct dlg_cell *dlg, struct sip_msg *msg)
 	param.v.int_set = setid;
 	param.t = NH_VAL_SET_UNDEF;
 
-	force_rtp_proxy(msg, param1_val.s, param2_val.s, &param, NULL, NULL, offer);
+	force_rtp_proxy(msg, param1_val.s, param2_val.s, &param, NULL, NULL, offer, NULL);
 
 	if (alloc) {
 		if (param1_val.s)
@@ -2855,7 +3069,7 @@ engage_rtp_proxy5_f(struct sip_msg *msg, str *param1, str *param2,
 	/* is this a late negotiation scenario? */
 	if (msg_has_sdp(msg)) {
 		LM_DBG("message has sdp body -> forcing rtp proxy\n");
-		if(force_rtp_proxy(msg,param1_val.s,param2_val.s,param3,param4, param5,1) < 0) {
+		if(force_rtp_proxy(msg,param1_val.s,param2_val.s,param3,param4, param5,1,NULL) < 0) {
 			LM_ERR("error forcing rtp proxy\n");
 			return -1;
 		}
@@ -2965,6 +3179,176 @@ engage_rtp_proxy5_f(struct sip_msg *msg, str *param1, str *param2,
 	return 1;
 }
 
+#define RTPP_ASYNC_HASH_SIZE	64
+
+enum rtpp_async_op {
+	RTPP_ASYNC_OFFER,
+	RTPP_ASYNC_ANSWER,
+	RTPP_ASYNC_UNFORCE
+};
+
+/* a command of an async request - an offer/answer sends one command for
+ * each media stream of the body, all of them at once */
+struct rtpp_async_cmd {
+	unsigned int seqn;
+	str cookie;
+	str cmd;
+	char *reply;
+	struct rtpp_async_req *req;
+	struct rtpp_async_cmd *next;	/* in the request */
+	struct rtpp_async_cmd *hnext;	/* in the hash */
+};
+
+/* each request owns a timer FD which the script waits on - the timer fires
+ * either on timeout (time to retransmit or to fail over) or right away,
+ * once all the replies arrived */
+struct rtpp_async_req {
+	enum rtpp_async_op op;
+	struct rtpp_async_cmd *cmds;
+	struct rtpp_async_cmd *last;
+	struct rtpp_async_cmd *cur;		/* next reply to be applied */
+	int pending;		/* replies not received yet */
+	int applying;		/* the replies are being applied on the message */
+	int lookup;			/* looks up existing sessions - no fail over */
+	int sync_only;		/* the node can only be used in blocking mode */
+	str url;			/* of the node the commands were built for */
+	char *adv_address;
+	unsigned int set_id;
+	unsigned int node_idx;
+	unsigned int version;
+	int tries;			/* sends left towards the current node */
+	struct timeval sent;
+	int tfd;
+	char *arg1;
+	char *arg2;
+	pv_spec_t *var;
+	pv_spec_t *ipvar;
+};
+
+/* the pending commands of this process, indexed by cookie sequence */
+static struct rtpp_async_cmd *rtpp_async_cmds[RTPP_ASYNC_HASH_SIZE];
+
+/* drops the commands built so far, along with the node they were built for */
+static void rtpp_async_reset(struct rtpp_async_req *req)
+{
+	struct rtpp_async_cmd *cmd, **it;
+
+	while ((cmd = req->cmds)) {
+		req->cmds = cmd->next;
+		for (it = &rtpp_async_cmds[cmd->seqn % RTPP_ASYNC_HASH_SIZE]; *it;
+				it = &(*it)->hnext)
+			if (*it == cmd) {
+				*it = cmd->hnext;
+				break;
+			}
+		if (cmd->reply)
+			pkg_free(cmd->reply);
+		pkg_free(cmd);
+	}
+	req->last = req->cur = NULL;
+	req->pending = 0;
+	req->lookup = 0;
+
+	if (req->url.s) {
+		pkg_free(req->url.s);
+		req->url.s = NULL;
+		req->url.len = 0;
+	}
+	if (req->adv_address) {
+		pkg_free(req->adv_address);
+		req->adv_address = NULL;
+	}
+}
+
+/* queues a command of the request, built for @node */
+static int rtpp_async_add_cmd(struct rtpp_async_req *req,
+		struct rtpp_node *node, struct iovec *v, int vcnt, int create)
+{
+	struct rtpp_async_cmd *cmd;
+	char *cookie, *p;
+	int i, len;
+
+	if (node->rn_umode == 0) {
+		/* UNIX socket nodes can only be used in blocking mode */
+		req->sync_only = 1;
+		return -1;
+	}
+
+	if (!req->url.s) {
+		if (pkg_str_dup(&req->url, &node->rn_url) < 0) {
+			LM_ERR("no more pkg memory\n");
+			req->url.s = NULL;
+			return -1;
+		}
+		if (node->adv_address &&
+				!(req->adv_address = pkg_strdup(node->adv_address))) {
+			LM_ERR("no more pkg memory\n");
+			return -1;
+		}
+		req->node_idx = node->idx;
+		req->version = *list_version;
+		req->tries = rtpproxy_retr;
+	} else if (req->node_idx != node->idx || req->version != *list_version) {
+		LM_ERR("media streams of the same call handled by different "
+			"nodes\n");
+		return -1;
+	}
+
+	for (len = 0, i = 1; i < vcnt; i++)
+		len += v[i].iov_len;
+
+	cmd = pkg_malloc(sizeof *cmd + 34 + len);
+	if (!cmd) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	memset(cmd, 0, sizeof *cmd);
+
+	cmd->seqn = myseqn;
+	cookie = gencookie();
+	cmd->cookie.s = (char *)(cmd + 1);
+	cmd->cookie.len = strlen(cookie);
+	memcpy(cmd->cookie.s, cookie, cmd->cookie.len);
+
+	cmd->cmd.s = p = cmd->cookie.s + cmd->cookie.len;
+	for (i = 1; i < vcnt; i++) {
+		memcpy(p, v[i].iov_base, v[i].iov_len);
+		p += v[i].iov_len;
+	}
+	cmd->cmd.len = len;
+	cmd->req = req;
+
+	if (req->last)
+		req->last->next = cmd;
+	else
+		req->cmds = cmd;
+	req->last = cmd;
+
+	cmd->hnext = rtpp_async_cmds[cmd->seqn % RTPP_ASYNC_HASH_SIZE];
+	rtpp_async_cmds[cmd->seqn % RTPP_ASYNC_HASH_SIZE] = cmd;
+
+	req->pending++;
+	if (!create)
+		req->lookup = 1;
+
+	return 0;
+}
+
+/* hands out the replies, in the order of their commands */
+static char *rtpp_async_next_reply(struct rtpp_async_req *req)
+{
+	char *reply;
+
+	if (!req->cur) {
+		LM_ERR("more media streams than replies from the RTP proxy\n");
+		return NULL;
+	}
+
+	reply = req->cur->reply;
+	req->cur = req->cur->next;
+	return reply;
+}
+
 struct options {
 	str s;
 	int oidx;
@@ -3035,7 +3419,7 @@ free_opts(struct options *op1, struct options *op2, struct options *op3, struct
 
 static int
 force_rtp_proxy(struct sip_msg* msg, char* str1, char* str2, nh_set_param_t *setid,
-											pv_spec_t *var, pv_spec_t *ipvar, int offer)
+		pv_spec_t *var, pv_spec_t *ipvar, int offer, struct rtpp_async_req *areq)
 {
 	struct body_part *p;
 	struct force_rtpp_args args;
@@ -3063,6 +3447,7 @@ force_rtp_proxy(struct sip_msg* msg, char* str1, char* str2, nh_set_param_t *set
 	args.arg1 = str1;
 	args.arg2 = str2;
 	args.offer = offer;
+	args.areq = areq;
 
 	for (p = &msg->body->first; p != NULL; p = p->next)
 	{
@@ -3093,7 +3478,8 @@ force_rtp_proxy(struct sip_msg* msg, char* str1, char* str2, nh_set_param_t *set
 			if (nh_lock)
 				lock_start_read(nh_lock);
 
-			args.node = select_rtpp_node(msg, args.callid, args.set, var, 1);
+			args.node = select_rtpp_node(msg, args.callid, args.set, var,
+					args.areq ? RTPP_SELECT_NO_PROBE : 1);
 			if (args.node == NULL) {
 				LM_ERR("no available proxies\n");
 				goto error_with_lock;
@@ -3629,6 +4015,18 @@ int force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args,
 				v[13].iov_len = v[14].iov_len = 0;
 				v[17].iov_len = v[18].iov_len = 0;
 			}
+			if (args->areq && args->areq->applying) {
+				/* async mode - the reply is already here */
+				cp = rtpp_async_next_reply(args->areq);
+				if (!cp)
+					goto error;
+				if ((err = rtpp_get_error(cp))) {
+					LM_ERR("unhandled rtpproxy error: %d\n", err);
+					goto error;
+				}
+				adv_address = args->areq->adv_address;
+				goto reply;
+			}
 			if (!args->node && nh_lock) {
 				locked = 1;
 				lock_start_read(nh_lock);
@@ -3637,7 +4035,8 @@ int force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args,
 
 				/* if not successful choose a different rtpproxy */
 				if (!args->node) {
-					args->node = select_rtpp_node(msg, args->callid, args->set, var, 0);
+					args->node = select_rtpp_node(msg, args->callid, args->set,
+							var, args->areq ? RTPP_SELECT_NO_PROBE : 0);
 					if (!args->node) {
 						LM_ERR("no available proxies\n");
 						goto error;
@@ -3741,6 +4140,15 @@ int force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args,
 
 				v[1].iov_base = m_opts.s.s;
 				v[1].iov_len = m_opts.oidx;
+				if (args->areq) {
+					/* async mode - only queue the command for now, all the
+					 * commands of the body are sent at once */
+					if (rtpp_async_add_cmd(args->areq, args->node, v, vcnt,
+							create) < 0)
+						goto error;
+					args->node = NULL;
+					break;
+				}
 				cp = send_rtpp_command(args->node, v, vcnt);
 				if (!cp && !create) {
 					LM_ERR("cannot lookup a session on a different RTPProxy\n");
@@ -3765,6 +4173,9 @@ int force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args,
 				locked = 0;
 				lock_stop_read(nh_lock);
 			}
+			if (args->areq)
+				continue;
+reply:
 			LM_DBG("proxy reply: %s\n", cp);
 			/* Parse proxy reply to <argc,argv> */
 			argc = 0;
@@ -3904,6 +4315,9 @@ int force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args,
 	} /* Iterate sessions */
 	free_opts(&opts, &rep_opts, &pt_opts, &mod_opts);
 
+	if (args->areq && !args->areq->applying)
+		return 1;
+
 	if (proxied == 0 && nortpproxy_str.len && keep_body == 0) {
 		cp = pkg_malloc((1 + nortpproxy_str.len + CRLF_LEN) * sizeof(char));
 		if (cp == NULL) {
@@ -3950,6 +4364,496 @@ error:
 
 
 
+#ifdef HAVE_TIMER_FD
+
+static void rtpp_async_free(struct rtpp_async_req *req)
+{
+	rtpp_async_reset(req);
+
+	if (req->arg1)
+		pkg_free(req->arg1);
+	if (req->arg2)
+		pkg_free(req->arg2);
+	pkg_free(req);
+}
+
+static struct rtpp_async_cmd *rtpp_async_lookup(char *cookie, int len)
+{
+	struct rtpp_async_cmd *cmd;
+	unsigned int seqn;
+	str seqn_s;
+	char *p;
+
+	p = memchr(cookie, '_', len);
+	if (!p)
+		return NULL;
+	seqn_s.s = p + 1;
+	seqn_s.len = cookie + len - seqn_s.s;
+	if (str2int(&seqn_s, &seqn) < 0)
+		return NULL;
+
+	for (cmd = rtpp_async_cmds[seqn % RTPP_ASYNC_HASH_SIZE]; cmd;
+			cmd = cmd->hnext)
+		if (cmd->seqn == seqn && cmd->cookie.len - 1 == len &&
+				memcmp(cmd->cookie.s, cookie, len) == 0)
+			return cmd;
+
+	return NULL;
+}
+
+static inline int rtpp_async_arm(struct rtpp_async_req *req, int ms)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof its);
+	its.it_value.tv_sec = ms / 1000;
+	/* a zero value would disarm the timer */
+	its.it_value.tv_nsec = (ms % 1000) * 1000000 + 1;
+
+	if (timerfd_settime(req->tfd, 0, &its, NULL) < 0) {
+		LM_ERR("failed to set timer FD (%d) <%s>\n", errno, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* the node the commands of the request were built for, if not reloaded
+ * since; must be called under the nh_lock */
+static struct rtpp_node *rtpp_async_node(struct rtpp_async_req *req)
+{
+	struct rtpp_set *set;
+	struct rtpp_node *node;
+
+	if (!req->url.s || req->version != *list_version)
+		return NULL;
+
+	set = select_rtpp_set(req->set_id);
+	if (!set)
+		return NULL;
+
+	for (node = set->rn_first; node; node = node->rn_next)
+		if (node->idx == req->node_idx)
+			return node;
+
+	return NULL;
+}
+
+/* reads all the replies available on the socket of a node and wakes up
+ * the requests which got all their replies */
+static int rtpp_async_reply(int fd, void *param)
+{
+	static char buf[RTPPROXY_BUF_SIZE];
+	struct rtpp_async_cmd *cmd;
+	struct rtpp_async_req *req;
+	struct rtpp_node *node;
+	char *p;
+	int len, i;
+
+	for (i = 0; i < rtpp_number; i++)
+		if (rtpp_async_socks[i] == fd)
+			break;
+	if (i == rtpp_number) {
+		/* socket shut down on rtpproxies reload */
+		async_status = ASYNC_DONE_CLOSE_FD;
+		return 0;
+	}
+
+	async_status = ASYNC_CONTINUE;
+
+	for (;;) {
+		len = recv(fd, buf, sizeof(buf) - 1, MSG_DONTWAIT);
+		if (len < 0) {
+			if (errno == EINTR || errno == ECONNREFUSED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				LM_WARN("error while reading rtpproxy socket %d (%d:%s)\n",
+					fd, errno, strerror(errno));
+			return 0;
+		}
+
+		p = memchr(buf, ' ', len);
+		if (!p) {
+			LM_WARN("no cookie in the reply from a RTP proxy\n");
+			continue;
+		}
+
+		cmd = rtpp_async_lookup(buf, p - buf);
+		if (!cmd || cmd->reply) {
+			LM_DBG("late or unknown reply: %.*s\n", (int)(p - buf), buf);
+			continue;
+		}
+		req = cmd->req;
+
+		len -= p + 1 - buf;
+		cmd->reply = pkg_malloc(len + 1);
+		if (!cmd->reply) {
+			LM_ERR("no more pkg memory\n");
+			continue;
+		}
+		memcpy(cmd->reply, p + 1, len);
+		cmd->reply[len] = '\0';
+
+		if (--req->pending > 0)
+			continue;
+
+		if (nh_lock)
+			lock_start_read(nh_lock);
+		node = rtpp_async_node(req);
+		if (node)
+			rtpp_account_rtt(node, &req->sent);
+		if (nh_lock)
+			lock_stop_read(nh_lock);
+
+		rtpp_async_arm(req, 0);
+	}
+}
+
+static int rtpp_async_sock(struct rtpp_node *node)
+{
+	int fd, flags;
+
+	if (rtpp_async_socks[node->idx] != -1)
+		return rtpp_async_socks[node->idx];
+
+	fd = rtpp_node_socket(node);
+	if (fd == -1)
+		return -1;
+
+	flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		LM_ERR("failed to make the socket non-blocking (%d:%s)\n",
+			errno, strerror(errno));
+		goto error;
+	}
+
+	if (register_async_fd(fd, rtpp_async_reply, NULL) < 0) {
+		LM_ERR("failed to watch the rtpproxy socket\n");
+		goto error;
+	}
+
+	rtpp_async_socks[node->idx] = fd;
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+/* (re-)sends the commands still waiting for a reply, all at once, to the
+ * node they were built for and arms the timer of the request; once the
+ * node used up all its sends, it gets disabled */
+static int rtpp_async_send(struct rtpp_async_req *req)
+{
+	struct rtpp_async_cmd *cmd;
+	struct rtpp_node *node;
+	struct iovec v[2];
+	int fd, len, rc = -1;
+
+	if (nh_lock)
+		lock_start_read(nh_lock);
+
+	/* check last list version */
+	if (my_version != *list_version && update_rtpp_proxies() < 0) {
+		LM_ERR("cannot update rtpp proxies list\n");
+		goto out;
+	}
+
+	node = rtpp_async_node(req);
+	if (!node || node->rn_disabled)
+		goto out;
+
+	if (req->tries == 0) {
+		LM_ERR("proxy <%s> does not respond, disable it\n", node->rn_url.s);
+		rtpp_disable_node(node);
+		goto out;
+	}
+
+	fd = rtpp_async_sock(node);
+	if (fd == -1) {
+		LM_ERR("proxy <%s> cannot be reached, disable it\n", node->rn_url.s);
+		rtpp_disable_node(node);
+		goto out;
+	}
+
+	if (req->tries == rtpproxy_retr)
+		gettimeofday(&req->sent, NULL);
+
+	for (cmd = req->cmds; cmd; cmd = cmd->next) {
+		if (cmd->reply)
+			continue;
+		v[0].iov_base = cmd->cookie.s;
+		v[0].iov_len = cmd->cookie.len;
+		v[1].iov_base = cmd->cmd.s;
+		v[1].iov_len = cmd->cmd.len;
+		do {
+			len = writev(fd, v, 2);
+		} while (len == -1 && (errno == EINTR || errno == ENOBUFS));
+		if (len <= 0)
+			LM_ERR("can't send command to a RTP proxy (%d:%s)\n",
+					errno, strerror(errno));
+	}
+	req->tries--;
+	rc = 0;
+
+out:
+	if (nh_lock)
+		lock_stop_read(nh_lock);
+	if (rc == 0)
+		rc = rtpp_async_arm(req, rtpproxy_tout);
+	return rc;
+}
+
+/* (re-)builds the commands of the request, for the node of the set the
+ * call is balanced to */
+static int rtpp_async_build(struct sip_msg *msg, struct rtpp_async_req *req,
+		nh_set_param_t *pset)
+{
+	nh_set_param_t set_param;
+
+	rtpp_async_reset(req);
+
+	if (!pset) {
+		set_param.t = NH_VAL_SET_UNDEF;
+		set_param.v.int_set = req->set_id;
+		pset = &set_param;
+	}
+
+	if (req->op == RTPP_ASYNC_UNFORCE)
+		return unforce_rtp_proxy(msg, pset, req->var, req);
+
+	return force_rtp_proxy(msg, req->arg1, req->arg2, pset, req->var,
+		req->ipvar, req->op == RTPP_ASYNC_OFFER, req);
+}
+
+/* moves the request to another node of the set, if there is any left
+ * @return: 0 - sent, -1 - failed, -2 - node reachable only in sync */
+static int rtpp_async_failover(struct sip_msg *msg, struct rtpp_async_req *req)
+{
+	struct rtpp_set *set;
+	struct rtpp_node *node;
+
+	for (;;) {
+		if (req->lookup) {
+			LM_ERR("cannot lookup a session on a different RTPProxy\n");
+			return -1;
+		}
+
+		/* do not block the process waiting for all the nodes to be
+		 * probed again */
+		node = NULL;
+		if (nh_lock)
+			lock_start_read(nh_lock);
+		if ((set = select_rtpp_set(req->set_id)))
+			for (node = set->rn_first; node; node = node->rn_next)
+				if (!node->rn_disabled)
+					break;
+		if (nh_lock)
+			lock_stop_read(nh_lock);
+		if (!node) {
+			LM_ERR("no available proxies\n");
+			return -1;
+		}
+
+		if (rtpp_async_build(msg, req, NULL) < 0 || !req->cmds)
+			return req->sync_only ? -2 : -1;
+
+		if (rtpp_async_send(req) == 0)
+			return 0;
+	}
+}
+
+/* runs the request in blocking mode or, once all the replies are here,
+ * applies them on the message (@areq set) */
+static int rtpp_async_run(struct sip_msg *msg, struct rtpp_async_req *req,
+		struct rtpp_async_req *areq)
+{
+	nh_set_param_t set_param;
+
+	set_param.t = NH_VAL_SET_UNDEF;
+	set_param.v.int_set = req->set_id;
+
+	if (req->op == RTPP_ASYNC_UNFORCE)
+		return areq ? 1 : unforce_rtp_proxy(msg, &set_param, req->var, NULL);
+
+	return force_rtp_proxy(msg, req->arg1, req->arg2, &set_param, req->var,
+		req->ipvar, req->op == RTPP_ASYNC_OFFER, areq);
+}
+
+static int rtpp_async_resume(int fd, struct sip_msg *msg, void *param)
+{
+	struct rtpp_async_req *req = (struct rtpp_async_req *)param;
+	struct rtpp_async_cmd *cmd;
+	struct rtpp_node *node;
+	uint64_t exp;
+	int rc, err;
+
+	while (read(fd, &exp, sizeof exp) < 0 && errno == EINTR) ;
+
+	if (req->pending) {
+		/* not all the replies in due time - retransmit or fail over */
+		if (rtpp_async_send(req) == 0)
+			goto wait;
+		goto failover;
+	}
+
+	for (cmd = req->cmds; cmd; cmd = cmd->next) {
+		/* check internal errors */
+		err = rtpp_get_error(cmd->reply);
+		if (err >= 7 && err <= 10) {
+			if (nh_lock)
+				lock_start_read(nh_lock);
+			node = rtpp_async_node(req);
+			if (node)
+				rtpp_disable_node(node);
+			if (nh_lock)
+				lock_stop_read(nh_lock);
+			goto failover;
+		}
+	}
+
+	req->applying = 1;
+	req->cur = req->cmds;
+	rc = rtpp_async_run(msg, req, req);
+	goto done;
+
+failover:
+	rc = rtpp_async_failover(msg, req);
+	if (rc == 0)
+		goto wait;
+	if (rc == -2)
+		rc = rtpp_async_run(msg, req, NULL);
+	else if (req->op == RTPP_ASYNC_UNFORCE)
+		rc = 1;
+done:
+	rtpp_async_free(req);
+	async_status = ASYNC_DONE_CLOSE_FD;
+	return rc;
+wait:
+	async_status = ASYNC_CONTINUE;
+	return 1;
+}
+
+static int rtpp_async_call(struct sip_msg *msg, async_ctx *ctx,
+		enum rtpp_async_op op, str *param1, str *param2, nh_set_param_t *pset,
+		pv_spec_t *var, pv_spec_t *ipvar)
+{
+	struct rtpp_async_req *req;
+	struct rtpp_set *set;
+	str param1_val = {0, 0}, param2_val = {0, 0};
+	int rc;
+
+	if (param1)
+		rtpp_get_nt_str_param(param1, &param1_val, 0);
+	if (param2)
+		rtpp_get_nt_str_param(param2, &param2_val, 1);
+
+	/* the bridging mode needs the commands sent right before forwarding */
+	if (rtpproxy_autobridge)
+		goto sync;
+
+	set = get_rtpp_set(pset);
+	if (!set) {
+		LM_ERR("could not find rtpproxy set\n");
+		return -1;
+	}
+
+	req = pkg_malloc(sizeof *req);
+	if (!req) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	memset(req, 0, sizeof *req);
+
+	req->op = op;
+	req->set_id = set->id_set;
+	req->var = var;
+	req->ipvar = ipvar;
+	if ((param1_val.s && !(req->arg1 = pkg_strdup(param1_val.s))) ||
+			(param2_val.s && !(req->arg2 = pkg_strdup(param2_val.s)))) {
+		LM_ERR("no more pkg memory\n");
+		rtpp_async_free(req);
+		return -1;
+	}
+
+	rc = rtpp_async_build(msg, req, pset);
+	if (rc < 0 || !req->cmds) {
+		/* nothing to wait for */
+		if (rc < 0 && !req->sync_only) {
+			rtpp_async_free(req);
+			return rc;
+		}
+		rtpp_async_free(req);
+		goto sync;
+	}
+
+	req->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	if (req->tfd < 0) {
+		LM_ERR("failed to create new timer FD (%d) <%s>\n",
+			errno, strerror(errno));
+		rtpp_async_free(req);
+		goto sync;
+	}
+
+	if (rtpp_async_send(req) < 0) {
+		rc = rtpp_async_failover(msg, req);
+		if (rc < 0) {
+			close(req->tfd);
+			rtpp_async_free(req);
+			if (rc == -2)
+				goto sync;
+			return op == RTPP_ASYNC_UNFORCE ? 1 : -1;
+		}
+	}
+
+	ctx->resume_param = req;
+	ctx->resume_f = rtpp_async_resume;
+	async_status = req->tfd;
+	return 1;
+
+sync:
+	ctx->resume_param = NULL;
+	ctx->resume_f = NULL;
+	async_status = ASYNC_NO_IO;
+
+	if (op == RTPP_ASYNC_UNFORCE)
+		return unforce_rtp_proxy(msg, pset, var, NULL);
+	return force_rtp_proxy(msg, param1_val.s, param2_val.s, pset, var, ipvar,
+		op == RTPP_ASYNC_OFFER, NULL);
+}
+
+static int rtpproxy_offer_async_f(struct sip_msg *msg, async_ctx *ctx,
+				str *param1, str *param2, nh_set_param_t *param3,
+				pv_spec_t *param4, pv_spec_t *param5)
+{
+	if (rtpproxy_offer_dlg(msg) < 0)
+		return -1;
+
+	return rtpp_async_call(msg, ctx, RTPP_ASYNC_OFFER, param1, param2,
+		param3, param4, param5);
+}
+
+static int rtpproxy_answer_async_f(struct sip_msg *msg, async_ctx *ctx,
+				str *param1, str *param2, nh_set_param_t *param3,
+				pv_spec_t *param4, pv_spec_t *param5)
+{
+	return rtpp_async_call(msg, ctx, RTPP_ASYNC_ANSWER, param1, param2,
+		param3, param4, param5);
+}
+
+static int rtpproxy_unforce_async_f(struct sip_msg *msg, async_ctx *ctx,
+				nh_set_param_t *pset, pv_spec_t *var)
+{
+	if (!msg || msg == FAKED_REPLY)
+		return 1;
+
+	return rtpp_async_call(msg, ctx, RTPP_ASYNC_UNFORCE, NULL, NULL,
+		pset, var, NULL);
+}
+
+#endif /* HAVE_TIMER_FD */
+
+
 static char *rtpproxy_stats_pop_int(struct sip_msg *msg, char *p,
 		pv_spec_p spec, const char *varname)
 {
@@ -43,6 +43,8 @@ struct rtpp_node {
 	char				*adv_address;	/* advertised address of rtpproxy */
 	int					rn_disabled;	/* found unaccessible? */
 	unsigned			rn_weight;		/* for load balancing */
+	unsigned int		rn_rtt;			/* smoothed reply time, in us */
+	unsigned int		rn_rtt_shift;	/* weight derating due to rn_rtt */
 	unsigned int		rn_recheck_ticks;
 	unsigned int		capabilities;
 	struct rtpp_node	*rn_next;
@@ -96,6 +98,8 @@ struct rtpp_set_head{
 	struct rtpp_set		*rset_last;
 };
 
+struct rtpp_async_req;
+
 struct force_rtpp_args {
     char *arg1;
     char *arg2;
@@ -105,6 +109,7 @@ struct force_rtpp_args {
     struct rtpp_set *set;
     struct rtpp_node *node;
     str raddr;
+    struct rtpp_async_req *areq;	/* set when running in async mode */
 };
 
 /* used in timeout_listener_process */
@@ -158,6 +163,10 @@ void notification_listener_process(int rank);
 
 /* Functions from nathelper */
 struct rtpp_set *get_rtpp_set(nh_set_param_t *);
+/* last argument of select_rtpp_node(): 1 - check the chosen node,
+ * 0 - do not check it, RTPP_SELECT_NO_PROBE - never send a blocking probe,
+ * leaving the disabled nodes to the timer and to the blocking commands */
+#define RTPP_SELECT_NO_PROBE  -1
 struct rtpp_node *select_rtpp_node(struct sip_msg *, str, struct rtpp_set *, pv_spec_p, int);
 char *send_rtpp_command(struct rtpp_node *, struct iovec *, int);
 int force_rtp_proxy_body(struct sip_msg* msg, struct force_rtpp_args *args,
@@ -90,6 +90,9 @@
 #include "../../statistics.h"
 #endif
 
+#include "sipcapture_bulk.h"
+#include "sipcapture_ring.h"
+
 /* this value shall be put in proto_reserved2 field of
  * the receive_info structure and help us identify a
  * hep message */
@@ -230,6 +233,13 @@ struct _sipcapture_object {
 typedef void* sc_async_param_t;
 db_key_t db_keys[NR_KEYS];
 
+/* the columns actually stored (non-empty name) and their db_keys index */
+static db_key_t sc_keys[NR_KEYS];
+static int sc_keys_idx[NR_KEYS];
+static int sc_keys_no;
+
+#define SC_STORED(_col) ((_col).len != 0)
+
 static int rtp_keys_no = RTCP_NR_KEYS;
 db_key_t rtcp_db_keys[RTCP_NR_KEYS];
 
@@ -557,6 +567,7 @@ static acmd_export_t acmds[] = {
 
 static proc_export_t procs[] = {
         {"RAW receiver",  0,  0, raw_socket_process, 1, PROC_FLAG_INITCHILD},
+        {"SIP capture writer", 0, 0, sc_bulk_writer_proc, 0, 0},
         {0,0,0,0,0,0}
 };
 
@@ -617,7 +628,14 @@ static param_export_t params[] = {
 	{"raw_interface",     		STR_PARAM, &raw_interface.s   },
         {"promiscious_on",  		INT_PARAM, &promisc_on   },
         {"raw_moni_bpf_on",  		INT_PARAM, &bpf_on   },
+	{"raw_ring_on",			INT_PARAM, &raw_ring_on },
+	{"raw_ring_blocks",		INT_PARAM, &raw_ring_blocks },
+	{"raw_ring_block_size",	INT_PARAM, &raw_ring_block_size },
 	{"hep_route",		STR_PARAM, &hep_route_name},
+	{"bulk_writers",		INT_PARAM, &bulk_writers },
+	{"bulk_batch_size",		INT_PARAM, &bulk_batch_size },
+	{"bulk_flush_interval",	INT_PARAM, &bulk_flush_interval },
+	{"bulk_queue_size",		INT_PARAM, &bulk_queue_size },
 	{0, 0, 0}
 };
 
@@ -641,6 +659,11 @@ stat_var* sipcapture_rpl;
 stat_export_t sipcapture_stats[] = {
 	{"captured_requests" ,  0,  &sipcapture_req  },
 	{"captured_replies"  ,  0,  &sipcapture_rpl  },
+	{"bulk_queue_depth",   STAT_IS_FUNC, (stat_var**)sc_bulk_queue_depth   },
+	{"bulk_flush_latency", STAT_IS_FUNC, (stat_var**)sc_bulk_flush_latency },
+	{"bulk_written",       0,  &bulk_written_stat  },
+	{"bulk_dropped",       0,  &bulk_dropped_stat  },
+	{"bulk_failed",        0,  &bulk_failed_stat   },
 	{0,0,0}
 };
 #endif
@@ -873,6 +896,9 @@ static int mod_init(void) {
 
 	/* check if we need to start extra process */
 	procs[0].no = (ipip_capture_on || moni_capture_on) ? raw_sock_children:0;
+	if (bulk_writers < 0)
+		bulk_writers = 0;
+	procs[1].no = (db_url.s && db_url.len) ? bulk_writers : 0;
 
 	table_name.len = strlen(table_name.s);
 	rtcp_table_name.len = strlen(rtcp_table_name.s);
@@ -914,6 +940,22 @@ static int mod_init(void) {
 	msg_column.len = strlen(msg_column.s);
 	capture_node.len = strlen(capture_node.s);
 
+	/* an empty column name means the field is neither parsed nor stored */
+	for (i = 1; i < NR_KEYS; i++) {
+		db_keys[i]->len = strlen(db_keys[i]->s);
+		if (!db_keys[i]->len)
+			continue;
+		sc_keys[sc_keys_no] = db_keys[i];
+		sc_keys_idx[sc_keys_no++] = i;
+	}
+	if (!sc_keys_no) {
+		LM_ERR("all the capture columns are disabled\n");
+		return -1;
+	}
+	if (sc_keys_no != NR_KEYS - 1)
+		LM_INFO("storing %d out of %d capture columns\n",
+			sc_keys_no, NR_KEYS - 1);
+
 
 	/* extract prefix and suffix from table name */
 	parse_table_str(&table_name, &tz_table);
@@ -989,6 +1031,11 @@ static int mod_init(void) {
 			LM_ERR("table_name is not defined or empty\n");
 			return -1;
 		}
+
+		if (bulk_writers && sc_bulk_init(&db_url) < 0) {
+			LM_ERR("failed to initialize the bulk writers\n");
+			return -1;
+		}
 	}
 
 	capture_on_flag = (int*)shm_malloc(sizeof(int));
@@ -1021,7 +1068,12 @@ static int mod_init(void) {
 				return -1;
 				}
 
-		raw_sock_desc = raw_capture_socket(raw_socket_listen.len ? ip : 0, raw_interface.len ? &raw_interface : 0,
+		if (moni_capture_on && raw_ring_on)
+			/* one ring per RAW receiver, the first one is ours to close */
+			raw_sock_desc = sc_ring_init(raw_interface.len ? &raw_interface : 0,
+					raw_sock_children, moni_port_start, moni_port_end);
+		else
+			raw_sock_desc = raw_capture_socket(raw_socket_listen.len ? ip : 0, raw_interface.len ? &raw_interface : 0,
 										moni_port_start, moni_port_end , ipip_capture_on ? IPPROTO_IPIP : htons(0x0800));
 
 		if(raw_sock_desc < 0) {
@@ -1064,6 +1116,7 @@ static int mod_init(void) {
 #ifdef __OS_linux
 error:
 	if(raw_sock_desc) close(raw_sock_desc);
+	sc_ring_destroy();
 	return -1;
 #endif
 }
@@ -2249,7 +2302,10 @@ static void raw_socket_process(int rank)
 			return;
 		}
 
-	raw_capture_rcv_loop(raw_sock_desc, moni_port_start, moni_port_end,
+	if (moni_capture_on && raw_ring_on)
+		sc_ring_rcv_loop(rank, moni_port_start, moni_port_end);
+	else
+		raw_capture_rcv_loop(raw_sock_desc, moni_port_start, moni_port_end,
 			moni_capture_on ? 0 : 1);
 
 	/* Destroy DB socket */
@@ -2357,6 +2413,8 @@ static void destroy(void)
 		}
 	}
 
+	sc_bulk_destroy();
+
 	/* Destroy DB socket */
 	sipcapture_db_close();
 
@@ -2376,6 +2434,8 @@ static void destroy(void)
                 }
 		close(raw_sock_desc);
 	}
+
+	sc_ring_destroy();
 }
 
 /**
@@ -2744,14 +2804,39 @@ static int sip_capture_store(struct _sipcapture_object *sco,
 	for (i = 1; i < NR_KEYS; i++)
 		db_vals[i].nul = 0;
 
+	/* drop the values of the disabled columns; sc_keys_idx[i] > i */
+	if (sc_keys_no != NR_KEYS - 1)
+		for (i = 0; i < sc_keys_no; i++)
+			db_vals[i + 1] = db_vals[sc_keys_idx[i]];
+
 	ret=1;
 
+	if (bulk_writers) {
+		if (actx) {
+			actx->resume_f     = NULL;
+			actx->resume_param = NULL;
+			async_status  = ASYNC_NO_IO;
+		}
+		if (sc_bulk_queue_row(&current_table, sc_keys, db_vals+1,
+				sc_keys_no) < 0)
+			return -1;
+		goto done;
+	}
+
 	/* each query has it's own parameters for the prepared statements */
-	if (con_set_inslist(&db_funcs,db_con,&sc_ins_list,db_keys+1,NR_KEYS-1) < 0)
+	if (con_set_inslist(&db_funcs,db_con,&sc_ins_list,sc_keys,sc_keys_no) < 0)
 	               CON_RESET_INSLIST(db_con);
 	CON_PS_REFERENCE(db_con) = &sc_ps;
 
-	if (!actx && db_sync_store(db_vals+1, db_keys+1, NR_KEYS-1) != 1) {
+	if (actx && sc_keys_no != NR_KEYS - 1) {
+		/* the raw async query always holds all the columns */
+		actx->resume_f     = NULL;
+		actx->resume_param = NULL;
+		async_status  = ASYNC_NO_IO;
+		actx = NULL;
+	}
+
+	if (!actx && db_sync_store(db_vals+1, sc_keys, sc_keys_no) != 1) {
 		LM_ERR("failed to insert into database\n");
 		return -1;
 	} else if (actx) {
@@ -2759,6 +2844,8 @@ static int sip_capture_store(struct _sipcapture_object *sco,
 				actx, t_el);
 	}
 
+done:
+
 	#ifdef STATISTICS
 		update_stat(sco->stat, 1);
 	#endif
@@ -3164,14 +3251,17 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
 
 	if(msg->first_line.type == SIP_REQUEST) {
 
-		if (parse_sip_msg_uri(msg)<0) return -1;
-
 		sco.method = msg->first_line.u.request.method;
 		EMPTY_STR(sco.reply_reason);
 
 		sco.ruri = msg->first_line.u.request.uri;
-		sco.ruri_user = msg->parsed_uri.user;
-		sco.ruri_domain = msg->parsed_uri.host;
+
+		/* parse only what is stored - the other columns stay empty */
+		if (SC_STORED(ruri_user_column) || SC_STORED(ruri_domain_column)) {
+			if (parse_sip_msg_uri(msg)<0) return -1;
+			sco.ruri_user = msg->parsed_uri.user;
+			sco.ruri_domain = msg->parsed_uri.host;
+		}
 	}
 	else if(msg->first_line.type == SIP_REPLY) {
 		sco.method = msg->first_line.u.reply.status;
@@ -3189,7 +3279,8 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
 	}
 
 	/* Parse FROM */
-        if(msg->from) {
+        if(msg->from && (SC_STORED(from_user_column) ||
+				SC_STORED(from_tag_column) || SC_STORED(from_domain_column))) {
 
               if (parse_from_header(msg)!=0){
                    LM_ERR("bad or missing" " From: header\n");
@@ -3211,7 +3302,8 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
         }
 
         /* Parse TO */
-        if(msg->to) {
+        if(msg->to && (SC_STORED(to_user_column) ||
+				SC_STORED(to_tag_column) || SC_STORED(to_domain_column))) {
 
               if (parse_uri(get_to(msg)->uri.s, get_to(msg)->uri.len, &to)<0){
                     LM_ERR("bad to dropping"" packet\n");
@@ -3234,7 +3326,10 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
 	else { EMPTY_STR(sco.callid); }
 
 	/* P-Asserted-Id */
-	if(msg->pai && (parse_pai_header(msg) == 0)) {
+	if (!SC_STORED(pid_user_column)) {
+		EMPTY_STR(sco.pid_user);
+	}
+	else if(msg->pai && (parse_pai_header(msg) == 0)) {
 
 	     if (parse_uri(get_pai(msg)->uri.s, get_pai(msg)->uri.len, &pai)<0){
              	LM_DBG("bad pai: method:[%.*s] CID: [%.*s]\n", sco.method.len, sco.method.s, sco.callid.len, sco.callid.s);
@@ -3259,13 +3354,14 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
         if(msg->proxy_auth != NULL) hook1 = msg->proxy_auth;
         else if(msg->authorization != NULL) hook1 = msg->authorization;
 
-        if(hook1) {
+        if(hook1 && SC_STORED(auth_user_column)) {
                if(parse_credentials(hook1) == 0)  sco.auth_user = ((auth_body_t*)(hook1->parsed))->digest.username.user;
                else { EMPTY_STR(sco.auth_user); }
         }
         else { EMPTY_STR(sco.auth_user);}
 
-	if(msg->contact) {
+	if(msg->contact && (SC_STORED(contact_ip_column) ||
+			SC_STORED(contact_port_column))) {
 
               if (msg->contact->parsed == 0 && parse_contact(msg->contact) == -1) {
                      LM_ERR("while parsing <Contact:> header\n");
@@ -3285,7 +3381,8 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
 
 	/* get header x-cid: */
 	/* callid_aleg X-CID */
-	if((tmphdr[0] = get_header_by_static_name(msg,"X-CID")) != NULL) {
+	if(SC_STORED(callid_aleg_column) &&
+			(tmphdr[0] = get_header_by_static_name(msg,"X-CID")) != NULL) {
 		sco.callid_aleg = tmphdr[0]->body;
         }
 	else { EMPTY_STR(sco.callid_aleg);}
@@ -3302,7 +3399,8 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
 	else { EMPTY_STR(sco.cseq); }
 
 	/* Reason */
-	if((tmphdr[1] = get_header_by_static_name(msg,"Reason")) != NULL) {
+	if(SC_STORED(reason_column) &&
+			(tmphdr[1] = get_header_by_static_name(msg,"Reason")) != NULL) {
 		sco.reason =  tmphdr[1]->body;
 	}
 	else { EMPTY_STR(sco.reason); }
@@ -3330,7 +3428,8 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
 	}
 
 	/* X-OIP */
-	if((tmphdr[2] = get_header_by_static_name(msg,"X-OIP")) != NULL) {
+	if((SC_STORED(orig_ip_column) || SC_STORED(orig_port_column)) &&
+			(tmphdr[2] = get_header_by_static_name(msg,"X-OIP")) != NULL) {
 		sco.originator_ip = tmphdr[2]->body;
 		/* Originator port. Should be parsed from XOIP header as ":" param */
 		tmp = strchr(tmphdr[2]->body.s, ':');
@@ -3347,7 +3446,10 @@ static int w_sip_capture(struct sip_msg *msg, void *table_name,
 	}
 
 	/* X-RTP-Stat */
-	if((tmphdr[3] = get_header_by_static_name(msg,"X-RTP-Stat")) != NULL) {
+	if (!SC_STORED(rtp_stat_column)) {
+		EMPTY_STR(sco.rtp_stat);
+	}
+	else if((tmphdr[3] = get_header_by_static_name(msg,"X-RTP-Stat")) != NULL) {
 		sco.rtp_stat =  tmphdr[3]->body;
 	}
 	/* P-RTP-Stat */
@@ -4699,6 +4801,16 @@ static int report_capture(struct sip_msg* msg, str* table, str* cor_id,
 	}
 
 	/* each query has it's own parameters for the prepared statements */
+	if (bulk_writers) {
+		if (actx) {
+			actx->resume_f     = NULL;
+			actx->resume_param = NULL;
+			async_status  = ASYNC_NO_IO;
+		}
+		return sc_bulk_queue_row(&current_table, rtcp_db_keys, db_vals,
+				rtp_keys_no);
+	}
+
 	if (con_set_inslist(&db_funcs,db_con,&rc_ins_list,db_keys,NR_KEYS) < 0 )
 	               CON_RESET_INSLIST(db_con);
 	CON_PS_REFERENCE(db_con) = &rc_ps;
@@ -4820,6 +4932,35 @@ static mi_response_t *sip_capture_mi_1(const mi_params_t *params,
 	}
 }
 
+#ifdef __OS_linux
+/* attaches the port/portrange filter to a PF_PACKET socket */
+void raw_capture_bpf(int sock, int port_start, int port_end)
+{
+	struct sock_fprog pf;
+
+	memset(&pf, 0, sizeof(pf));
+	pf.len = sizeof(BPF_code) / sizeof(BPF_code[0]);
+	pf.filter = (struct sock_filter *) BPF_code;
+
+	if(!port_end) port_end = port_start;
+
+	/* Start PORT */
+	BPF_code[5]  = (struct sock_filter)BPF_JUMP(0x35, port_start, 0, 1);
+	BPF_code[8] = (struct  sock_filter)BPF_JUMP(0x35, port_start, 11, 13);
+	BPF_code[16] = (struct sock_filter)BPF_JUMP(0x35, port_start, 0, 1);
+	BPF_code[19] = (struct sock_filter)BPF_JUMP(0x35, port_start, 0, 2);
+	/* Stop PORT */
+	BPF_code[6]  = (struct sock_filter)BPF_JUMP(0x25, port_end, 0, 14);
+	BPF_code[17] = (struct sock_filter)BPF_JUMP(0x25, port_end, 0, 3);
+	BPF_code[20] = (struct sock_filter)BPF_JUMP(0x25, port_end, 1, 0);
+
+	/* Attach the filter to the socket */
+	if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &pf, sizeof(pf)) < 0 ) {
+		LM_ERR("setsockopt filter: [%s] [%d]\n", strerror(errno), errno);
+	}
+}
+#endif
+
 /* Local raw socket */
 int raw_capture_socket(struct ip_addr* ip, str* iface, int port_start, int port_end, int proto)
 {
@@ -4828,7 +4969,6 @@ int raw_capture_socket(struct ip_addr* ip, str* iface, int port_start, int port_
 	union sockaddr_union su;
 
 #ifdef __OS_linux
-	struct sock_fprog pf;
 	char short_ifname[sizeof(int)];
 	int ifname_len;
 	char* ifname;
@@ -4873,29 +5013,8 @@ int raw_capture_socket(struct ip_addr* ip, str* iface, int port_start, int port_
 		}
 	}
 
-	if(bpf_on) {
-
-		memset(&pf, 0, sizeof(pf));
-	        pf.len = sizeof(BPF_code) / sizeof(BPF_code[0]);
-        	pf.filter = (struct sock_filter *) BPF_code;
-
-                if(!port_end) port_end = port_start;
-
-        	/* Start PORT */
-        	BPF_code[5]  = (struct sock_filter)BPF_JUMP(0x35, port_start, 0, 1);
-        	BPF_code[8] = (struct  sock_filter)BPF_JUMP(0x35, port_start, 11, 13);
-        	BPF_code[16] = (struct sock_filter)BPF_JUMP(0x35, port_start, 0, 1);
-        	BPF_code[19] = (struct sock_filter)BPF_JUMP(0x35, port_start, 0, 2);
-        	/* Stop PORT */
-        	BPF_code[6]  = (struct sock_filter)BPF_JUMP(0x25, port_end, 0, 14);
-        	BPF_code[17] = (struct sock_filter)BPF_JUMP(0x25, port_end, 0, 3);
-        	BPF_code[20] = (struct sock_filter)BPF_JUMP(0x25, port_end, 1, 0);
-
-        	/* Attach the filter to the socket */
-        	if(setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &pf, sizeof(pf)) < 0 ) {
-                        LM_ERR("setsockopt filter: [%s] [%d]\n", strerror(errno), errno);
-                }
-        }
+	if(bpf_on)
+		raw_capture_bpf(sock, port_start, port_end);
 #endif
 
         if (ip && proto == IPPROTO_IPIP){
@@ -4931,14 +5050,12 @@ void rpc_msg_received(int sender, void *param)
 	shm_free( ipc_pack );
 }
 
-/* Local raw receive loop */
-int raw_capture_rcv_loop(int rsock, int port1, int port2, int ipip) {
-
-
-	static char buf [BUF_SIZE+1];
+/* handles one captured frame (IPIP or ethernet, from a raw socket or
+ * from the packet ring) and dispatches the SIP payload to a worker */
+void raw_capture_packet(char *buf, int len, int port1, int port2, int ipip)
+{
 	union sockaddr_union from;
 	union sockaddr_union to;
-	int len;
 	struct ip *iph;
 	struct udphdr *udph;
 	char* udph_start;
@@ -4950,107 +5067,120 @@ int raw_capture_rcv_loop(int rsock, int port1, int port2, int ipip) {
 	struct ip_addr dst_ip, src_ip;
 	struct ipc_msg_pack *ipc_pack;
 
+	end=buf+len;
 
-	for(;;) {
-
-		len = recvfrom(rsock, buf, BUF_SIZE, 0, 0, 0);
+	offset =  ipip ? sizeof(struct ip) : ETHHDR;
 
-		if (len<0){
-			if (len==-1){
-				LM_ERR("recvfrom: %s [%d]\n",
-						strerror(errno), errno);
-				if ((errno==EINTR)||(errno==EWOULDBLOCK))
-					continue;
-				else goto error;
-			}else{
-				LM_DBG("recvfrom error: %d\n", len);
-				continue;
-			}
-		}
+	if (len < (sizeof(struct ip)+sizeof(struct udphdr) + offset)) {
+		LM_DBG("received small packet: %d. Ignore it\n",len);
+		return;
+	}
 
-		end=buf+len;
+	iph = (struct ip*) (buf + offset);
 
-		offset =  ipip ? sizeof(struct ip) : ETHHDR;
+	offset+=iph->ip_hl*4;
 
-		if (len < (sizeof(struct ip)+sizeof(struct udphdr) + offset)) {
-			LM_DBG("received small packet: %d. Ignore it\n",len);
-			continue;
-		}
+	udph_start = buf+offset;
 
-		iph = (struct ip*) (buf + offset);
+	udph = (struct udphdr*) udph_start;
+	offset +=sizeof(struct udphdr);
 
-		offset+=iph->ip_hl*4;
+	if ((buf+offset)>end){
+		return;
+	}
 
-		udph_start = buf+offset;
+	/* cut off the offset */
+	len -= offset;
 
-		udph = (struct udphdr*) udph_start;
-		offset +=sizeof(struct udphdr);
+	if (len<MIN_UDP_PACKET){
+		LM_DBG("probing packet received from\n");
+		return;
+	}
 
-		if ((buf+offset)>end){
-			continue;
+	udp_len=ntohs(udph->uh_ulen);
+	if ((udph_start+udp_len)!=end){
+		if ((udph_start+udp_len)>end){
+			return;
+		}else{
+			LM_DBG("udp length too small: %d/%d\n", (int)udp_len, (int)(end-udph_start));
+			return;
 		}
+	}
 
-		/* cut off the offset */
-		len -= offset;
+	/* fill dst_port */
+	dst_port=ntohs(udph->uh_dport);
+	/* fill src_port */
+	src_port=ntohs(udph->uh_sport);
+
+	LM_DBG("PORT: [%d] and [%d]\n", port1, port2);
+
+	/* check the ports before paying for the copy */
+	if (!((!port1 && !port2)
+	|| (src_port >= port1 && src_port <= port2)
+	|| (dst_port >= port1 && dst_port <= port2)
+	|| (!port2 && (src_port == port1 || dst_port == port1))))
+		return;
+
+	ipc_pack = (struct ipc_msg_pack*)shm_malloc( sizeof(struct ipc_msg_pack) + len );
+	if (ipc_pack==NULL) {
+		LM_ERR("failed to allocate new ipc_msg_pack, discarding...\n");
+		return;
+	}
+	memset( ipc_pack, 0, sizeof(struct ipc_msg_pack));
+
+	/* cleaup previous values in dst */
+	memset(&dst_ip, 0, sizeof(dst_ip));
+
+	/*FIL IPs*/
+	dst_ip.af=AF_INET;
+	dst_ip.len=4;
+	dst_ip.u.addr32[0]=iph->ip_dst.s_addr;
+	ip_addr2su(&to, &dst_ip, dst_port);
+	src_ip.af=AF_INET;
+	src_ip.len=4;
+	src_ip.u.addr32[0]=iph->ip_src.s_addr;
+	ip_addr2su(&from, &src_ip, src_port);
+	su_setport(&from, src_port);
+
+	ipc_pack->ri.src_su=from;
+	su2ip_addr(&(ipc_pack->ri.src_ip), &from);
+	ipc_pack->ri.src_port=src_port;
+		su2ip_addr(&(ipc_pack->ri.dst_ip), &to);
+	ipc_pack->ri.dst_port=dst_port;
+	ipc_pack->ri.proto=PROTO_UDP;
+
+	ipc_pack->buf.s = (char*)(ipc_pack+1);
+	ipc_pack->buf.len = len;
+	memcpy( ipc_pack->buf.s, buf+offset, len);
+
+	ipc_dispatch_rpc( rpc_msg_received, ipc_pack);
+}
 
-		if (len<MIN_UDP_PACKET){
-			LM_DBG("probing packet received from\n");
-			continue;
-		}
+/* Local raw receive loop */
+int raw_capture_rcv_loop(int rsock, int port1, int port2, int ipip) {
 
-		udp_len=ntohs(udph->uh_ulen);
-		if ((udph_start+udp_len)!=end){
-			if ((udph_start+udp_len)>end){
-				continue;
+
+	static char buf [BUF_SIZE+1];
+	int len;
+
+	for(;;) {
+
+		len = recvfrom(rsock, buf, BUF_SIZE, 0, 0, 0);
+
+		if (len<0){
+			if (len==-1){
+				LM_ERR("recvfrom: %s [%d]\n",
+						strerror(errno), errno);
+				if ((errno==EINTR)||(errno==EWOULDBLOCK))
+					continue;
+				else goto error;
 			}else{
-				LM_DBG("udp length too small: %d/%d\n", (int)udp_len, (int)(end-udph_start));
+				LM_DBG("recvfrom error: %d\n", len);
 				continue;
 			}
 		}
 
-		ipc_pack = (struct ipc_msg_pack*)shm_malloc( sizeof(struct ipc_msg_pack) + len );
-		if (ipc_pack==NULL) {
-			LM_ERR("failed to allocate new ipc_msg_pack, discarding...\n");
-			continue;
-		}
-		memset( ipc_pack, 0, sizeof(struct ipc_msg_pack) + len);
-
-		/* cleaup previous values in dst */
-		memset(&dst_ip, 0, sizeof(dst_ip));
-
-		/*FIL IPs*/
-		dst_ip.af=AF_INET;
-		dst_ip.len=4;
-		dst_ip.u.addr32[0]=iph->ip_dst.s_addr;
-		/* fill dst_port */
-		dst_port=ntohs(udph->uh_dport);
-		ip_addr2su(&to, &dst_ip, dst_port);
-		/* fill src_port */
-		src_port=ntohs(udph->uh_sport);
-		src_ip.af=AF_INET;
-		src_ip.len=4;
-		src_ip.u.addr32[0]=iph->ip_src.s_addr;
-		ip_addr2su(&from, &src_ip, src_port);
-		su_setport(&from, src_port);
-
-		ipc_pack->ri.src_su=from;
-		su2ip_addr(&(ipc_pack->ri.src_ip), &from);
-		ipc_pack->ri.src_port=src_port;
-			su2ip_addr(&(ipc_pack->ri.dst_ip), &to);
-		ipc_pack->ri.dst_port=dst_port;
-		ipc_pack->ri.proto=PROTO_UDP;
-
-		LM_DBG("PORT: [%d] and [%d]\n", port1, port2);
-
-		ipc_pack->buf.s = (char*)(ipc_pack+1);
-		ipc_pack->buf.len = len;
-		memcpy( ipc_pack->buf.s, buf+offset, len);
-
-		if((!port1 && !port2)
-		|| (src_port >= port1 && src_port <= port2)
-		|| (dst_port >= port1 && dst_port <= port2)
-		|| (!port2 && (src_port == port1 || dst_port == port1)))
-			ipc_dispatch_rpc( rpc_msg_received, ipc_pack);
+		raw_capture_packet(buf, len, port1, port2, ipip);
 	}
 
 	return 0;
@@ -0,0 +1,451 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *
+ * Bulk capture ingestion: the SIP workers only copy the captured rows into
+ * the shm queue of one of the writer processes. Each writer groups the rows
+ * per table (time partition) and inserts them in batches, flushed either
+ * when bulk_batch_size rows piled up or when the oldest row is older than
+ * bulk_flush_interval.
+ */
+
+#include <string.h>
+#include <sys/time.h>
+
+#include "../../dprint.h"
+#include "../../ut.h"
+#include "../../pt.h"
+#include "../../mem/mem.h"
+#include "../../mem/shm_mem.h"
+#include "../../timer.h"
+#include "../../db/db_insertq.h"
+#include "../../lib/writer_queue.h"
+
+#include "sipcapture_bulk.h"
+
+/* an empty batch getting no rows for this long (us) belongs to a time
+ * partition that is no longer current, so it is reused for the next one */
+#define BULK_BATCH_IDLE (60 * 1000000)
+
+struct sc_bulk_row {
+	str table;
+	db_key_t *keys;
+	int n;
+	utime_t queued;
+	db_val_t *vals;
+	struct wq_item link;
+	/* db_val_t[n], table name and string values follow */
+};
+
+#define sc_bulk_row_of(_it) container_of(_it, struct sc_bulk_row, link)
+
+/* rows of the same table and columns, held by a writer until flushed */
+struct sc_bulk_batch {
+	str table;
+	db_key_t *keys;
+	int n;
+	db_ps_t ps;
+	query_list_t *ins_list;
+	struct wq_item *first;
+	struct wq_item *last;
+	int rows;
+	int table_size;
+	utime_t since;         /* when the oldest row was queued */
+	utime_t used;          /* when the last row was added */
+	struct sc_bulk_batch *next;
+};
+
+int bulk_writers = 0;
+int bulk_batch_size = 1000;
+int bulk_flush_interval = 500;
+int bulk_queue_size = 100000;
+
+stat_var *bulk_written_stat;
+stat_var *bulk_dropped_stat;
+stat_var *bulk_failed_stat;
+
+extern db_func_t db_funcs;
+extern db_con_t *db_con;
+int sipcapture_db_init(const str* db_url);
+void sipcapture_db_close(void);
+
+/* one queue per writer */
+static struct writer_queue **bulk_queues;
+static const str *bulk_db_url;
+
+/* writer process only */
+static struct writer_queue *my_queue;
+static struct sc_bulk_batch *bulk_batches;
+
+
+int sc_bulk_init(const str *db_url)
+{
+	int i;
+
+	if (bulk_batch_size <= 0) {
+		LM_ERR("invalid bulk_batch_size %d\n", bulk_batch_size);
+		return -1;
+	}
+	if (bulk_queue_size < bulk_batch_size) {
+		LM_ERR("bulk_queue_size (%d) must not be lower than "
+			"bulk_batch_size (%d)\n", bulk_queue_size, bulk_batch_size);
+		return -1;
+	}
+	if (bulk_flush_interval <= 0)
+		bulk_flush_interval = 500;
+
+	bulk_queues = pkg_malloc(bulk_writers * sizeof *bulk_queues);
+	if (!bulk_queues) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	memset(bulk_queues, 0, bulk_writers * sizeof *bulk_queues);
+
+	for (i = 0; i < bulk_writers; i++) {
+		bulk_queues[i] = wq_create(bulk_queue_size, bulk_batch_size);
+		if (!bulk_queues[i])
+			return -1;
+	}
+
+	bulk_db_url = db_url;
+	return 0;
+}
+
+
+unsigned long sc_bulk_queue_depth(void)
+{
+	unsigned long depth = 0;
+	int i;
+
+	if (bulk_queues)
+		for (i = 0; i < bulk_writers; i++)
+			depth += bulk_queues[i]->depth;
+
+	return depth;
+}
+
+
+unsigned long sc_bulk_flush_latency(void)
+{
+	unsigned long ms = 0;
+	int i;
+
+	/* the slowest writer is the one to watch */
+	if (bulk_queues)
+		for (i = 0; i < bulk_writers; i++)
+			if (bulk_queues[i]->flush_ms > ms)
+				ms = bulk_queues[i]->flush_ms;
+
+	return ms;
+}
+
+
+static inline unsigned int sc_bulk_val_len(const db_val_t *v)
+{
+	if (VAL_NULL(v))
+		return 0;
+
+	switch (VAL_TYPE(v)) {
+		case DB_STR:
+			return VAL_STR(v).len;
+		case DB_STRING:
+			return strlen(VAL_STRING(v)) + 1;
+		case DB_BLOB:
+			return VAL_BLOB(v).len;
+		default:
+			return 0;
+	}
+}
+
+
+int sc_bulk_queue_row(const str *table, db_key_t *keys,
+		const db_val_t *vals, int n)
+{
+	struct writer_queue *q;
+	struct sc_bulk_row *row;
+	unsigned int size, len;
+	char *p;
+	int i, w;
+
+	/* keep the rows of a worker on the same writer, so they are
+	 * inserted in the order they were captured */
+	w = process_no % bulk_writers;
+	q = bulk_queues[w];
+
+	/* cheap check before paying for the copy */
+	if (wq_full(q))
+		goto full;
+
+	size = n * sizeof(db_val_t) + table->len;
+	for (i = 0; i < n; i++)
+		size += sc_bulk_val_len(vals + i);
+
+	row = shm_malloc(sizeof *row + size);
+	if (!row) {
+		LM_ERR("no more shm memory\n");
+		update_stat(bulk_dropped_stat, 1);
+		return -1;
+	}
+
+	row->keys = keys;
+	row->n = n;
+	row->queued = get_uticks();
+	row->vals = (db_val_t *)(row + 1);
+	memcpy(row->vals, vals, n * sizeof(db_val_t));
+
+	p = (char *)(row->vals + n);
+	row->table.s = p;
+	row->table.len = table->len;
+	memcpy(p, table->s, table->len);
+	p += table->len;
+
+	for (i = 0; i < n; i++) {
+		VAL_FREE(row->vals + i) = 0;
+		if ((len = sc_bulk_val_len(vals + i)) == 0)
+			continue;
+		switch (VAL_TYPE(vals + i)) {
+			case DB_STR:
+			case DB_BLOB:
+				memcpy(p, VAL_STR(vals + i).s, len);
+				VAL_STR(row->vals + i).s = p;
+				break;
+			case DB_STRING:
+				memcpy(p, VAL_STRING(vals + i), len);
+				VAL_STRING(row->vals + i) = p;
+				break;
+			default:
+				break;
+		}
+		p += len;
+	}
+
+	if (wq_push(q, &row->link) < 0) {
+		shm_free(row);
+		goto full;
+	}
+
+	return 1;
+full:
+	LM_DBG("capture queue of writer %d is full (%d rows), dropping row\n",
+		w, bulk_queue_size);
+	update_stat(bulk_dropped_stat, 1);
+	return -1;
+}
+
+
+static struct sc_bulk_batch *sc_bulk_get_batch(struct sc_bulk_row *row,
+		utime_t now)
+{
+	struct sc_bulk_batch *b, *idle = NULL;
+	char *s;
+
+	for (b = bulk_batches; b; b = b->next) {
+		if (b->keys != row->keys || b->n != row->n)
+			continue;
+		if (str_strcmp(&b->table, &row->table) == 0)
+			return b;
+		if (!b->rows && now - b->used >= BULK_BATCH_IDLE)
+			idle = b;
+	}
+
+	/* the tables are time partitions - take over the batch of an old one,
+	 * so the list does not grow with every new partition */
+	if (idle) {
+		if (idle->table_size < row->table.len) {
+			s = pkg_realloc(idle->table.s, row->table.len);
+			if (!s) {
+				LM_ERR("no more pkg memory\n");
+				return NULL;
+			}
+			idle->table.s = s;
+			idle->table_size = row->table.len;
+		}
+
+		LM_DBG("batch of table %.*s reused for %.*s\n", idle->table.len,
+			idle->table.s, row->table.len, row->table.s);
+
+		memcpy(idle->table.s, row->table.s, row->table.len);
+		idle->table.len = row->table.len;
+		/* the core insert list is per table */
+		idle->ins_list = NULL;
+		return idle;
+	}
+
+	b = pkg_malloc(sizeof *b);
+	if (!b) {
+		LM_ERR("no more pkg memory\n");
+		return NULL;
+	}
+	memset(b, 0, sizeof *b);
+	b->table.s = pkg_malloc(row->table.len);
+	if (!b->table.s) {
+		LM_ERR("no more pkg memory\n");
+		pkg_free(b);
+		return NULL;
+	}
+	b->table.len = b->table_size = row->table.len;
+	memcpy(b->table.s, row->table.s, row->table.len);
+	b->keys = row->keys;
+	b->n = row->n;
+
+	LM_DBG("new batch for table %.*s\n", b->table.len, b->table.s);
+
+	b->next = bulk_batches;
+	bulk_batches = b;
+	return b;
+}
+
+
+static void sc_bulk_flush(struct sc_bulk_batch *b)
+{
+	struct wq_item *it, *next;
+	struct timeval start, end;
+	int written = 0, failed = 0, no = b->rows;
+
+	gettimeofday(&start, NULL);
+
+	if (db_funcs.use_table(db_con, &b->table) < 0) {
+		LM_ERR("use_table failed for %.*s\n", b->table.len, b->table.s);
+		failed = no;
+		goto done;
+	}
+
+	/* the rows are piled up in the core insert list, so they reach the
+	 * database as multi-row inserts (see query_buffer_size) */
+	if (con_set_inslist(&db_funcs, db_con, &b->ins_list, b->keys, b->n) < 0)
+		b->ins_list = NULL;
+
+	for (it = b->first; it; it = it->next) {
+		if (b->ins_list)
+			db_con->ins_list = b->ins_list;
+		else
+			CON_RESET_INSLIST(db_con);
+		CON_PS_REFERENCE(db_con) = &b->ps;
+
+		if (db_funcs.insert(db_con, b->keys, sc_bulk_row_of(it)->vals,
+		b->n) < 0)
+			failed++;
+		else
+			written++;
+	}
+
+	/* do not leave the tail of the batch in the insert list */
+	if (b->ins_list && ql_flush_rows(&db_funcs, db_con, b->ins_list) < 0) {
+		failed += written;
+		written = 0;
+	}
+	CON_RESET_INSLIST(db_con);
+
+done:
+	gettimeofday(&end, NULL);
+
+	for (it = b->first; it; it = next) {
+		next = it->next;
+		shm_free(sc_bulk_row_of(it));
+	}
+	b->first = b->last = NULL;
+	b->rows = 0;
+
+	my_queue->flush_ms = (end.tv_sec - start.tv_sec) * 1000 +
+		(end.tv_usec - start.tv_usec) / 1000;
+	wq_done(my_queue, no);
+
+	if (written)
+		update_stat(bulk_written_stat, written);
+	if (failed) {
+		update_stat(bulk_failed_stat, failed);
+		LM_ERR("failed to insert %d rows into %.*s\n", failed,
+			b->table.len, b->table.s);
+	}
+}
+
+
+void sc_bulk_writer_proc(int rank)
+{
+	struct sc_bulk_batch *b;
+	struct sc_bulk_row *row;
+	struct wq_item *it, *last, *next;
+	utime_t now, max_age;
+	unsigned int n;
+
+	if (sipcapture_db_init(bulk_db_url) < 0) {
+		LM_ERR("could not open database connection\n");
+		return;
+	}
+
+	my_queue = bulk_queues[rank];
+	max_age = (utime_t)bulk_flush_interval * 1000;
+
+	for (;;) {
+		wq_wait(my_queue, bulk_flush_interval);
+
+		now = get_uticks();
+		for (it = wq_take(my_queue, 0, &last, &n); it; it = next) {
+			next = it->next;
+			it->next = NULL;
+			row = sc_bulk_row_of(it);
+
+			b = sc_bulk_get_batch(row, now);
+			if (!b) {
+				shm_free(row);
+				update_stat(bulk_failed_stat, 1);
+				wq_done(my_queue, 1);
+				continue;
+			}
+
+			if (b->last)
+				b->last->next = it;
+			else {
+				b->first = it;
+				b->since = row->queued;
+			}
+			b->last = it;
+			b->used = now;
+
+			if (++b->rows >= bulk_batch_size)
+				sc_bulk_flush(b);
+		}
+
+		now = get_uticks();
+		for (b = bulk_batches; b; b = b->next)
+			if (b->rows && now - b->since >= max_age)
+				sc_bulk_flush(b);
+	}
+
+	sipcapture_db_close();
+}
+
+
+void sc_bulk_destroy(void)
+{
+	int i;
+
+	if (!bulk_queues)
+		return;
+
+	for (i = 0; i < bulk_writers && bulk_queues[i]; i++) {
+		if (bulk_queues[i]->depth)
+			LM_WARN("%u captured rows of writer %d were not written to "
+				"the database\n", bulk_queues[i]->depth, i);
+		wq_destroy(bulk_queues[i]);
+	}
+
+	pkg_free(bulk_queues);
+	bulk_queues = NULL;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SIPCAPTURE_BULK_H
+#define _SIPCAPTURE_BULK_H
+
+#include "../../str.h"
+#include "../../db/db.h"
+#include "../../statistics.h"
+
+extern int bulk_writers;
+extern int bulk_batch_size;
+extern int bulk_flush_interval;
+extern int bulk_queue_size;
+
+extern stat_var *bulk_written_stat;
+extern stat_var *bulk_dropped_stat;
+extern stat_var *bulk_failed_stat;
+
+int sc_bulk_init(const str *db_url);
+void sc_bulk_destroy(void);
+
+/* copies the row into the queue of one of the writers;
+ * 'keys' must stay valid in all the processes (module globals) */
+int sc_bulk_queue_row(const str *table, db_key_t *keys,
+		const db_val_t *vals, int n);
+
+void sc_bulk_writer_proc(int rank);
+
+unsigned long sc_bulk_queue_depth(void);
+unsigned long sc_bulk_flush_latency(void);
+
+#endif
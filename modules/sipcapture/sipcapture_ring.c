@@ -0,0 +1,301 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ *
+ *
+ * Packet ring capture for the mirroring mode: each RAW receiver reads the
+ * frames straight from its own TPACKET_V3 ring, mapped in the process
+ * memory, and the kernel spreads the traffic over the rings (per flow)
+ * with PACKET_FANOUT, so the receivers do not compete for one socket.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../../dprint.h"
+#include "../../mem/mem.h"
+
+#include "sipcapture_ring.h"
+
+int raw_ring_on = 0;
+int raw_ring_blocks = 32;
+int raw_ring_block_size = 1 << 20;
+
+#ifdef __OS_linux
+#include <poll.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#endif
+
+#if defined(__OS_linux) && defined(TPACKET3_HDRLEN)
+
+#define RING_FRAME_SIZE   2048
+#define RING_BLOCK_TMO_MS 10
+
+struct sc_ring {
+	int fd;
+	char *map;
+	unsigned int cur;
+};
+
+void raw_capture_bpf(int sock, int port_start, int port_end);
+void raw_capture_packet(char *buf, int len, int port1, int port2, int ipip);
+
+extern int bpf_on;
+
+static struct sc_ring *rings;
+static int rings_no;
+
+
+static int sc_ring_open(struct sc_ring *r, int ifindex, int fanout,
+		int port_start, int port_end)
+{
+	struct tpacket_req3 req;
+	struct sockaddr_ll ll;
+	int val;
+
+	r->fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_IP));
+	if (r->fd < 0) {
+		LM_ERR("failed to create packet socket: %s (%d)\n",
+			strerror(errno), errno);
+		return -1;
+	}
+
+	val = TPACKET_V3;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_VERSION, &val, sizeof val) < 0) {
+		LM_ERR("TPACKET_V3 not supported: %s (%d)\n", strerror(errno), errno);
+		return -1;
+	}
+
+	/* filter before the ring exists, so nothing else gets in */
+	if (bpf_on)
+		raw_capture_bpf(r->fd, port_start, port_end);
+
+	memset(&req, 0, sizeof req);
+	req.tp_block_size = raw_ring_block_size;
+	req.tp_block_nr = raw_ring_blocks;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (raw_ring_block_size / RING_FRAME_SIZE) * raw_ring_blocks;
+	/* hand over partially filled blocks too, not to delay quiet links */
+	req.tp_retire_blk_tov = RING_BLOCK_TMO_MS;
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof req) < 0) {
+		LM_ERR("failed to set up the packet ring (%d x %d bytes): %s (%d)\n",
+			raw_ring_blocks, raw_ring_block_size, strerror(errno), errno);
+		return -1;
+	}
+
+	r->map = mmap(NULL, (size_t)raw_ring_block_size * raw_ring_blocks,
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_LOCKED, r->fd, 0);
+	if (r->map == MAP_FAILED) {
+		/* MAP_LOCKED may be over RLIMIT_MEMLOCK - not critical */
+		r->map = mmap(NULL, (size_t)raw_ring_block_size * raw_ring_blocks,
+			PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, 0);
+		if (r->map == MAP_FAILED) {
+			r->map = NULL;
+			LM_ERR("failed to map the packet ring: %s (%d)\n",
+				strerror(errno), errno);
+			return -1;
+		}
+	}
+	r->cur = 0;
+
+	memset(&ll, 0, sizeof ll);
+	ll.sll_family = AF_PACKET;
+	ll.sll_protocol = htons(ETH_P_IP);
+	ll.sll_ifindex = ifindex;
+	if (bind(r->fd, (struct sockaddr *)&ll, sizeof ll) < 0) {
+		LM_ERR("failed to bind the packet socket: %s (%d)\n",
+			strerror(errno), errno);
+		return -1;
+	}
+
+	/* keep the fragments of a datagram on the same ring */
+	val = (int)(fanout | (unsigned int)(PACKET_FANOUT_HASH |
+		PACKET_FANOUT_FLAG_DEFRAG) << 16);
+	if (setsockopt(r->fd, SOL_PACKET, PACKET_FANOUT, &val, sizeof val) < 0) {
+		LM_ERR("failed to join fanout group %d: %s (%d)\n", fanout,
+			strerror(errno), errno);
+		return -1;
+	}
+
+	return 0;
+}
+
+
+int sc_ring_init(str *iface, int rings_nr, int port_start, int port_end)
+{
+	char ifname[IFNAMSIZ];
+	int ifindex = 0, fanout, i;
+	long page = sysconf(_SC_PAGESIZE);
+
+	if (raw_ring_block_size <= 0 || raw_ring_block_size % page ||
+	raw_ring_block_size % RING_FRAME_SIZE) {
+		LM_ERR("raw_ring_block_size (%d) must be a multiple of the page "
+			"size (%ld)\n", raw_ring_block_size, page);
+		return -1;
+	}
+	if (raw_ring_blocks <= 0) {
+		LM_ERR("invalid raw_ring_blocks %d\n", raw_ring_blocks);
+		return -1;
+	}
+	if (rings_nr <= 0) {
+		LM_ERR("no RAW receiver to read the packet rings\n");
+		return -1;
+	}
+
+	if (iface && iface->len) {
+		if (iface->len >= IFNAMSIZ) {
+			LM_ERR("interface name too long: %.*s\n", iface->len, iface->s);
+			return -1;
+		}
+		memcpy(ifname, iface->s, iface->len);
+		ifname[iface->len] = 0;
+		ifindex = if_nametoindex(ifname);
+		if (!ifindex) {
+			LM_ERR("unknown interface %s\n", ifname);
+			return -1;
+		}
+	}
+
+	rings = pkg_malloc(rings_nr * sizeof *rings);
+	if (!rings) {
+		LM_ERR("no more pkg memory\n");
+		return -1;
+	}
+	memset(rings, 0, rings_nr * sizeof *rings);
+	for (i = 0; i < rings_nr; i++)
+		rings[i].fd = -1;
+	rings_no = rings_nr;
+
+	/* fanout groups are global to the host - keep ours per instance */
+	fanout = getpid() & 0xffff;
+
+	for (i = 0; i < rings_nr; i++)
+		if (sc_ring_open(rings + i, ifindex, fanout, port_start, port_end) < 0)
+			goto error;
+
+	LM_INFO("capturing on %d packet rings of %d x %d bytes\n", rings_nr,
+		raw_ring_blocks, raw_ring_block_size);
+
+	return rings[0].fd;
+
+error:
+	for (i = 0; i < rings_nr; i++) {
+		if (rings[i].map)
+			munmap(rings[i].map, (size_t)raw_ring_block_size * raw_ring_blocks);
+		if (rings[i].fd >= 0)
+			close(rings[i].fd);
+	}
+	pkg_free(rings);
+	rings = NULL;
+	rings_no = 0;
+	return -1;
+}
+
+
+int sc_ring_rcv_loop(int rank, int port1, int port2)
+{
+	struct sc_ring *r;
+	struct tpacket_block_desc *bd;
+	struct tpacket3_hdr *ph;
+	struct pollfd pfd;
+	unsigned int i;
+
+	if (rank >= rings_no) {
+		LM_ERR("no packet ring for RAW receiver %d\n", rank);
+		return -1;
+	}
+	r = rings + rank;
+
+	pfd.fd = r->fd;
+	pfd.events = POLLIN | POLLERR;
+
+	for (;;) {
+		bd = (struct tpacket_block_desc *)
+			(r->map + (size_t)r->cur * raw_ring_block_size);
+
+		if (!(bd->hdr.bh1.block_status & TP_STATUS_USER)) {
+			if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+				LM_ERR("poll: %s [%d]\n", strerror(errno), errno);
+				return -1;
+			}
+			continue;
+		}
+
+		ph = (struct tpacket3_hdr *)((char *)bd +
+			bd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < bd->hdr.bh1.num_pkts; i++) {
+			raw_capture_packet((char *)ph + ph->tp_mac, ph->tp_snaplen,
+				port1, port2, 0);
+			ph = (struct tpacket3_hdr *)((char *)ph + ph->tp_next_offset);
+		}
+
+		/* give the block back to the kernel */
+		__sync_synchronize();
+		bd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+		r->cur = (r->cur + 1) % raw_ring_blocks;
+	}
+
+	return 0;
+}
+
+
+void sc_ring_destroy(void)
+{
+	int i;
+
+	if (!rings)
+		return;
+
+	for (i = 0; i < rings_no; i++) {
+		if (rings[i].map)
+			munmap(rings[i].map, (size_t)raw_ring_block_size * raw_ring_blocks);
+		/* the first socket is owned by the caller */
+		if (i && rings[i].fd >= 0)
+			close(rings[i].fd);
+	}
+
+	pkg_free(rings);
+	rings = NULL;
+	rings_no = 0;
+}
+
+#else
+
+int sc_ring_init(str *iface, int rings_nr, int port_start, int port_end)
+{
+	LM_ERR("packet ring capture is supported only on Linux, "
+		"with TPACKET_V3\n");
+	return -1;
+}
+
+int sc_ring_rcv_loop(int rank, int port1, int port2)
+{
+	return -1;
+}
+
+void sc_ring_destroy(void)
+{
+}
+
+#endif
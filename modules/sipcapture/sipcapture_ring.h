@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2026 OpenSIPS Solutions
+ *
+ * This file is part of opensips, a free SIP server.
+ *
+ * opensips is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * opensips is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#ifndef _SIPCAPTURE_RING_H
+#define _SIPCAPTURE_RING_H
+
+#include "../../str.h"
+
+extern int raw_ring_on;
+extern int raw_ring_blocks;
+extern int raw_ring_block_size;
+
+/* opens one TPACKET_V3 ring per RAW receiver, all in the same fanout
+ * group; returns the socket of the first ring, which the caller owns */
+int sc_ring_init(str *iface, int rings, int port_start, int port_end);
+
+/* reads the ring of the given RAW receiver, never returns on success */
+int sc_ring_rcv_loop(int rank, int port1, int port2);
+
+/* unmaps the rings and closes all their sockets but the first one */
+void sc_ring_destroy(void);
+
+#endif
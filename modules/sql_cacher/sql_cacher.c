@@ -23,6 +23,10 @@
  *  2015-09-xx  initial version (Vlad Patrascu)
 */
 
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
 #include "../../sr_module.h"
 #include "../../dprint.h"
 #include "../../mem/mem.h"
@@ -33,6 +37,8 @@
 #include "../../rw_locking.h"
 #include "../../timer.h"
 #include "../../ipc.h"
+#include "../../async.h"
+#include "../../strcommon.h"
 #include "sql_cacher.h"
 
 static int mod_init(void);
@@ -44,6 +50,8 @@ int pv_init_param(pv_spec_p sp, int param);
 int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t *res);
 static int parse_cache_entry(unsigned int type, void *val);
 static void free_c_entry(cache_entry_t *c);
+static int w_async_load_key(struct sip_msg *msg, async_ctx *ctx,
+								str *id, str *key);
 
 static mi_response_t *mi_reload_1(const mi_params_t *params,
 								struct mi_handler *async_hdl);
@@ -56,6 +64,7 @@ static str columns_delimiter = str_init(DEFAULT_COLUMNS_DELIM);
 static int fetch_nr_rows = DEFAULT_FETCH_NR_ROWS;
 static int full_caching_expire = DEFAULT_FULL_CACHING_EXPIRE;
 static int reload_interval = DEFAULT_RELOAD_INTERVAL;
+static int store_hash_size = DEFAULT_STORE_HASH_SIZE;
 
 static cache_entry_t **entry_list;
 static struct queried_key **queries_in_progress;
@@ -73,10 +82,18 @@ static param_export_t mod_params[] = {
 	{"sql_fetch_nr_rows", INT_PARAM, &fetch_nr_rows},
 	{"full_caching_expire", INT_PARAM, &full_caching_expire},
 	{"reload_interval", INT_PARAM, &reload_interval},
+	{"store_hash_size", INT_PARAM, &store_hash_size},
 	{"cache_table", STR_PARAM|USE_FUNC_PARAM, (void *)&parse_cache_entry},
 	{0,0,0}
 };
 
+static acmd_export_t acmds[] = {
+	{"sql_cacher_load", (acmd_function)w_async_load_key, {
+		{CMD_PARAM_STR, 0, 0},
+		{CMD_PARAM_STR, 0, 0}, {0, 0, 0}}},
+	{0, 0, {{0, 0, 0}}}
+};
+
 static pv_export_t mod_items[] = {
 	{{"sql_cached_value", sizeof("sql_cached_value") - 1}, 1000,
 		pv_get_sql_cached_value, 0, pv_parse_name, 0, 0, 0},
@@ -95,7 +112,7 @@ static mi_export_t mi_cmds[] = {
 static dep_export_t deps = {
 	{ /* OpenSIPS module dependencies */
 		{ MOD_TYPE_SQLDB, NULL, DEP_ABORT },
-		{ MOD_TYPE_CACHEDB, NULL, DEP_ABORT },
+		{ MOD_TYPE_CACHEDB, NULL, DEP_SILENT },
 		{ MOD_TYPE_NULL, NULL, 0 },
 	},
 	{ /* modparam dependencies */
@@ -114,7 +131,7 @@ struct module_exports exports = {
 	0,							/* load function */
 	&deps,						/* OpenSIPS module dependencies */
 	0,							/* exported functions */
-	0,							/* exported async functions */
+	acmds,						/* exported async functions */
 	mod_params,					/* exported parameters */
 	0,							/* exported statistics */
 	mi_cmds,					/* exported MI functions */
@@ -159,7 +176,9 @@ static int parse_cache_entry(unsigned int type, void *val)
 			LM_ERR("No more memory for cache entry struct\n");
 			return -1;
 		}
+		memset(new_entry, 0, sizeof(cache_entry_t));
 		new_entry->id.s = NULL;
+		new_entry->cachedb_url.s = NULL;
 		new_entry->columns = NULL;
 		new_entry->nr_columns = 0;
 		new_entry->on_demand = 0;
@@ -211,11 +230,13 @@ static int parse_cache_entry(unsigned int type, void *val)
 		/* parse the db_url */
 		p1 = tmp + 1;
 		PARSE_TOKEN(p1, p2, db_url, DB_URL_STR, DB_URL_LEN);
-		/* parse the cachedb_url */
+		/* parse the cachedb_url, if missing use the native shm store */
 		p1 = tmp + 1;
-		PARSE_TOKEN(p1, p2, cachedb_url, CACHEDB_URL_STR, CACHEDB_URL_LEN);
+		if (!memcmp(p1, CACHEDB_URL_STR, CACHEDB_URL_LEN)) {
+			PARSE_TOKEN(p1, p2, cachedb_url, CACHEDB_URL_STR, CACHEDB_URL_LEN);
+			p1 = tmp + 1;
+		}
 		/* parse the table name */
-		p1 = tmp + 1;
 		PARSE_TOKEN(p1, p2, table, TABLE_STR, TABLE_STR_LEN);
 #undef PARSE_TOKEN
 
@@ -482,14 +503,315 @@ static unsigned int get_cdb_val_size(cache_entry_t *c_entry, db_val_t *values, i
 	return len;
 }
 
+/* make sure the key is string; integer keys are printed in a static buffer */
+static int get_key_str(db_val_t *key, str *str_key)
+{
+	switch (VAL_TYPE(key)) {
+		case DB_STRING:
+			str_key->s = (char *)VAL_STRING(key);
+			str_key->len = strlen(str_key->s);
+			break;
+		case DB_STR:
+			*str_key = VAL_STR(key);
+			break;
+		case DB_BLOB:
+			*str_key = VAL_BLOB(key);
+			break;
+		case DB_INT:
+			str_key->s = sint2str(VAL_INT(key), &str_key->len);
+			break;
+		case DB_BIGINT:
+			str_key->s = sint2str((int)VAL_BIGINT(key), &str_key->len);
+			break;
+		case DB_DOUBLE:
+			str_key->s = sint2str((int)VAL_DOUBLE(key), &str_key->len);
+			break;
+		default:
+			LM_ERR("Unsupported type for SQL DB key column\n");
+			return -1;
+	}
+
+	return 0;
+}
+
+/* builds a row of the native store; with no @values, the row records that
+ * the key was not found in the SQL table */
+static sc_row_t *new_store_row(str *key, db_val_t *values, int nr_columns)
+{
+	sc_row_t *row;
+	str str_val;
+	char *p;
+	int i, len;
+
+	len = sizeof(sc_row_t) + nr_columns * sizeof(sc_val_t) + key->len;
+	for (i = 0; i < nr_columns; i++) {
+		if (VAL_NULL(values + i))
+			continue;
+		switch (VAL_TYPE(values + i)) {
+			case DB_STRING:
+				len += strlen(VAL_STRING(values + i));
+				break;
+			case DB_STR:
+				len += VAL_STR(values + i).len;
+				break;
+			case DB_BLOB:
+				len += VAL_BLOB(values + i).len;
+				break;
+			default: continue;
+		}
+	}
+
+	row = shm_malloc(len);
+	if (!row) {
+		LM_ERR("No more shm memory\n");
+		return NULL;
+	}
+	memset(row, 0, sizeof(sc_row_t) + nr_columns * sizeof(sc_val_t));
+
+	p = (char *)(row->vals + nr_columns);
+	row->key.s = p;
+	row->key.len = key->len;
+	memcpy(p, key->s, key->len);
+	p += key->len;
+
+	if (!values) {
+		row->not_found = 1;
+		return row;
+	}
+
+	for (i = 0; i < nr_columns; i++) {
+		if (VAL_NULL(values + i)) {
+			row->nulls |= (1LL << i);
+			continue;
+		}
+
+		switch (VAL_TYPE(values + i)) {
+			case DB_INT:
+				row->vals[i].n = VAL_INT(values + i);
+				continue;
+			case DB_BIGINT:
+				row->vals[i].n = (int)VAL_BIGINT(values + i);
+				continue;
+			case DB_DOUBLE:
+				row->vals[i].n = (int)VAL_DOUBLE(values + i);
+				continue;
+			case DB_STRING:
+				str_val.s = (char *)VAL_STRING(values + i);
+				str_val.len = strlen(str_val.s);
+				break;
+			case DB_STR:
+				str_val = VAL_STR(values + i);
+				break;
+			case DB_BLOB:
+				str_val = VAL_BLOB(values + i);
+				break;
+			default:
+				LM_ERR("Unsupported type: %d for column: %d\n",
+					VAL_TYPE(values + i), i);
+				shm_free(row);
+				return NULL;
+		}
+
+		row->vals[i].s.s = p;
+		row->vals[i].s.len = str_val.len;
+		memcpy(p, str_val.s, str_val.len);
+		p += str_val.len;
+	}
+
+	return row;
+}
+
+static sc_table_t *new_store_table(unsigned int size)
+{
+	sc_table_t *table;
+
+	table = shm_malloc(sizeof(sc_table_t) + size * sizeof(sc_row_t *));
+	if (!table) {
+		LM_ERR("No more shm memory\n");
+		return NULL;
+	}
+	memset(table, 0, sizeof(sc_table_t) + size * sizeof(sc_row_t *));
+
+	table->size = size;
+	table->buckets = (sc_row_t **)(table + 1);
+
+	return table;
+}
+
+static void free_store_table(sc_table_t *table)
+{
+	sc_row_t *row, *next;
+	unsigned int i;
+
+	if (!table)
+		return;
+
+	for (i = 0; i < table->size; i++)
+		for (row = table->buckets[i]; row; row = next) {
+			next = row->next;
+			shm_free(row);
+		}
+
+	shm_free(table);
+}
+
+/* looks up @key in the store; in on demand mode the bucket lock must be held
+ * and the expired rows or the ones older than @rld_vers are dropped */
+static sc_row_t *store_lookup(cache_entry_t *c_entry, sc_table_t *table,
+						unsigned int hash, str *key, int rld_vers)
+{
+	sc_row_t *row, **prev;
+
+	for (prev = &table->buckets[hash]; (row = *prev); prev = &row->next)
+		if (row->key.len == key->len && !memcmp(row->key.s, key->s, key->len))
+			break;
+
+	if (row && c_entry->on_demand && (row->rld_vers != rld_vers ||
+		(row->expires && row->expires < get_ticks()))) {
+		*prev = row->next;
+		shm_free(row);
+		return NULL;
+	}
+
+	return row;
+}
+
+/* caches a loaded key in on demand mode */
+static int insert_in_store(cache_entry_t *c_entry, db_val_t *key,
+				db_val_t *values, int rld_vers, int nr_columns)
+{
+	sc_table_t *table = c_entry->store;
+	sc_row_t *row, *old, **prev;
+	unsigned int hash;
+	str str_key;
+
+	if (get_key_str(key, &str_key) < 0)
+		return -1;
+
+	row = new_store_row(&str_key, values, values ? nr_columns : 0);
+	if (!row)
+		return -1;
+	row->rld_vers = rld_vers;
+	row->expires = get_ticks() + c_entry->expire;
+
+	hash = core_hash(&str_key, NULL, table->size);
+	lock_set_get(c_entry->store_locks, hash);
+
+	/* a reload happened while the key was being queried */
+	if (rld_vers != c_entry->rld_vers) {
+		lock_set_release(c_entry->store_locks, hash);
+		shm_free(row);
+		return 0;
+	}
+
+	/* drop the previous row of the key, if any */
+	for (prev = &table->buckets[hash]; (old = *prev); prev = &old->next)
+		if (old->key.len == str_key.len &&
+			!memcmp(old->key.s, str_key.s, str_key.len)) {
+			*prev = old->next;
+			shm_free(old);
+			break;
+		}
+
+	row->next = table->buckets[hash];
+	table->buckets[hash] = row;
+
+	lock_set_release(c_entry->store_locks, hash);
+
+	return 0;
+}
+
+/*  return:
+ *  0 - succes => if str column, the value is copied into @buf
+ *  1 - succes, null value in db
+ * -1 - error
+ * -2 - not found in sql db
+ *  3 - not cached
+ */
+static int store_fetch(pv_name_fix_t *pv_name, int rld_vers, str *buf,
+							str *str_res, int *int_res)
+{
+	cache_entry_t *c_entry = pv_name->c_entry;
+	sc_row_t *row;
+	unsigned int hash = 0;
+	int rc;
+
+	if (c_entry->on_demand) {
+		hash = core_hash(&pv_name->key, NULL, c_entry->store->size);
+		lock_set_get(c_entry->store_locks, hash);
+	} else {
+		lock_start_read(c_entry->ref_lock);
+		if (!c_entry->store) {
+			lock_stop_read(c_entry->ref_lock);
+			return 3;
+		}
+		hash = core_hash(&pv_name->key, NULL, c_entry->store->size);
+	}
+
+	row = store_lookup(c_entry, c_entry->store, hash, &pv_name->key, rld_vers);
+	if (!row) {
+		rc = 3;
+	} else if (row->not_found) {
+		rc = -2;
+	} else if (row->nulls & (1LL << pv_name->col_nr)) {
+		rc = 1;
+	} else if (is_str_column(pv_name)) {
+		rc = 0;
+		str_res->len = row->vals[pv_name->col_nr].s.len;
+		if (pkg_str_extend(buf, str_res->len) != 0) {
+			LM_ERR("failed to alloc buffer\n");
+			rc = -1;
+		} else {
+			str_res->s = buf->s;
+			memcpy(str_res->s, row->vals[pv_name->col_nr].s.s, str_res->len);
+		}
+	} else {
+		rc = 0;
+		*int_res = row->vals[pv_name->col_nr].n;
+	}
+
+	if (c_entry->on_demand)
+		lock_set_release(c_entry->store_locks, hash);
+	else
+		lock_stop_read(c_entry->ref_lock);
+
+	return rc;
+}
+
+/* drops the expired and outdated rows of the on demand stores */
+static void store_clean_timer(unsigned int ticks, void *param)
+{
+	cache_entry_t *c_entry;
+	sc_row_t *row, **prev;
+	unsigned int i;
+
+	for (c_entry = *entry_list; c_entry; c_entry = c_entry->next) {
+		if (!is_shm_store(c_entry) || !c_entry->on_demand)
+			continue;
+
+		for (i = 0; i < c_entry->store->size; i++) {
+			lock_set_get(c_entry->store_locks, i);
+			for (prev = &c_entry->store->buckets[i]; (row = *prev); ) {
+				if (row->rld_vers != c_entry->rld_vers ||
+					(row->expires && row->expires < ticks)) {
+					*prev = row->next;
+					shm_free(row);
+				} else {
+					prev = &row->next;
+				}
+			}
+			lock_set_release(c_entry->store_locks, i);
+		}
+	}
+}
+
 static int insert_in_cachedb(cache_entry_t *c_entry, db_handlers_t *db_hdls,
 			db_val_t *key, db_val_t *values, int reload_version, int nr_columns)
 {
 	unsigned int i, offset = 0, strs_offset = 0;
 	int int_val;
-	int int_key_len = 0, rc = 0;
+	int rc = 0;
 	char int_buf[4], int_enc_buf[INT_B64_ENC_LEN];
-	char *int_key_buf = NULL;
 	str str_val;
 	db_type_t val_type;
 	str str_key = STR_NULL;
@@ -572,38 +894,9 @@ static int insert_in_cachedb(cache_entry_t *c_entry, db_handlers_t *db_hdls,
 		strs_offset += str_val.len;
 	}
 
-	/* make sure the key is string */
-	val_type = VAL_TYPE(key);
-	switch (val_type) {
-		case DB_STRING:
-			str_key.s = (char *)VAL_STRING(key);
-			str_key.len = strlen(str_key.s);
-			break;
-		case DB_STR:
-			str_key = VAL_STR(key);
-			break;
-		case DB_BLOB:
-			str_key = VAL_BLOB(key);
-			break;
-		case DB_INT:
-			int_key_buf = sint2str(VAL_INT(key), &int_key_len);
-			break;
-		case DB_BIGINT:
-			int_val = (int)VAL_BIGINT(key);
-			int_key_buf = sint2str(int_val, &int_key_len);
-			break;
-		case DB_DOUBLE:
-			int_val = (int)VAL_DOUBLE(key);
-			int_key_buf = sint2str(int_val, &int_key_len);
-			break;
-		default:
-			LM_ERR("Unsupported type for SQL DB key column\n");
-			rc = -1;
-			goto out;
-	}
-	if (int_key_len) {
-		str_key.s = int_key_buf;
-		str_key.len = int_key_len;
+	if (get_key_str(key, &str_key) < 0) {
+		rc = -1;
+		goto out;
 	}
 
 	cdb_key.len = c_entry->id.len + str_key.len;
@@ -652,42 +945,44 @@ static db_handlers_t *db_init_test_conn(cache_entry_t *c_entry)
 	new_db_hdls->cdbcon = 0;
 
 	/* cachedb init and test connection */
-	if (cachedb_bind_mod(&c_entry->cachedb_url, &new_db_hdls->cdbf) < 0) {
-		LM_ERR("Unable to bind to a cachedb database driver for URL: %.*s\n",
-			c_entry->cachedb_url.len, c_entry->cachedb_url.s);
-		return NULL;
-	}
-	/* open a test connection */
-	new_db_hdls->cdbcon = new_db_hdls->cdbf.init(&c_entry->cachedb_url);
-	if (!new_db_hdls->cdbcon) {
-		LM_ERR("Cannot init connection to cachedb: %.*s\n",
-			c_entry->cachedb_url.len, c_entry->cachedb_url.s);
-		return NULL;
-	}
-	/* setting and getting a test key in cachedb */
-	if (new_db_hdls->cdbf.set(new_db_hdls->cdbcon, &cdb_test_key, &cdb_test_val,
-		0) < 0) {
-		LM_ERR("Failed to set test key in cachedb: %.*s\n",
-			c_entry->cachedb_url.len, c_entry->cachedb_url.s);
-		new_db_hdls->cdbf.destroy(new_db_hdls->cdbcon);
-		new_db_hdls->cdbcon = 0;
-		return NULL;
-	}
-	if (new_db_hdls->cdbf.get(new_db_hdls->cdbcon, &cdb_test_key, &cachedb_res) < 0) {
-		LM_ERR("Failed to get test key from cachedb: %.*s\n",
-			c_entry->cachedb_url.len, c_entry->cachedb_url.s);
-		new_db_hdls->cdbf.destroy(new_db_hdls->cdbcon);
-		new_db_hdls->cdbcon = 0;
-		return NULL;
-	}
-	rc = str_strcmp(&cachedb_res, &cdb_test_val);
-	pkg_free(cachedb_res.s);
-	if (rc != 0) {
-		LM_ERR("Inconsistent test key for cachedb: %.*s\n",
-			c_entry->cachedb_url.len, c_entry->cachedb_url.s);
-		new_db_hdls->cdbf.destroy(new_db_hdls->cdbcon);
-		new_db_hdls->cdbcon = 0;
-		return NULL;
+	if (!is_shm_store(c_entry)) {
+		if (cachedb_bind_mod(&c_entry->cachedb_url, &new_db_hdls->cdbf) < 0) {
+			LM_ERR("Unable to bind to a cachedb database driver for URL: %.*s\n",
+				c_entry->cachedb_url.len, c_entry->cachedb_url.s);
+			return NULL;
+		}
+		/* open a test connection */
+		new_db_hdls->cdbcon = new_db_hdls->cdbf.init(&c_entry->cachedb_url);
+		if (!new_db_hdls->cdbcon) {
+			LM_ERR("Cannot init connection to cachedb: %.*s\n",
+				c_entry->cachedb_url.len, c_entry->cachedb_url.s);
+			return NULL;
+		}
+		/* setting and getting a test key in cachedb */
+		if (new_db_hdls->cdbf.set(new_db_hdls->cdbcon, &cdb_test_key, &cdb_test_val,
+			0) < 0) {
+			LM_ERR("Failed to set test key in cachedb: %.*s\n",
+				c_entry->cachedb_url.len, c_entry->cachedb_url.s);
+			new_db_hdls->cdbf.destroy(new_db_hdls->cdbcon);
+			new_db_hdls->cdbcon = 0;
+			return NULL;
+		}
+		if (new_db_hdls->cdbf.get(new_db_hdls->cdbcon, &cdb_test_key, &cachedb_res) < 0) {
+			LM_ERR("Failed to get test key from cachedb: %.*s\n",
+				c_entry->cachedb_url.len, c_entry->cachedb_url.s);
+			new_db_hdls->cdbf.destroy(new_db_hdls->cdbcon);
+			new_db_hdls->cdbcon = 0;
+			return NULL;
+		}
+		rc = str_strcmp(&cachedb_res, &cdb_test_val);
+		pkg_free(cachedb_res.s);
+		if (rc != 0) {
+			LM_ERR("Inconsistent test key for cachedb: %.*s\n",
+				c_entry->cachedb_url.len, c_entry->cachedb_url.s);
+			new_db_hdls->cdbf.destroy(new_db_hdls->cdbcon);
+			new_db_hdls->cdbcon = 0;
+			return NULL;
+		}
 	}
 
 	/* SQL DB init and test connection */
@@ -696,6 +991,16 @@ static db_handlers_t *db_init_test_conn(cache_entry_t *c_entry)
 			c_entry->db_url.len, c_entry->db_url.s);
 		return NULL;
 	}
+	/* the async loads build raw queries, so the key may only be quoted
+	 * for the backends whose string literal syntax is known */
+	if (c_entry->db_url.len > 6 && !strncasecmp(c_entry->db_url.s, "mysql:", 6))
+		new_db_hdls->key_esc = KEY_ESC_MYSQL;
+	else if (c_entry->db_url.len > 9 &&
+		!strncasecmp(c_entry->db_url.s, "postgres:", 9))
+		new_db_hdls->key_esc = KEY_ESC_POSTGRES;
+	else
+		new_db_hdls->key_esc = KEY_ESC_NONE;
+
 	/* open a test connection */
 	if ((new_db_hdls->db_con = new_db_hdls->db_funcs.init(&c_entry->db_url)) == 0) {
 		LM_ERR("Cannot init connection to SQL DB: %.*s\n",
@@ -748,6 +1053,11 @@ static int inc_cache_rld_vers(db_handlers_t *db_hdls, int *rld_vers)
 {
 	str rld_vers_key;
 
+	if (is_shm_store(db_hdls->c_entry)) {
+		*rld_vers = __sync_add_and_fetch(&db_hdls->c_entry->rld_vers, 1);
+		return 0;
+	}
+
 	rld_vers_key.len = db_hdls->c_entry->id.len + 23;
 	rld_vers_key.s = pkg_malloc(rld_vers_key.len);
 	if (!rld_vers_key.s) {
@@ -768,15 +1078,11 @@ static int inc_cache_rld_vers(db_handlers_t *db_hdls, int *rld_vers)
 	return 0;
 }
 
-static int load_entire_table(cache_entry_t *c_entry, db_handlers_t *db_hdls,
-								int inc_rld_vers)
+static int query_entire_table(cache_entry_t *c_entry, db_handlers_t *db_hdls,
+								db_res_t **sql_res)
 {
 	db_key_t *query_cols = NULL;
-	db_res_t *sql_res = NULL;
-	db_row_t *row;
-	db_val_t *values;
 	int i;
-	int reload_vers = 0;
 
 	query_cols = pkg_malloc((c_entry->nr_columns + 1) * sizeof(db_key_t));
 	if (!query_cols) {
@@ -801,66 +1107,70 @@ static int load_entire_table(cache_entry_t *c_entry, db_handlers_t *db_hdls,
 			LM_ERR("Failure to issue query to SQL DB: %.*s\n",
 			c_entry->db_url.len, c_entry->db_url.s);
 			pkg_free(query_cols);
-			goto error;
+			return -1;
 		}
 
-		if (db_hdls->db_funcs.fetch_result(db_hdls->db_con,&sql_res,fetch_nr_rows)<0) {
+		if (db_hdls->db_funcs.fetch_result(db_hdls->db_con,sql_res,fetch_nr_rows)<0) {
 			LM_ERR("Error fetching rows from SQL DB: %.*s\n",
 			c_entry->db_url.len, c_entry->db_url.s);
 			pkg_free(query_cols);
-			goto error;
+			return -1;
 		}
 	} else {
 		if (db_hdls->db_funcs.query(db_hdls->db_con, NULL, 0, NULL,
-						query_cols, 0, c_entry->nr_columns + 1, 0, &sql_res) != 0) {
+						query_cols, 0, c_entry->nr_columns + 1, 0, sql_res) != 0) {
 			LM_ERR("Failure to issue query to SQL DB: %.*s\n",
 			c_entry->db_url.len, c_entry->db_url.s);
 			pkg_free(query_cols);
-			goto error;
+			return -1;
 		}
 	}
 
 	pkg_free(query_cols);
+	return 0;
+}
 
-	lock_start_write(db_hdls->c_entry->ref_lock);
-
-	if (inc_rld_vers && inc_cache_rld_vers(db_hdls, &reload_vers) < 0) {
-		lock_stop_write(db_hdls->c_entry->ref_lock);
-		goto error;
-	}
-
-	/* anything loaded ? if not, we can do a quick exit here */
-	if (RES_ROW_N(sql_res) == 0) {
-		lock_stop_write(db_hdls->c_entry->ref_lock);
-		db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
-		return 0;
-	}
+/* builds a new store out of the whole table and swaps it with the current
+ * one, so the readers are only blocked for the swap */
+static int load_table_in_store(cache_entry_t *c_entry, db_handlers_t *db_hdls,
+								db_res_t *sql_res)
+{
+	sc_row_t *rows = NULL, *row, *next;
+	sc_table_t *table, *old_table;
+	unsigned int nr_rows = 0, size, hash;
+	db_val_t *values;
+	str str_key;
+	int i;
 
-	row = RES_ROWS(sql_res);
-	values = ROW_VALUES(row);
-	if (get_column_types(c_entry, values + 1, ROW_N(row) - 1) < 0) {
-		lock_stop_write(db_hdls->c_entry->ref_lock);
-		goto error;
+	if (RES_ROW_N(sql_res) > 0) {
+		values = ROW_VALUES(RES_ROWS(sql_res));
+		if (get_column_types(c_entry, values + 1,
+			ROW_N(RES_ROWS(sql_res)) - 1) < 0)
+			goto error;
 	}
 
-	/* load the rows into the cahchedb */
 	do {
 		for (i=0; i < RES_ROW_N(sql_res); i++) {
-			row = RES_ROWS(sql_res) + i;
-			values = ROW_VALUES(row);
-			if (!VAL_NULL(values))
-				if (insert_in_cachedb(c_entry, db_hdls, values ,values + 1,
-					reload_vers, ROW_N(row) - 1) < 0) {
-					lock_stop_write(db_hdls->c_entry->ref_lock);
-					return -1;
-				}
+			values = ROW_VALUES(RES_ROWS(sql_res) + i);
+			if (VAL_NULL(values))
+				continue;
+
+			if (get_key_str(values, &str_key) < 0)
+				goto error;
+			row = new_store_row(&str_key, values + 1,
+					ROW_N(RES_ROWS(sql_res) + i) - 1);
+			if (!row)
+				goto error;
+
+			row->next = rows;
+			rows = row;
+			nr_rows++;
 		}
 
 		if (DB_CAPABILITY(db_hdls->db_funcs, DB_CAP_FETCH)) {
 			if (db_hdls->db_funcs.fetch_result(db_hdls->db_con,&sql_res,fetch_nr_rows)<0) {
 				LM_ERR("Error fetching rows (1) from SQL DB: %.*s\n",
 					c_entry->db_url.len, c_entry->db_url.s);
-				lock_stop_write(db_hdls->c_entry->ref_lock);
 				goto error;
 			}
 		} else {
@@ -868,17 +1178,175 @@ static int load_entire_table(cache_entry_t *c_entry, db_handlers_t *db_hdls,
 		}
 	} while (RES_ROW_N(sql_res) > 0);
 
-	lock_stop_write(db_hdls->c_entry->ref_lock);
-
 	db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
-	return 0;
+	sql_res = NULL;
 
-error:
-	if (sql_res)
+	for (size = 16; size < nr_rows; size <<= 1) ;
+	table = new_store_table(size);
+	if (!table)
+		goto error;
+
+	for (row = rows; row; row = next) {
+		next = row->next;
+		hash = core_hash(&row->key, NULL, size);
+		row->next = table->buckets[hash];
+		table->buckets[hash] = row;
+	}
+
+	lock_start_write(c_entry->ref_lock);
+	old_table = c_entry->store;
+	c_entry->store = table;
+	lock_stop_write(c_entry->ref_lock);
+
+	free_store_table(old_table);
+
+	LM_DBG("loaded %u rows from table %.*s\n", nr_rows,
+		c_entry->table.len, c_entry->table.s);
+	return 0;
+
+error:
+	for (row = rows; row; row = next) {
+		next = row->next;
+		shm_free(row);
+	}
+	if (sql_res)
+		db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
+	return -1;
+}
+
+static int load_entire_table(cache_entry_t *c_entry, db_handlers_t *db_hdls,
+								int inc_rld_vers)
+{
+	db_res_t *sql_res = NULL;
+	db_row_t *row;
+	db_val_t *values;
+	int i;
+	int reload_vers = 0;
+
+	if (query_entire_table(c_entry, db_hdls, &sql_res) < 0)
+		goto error;
+
+	if (is_shm_store(c_entry))
+		return load_table_in_store(c_entry, db_hdls, sql_res);
+
+	lock_start_write(db_hdls->c_entry->ref_lock);
+
+	if (inc_rld_vers && inc_cache_rld_vers(db_hdls, &reload_vers) < 0) {
+		lock_stop_write(db_hdls->c_entry->ref_lock);
+		goto error;
+	}
+
+	/* anything loaded ? if not, we can do a quick exit here */
+	if (RES_ROW_N(sql_res) == 0) {
+		lock_stop_write(db_hdls->c_entry->ref_lock);
+		db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
+		return 0;
+	}
+
+	row = RES_ROWS(sql_res);
+	values = ROW_VALUES(row);
+	if (get_column_types(c_entry, values + 1, ROW_N(row) - 1) < 0) {
+		lock_stop_write(db_hdls->c_entry->ref_lock);
+		goto error;
+	}
+
+	/* load the rows into the cahchedb */
+	do {
+		for (i=0; i < RES_ROW_N(sql_res); i++) {
+			row = RES_ROWS(sql_res) + i;
+			values = ROW_VALUES(row);
+			if (!VAL_NULL(values))
+				if (insert_in_cachedb(c_entry, db_hdls, values ,values + 1,
+					reload_vers, ROW_N(row) - 1) < 0) {
+					lock_stop_write(db_hdls->c_entry->ref_lock);
+					return -1;
+				}
+		}
+
+		if (DB_CAPABILITY(db_hdls->db_funcs, DB_CAP_FETCH)) {
+			if (db_hdls->db_funcs.fetch_result(db_hdls->db_con,&sql_res,fetch_nr_rows)<0) {
+				LM_ERR("Error fetching rows (1) from SQL DB: %.*s\n",
+					c_entry->db_url.len, c_entry->db_url.s);
+				lock_stop_write(db_hdls->c_entry->ref_lock);
+				goto error;
+			}
+		} else {
+			break;
+		}
+	} while (RES_ROW_N(sql_res) > 0);
+
+	lock_stop_write(db_hdls->c_entry->ref_lock);
+
+	db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
+	return 0;
+
+error:
+	if (sql_res)
 		db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
 	return -1;
 }
 
+static inline void account_load(cache_entry_t *c_entry, struct timeval *start)
+{
+	update_stat(c_entry->loads, 1);
+	__sync_fetch_and_add(&c_entry->load_time, get_time_diff(start));
+}
+
+/* caches the result of the query for a single key
+ *  return:
+ *  0 - succes
+ * -1 - error
+ * -2 - not found in sql db
+ */
+static int cache_key_result(cache_entry_t *c_entry, db_handlers_t *db_hdls,
+		str *src_key, db_val_t *key_val, db_res_t *sql_res, db_val_t **values,
+		int rld_vers)
+{
+	db_row_t *row;
+	str null_val;
+
+	if (RES_ROW_N(sql_res) == 0) {
+		LM_DBG("key %.*s not found in SQL db\n",
+			VAL_STR(key_val).len, VAL_STR(key_val).s);
+		if (is_shm_store(c_entry)) {
+			if (insert_in_store(c_entry, key_val, NULL, rld_vers, 0) < 0) {
+				LM_ERR("Failed to insert null in store\n");
+				return -1;
+			}
+		} else {
+			null_val.len = 0;
+			null_val.s = NULL;
+			if (db_hdls->cdbf.set(db_hdls->cdbcon, src_key, &null_val,
+				c_entry->expire) < 0) {
+				LM_ERR("Failed to insert null in cachedb\n");
+				return -1;
+			}
+		}
+
+		return -2;
+	} else if (RES_ROW_N(sql_res) > 1) {
+		LM_ERR("SQL query returned multiple rows\n");
+		return -1;
+	}
+
+	row = RES_ROWS(sql_res);
+	*values = ROW_VALUES(row);
+
+	if (c_entry->nr_ints + c_entry->nr_strs == 0 &&
+		get_column_types(c_entry, *values, ROW_N(row)) < 0)
+		return -1;
+
+	if (is_shm_store(c_entry)) {
+		if (insert_in_store(c_entry, key_val, *values, rld_vers, ROW_N(row)) < 0)
+			return -1;
+	} else if (insert_in_cachedb(c_entry, db_hdls, key_val, *values, rld_vers,
+		ROW_N(row)) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
 /*  return:
  *  0 - succes
  * -1 - error
@@ -888,9 +1356,10 @@ static int load_key(cache_entry_t *c_entry, db_handlers_t *db_hdls, str key,
 				db_val_t **values, db_res_t **sql_res, int rld_vers)
 {
 	db_key_t key_col;
-	db_row_t *row;
 	db_val_t key_val;
-	str src_key, null_val;
+	str src_key;
+	struct timeval start;
+	int rc;
 
 	src_key.len = c_entry->id.len + key.len;
 	src_key.s = pkg_malloc(src_key.len);
@@ -913,6 +1382,8 @@ static int load_key(cache_entry_t *c_entry, db_handlers_t *db_hdls, str key,
 		goto out_error;
 	}
 
+	gettimeofday(&start, NULL);
+
 	CON_PS_REFERENCE(db_hdls->db_con) = &db_hdls->query_ps;
 	if (db_hdls->db_funcs.query(db_hdls->db_con,
 		&key_col, 0, &key_val, c_entry->columns, 1,
@@ -922,34 +1393,17 @@ static int load_key(cache_entry_t *c_entry, db_handlers_t *db_hdls, str key,
 		goto sql_error;
 	}
 
-	if (RES_ROW_N(*sql_res) == 0) {
-		LM_DBG("key %.*s not found in SQL db\n", key.len, key.s);
-		null_val.len = 0;
-		null_val.s = NULL;
-		if (db_hdls->cdbf.set(db_hdls->cdbcon, &src_key, &null_val, c_entry->expire) < 0) {
-			LM_ERR("Failed to insert null in cachedb\n");
-			goto sql_error;
-		}
-
+	rc = cache_key_result(c_entry, db_hdls, &src_key, &key_val, *sql_res,
+			values, rld_vers);
+	account_load(c_entry, &start);
+	if (rc == -2) {
 		pkg_free(src_key.s);
 		db_hdls->db_funcs.free_result(db_hdls->db_con, *sql_res);
 		return -2;
-
-	} else if (RES_ROW_N(*sql_res) > 1) {
-		LM_ERR("SQL query returned multiple rows\n");
+	} else if (rc < 0) {
 		goto sql_error;
 	}
 
-	row = RES_ROWS(*sql_res);
-	*values = ROW_VALUES(row);
-
-	if (c_entry->nr_ints + c_entry->nr_strs == 0 &&
-		get_column_types(c_entry, *values, ROW_N(row)) < 0)
-		goto sql_error;
-
-	if (insert_in_cachedb(c_entry, db_hdls, &key_val, *values, rld_vers, ROW_N(row)) < 0)
-		goto sql_error;
-
 	pkg_free(src_key.s);
 	return 0;
 
@@ -966,6 +1420,9 @@ static int get_rld_vers_from_cache(cache_entry_t *c_entry, db_handlers_t *db_hdl
 	str rld_vers_key;
 	int rld_vers = -1;
 
+	if (is_shm_store(c_entry))
+		return c_entry->rld_vers;
+
 	rld_vers_key.len = c_entry->id.len + 23;
 	rld_vers_key.s = pkg_malloc(rld_vers_key.len);
 	if (!rld_vers_key.s) {
@@ -1105,6 +1562,11 @@ static int init_rld_vers_key(cache_entry_t *c_entry, db_handlers_t *db_hdls)
 	str rld_vers_key;
 	int reload_version = -1;
 
+	if (is_shm_store(c_entry)) {
+		c_entry->rld_vers = 0;
+		return 0;
+	}
+
 	/* set up reload version counter for this entry in cachedb */
 	rld_vers_key.len = c_entry->id.len + 23;
 	rld_vers_key.s = pkg_malloc(rld_vers_key.len);
@@ -1150,11 +1612,54 @@ static void cache_init_load(int sender, void *param)
 	}
 }
 
+static unsigned long get_avg_load_time(void *param)
+{
+	cache_entry_t *c_entry = (cache_entry_t *)param;
+	unsigned long loads = get_stat_val(c_entry->loads);
+
+	return loads ? c_entry->load_time / loads : 0;
+}
+
+/* registers the "<id>-<stat>" statistics of a cache entry */
+static int register_entry_stats(cache_entry_t *c_entry)
+{
+	struct {
+		char *name;
+		stat_var **var;
+	} stats[] = {
+		{"hits", &c_entry->hits},
+		{"misses", &c_entry->misses},
+		{"loads", &c_entry->loads},
+	};
+	char *name;
+	int i;
+
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+		name = build_stat_name(&c_entry->id, stats[i].name);
+		if (!name || register_stat2(exports.name, name, stats[i].var,
+			STAT_SHM_NAME, NULL, 0) != 0) {
+			LM_ERR("failed to register stat %s\n", stats[i].name);
+			return -1;
+		}
+	}
+
+	name = build_stat_name(&c_entry->id, "load_avg_time");
+	if (!name || register_stat2(exports.name, name,
+		(stat_var **)get_avg_load_time, STAT_SHM_NAME|STAT_IS_FUNC,
+		c_entry, 0) != 0) {
+		LM_ERR("failed to register stat load_avg_time\n");
+		return -1;
+	}
+
+	return 0;
+}
+
 static int mod_init(void)
 {
 	cache_entry_t *c_entry, *c_prev = NULL, *c_tmp;
 	db_handlers_t *db_hdls;
-	char use_timer = 0;
+	char use_timer = 0, use_clean_timer = 0;
+	unsigned int size;
 
 	if (full_caching_expire <= 0) {
 		full_caching_expire = DEFAULT_FULL_CACHING_EXPIRE;
@@ -1166,6 +1671,14 @@ static int mod_init(void)
 		LM_WARN("Invalid reload_interval parameter, "
 			"setting default value: %d sec\n", DEFAULT_RELOAD_INTERVAL);
 	}
+	if (store_hash_size <= 0) {
+		store_hash_size = DEFAULT_STORE_HASH_SIZE;
+		LM_WARN("Invalid store_hash_size parameter, "
+			"setting default value: %d\n", DEFAULT_STORE_HASH_SIZE);
+	}
+	for (size = 1; size < store_hash_size; size <<= 1) ;
+	store_hash_size = size;
+
 	if(!entry_list){
 		entry_list =  shm_malloc(sizeof(cache_entry_t*));
 		if (!entry_list) {
@@ -1213,12 +1726,27 @@ static int mod_init(void)
 				LM_ERR("Failed to init readers-writers lock\n");
 				continue;
 			}
+		} else if (is_shm_store(c_entry)) {
+			use_clean_timer = 1;
+			c_entry->store = new_store_table(store_hash_size);
+			if (!c_entry->store)
+				return -1;
+			c_entry->store_locks = lock_set_alloc(store_hash_size);
+			if (!c_entry->store_locks || !lock_set_init(c_entry->store_locks)) {
+				LM_ERR("Failed to init the store locks\n");
+				return -1;
+			}
 		}
 
+		if (register_entry_stats(c_entry) < 0)
+			return -1;
+
 		db_hdls->db_funcs.close(db_hdls->db_con);
 		db_hdls->db_con = 0;
-		db_hdls->cdbf.destroy(db_hdls->cdbcon);
-		db_hdls->cdbcon = 0;
+		if (db_hdls->cdbcon) {
+			db_hdls->cdbf.destroy(db_hdls->cdbcon);
+			db_hdls->cdbcon = 0;
+		}
 		db_hdls->next = db_hdls_list;
 		db_hdls_list = db_hdls;
 
@@ -1232,6 +1760,13 @@ static int mod_init(void)
 		return -1;
 	}
 
+	if (use_clean_timer && register_timer("sql_cacher_store-clean",
+		store_clean_timer, NULL, STORE_CLEAN_INTERVAL,
+		TIMER_FLAG_DELAY_ON_DELAY) < 0) {
+		LM_ERR("failed to register timer\n");
+		return -1;
+	}
+
 	return 0;
 }
 
@@ -1240,10 +1775,12 @@ static int child_init(int rank)
 	db_handlers_t *db_hdls;
 
 	for (db_hdls = db_hdls_list; db_hdls; db_hdls = db_hdls->next) {
-		db_hdls->cdbcon = db_hdls->cdbf.init(&db_hdls->c_entry->cachedb_url);
-		if (!db_hdls->cdbcon) {
-			LM_ERR("Cannot connect to cachedb from child\n");
-			return -1;
+		if (!is_shm_store(db_hdls->c_entry)) {
+			db_hdls->cdbcon = db_hdls->cdbf.init(&db_hdls->c_entry->cachedb_url);
+			if (!db_hdls->cdbcon) {
+				LM_ERR("Cannot connect to cachedb from child\n");
+				return -1;
+			}
 		}
 
 		if ((db_hdls->db_con = db_hdls->db_funcs.init(&db_hdls->c_entry->db_url)) == 0) {
@@ -1411,6 +1948,100 @@ static void unlink_from_query_list(struct queried_key *pos)
 	prev->next = pos->next;
 }
 
+/* marks @src_key as being queried from the SQL db by the current process,
+ * the caller must hold queries_lock; the other processes looking for the key
+ * will wait on the returned entry until del_queried_key(), or, if they run
+ * in async mode, get resumed from it */
+static struct queried_key *add_queried_key(str *src_key)
+{
+	struct queried_key *new_key;
+
+	new_key = shm_malloc(sizeof(struct queried_key));
+	if (!new_key) {
+		LM_ERR("No more shm memory\n");
+		return NULL;
+	}
+	new_key->key = *src_key;
+	new_key->nr_waiting_procs = 0;
+	new_key->async = 0;
+	new_key->done = 0;
+	new_key->async_waiters = NULL;
+	new_key->wait_sql_query = lock_alloc();
+	if (!new_key->wait_sql_query) {
+		LM_ERR("No more memory for wait_sql_query lock\n");
+		shm_free(new_key);
+		return NULL;
+	}
+	if (!lock_init(new_key->wait_sql_query)) {
+		LM_ERR("Failed to init wait_sql_query lock\n");
+		lock_dealloc(new_key->wait_sql_query);
+		shm_free(new_key);
+		return NULL;
+	}
+
+	new_key->next = *queries_in_progress;
+	*queries_in_progress = new_key;
+
+	lock_get(new_key->wait_sql_query);
+
+	return new_key;
+}
+
+/* an async context waiting for the query of another request: it is
+ * suspended on its own pipe, written once the query completes */
+struct key_wait {
+	int fd[2];
+	int woken;
+	int resumed;
+};
+
+/* runs in the process of the waiter */
+static void rpc_wake_waiter(int sender, void *param)
+{
+	struct key_wait *kw = (struct key_wait *)param;
+
+	kw->woken = 1;
+	if (kw->resumed) {
+		/* already resumed (timeout), nobody reads the pipe anymore */
+		pkg_free(kw);
+		return;
+	}
+
+	if (write(kw->fd[1], "", 1) < 0 && errno != EAGAIN)
+		LM_ERR("failed to wake up a context waiting for a key: %s\n",
+			strerror(errno));
+}
+
+static void del_queried_key(struct queried_key *q_key)
+{
+	struct queried_key_waiter *w;
+
+	lock_get(queries_lock);
+
+	q_key->done = 1;
+	lock_release(q_key->wait_sql_query);
+
+	/* the async waiters are resumed by the processes they suspended in */
+	while ((w = q_key->async_waiters)) {
+		q_key->async_waiters = w->next;
+		if (ipc_send_rpc(w->proc_no, rpc_wake_waiter, w->wait) < 0)
+			LM_ERR("failed to resume a context waiting for key %.*s\n",
+				q_key->key.len, q_key->key.s);
+		shm_free(w);
+	}
+
+	/* delete key from list */
+	if (q_key->nr_waiting_procs == 0) {
+		lock_destroy(q_key->wait_sql_query);
+		lock_dealloc(q_key->wait_sql_query);
+		unlink_from_query_list(q_key);
+		shm_free(q_key->key.s);
+		shm_free(q_key);
+	}
+
+	lock_release(queries_lock);
+}
+
 /*  return:
  *  0 - succes => if str column, @str_res->s must be pkg_free()'d
  *  1 - succes, null value in db
@@ -1453,7 +2084,9 @@ static int on_demand_load(pv_name_fix_t *pv_name, str *str_res, int *int_res,
 	lock_get(queries_lock);
 
 	for (it = *queries_in_progress; it; it = it->next) {
-		if (str_strcmp(&it->key, &src_key))
+		/* an async query only completes from the reactor of its process,
+		 * which may be blocked waiting for us - run our own query */
+		if (it->async || str_strcmp(&it->key, &src_key))
 			continue;
 
 		it->nr_waiting_procs++;  /* key is in list! */
@@ -1478,6 +2111,21 @@ static int on_demand_load(pv_name_fix_t *pv_name, str *str_res, int *int_res,
 		}
 		lock_release(queries_lock);
 
+		/* read the key from the store */
+		if (is_shm_store(pv_name->c_entry)) {
+			memset(&st, 0, sizeof st);
+			rc = store_fetch(pv_name, pv_name->c_entry->rld_vers, &st,
+					str_res, int_res);
+			if (rc == 3) {
+				LM_ERR("Key should be in store after the query\n");
+				rc = -1;
+			}
+			if ((rc != 0 || !is_str_column(pv_name)) && st.s)
+				pkg_free(st.s);
+
+			return rc;
+		}
+
 		/* reload key from cachedb */
 		if (cdb_fetch(pv_name, &cdb_res, &rld_vers_retry) < 0) {
 			LM_ERR("Error on retrying fetch from cachedb\n");
@@ -1507,53 +2155,17 @@ static int on_demand_load(pv_name_fix_t *pv_name, str *str_res, int *int_res,
 	}
 
 	/* key not found in list -> insert it */
-	new_key = shm_malloc(sizeof(struct queried_key));
+	new_key = add_queried_key(&src_key);
+	lock_release(queries_lock);
 	if (!new_key) {
-		LM_ERR("No more shm memory\n");
-		lock_release(queries_lock);
-		return -1;
-	}
-	new_key->key = src_key;
-	new_key->nr_waiting_procs = 0;
-	new_key->wait_sql_query = lock_alloc();
-	if (!new_key->wait_sql_query) {
-		LM_ERR("No more memory for wait_sql_query lock\n");
-		shm_free(new_key);
-		lock_release(queries_lock);
-		return -1;
-	}
-	if (!lock_init(new_key->wait_sql_query)) {
-		LM_ERR("Failed to init wait_sql_query lock\n");
-		lock_dealloc(new_key->wait_sql_query);
-		shm_free(new_key);
-		lock_release(queries_lock);
+		shm_free(src_key.s);
 		return -1;
 	}
 
-	new_key->next = *queries_in_progress;
-	*queries_in_progress = new_key;
-
-	lock_get(new_key->wait_sql_query);
-
-	lock_release(queries_lock);
-
 	rc = load_key(pv_name->c_entry, pv_name->db_hdls, pv_name->key, &values,
 			&sql_res, rld_vers);
 
-	lock_get(queries_lock);
-
-	lock_release(new_key->wait_sql_query);
-
-	/* delete key from list */
-	if (new_key->nr_waiting_procs == 0) {
-		lock_destroy(new_key->wait_sql_query);
-		lock_dealloc(new_key->wait_sql_query);
-		unlink_from_query_list(new_key);
-		shm_free(new_key->key.s);
-		shm_free(new_key);
-	}
-
-	lock_release(queries_lock);
+	del_queried_key(new_key);
 
 	if (rc < 0)
 		return rc;
@@ -1609,6 +2221,323 @@ out_free_res:
 	return rc;
 }
 
+struct load_key_param {
+	db_handlers_t *db_hdls;
+	struct queried_key *q_key;
+	void *db_param;
+	int rld_vers;
+	struct timeval start;
+	str key;
+};
+
+/* checks if @key is cached with the current reload version */
+static int key_is_cached(db_handlers_t *db_hdls, str *key, str *src_key,
+							int rld_vers)
+{
+	cache_entry_t *c_entry = db_hdls->c_entry;
+	unsigned int hash;
+	char int_buf[4];
+	str cdb_res;
+	int rc = 0, vers;
+
+	if (is_shm_store(c_entry)) {
+		hash = core_hash(key, NULL, c_entry->store->size);
+		lock_set_get(c_entry->store_locks, hash);
+		rc = store_lookup(c_entry, c_entry->store, hash, key, rld_vers) != NULL;
+		lock_set_release(c_entry->store_locks, hash);
+		return rc;
+	}
+
+	if (db_hdls->cdbf.get(db_hdls->cdbcon, src_key, &cdb_res) < 0)
+		return 0;
+
+	if (cdb_res.len == 0) {
+		/* the key was not found in the SQL db */
+		rc = 1;
+	} else if (cdb_res.len >= INT_B64_ENC_LEN && base64decode(
+		(unsigned char *)int_buf, (unsigned char *)cdb_res.s,
+		INT_B64_ENC_LEN) == 4) {
+		memcpy(&vers, int_buf, 4);
+		rc = (vers == rld_vers);
+	}
+
+	if (cdb_res.s)
+		pkg_free(cdb_res.s);
+	return rc;
+}
+
+/* SELECT col1,...,colN FROM table WHERE key='escaped key'; the key is
+ * backslash escaped, which MySQL accepts in plain literals and Postgres
+ * only in E'' literals, whatever standard_conforming_strings says */
+static int build_key_query(db_handlers_t *db_hdls, str *key, str *query)
+{
+	cache_entry_t *c_entry = db_hdls->c_entry;
+	char *p;
+	int i, len;
+
+	len = sizeof("SELECT  FROM  WHERE =E''") + c_entry->table.len +
+		c_entry->key.len + 2 * key->len;
+	for (i = 0; i < c_entry->nr_columns; i++)
+		len += c_entry->columns[i]->len + 1;
+
+	query->s = pkg_malloc(len);
+	if (!query->s) {
+		LM_ERR("No more pkg memory\n");
+		return -1;
+	}
+
+	p = query->s;
+	memcpy(p, "SELECT ", 7);
+	p += 7;
+	for (i = 0; i < c_entry->nr_columns; i++) {
+		if (i)
+			*p++ = ',';
+		memcpy(p, c_entry->columns[i]->s, c_entry->columns[i]->len);
+		p += c_entry->columns[i]->len;
+	}
+	memcpy(p, " FROM ", 6);
+	p += 6;
+	memcpy(p, c_entry->table.s, c_entry->table.len);
+	p += c_entry->table.len;
+	memcpy(p, " WHERE ", 7);
+	p += 7;
+	memcpy(p, c_entry->key.s, c_entry->key.len);
+	p += c_entry->key.len;
+	*p++ = '=';
+	if (db_hdls->key_esc == KEY_ESC_POSTGRES)
+		*p++ = 'E';
+	*p++ = '\'';
+	p += escape_common(p, key->s, key->len);
+	*p++ = '\'';
+
+	query->len = p - query->s;
+	return 0;
+}
+
+static int resume_async_load_key(int fd, struct sip_msg *msg, void *_param)
+{
+	struct load_key_param *param = (struct load_key_param *)_param;
+	db_handlers_t *db_hdls = param->db_hdls;
+	db_res_t *sql_res = NULL;
+	db_val_t key_val, *values;
+	int rc;
+
+	rc = db_hdls->db_funcs.async_resume(db_hdls->db_con, fd, &sql_res,
+			param->db_param);
+	if (async_status == ASYNC_CONTINUE || async_status == ASYNC_CHANGE_FD)
+		return rc;
+
+	if (rc != 0) {
+		LM_ERR("async query for key %.*s failed\n",
+			param->key.len, param->key.s);
+		rc = -1;
+	} else {
+		VAL_NULL(&key_val) = 0;
+		VAL_TYPE(&key_val) = DB_STR;
+		VAL_STR(&key_val) = param->key;
+
+		rc = cache_key_result(db_hdls->c_entry, db_hdls, &param->q_key->key,
+				&key_val, sql_res, &values, param->rld_vers);
+		if (rc == 0) {
+			rc = 1;
+			async_status = ASYNC_DONE;
+		}
+	}
+
+	account_load(db_hdls->c_entry, &param->start);
+
+	db_hdls->db_funcs.async_free_result(db_hdls->db_con, sql_res,
+		param->db_param);
+	del_queried_key(param->q_key);
+	pkg_free(param);
+
+	return rc;
+}
+
+static int resume_wait_load_key(int fd, struct sip_msg *msg, void *param)
+{
+	struct key_wait *kw = (struct key_wait *)param;
+
+	/* the process running the query cached the key, or failed to load it
+	 * and the next read will retry */
+	close(kw->fd[1]);
+	kw->resumed = 1;
+	if (kw->woken)
+		pkg_free(kw);
+
+	async_status = ASYNC_DONE_CLOSE_FD;
+	return 1;
+}
+
+/* loads a key of an on demand entry into the cache without blocking;
+ * if the key is already cached there is nothing to wait for, if it is
+ * being loaded, the context resumes once that query completes */
+static int w_async_load_key(struct sip_msg *msg, async_ctx *ctx,
+								str *id, str *key)
+{
+	db_handlers_t *db_hdls;
+	cache_entry_t *c_entry;
+	struct load_key_param *param = NULL;
+	struct queried_key *it;
+	struct queried_key_waiter *waiter;
+	struct key_wait *kw;
+	db_res_t *sql_res = NULL;
+	db_val_t *values;
+	str src_key, query;
+	int rld_vers, read_fd, use_async, rc = 1;
+
+	for (db_hdls = db_hdls_list; db_hdls; db_hdls = db_hdls->next)
+		if (!str_strcmp(&db_hdls->c_entry->id, id))
+			break;
+	if (!db_hdls) {
+		LM_ERR("Unknown caching id %.*s\n", id->len, id->s);
+		return -1;
+	}
+	c_entry = db_hdls->c_entry;
+
+	/* the whole table is already cached */
+	if (!c_entry->on_demand)
+		goto sync_done;
+
+	rld_vers = get_rld_vers_from_cache(c_entry, db_hdls);
+	if (rld_vers < 0)
+		return -1;
+
+	src_key.len = c_entry->id.len + key->len;
+	src_key.s = shm_malloc(src_key.len);
+	if (!src_key.s) {
+		LM_ERR("No more shm memory\n");
+		return -1;
+	}
+	memcpy(src_key.s, c_entry->id.s, c_entry->id.len);
+	memcpy(src_key.s + c_entry->id.len, key->s, key->len);
+
+	if (key_is_cached(db_hdls, key, &src_key, rld_vers)) {
+		shm_free(src_key.s);
+		goto sync_done;
+	}
+
+	param = pkg_malloc(sizeof *param + key->len);
+	kw = pkg_malloc(sizeof *kw);
+	if (kw) {
+		memset(kw, 0, sizeof *kw);
+		kw->fd[0] = kw->fd[1] = -1;
+	}
+	if (!param || !kw) {
+		LM_ERR("No more pkg memory\n");
+		goto error;
+	}
+
+	/* no async capabilities or no safe way to quote the key in a raw
+	 * query - just run it in blocking mode */
+	use_async = DB_CAPABILITY(db_hdls->db_funcs, DB_CAP_ASYNC_RAW_QUERY) &&
+		db_hdls->key_esc != KEY_ESC_NONE;
+
+	lock_get(queries_lock);
+
+	for (it = *queries_in_progress; it; it = it->next)
+		if (!it->done && !str_strcmp(&it->key, &src_key))
+			break;
+	if (it) {
+		if (pipe(kw->fd) < 0 || fcntl(kw->fd[1], F_SETFL, O_NONBLOCK) < 0) {
+			lock_release(queries_lock);
+			LM_ERR("failed to create the wait pipe: %s\n", strerror(errno));
+			goto error;
+		}
+
+		waiter = shm_malloc(sizeof *waiter);
+		if (!waiter) {
+			lock_release(queries_lock);
+			LM_ERR("No more shm memory\n");
+			goto error;
+		}
+		waiter->wait = kw;
+		waiter->proc_no = process_no;
+		waiter->next = it->async_waiters;
+		it->async_waiters = waiter;
+		lock_release(queries_lock);
+
+		shm_free(src_key.s);
+		pkg_free(param);
+
+		ctx->resume_param = kw;
+		ctx->resume_f = resume_wait_load_key;
+		async_status = kw->fd[0];
+		return 1;
+	}
+
+	pkg_free(kw);
+	param->q_key = add_queried_key(&src_key);
+	if (param->q_key)
+		param->q_key->async = use_async;
+	lock_release(queries_lock);
+	if (!param->q_key) {
+		shm_free(src_key.s);
+		pkg_free(param);
+		return -1;
+	}
+
+	if (!use_async) {
+		rc = load_key(c_entry, db_hdls, *key, &values, &sql_res, rld_vers);
+		if (rc == 0) {
+			db_hdls->db_funcs.free_result(db_hdls->db_con, sql_res);
+			rc = 1;
+		}
+		del_queried_key(param->q_key);
+		goto sync_done;
+	}
+
+	if (build_key_query(db_hdls, key, &query) < 0) {
+		del_queried_key(param->q_key);
+		rc = -1;
+		goto sync_done;
+	}
+
+	gettimeofday(&param->start, NULL);
+	read_fd = db_hdls->db_funcs.async_raw_query(db_hdls->db_con, &query,
+			&param->db_param);
+	pkg_free(query.s);
+	if (read_fd < 0) {
+		LM_ERR("failed to start the async query for key %.*s\n",
+			key->len, key->s);
+		del_queried_key(param->q_key);
+		rc = -1;
+		goto sync_done;
+	}
+
+	param->db_hdls = db_hdls;
+	param->rld_vers = rld_vers;
+	param->key.s = (char *)(param + 1);
+	param->key.len = key->len;
+	memcpy(param->key.s, key->s, key->len);
+
+	ctx->resume_param = param;
+	ctx->resume_f = resume_async_load_key;
+	async_status = read_fd;
+	return 1;
+
+sync_done:
+	if (param)
+		pkg_free(param);
+	ctx->resume_param = NULL;
+	ctx->resume_f = NULL;
+	async_status = ASYNC_NO_IO;
+	return rc;
+
+error:
+	shm_free(src_key.s);
+	if (kw) {
+		if (kw->fd[0] >= 0) {
+			close(kw->fd[0]);
+			close(kw->fd[1]);
+		}
+		pkg_free(kw);
+	}
+	if (param)
+		pkg_free(param);
+	return -1;
+}
+
 static int parse_pv_name_s(pv_name_fix_t *pv_name, str *name_s)
 {
 	char *p1 = NULL, *p2 = NULL;
@@ -1697,6 +2626,73 @@ int pv_parse_name(pv_spec_p sp, str *in)
 }
 
 static str valbuff[PV_VAL_BUF_NO];
+static int valbuff_itr = 0;
+
+static int pv_get_store_value(struct sip_msg *msg, pv_param_t *param,
+								pv_value_t *res, pv_name_fix_t *pv_name)
+{
+	cache_entry_t *c_entry = pv_name->c_entry;
+	str str_res = {NULL, 0}, *buf;
+	int int_res = 0, rc, l = 0;
+	char *ch;
+
+	if (pv_name->last_str == -1 || pv_name->pv_elem_list)
+		optimize_cdb_decode(pv_name);
+	if (pv_name->col_offset == -1) {
+		LM_WARN("Unknown column %.*s\n", pv_name->col.len, pv_name->col.s);
+		return pv_get_null(msg, param, res);
+	}
+
+	buf = &valbuff[valbuff_itr];
+	rc = store_fetch(pv_name, get_rld_vers_from_cache(c_entry, pv_name->db_hdls),
+			buf, &str_res, &int_res);
+	if (rc == 3) {
+		update_stat(c_entry->misses, 1);
+		if (!c_entry->on_demand) {
+			LM_DBG("key: %.*s not found\n", pv_name->key.len, pv_name->key.s);
+			return pv_get_null(msg, param, res);
+		}
+
+		rc = on_demand_load(pv_name, &str_res, &int_res, c_entry->rld_vers);
+		if (rc == 0 && is_str_column(pv_name)) {
+			if (pkg_str_extend(buf, str_res.len) != 0) {
+				LM_ERR("failed to alloc buffer\n");
+				rc = -1;
+			} else {
+				memcpy(buf->s, str_res.s, str_res.len);
+			}
+			if (str_res.s)
+				pkg_free(str_res.s);
+			str_res.s = buf->s;
+		}
+	} else {
+		update_stat(c_entry->hits, 1);
+	}
+
+	if (rc == 1) {
+		LM_DBG("NULL value in SQL db\n");
+		return pv_get_null(msg, param, res);
+	} else if (rc != 0) {
+		return pv_get_null(msg, param, res);
+	}
+
+	if (is_str_column(pv_name)) {
+		res->flags = PV_VAL_STR;
+		res->rs.s = str_res.s;
+		res->rs.len = str_res.len;
+
+		valbuff_itr = (valbuff_itr + 1) % PV_VAL_BUF_NO;
+	} else {
+		res->ri = int_res;
+		ch = int2str(int_res, &l);
+		res->rs.s = ch;
+		res->rs.len = l;
+		res->flags = PV_VAL_STR|PV_VAL_INT|PV_TYPE_INT;
+	}
+
+	return 0;
+}
+
 int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t *res)
 {
 	pv_name_fix_t *pv_name;
@@ -1705,7 +2701,6 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 	int rc, rc2, int_res = 0, l = 0;
 	char *ch = NULL;
 	str str_res = {NULL, 0}, cdb_res = {NULL, 0};
-	static int buf_itr = 0;
 	int entry_rld_vers, free_str_res = 0;
 
 	if (!param || param->pvn.type != PV_NAME_PVAR ||
@@ -1744,6 +2739,9 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 		}
 	}
 
+	if (is_shm_store(pv_name->c_entry))
+		return pv_get_store_value(msg, param, res, pv_name);
+
 	if (!pv_name->c_entry->on_demand)
 		lock_start_read(pv_name->c_entry->ref_lock);
 
@@ -1758,6 +2756,7 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 	if (!pv_name->c_entry->on_demand) {
 		if (rc == -2) {
 			LM_DBG("key: %.*s not found\n", pv_name->key.len, pv_name->key.s);
+			update_stat(pv_name->c_entry->misses, 1);
 			lock_stop_read(pv_name->c_entry->ref_lock);
 			return pv_get_null(msg, param, res);
 		} else {
@@ -1771,6 +2770,8 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 				optimize_cdb_decode(pv_name);
 			rc2 = cdb_val_decode(pv_name, &cdb_res, entry_rld_vers, &str_res,
 									&int_res);
+			update_stat(rc2 == 3 ?
+				pv_name->c_entry->misses : pv_name->c_entry->hits, 1);
 
 			lock_stop_read(pv_name->c_entry->ref_lock);
 
@@ -1787,6 +2788,7 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 		}
 	} else {
 		if (rc == -2) {  /* key not found in cache */
+			update_stat(pv_name->c_entry->misses, 1);
 			rc2 = on_demand_load(pv_name, &str_res, &int_res, entry_rld_vers);
 			if (rc2 == 1) {
 				LM_DBG("NULL value in SQL db\n");
@@ -1798,6 +2800,7 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 		} else {
 			if (cdb_res.len == 0 || !cdb_res.s) {
 				LM_DBG("key: %.*s not found in SQL db\n", pv_name->key.len, pv_name->key.s);
+				update_stat(pv_name->c_entry->hits, 1);
 				return pv_get_null(msg, param, res);
 			}
 
@@ -1805,6 +2808,8 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 				optimize_cdb_decode(pv_name);
 			rc2 = cdb_val_decode(pv_name, &cdb_res, entry_rld_vers, &str_res,
 									&int_res);
+			update_stat(rc2 == 3 ?
+				pv_name->c_entry->misses : pv_name->c_entry->hits, 1);
 			if (rc2 == 2)
 				goto out_free_null;
 			if (rc2 == 1) {
@@ -1826,23 +2831,23 @@ int pv_get_sql_cached_value(struct sip_msg *msg,  pv_param_t *param, pv_value_t
 	}
 
 	if (is_str_column(pv_name)) {
-		if (pkg_str_extend(&valbuff[buf_itr], str_res.len) != 0) {
+		if (pkg_str_extend(&valbuff[valbuff_itr], str_res.len) != 0) {
 			LM_ERR("failed to alloc buffer\n");
 			if (free_str_res)
 				pkg_free(str_res.s);
 			goto out_free_null;
 		}
 
-		memcpy(valbuff[buf_itr].s, str_res.s, str_res.len);
+		memcpy(valbuff[valbuff_itr].s, str_res.s, str_res.len);
 
 		if (free_str_res)
 			pkg_free(str_res.s);
 
 		res->flags = PV_VAL_STR;
-		res->rs.s = valbuff[buf_itr].s;
+		res->rs.s = valbuff[valbuff_itr].s;
 		res->rs.len = str_res.len;
 
-		buf_itr = (buf_itr + 1) % PV_VAL_BUF_NO;
+		valbuff_itr = (valbuff_itr + 1) % PV_VAL_BUF_NO;
 	} else {
 		res->ri = int_res;
 		ch = int2str(int_res, &l);
@@ -1867,7 +2872,8 @@ static void free_c_entry(cache_entry_t *c)
 
 	shm_free(c->id.s);
 	shm_free(c->db_url.s);
-	shm_free(c->cachedb_url.s);
+	if (c->cachedb_url.s)
+		shm_free(c->cachedb_url.s);
 	shm_free(c->table.s);
 	shm_free(c->key.s);
 	for (i = 0; i < c->nr_columns; i++) {
@@ -1876,6 +2882,11 @@ static void free_c_entry(cache_entry_t *c)
 	}
 	shm_free(c->columns);
 	lock_destroy_rw(c->ref_lock);
+	free_store_table(c->store);
+	if (c->store_locks) {
+		lock_set_destroy(c->store_locks);
+		lock_set_dealloc(c->store_locks);
+	}
 	shm_free(c);
 }
 
@@ -28,6 +28,10 @@
 
 #include "../../db/db.h"
 #include "../../cachedb/cachedb.h"
+#include "../../async.h"
+#include "../../locking.h"
+#include "../../rw_locking.h"
+#include "../../statistics.h"
 
 #define DEFAULT_SPEC_DELIM "\n"
 #define DEFAULT_COLUMNS_DELIM " "
@@ -58,12 +62,39 @@
 #define CDB_TEST_KEY_STR "sql_cacher_cdb_test_key"
 #define CDB_TEST_VAL_STR "sql_cacher_cdb_test_val"
 #define INT_B64_ENC_LEN 8
+#define DEFAULT_STORE_HASH_SIZE 1024
+#define STORE_CLEAN_INTERVAL 60
 
 #define PV_VAL_BUF_NO 7
 
 #define is_str_column(pv_name_fix_p) \
 	((pv_name_fix_p)->c_entry->column_types & (1LL << (pv_name_fix_p)->col_nr))
 
+/* entries with no cachedb_url keep their rows in the native shm store */
+#define is_shm_store(c_entry) (!(c_entry)->cachedb_url.s)
+
+typedef union _sc_val {
+	int n;
+	str s;
+} sc_val_t;
+
+/* a row of the native store, allocated as a single shm chunk: the struct,
+ * the column values, the key and the string values */
+typedef struct _sc_row {
+	str key;
+	unsigned int expires;
+	int rld_vers;
+	long long nulls;	/* bitmask of the NULL columns */
+	int not_found;		/* the key does not exist in the SQL table */
+	struct _sc_row *next;
+	sc_val_t vals[0];
+} sc_row_t;
+
+typedef struct _sc_table {
+	unsigned int size;	/* power of 2 */
+	sc_row_t **buckets;
+} sc_table_t;
+
 typedef struct _cache_entry {
 	str id;
 	str db_url;
@@ -77,6 +108,19 @@ typedef struct _cache_entry {
 	unsigned int nr_ints, nr_strs;
 	long long column_types;
 	rw_lock_t *ref_lock;
+
+	/* native shm store; in full caching mode the whole table is swapped
+	 * under @ref_lock at reload, in on demand mode the buckets are
+	 * protected by @store_locks */
+	sc_table_t *store;
+	gen_lock_set_t *store_locks;
+	volatile int rld_vers;
+
+	stat_var *hits;
+	stat_var *misses;
+	stat_var *loads;
+	volatile unsigned long load_time;	/* total, in microseconds */
+
 	struct _cache_entry *next;
 } cache_entry_t;
 
@@ -87,12 +131,29 @@ typedef struct _db_handlers {
 	db_ps_t query_ps;
 	cachedb_funcs cdbf;
 	cachedb_con *cdbcon;
+	int key_esc;
 	struct _db_handlers *next;
 } db_handlers_t;
 
+/* how a key is quoted in the raw queries of the async loads */
+#define KEY_ESC_NONE      0	/* unknown backend, only blocking loads */
+#define KEY_ESC_MYSQL     1	/* '...' with backslash escapes */
+#define KEY_ESC_POSTGRES  2	/* E'...' with backslash escapes */
+
+/* script contexts suspended until an async query of the key completes;
+ * @wait lives in the pkg memory of process @proc_no */
+struct queried_key_waiter {
+	struct key_wait *wait;
+	int proc_no;
+	struct queried_key_waiter *next;
+};
+
 struct queried_key {
 	str key;
 	int nr_waiting_procs;
+	int async;		/* loaded by an async query, completed by a reactor */
+	int done;
+	struct queried_key_waiter *async_waiters;
 	gen_lock_t *wait_sql_query;
 	struct queried_key *next;
 };
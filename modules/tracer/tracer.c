@@ -110,6 +110,16 @@ static str trace_local_proto = {NULL, 0};
 static str trace_local_ip = {NULL, 0};
 static unsigned short trace_local_port = 0;
 
+/* percentage of the calls traced by trace() */
+static int sampling_rate = 100;
+static char *sampling_mode_s = NULL;
+enum trace_sampling_modes { SAMPLING_CALLID, SAMPLING_RANDOM };
+static int sampling_mode = SAMPLING_CALLID;
+
+/* max messages per second sent to each destination (0 - no limit) */
+static int rate_limit = 0;
+static int rate_limit_burst = 0;
+
 static tlist_elem_p trace_list=NULL;
 static tlist_elem_p *dyn_trace_list=NULL;
 static gen_lock_t *dyn_trace_lock;
@@ -127,7 +137,8 @@ static int corr_id=-1;
 static int fixup_tid(void **param);
 static int fixup_sflags(void **param);
 static int trace_w(struct sip_msg *msg, tlist_elem_p list,
-					void *scope_p, str *trace_types_s, str *trace_attrs);
+					void *scope_p, str *trace_types_s, str *trace_attrs,
+					int *sampling);
 static int sip_trace(struct sip_msg*, trace_info_p);
 static int sip_trace_instance(struct sip_msg*, trace_instance_p, int);
 
@@ -192,6 +203,7 @@ static void free_trace_filters(struct trace_filter *list);
 static int init_dyn_tracing(void);
 static void destroy_dyn_tracing(void);
 static int process_dyn_tracing(struct sip_msg *msg, void *param);
+static void trace_bucket_init(struct trace_bucket *b);
 
 
 /*
@@ -202,7 +214,8 @@ static cmd_export_t cmds[] = {
 		{CMD_PARAM_STR, fixup_tid, 0},
 		{CMD_PARAM_STR|CMD_PARAM_OPT, fixup_sflags, 0},
 		{CMD_PARAM_STR|CMD_PARAM_OPT, 0, 0},
-		{CMD_PARAM_STR|CMD_PARAM_OPT, 0, 0}, {0,0,0}},
+		{CMD_PARAM_STR|CMD_PARAM_OPT, 0, 0},
+		{CMD_PARAM_INT|CMD_PARAM_OPT, 0, 0}, {0,0,0}},
 		REQUEST_ROUTE|FAILURE_ROUTE|ONREPLY_ROUTE|BRANCH_ROUTE|LOCAL_ROUTE},
 	{0,0,{{0,0,0}},0}
 };
@@ -228,6 +241,10 @@ static param_export_t params[] = {
 	{"direction_column",   STR_PARAM, &direction_column.s   },
 	{"trace_on",           INT_PARAM, &trace_on             },
 	{"trace_local_ip",     STR_PARAM, &trace_local_ip.s     },
+	{"sampling_rate",      INT_PARAM, &sampling_rate        },
+	{"sampling_mode",      STR_PARAM, &sampling_mode_s      },
+	{"rate_limit",         INT_PARAM, &rate_limit           },
+	{"rate_limit_burst",   INT_PARAM, &rate_limit_burst     },
 	{0, 0, 0}
 };
 
@@ -244,6 +261,10 @@ static mi_export_t mi_cmds[] = {
 		{sip_trace_mi_dyn,{"id", "uri", 0}},
 		{sip_trace_mi_dyn,{"id", "uri", "filter", 0}},
 		{sip_trace_mi_dyn,{"id", "uri", "filter", "scope", "type", 0}},
+		{sip_trace_mi_dyn,{"id", "uri", "sampling", 0}},
+		{sip_trace_mi_dyn,{"id", "uri", "filter", "sampling", 0}},
+		{sip_trace_mi_dyn,{"id", "uri", "filter", "scope", "type",
+			"sampling", 0}},
 		{EMPTY_MI_RECIPE}
 		}
 	},
@@ -260,10 +281,14 @@ static mi_export_t mi_cmds[] = {
 
 stat_var* siptrace_req;
 stat_var* siptrace_rpl;
+stat_var* siptrace_sampled_out;
+stat_var* siptrace_rate_dropped;
 
 static stat_export_t siptrace_stats[] = {
 	{"traced_requests" ,  0,  &siptrace_req  },
 	{"traced_replies"  ,  0,  &siptrace_rpl  },
+	{"sampled_out"     ,  0,  &siptrace_sampled_out  },
+	{"rate_dropped"    ,  0,  &siptrace_rate_dropped },
 	{0,0,0}
 };
 #endif
@@ -822,6 +847,27 @@ static int mod_init(void)
 	if (trace_local_ip.s)
 		parse_trace_local_ip();
 
+	if (sampling_rate < 0 || sampling_rate > 100) {
+		LM_ERR("sampling_rate must be a percentage (0-100)\n");
+		return -1;
+	}
+	if (sampling_mode_s) {
+		if (!strcasecmp(sampling_mode_s, "callid")) {
+			sampling_mode = SAMPLING_CALLID;
+		} else if (!strcasecmp(sampling_mode_s, "random")) {
+			sampling_mode = SAMPLING_RANDOM;
+		} else {
+			LM_ERR("bad sampling_mode <%s>, use \"callid\" or \"random\"\n",
+				sampling_mode_s);
+			return -1;
+		}
+	}
+
+	if (rate_limit < 0)
+		rate_limit = 0;
+	if (rate_limit_burst <= 0)
+		rate_limit_burst = rate_limit;
+
 	LM_INFO("initializing...\n");
 
 	trace_on_flag = (int*)shm_malloc(sizeof(int));
@@ -873,6 +919,13 @@ static int mod_init(void)
 			return -1;
 		}
 		*it->traceable = trace_on;
+
+		it->bucket=shm_malloc(sizeof(struct trace_bucket));
+		if (it->bucket==NULL) {
+			LM_ERR("no more shmem!\n");
+			return -1;
+		}
+		trace_bucket_init(it->bucket);
 	}
 
 	/* sort the list */
@@ -980,6 +1033,8 @@ static void destroy(void)
 	while (el) {
 		if (last) {
 			shm_free(last->traceable);
+			if (last->bucket)
+				shm_free(last->bucket);
 			pkg_free(last);
 		}
 
@@ -1001,6 +1056,80 @@ static void destroy(void)
 
 
 
+static void trace_bucket_init(struct trace_bucket *b)
+{
+	memset(b, 0, sizeof *b);
+	lock_init(&b->lock);
+	b->tokens = (unsigned long long)rate_limit_burst * 1000;
+	b->last = get_uticks();
+}
+
+/* takes a token from the destination's bucket; returns 0 if the message
+ * should not be sent, as the destination is over its rate limit */
+static int trace_bucket_take(tlist_elem_p it)
+{
+	struct trace_bucket *b = it->bucket;
+	unsigned long long max;
+	utime_t now;
+	int ret = 1;
+
+	if (!rate_limit || !b)
+		return 1;
+
+	max = (unsigned long long)rate_limit_burst * 1000;
+	now = get_uticks();
+
+	lock_get(&b->lock);
+	/* ticks are in microseconds, tokens in thousandths of a message */
+	b->tokens += (now - b->last) * rate_limit / 1000;
+	if (b->tokens > max)
+		b->tokens = max;
+	b->last = now;
+
+	if (b->tokens >= 1000) {
+		b->tokens -= 1000;
+	} else {
+		b->dropped++;
+		ret = 0;
+	}
+	lock_release(&b->lock);
+
+#ifdef STATISTICS
+	if (!ret)
+		update_stat(siptrace_rate_dropped, 1);
+#endif
+
+	return ret;
+}
+
+/* decides whether a call falls within the traced percentage; with the
+ * Call-ID based sampling, all the messages of a call get the same answer */
+static int trace_sampled(struct sip_msg *msg, int rate)
+{
+	unsigned int h;
+
+	if (rate >= 100)
+		return 1;
+
+	if (rate > 0) {
+		if (sampling_mode == SAMPLING_CALLID &&
+		parse_headers(msg, HDR_CALLID_F, 0) == 0 && msg->callid) {
+			h = core_hash(&msg->callid->body, NULL, 0);
+		} else {
+			h = rand();
+		}
+
+		if (h % 100 < rate)
+			return 1;
+	}
+
+#ifdef STATISTICS
+	update_stat(siptrace_sampled_out, 1);
+#endif
+
+	return 0;
+}
+
 static inline int insert_siptrace(st_db_struct_t *st_db,
 		db_key_t *keys,db_val_t *vals, str *trace_attrs)
 {
@@ -1055,6 +1184,9 @@ static int save_siptrace(struct sip_msg *msg, db_key_t *keys, db_val_t *vals,
 		if (it->traceable && !(*it->traceable))
 			continue;
 
+		if (!trace_bucket_take(it))
+			continue;
+
 		switch (it->type) {
 		case TYPE_HEP:
 			if (send_trace_proto_duplicate(it->el.hep.hep_id,
@@ -1559,7 +1691,8 @@ static int sip_trace_handle(struct sip_msg *msg, tlist_elem_p el,
 
 /* tracer wrapper that verifies if the trace is on */
 static int trace_w(struct sip_msg *msg, tlist_elem_p list,
-					void *scope_p, str *trace_types_s, str *trace_attrs)
+					void *scope_p, str *trace_types_s, str *trace_attrs,
+					int *sampling)
 {
 
 	int trace_flags;
@@ -1571,6 +1704,11 @@ static int trace_w(struct sip_msg *msg, tlist_elem_p list,
 		return -1;
 	}
 
+	if (!trace_sampled(msg, sampling ? *sampling : sampling_rate)) {
+		LM_DBG("call not sampled for tracing\n");
+		return -2;
+	}
+
 	if (scope_p != NULL) {
 		trace_flags = (int)((unsigned long)scope_p);
 	} else {
@@ -2433,9 +2571,17 @@ static int mi_tid_info(tlist_elem_p tid_el, mi_item_t *dests_arr)
 			return -1;
 	}
 
+	if (rate_limit && tid_el->bucket &&
+	add_mi_number(dest_item, MI_SSTR("rate_dropped"),
+		tid_el->bucket->dropped) < 0)
+		return -1;
+
 	if (tid_el->dynamic) {
 		if (add_mi_string(dest_item, MI_SSTR("state"), MI_SSTR("dynamic")) < 0)
 			return -1;
+		if (add_mi_number(dest_item, MI_SSTR("sampling"),
+			trace_id_dyn(tid_el)->sampling) < 0)
+			return -1;
 		/* if dynamic, we might need information about the filters */
 		if (mi_tid_dyn_filters(trace_id_dyn(tid_el), dest_item) < 0)
 			return -1;
@@ -2680,13 +2826,25 @@ static mi_response_t *sip_trace_mi_dyn(const mi_params_t *params,
 	struct trace_filter *filters = NULL;
 	tlist_dyn_elem_p elem = NULL;
 	hid_list_t* hep_id = NULL;
+	struct trace_bucket *bucket;
 	int traced_scope, traced_type;
+	int sampling, rc;
 
 	if (get_mi_string_param(params, "id", &name.s, &name.len) < 0)
 		return init_mi_param_error();
 	if (get_mi_string_param(params, "uri", &uri.s, &uri.len) < 0)
 		return init_mi_param_error();
 
+	/* by default, all the matching calls are traced */
+	rc = try_get_mi_int_param(params, "sampling", &sampling);
+	if (rc == -1)
+		sampling = 100;
+	else if (rc < 0)
+		return init_mi_param_error();
+	if (sampling < 0 || sampling > 100)
+		return init_mi_error_extra(400, MI_SSTR("Bad parameter value"),
+					MI_SSTR("sampling must be a percentage"));
+
 	get_siptrace_type(&name, &uri, NULL, &hash, &uri_type);
 	if (uri_type == TYPE_DB) {
 		LM_WARN("dynamic DB tracing is not yet available!\n");
@@ -2738,13 +2896,16 @@ static mi_response_t *sip_trace_mi_dyn(const mi_params_t *params,
 	filters = parse_trace_filters(params);
 
 	/* first check if the destination exists */
-	elem = shm_malloc(sizeof(tlist_dyn_elem_t) + uri.len + name.len);
+	elem = shm_malloc(sizeof(tlist_dyn_elem_t) + sizeof(struct trace_bucket) +
+			uri.len + name.len);
 	if (!elem) {
 		LM_ERR("could not allocate dynamic elem!\n");
 		goto error;
 	}
 	memset(elem, 0, sizeof(tlist_dyn_elem_t));
-	p_uri = (char *)(elem + 1);
+	bucket = (struct trace_bucket *)(elem + 1);
+	trace_bucket_init(bucket);
+	p_uri = (char *)(bucket + 1);
 	memcpy(p_uri, uri.s, uri.len);
 	p_name = p_uri + uri.len;
 	memcpy(p_name, name.s, name.len);
@@ -2759,6 +2920,8 @@ static mi_response_t *sip_trace_mi_dyn(const mi_params_t *params,
 	}
 
 	elem->ref = 1;
+	elem->sampling = sampling;
+	elem->elem.bucket = bucket;
 	elem->scope = traced_scope;
 	elem->type = traced_type;
 	elem->filters = filters;
@@ -3252,6 +3415,9 @@ int sip_context_trace_impl(int id, union sockaddr_union* from_su,
 			if (it->type != TYPE_HEP || (it->traceable && !(*it->traceable)))
 				continue;
 
+			if (!trace_bucket_take(it))
+				continue;
+
 			trace_msg = tprot.create_trace_message(from_su, to_su,
 					net_proto, payload, id, it->el.hep.hep_id);
 
@@ -3409,6 +3575,9 @@ static int process_dyn_tracing(struct sip_msg *msg, void *param)
 					break;
 			}
 		}
+		if (!trace_sampled(msg, el->sampling))
+			goto skip;
+
 		if (sip_trace_handle(msg, it, el->scope, el->type, NULL) == 1)
 			trace_id_ref(el);
 skip:
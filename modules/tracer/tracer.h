@@ -25,6 +25,8 @@
 
 #include "../../db/db.h"
 #include "../../db/db_insertq.h"
+#include "../../locking.h"
+#include "../../timer.h"
 #include "../proto_hep/hep.h"
 
 #define NR_KEYS 14
@@ -61,6 +63,15 @@ typedef struct st_hep_struct {
 } st_hep_struct_t;
 
 
+/* token bucket limiting the messages per second sent to a destination;
+ * tokens are kept in thousandths of a message */
+struct trace_bucket {
+	gen_lock_t lock;
+	unsigned long long tokens;
+	utime_t last;
+	unsigned long dropped;
+};
+
 enum types { TYPE_HEP=0, TYPE_SIP, TYPE_DB, TYPE_END };
 typedef struct tlist_elem {
 	str name;          /* name of the partition */
@@ -69,6 +80,7 @@ typedef struct tlist_elem {
 	unsigned int uri_hash; /* hash over the uri*/
 	unsigned char *traceable; /* whether or not this id is traceable */
 	char dynamic;      /* whether this elem is dynamic or static */
+	struct trace_bucket *bucket; /* rate limit of the destination (shm) */
 
 	union {
 		st_db_struct_t  *db;
@@ -100,6 +112,7 @@ typedef struct tlist_dyn_elem {
 	unsigned int ref;
 	unsigned int type;
 	unsigned int scope;
+	int sampling;      /* percentage of the matching calls to trace */
 	struct trace_filter *filters;
 } tlist_dyn_elem_t, *tlist_dyn_elem_p;
 